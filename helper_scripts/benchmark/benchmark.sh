@@ -0,0 +1,151 @@
+#!/bin/bash
+
+#
+# benchmark.sh
+#
+# Created by Dimitrios Karageorgiou,
+#   for course "Parallel And Distributed Systems".
+#   Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+#
+# Script intended for benchmarking the implementation on a single machine,
+# by oversubscribing it with mpirun. It is run from the root of the project
+# by 'make benchmark', which builds the binaries it needs.
+#
+# Sweeps included:
+#   -Strong scaling: A dataset of BENCH_POINTS points, searched with every
+#    combination of processes, threads per process and k.
+#   -Weak scaling: The same combinations, with a dataset of
+#    BENCH_POINTS_PER_RANK points for every process.
+#
+# Datasets are generated by knn_generate, so every run of the script with
+# the same settings searches the same points. Every search runs the profiled
+# build of non_blocking_knn (see knn_profile.h), whose report provides:
+#   -search_secs: Wall clock time of the knn search ring.
+#   -distances_per_sec: Distances computed per second of search.
+#   -Time of every phase, as the maximum over processes, summed over rings.
+#   -bytes_sent: Bytes sent by all processes.
+#   -max_rss_kb: Greatest memory high-water mark of any process.
+# One CSV line is written to BENCH_OUTPUT for every run.
+#
+# When BENCH_BASELINE is set to the CSV file of a previous run, every run
+# is compared to the one of the same settings in it, and the script fails
+# if throughput dropped by more than BENCH_TOLERANCE.
+#
+# Every setting below may be overridden through the environment, e.g.
+#   BENCH_RANKS="1 2" BENCH_K="5 30" make benchmark
+#
+
+BENCH_DIR=${BENCH_DIR:-bench}
+BENCH_OUTPUT=${BENCH_OUTPUT:-$BENCH_DIR/results.csv}
+BENCH_MODES=${BENCH_MODES:-"strong weak"}
+BENCH_RANKS=${BENCH_RANKS:-"1 2 4"}
+BENCH_THREADS=${BENCH_THREADS:-"1 2"}
+BENCH_K=${BENCH_K:-"10"}
+BENCH_POINTS=${BENCH_POINTS:-20000}
+BENCH_POINTS_PER_RANK=${BENCH_POINTS_PER_RANK:-5000}
+BENCH_DIMS=${BENCH_DIMS:-32}
+BENCH_CLUSTERS=${BENCH_CLUSTERS:-16}
+BENCH_LABELS=${BENCH_LABELS:-10}
+BENCH_SEED=${BENCH_SEED:-1}
+BENCH_MPIRUN=${BENCH_MPIRUN:-"mpirun --oversubscribe"}
+BENCH_TOLERANCE=${BENCH_TOLERANCE:-0.10}
+
+GENERATOR=bin/knn_generate
+EXECUTABLE=bin/non_blocking_knn_profile
+PHASES="search distance topk merge labeling serialize wait deserialize"
+
+# Open MPI refuses to run as root, unless explicitly allowed.
+if [ "$(id -u)" = "0" ] && $BENCH_MPIRUN --version 2>&1 | grep -q "Open MPI"
+then
+    BENCH_MPIRUN="$BENCH_MPIRUN --allow-run-as-root"
+fi
+
+mkdir -p $BENCH_DIR
+echo "mode,ranks,threads,k,points,dims,search_secs,distances,\
+distances_per_sec,${PHASES// /,},bytes_sent,max_rss_kb,status" > $BENCH_OUTPUT
+
+# Generates the dataset of given number of points, unless it exists.
+generate() {
+    local prefix=$BENCH_DIR/data_${1}_${BENCH_DIMS}_${BENCH_CLUSTERS}
+    prefix=${prefix}_${BENCH_SEED}
+    if [ ! -f $prefix.karas ] || [ ! -f ${prefix}_labels.karas ]; then
+        $GENERATOR $prefix $1 $BENCH_DIMS $BENCH_CLUSTERS $BENCH_LABELS \
+                $BENCH_SEED > /dev/null || exit 1
+    fi
+    echo $prefix
+}
+
+# Extracts the CSV fields of a run out of the report of knn_profile.
+summarize() {
+    awk -F, -v ranks=$2 -v phases="$PHASES" '
+        $3 == "total" { max[$4] += $6; sum[$4] += $7 * ranks }
+        $2 == "search" && $3 == "total" && $4 == "step" { secs = $6 }
+        $2 == "search" && $3 == "total" && $4 == "distances" {
+            distances = $7 * ranks
+        }
+        END {
+            printf "%.6f,%.0f,%.0f", secs, distances,
+                   (secs > 0 ? distances / secs : 0)
+            n = split(phases, names, " ")
+            for (i = 1; i <= n; i++) printf ",%.6f", max[names[i]]
+            printf ",%.0f,%.0f", sum["bytes_sent"], max["max_rss_kb"]
+        }' $1
+}
+
+for mode in $BENCH_MODES; do
+    for ranks in $BENCH_RANKS; do
+        if [ $mode = "strong" ]; then
+            points=$BENCH_POINTS
+        else
+            points=$((BENCH_POINTS_PER_RANK * ranks))
+        fi
+        prefix=$(generate $points) || exit 1
+
+        for threads in $BENCH_THREADS; do
+            for k in $BENCH_K; do
+                report=$BENCH_DIR/report_${mode}_${ranks}_${threads}_${k}.csv
+                rm -f $report
+                echo "Running $mode scaling: $ranks processes x $threads" \
+                     "threads, k = $k, $points points."
+
+                OMP_NUM_THREADS=$threads KNN_PROFILE_REPORT=$report \
+                $BENCH_MPIRUN -np $ranks $EXECUTABLE $prefix.karas \
+                        ${prefix}_labels.karas $k > $BENCH_DIR/last_run.log 2>&1
+                rc=$?
+
+                line="$mode,$ranks,$threads,$k,$points,$BENCH_DIMS"
+                if [ $rc -eq 0 ] && [ -f $report ]; then
+                    echo "$line,$(summarize $report $ranks),ok" \
+                        >> $BENCH_OUTPUT
+                else
+                    echo "$line$(printf ',%.0s' $(seq 13))failed" \
+                        >> $BENCH_OUTPUT
+                    tail -5 $BENCH_DIR/last_run.log
+                fi
+            done
+        done
+    done
+done
+
+echo "Results written to $BENCH_OUTPUT."
+
+# Runs are matched by their settings, i.e. the first six fields.
+if [ -n "$BENCH_BASELINE" ]; then
+    awk -F, -v tolerance=$BENCH_TOLERANCE '
+        FNR == 1 { next }
+        FNR == NR { base[$1","$2","$3","$4","$5","$6] = $9; next }
+        {
+            key = $1","$2","$3","$4","$5","$6
+            if ($NF != "ok") {
+                printf "FAILED: %s\n", key
+                bad = 1
+            }
+            else if ((key in base) && $9 < base[key] * (1 - tolerance)) {
+                printf "REGRESSION: %s: %.0f distances/sec, was %.0f\n",
+                       key, $9, base[key]
+                bad = 1
+            }
+        }
+        END { exit bad }' $BENCH_BASELINE $BENCH_OUTPUT || exit 1
+    echo "No regressions against $BENCH_BASELINE."
+fi
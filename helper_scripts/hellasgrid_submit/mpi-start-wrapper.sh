@@ -10,7 +10,8 @@
 # Tests included:
 #   -Uses both datasets provided under datasets folder.
 #   -Tests for both blocking and non-blocking communications.
-#   -Tests for k in range [1, 50].
+#   -Tests for k in range [1, 50], all out of a single run (see KNN_SWEEP
+#    in testing.c).
 #
 # Submit using glite-wms interface (or later DIRAC interface), using
 # provided distributed_knn.jdl file.
@@ -24,10 +25,12 @@ LABELS_MODIFIER=_labels
 TEST_MODIFIER=_results
 INDEXES_MODIFIER=_indexes
 FILE_ENDING=.karas
-K_START=1
 K_STOP=50
 MPI_FLAVOR=OPENMPI
 
+# Classify for every k up to K_STOP, out of a single knn search.
+export KNN_SWEEP=1
+
 # Convert flavor to lowercase for passing to mpi-start.
 MPI_FLAVOR_LOWER=`echo $MPI_FLAVOR | tr '[:upper:]' '[:lower:]'`
 
@@ -55,28 +58,25 @@ do
         echo "======================================================"
         echo "Dataset used:" $DATA_FILENAME$datamod
 
-        # Run for the given range of k nearest neighbors.
-        for i in $(seq $K_START $K_STOP);
-        do
-            # Touch the executable. It exist must for the shared file system check.
-            # If it does not, then mpi-start may try to distribute the executable
-            # when it shouldn't.
-            touch $my_executable
+        # Run once for the whole range of k nearest neighbors.
+        # Touch the executable. It exist must for the shared file system check.
+        # If it does not, then mpi-start may try to distribute the executable
+        # when it shouldn't.
+        touch $my_executable
 
-            # Setup for mpi-start.
-            export I2G_MPI_APPLICATION=$my_executable
-            export I2G_MPI_APPLICATION_ARGS="$DATA_FILENAME$datamod$FILE_ENDING $DATA_FILENAME$LABELS_MODIFIER$datamod$FILE_ENDING $i $DATA_FILENAME$TEST_MODIFIER$datamod$FILE_ENDING $DATA_FILENAME$TEST_MODIFIER$INDEXES_MODIFIER$datamod$FILE_ENDING"
-            export I2G_MPI_TYPE=$MPI_FLAVOR_LOWER
-            export I2G_MPI_PRE_RUN_HOOK=mpi-hooks.sh
-            #export I2G_MPI_POST_RUN_HOOK=mpi-hooks.sh
+        # Setup for mpi-start.
+        export I2G_MPI_APPLICATION=$my_executable
+        export I2G_MPI_APPLICATION_ARGS="$DATA_FILENAME$datamod$FILE_ENDING $DATA_FILENAME$LABELS_MODIFIER$datamod$FILE_ENDING $K_STOP $DATA_FILENAME$TEST_MODIFIER$datamod$FILE_ENDING $DATA_FILENAME$TEST_MODIFIER$INDEXES_MODIFIER$datamod$FILE_ENDING"
+        export I2G_MPI_TYPE=$MPI_FLAVOR_LOWER
+        export I2G_MPI_PRE_RUN_HOOK=mpi-hooks.sh
+        #export I2G_MPI_POST_RUN_HOOK=mpi-hooks.sh
 
-            # If these are set then you will get more debugging information.
-            #export I2G_MPI_START_VERBOSE=1
-            #export I2G_MPI_START_DEBUG=1
+        # If these are set then you will get more debugging information.
+        #export I2G_MPI_START_VERBOSE=1
+        #export I2G_MPI_START_DEBUG=1
 
-            # Invoke mpi-start.
-            $I2G_MPI_START
-        done
+        # Invoke mpi-start.
+        $I2G_MPI_START
 
         echo "======================================================"
     done
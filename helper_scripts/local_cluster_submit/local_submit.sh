@@ -17,7 +17,8 @@
 # Tests included:
 #   -Uses both datasets provided under datasets folder.
 #   -Tests for both blocking and non-blocking communications.
-#   -Tests for k in range [1, 50].
+#   -Tests for k in range [1, 50], all out of a single run (see KNN_SWEEP
+#    in testing.c).
 #
 # In order to change the number of processors, modify 'nodes' and 'ppn'
 # atrributes at the beggining of this script.
@@ -34,10 +35,11 @@ LABELS_MODIFIER=_labels
 TEST_MODIFIER=_results
 INDEXES_MODIFIER=_indexes
 FILE_ENDING=.karas
-K_START=1
 K_STOP=50
 MPI_FLAVOR=MPICH2
 
+# Classify for every k up to K_STOP, out of a single knn search.
+export KNN_SWEEP=1
 # Define the number of threads to be used by each process.
 export OMP_NUM_THREADS=8
 # Enable in order to spawn 1 process per node.
@@ -47,6 +49,13 @@ export I2G_MPI_SINGLE_PROCESS=1
 # define explicity total number of processes.
 #export I2G_MPI_NP=8
 #export I2G_MPI_PER_NODE=2
+# With many processes per node, let them read the blocks of each other in
+# place, instead of passing them around the ring (see KNN_NODE_SHARING in
+# testing.c).
+#export KNN_NODE_SHARING=1
+# Or pass the blocks of each node around a ring of nodes, as a single message
+# (see KNN_RING in testing.c).
+#export KNN_RING=hierarchical
 
 cd $PBS_O_WORKDIR
 export NP=$(cat $PBS_NODEFILE | wc -l)
@@ -87,14 +96,11 @@ do
         echo "======================================================"
         echo "Dataset used:" $DATA_FILENAME$datamod
 
-        # Run for the given range of k nearest neighbors.
-        for k in $(seq $K_START $K_STOP);
-        do
-    	    export I2G_MPI_TYPE=$MPI_FLAVOR_LOWER
-    	    export I2G_MPI_APPLICATION=$my_executable
-    	    export I2G_MPI_APPLICATION_ARGS="$DATA_FILENAME$datamod$FILE_ENDING $DATA_FILENAME$LABELS_MODIFIER$datamod$FILE_ENDING $k $DATA_FILENAME$TEST_MODIFIER$datamod$FILE_ENDING $DATA_FILENAME$TEST_MODIFIER$INDEXES_MODIFIER$datamod$FILE_ENDING"
-    	    $I2G_MPI_START
-	done
+        # Run once for the whole range of k nearest neighbors.
+        export I2G_MPI_TYPE=$MPI_FLAVOR_LOWER
+        export I2G_MPI_APPLICATION=$my_executable
+        export I2G_MPI_APPLICATION_ARGS="$DATA_FILENAME$datamod$FILE_ENDING $DATA_FILENAME$LABELS_MODIFIER$datamod$FILE_ENDING $K_STOP $DATA_FILENAME$TEST_MODIFIER$datamod$FILE_ENDING $DATA_FILENAME$TEST_MODIFIER$INDEXES_MODIFIER$datamod$FILE_ENDING"
+        $I2G_MPI_START
 
         echo "======================================================"
     done
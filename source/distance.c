@@ -0,0 +1,584 @@
+/**
+ * distance.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * distance.c provides an implementation for routines defined in distance.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "distance.h"
+
+// Kernels for specific instruction sets are only built by compilers that
+// support target attributes, for x86 processors.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DISTANCE_X86
+#endif
+
+
+// A vector of DISTANCE_LANES doubles. Arithmetic on it is done lane by lane,
+// so the compiler maps it to whatever SIMD registers target provides.
+typedef double distance_vec_t
+        __attribute__ ((vector_size (sizeof(double) * DISTANCE_LANES)));
+
+// A vector of DISTANCE_FLOAT_LANES floats.
+typedef float distance_fvec_t
+        __attribute__ ((vector_size (sizeof(float) * DISTANCE_FLOAT_LANES)));
+
+// Forces inlining, so kernels get specialized for the constants they are
+// called with.
+#define DISTANCE_INLINE static inline __attribute__ ((always_inline))
+
+// Declares _cross_tile_ISA() and _cross_tile_float_ISA(), the kernels of
+// distance_cross_tile() and distance_cross_tile_float() built for an
+// instruction set.
+#define DISTANCE_DECLARE_KERNELS(ISA)                                       \
+static void _cross_tile_##ISA(matrix_t *points, int q_start, int q_end,     \
+                              matrix_t *data, int d_start, int d_end,       \
+                              double *tile);                                \
+static void _cross_tile_float_##ISA(matrix_t *points, int q_start,          \
+                                    int q_end, matrix_t *data,              \
+                                    int d_start, int d_end, float *tile);
+DISTANCE_DECLARE_KERNELS(generic)
+#ifdef DISTANCE_X86
+DISTANCE_DECLARE_KERNELS(avx2)
+#endif
+
+static int selected_isa = -1;  // Set on first call of distance_get_isa().
+
+static int _detect_isa(void);
+static inline double _reduce_lanes(distance_vec_t *acc);
+DISTANCE_INLINE void _cross_tile_body(matrix_t *points, int q_start,
+                                      int q_end, matrix_t *data, int d_start,
+                                      int d_end, int cols, double *tile);
+DISTANCE_INLINE void _cross_depth_tile(matrix_t *points, int q_start,
+                                       int q_end, matrix_t *data,
+                                       int d_start, int d_end, int c,
+                                       int len, double *tile);
+DISTANCE_INLINE void _dot_2x4(const double *q0, const double *q1,
+                              const double *d0, const double *d1,
+                              const double *d2, const double *d3,
+                              int len, double *out);
+static inline float _reduce_lanes_float(distance_fvec_t *acc);
+DISTANCE_INLINE void _cross_tile_body_float(matrix_t *points, int q_start,
+                                            int q_end, matrix_t *data,
+                                            int d_start, int d_end, int cols,
+                                            float *tile);
+DISTANCE_INLINE void _cross_depth_tile_float(matrix_t *points, int q_start,
+                                             int q_end, matrix_t *data,
+                                             int d_start, int d_end, int c,
+                                             int len, float *tile);
+DISTANCE_INLINE void _dot_2x4_float(const float *q0, const float *q1,
+                                    const float *d0, const float *d1,
+                                    const float *d2, const float *d3,
+                                    int len, float *out);
+
+
+void distance_row_norms(matrix_t *m, double *norms)
+{
+    int rows = matrix_get_rows(m);
+    int cols = matrix_get_cols(m);
+
+    #pragma omp parallel for
+    for (int r = 0; r < rows; r += 2) {
+        const double *r0 = matrix_get_row(m, r);
+        const double *r1 = (r + 1 < rows) ? matrix_get_row(m, r+1) : r0;
+
+        // Norms are accumulated per depth tile by the same micro-kernel used
+        // for the cross term, so x.x and ||x||^2 always result in the same
+        // value.
+        double n0 = 0.0;
+        double n1 = 0.0;
+        for (int c = 0; c < cols; c += DISTANCE_DEPTH_TILE) {
+            int len = cols - c < DISTANCE_DEPTH_TILE ?
+                      cols - c : DISTANCE_DEPTH_TILE;
+            double out[8];
+            _dot_2x4(r0+c, r1+c, r0+c, r1+c, r1+c, r1+c, len, out);
+            if (c == 0) {
+                n0 = out[0];
+                n1 = out[5];
+            } else {
+                n0 += out[0];
+                n1 += out[5];
+            }
+        }
+
+        norms[r] = n0;
+        if (r + 1 < rows) norms[r+1] = n1;
+    }
+}
+
+void distance_cross_tile(matrix_t *points, int q_start, int q_end,
+                         matrix_t *data, int d_start, int d_end,
+                         double *tile)
+{
+    switch (distance_get_isa()) {
+#ifdef DISTANCE_X86
+    case DISTANCE_ISA_AVX2:
+        _cross_tile_avx2(points, q_start, q_end, data, d_start, d_end, tile);
+        return;
+#endif
+    }
+
+    _cross_tile_generic(points, q_start, q_end, data, d_start, d_end, tile);
+}
+
+void distance_sq_tile(matrix_t *points, const double *q_norms,
+                      int q_start, int q_end,
+                      matrix_t *data, const double *d_norms,
+                      int d_start, int d_end, double *tile)
+{
+    distance_cross_tile(points, q_start, q_end, data, d_start, d_end, tile);
+
+    for (int q = 0; q < q_end - q_start; q++) {
+        double qn = q_norms[q_start+q];
+        double *t = tile + q * DISTANCE_DATA_TILE;
+        for (int d = 0; d < d_end - d_start; d++) {
+            double dist = qn + d_norms[d_start+d] - 2.0 * t[d];
+            t[d] = dist > 0.0 ? dist : 0.0;
+        }
+    }
+}
+
+void distance_row_norms_float(matrix_t *m, float *norms)
+{
+    int rows = matrix_get_rows(m);
+    int cols = matrix_get_cols(m);
+
+    #pragma omp parallel for
+    for (int r = 0; r < rows; r += 2) {
+        const float *r0 = matrix_get_frow(m, r);
+        const float *r1 = (r + 1 < rows) ? matrix_get_frow(m, r+1) : r0;
+
+        float n0 = 0.0f;
+        float n1 = 0.0f;
+        for (int c = 0; c < cols; c += DISTANCE_DEPTH_TILE) {
+            int len = cols - c < DISTANCE_DEPTH_TILE ?
+                      cols - c : DISTANCE_DEPTH_TILE;
+            float out[8];
+            _dot_2x4_float(r0+c, r1+c, r0+c, r1+c, r1+c, r1+c, len, out);
+            if (c == 0) {
+                n0 = out[0];
+                n1 = out[5];
+            } else {
+                n0 += out[0];
+                n1 += out[5];
+            }
+        }
+
+        norms[r] = n0;
+        if (r + 1 < rows) norms[r+1] = n1;
+    }
+}
+
+void distance_cross_tile_float(matrix_t *points, int q_start, int q_end,
+                               matrix_t *data, int d_start, int d_end,
+                               float *tile)
+{
+    switch (distance_get_isa()) {
+#ifdef DISTANCE_X86
+    case DISTANCE_ISA_AVX2:
+        _cross_tile_float_avx2(points, q_start, q_end, data, d_start, d_end,
+                               tile);
+        return;
+#endif
+    }
+
+    _cross_tile_float_generic(points, q_start, q_end, data, d_start, d_end,
+                              tile);
+}
+
+void distance_sq_tile_float(matrix_t *points, const float *q_norms,
+                            int q_start, int q_end,
+                            matrix_t *data, const float *d_norms,
+                            int d_start, int d_end, float *tile)
+{
+    distance_cross_tile_float(points, q_start, q_end,
+                              data, d_start, d_end, tile);
+
+    for (int q = 0; q < q_end - q_start; q++) {
+        float qn = q_norms[q_start+q];
+        float *t = tile + q * DISTANCE_DATA_TILE;
+        for (int d = 0; d < d_end - d_start; d++) {
+            float dist = qn + d_norms[d_start+d] - 2.0f * t[d];
+            t[d] = dist > 0.0f ? dist : 0.0f;
+        }
+    }
+}
+
+int distance_get_isa(void)
+{
+    int isa;
+    #pragma omp atomic read
+    isa = selected_isa;
+
+    // Detection always results to the same value, so threads that race for
+    // it store the same one.
+    if (isa < 0) {
+        isa = _detect_isa();
+        #pragma omp atomic write
+        selected_isa = isa;
+    }
+    return isa;
+}
+
+const char *distance_isa_name(int isa)
+{
+    switch (isa) {
+    case DISTANCE_ISA_AVX2: return "avx2";
+    default: return "generic";
+    }
+}
+
+/**
+ * Selects the instruction set of the kernels, as described in distance.h.
+ */
+static int _detect_isa(void)
+{
+    int preferred = DISTANCE_ISA_GENERIC;
+#ifdef DISTANCE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) preferred = DISTANCE_ISA_AVX2;
+#endif
+
+    char *requested = getenv("DISTANCE_ISA");
+    if (!requested || !strcmp(requested, "")) return preferred;
+
+    int isa = -1;
+    if (!strcmp(requested, "generic")) isa = DISTANCE_ISA_GENERIC;
+    else if (!strcmp(requested, "avx2")) isa = DISTANCE_ISA_AVX2;
+
+    if (isa < 0 || isa > preferred) {
+        printf("WARNING: DISTANCE_ISA=%s is not available, using %s.\n",
+               requested, distance_isa_name(preferred));
+        return preferred;
+    }
+    return isa;
+}
+
+/**
+ * Computes the dot products of distance_cross_tile(), for matrices of the
+ * given width.
+ *
+ * When width is a constant, as in the kernels specialized for fixed widths,
+ * the length of every depth tile is known at compile time. The micro-kernel
+ * then gets unrolled for it, without any remainder handling, which matters
+ * most for narrow matrices, where a depth tile is just a few vectors long.
+ * Partial sums are still computed in the same order, so results do not
+ * depend on the kernel used.
+ */
+DISTANCE_INLINE void _cross_tile_body(matrix_t *points, int q_start,
+                                      int q_end, matrix_t *data, int d_start,
+                                      int d_end, int cols, double *tile)
+{
+    // Walk the shared dimension in depth tiles, so the rows of both query and
+    // data tiles that are currently needed, remain in cache.
+    for (int c = 0; c < cols; c += DISTANCE_DEPTH_TILE) {
+        int len = cols - c < DISTANCE_DEPTH_TILE ?
+                  cols - c : DISTANCE_DEPTH_TILE;
+        _cross_depth_tile(points, q_start, q_end, data, d_start, d_end,
+                          c, len, tile);
+    }
+}
+
+/**
+ * Accumulates the dot products of a single depth tile into tile, as
+ * distance_cross_tile() does for all of them.
+ *
+ * Parameters:
+ *  -c: The first column of the depth tile. Products of the first depth tile
+ *          overwrite tile, while the rest are added to it.
+ *  -len: The number of columns of the depth tile.
+ */
+DISTANCE_INLINE void _cross_depth_tile(matrix_t *points, int q_start,
+                                       int q_end, matrix_t *data,
+                                       int d_start, int d_end, int c,
+                                       int len, double *tile)
+{
+    int qn = q_end - q_start;
+    int dn = d_end - d_start;
+
+    for (int q = 0; q < qn; q += 2) {
+        // When rows do not fill the micro-kernel, the last row is computed
+        // more than once, so a single micro-kernel can be used everywhere.
+        int q_pair = q + 1 < qn;
+        const double *q0 = matrix_get_row(points, q_start+q) + c;
+        const double *q1 = q_pair ?
+                           matrix_get_row(points, q_start+q+1) + c : q0;
+        double *t0 = tile + q * DISTANCE_DATA_TILE;
+        double *t1 = t0 + DISTANCE_DATA_TILE;
+
+        for (int d = 0; d < dn; d += 4) {
+            int d_valid = dn - d < 4 ? dn - d : 4;
+            const double *d0 = matrix_get_row(data, d_start+d) + c;
+            const double *d1 = d_valid > 1 ?
+                               matrix_get_row(data, d_start+d+1) + c : d0;
+            const double *d2 = d_valid > 2 ?
+                               matrix_get_row(data, d_start+d+2) + c : d0;
+            const double *d3 = d_valid > 3 ?
+                               matrix_get_row(data, d_start+d+3) + c : d0;
+
+            double out[8];
+            _dot_2x4(q0, q1, d0, d1, d2, d3, len, out);
+
+            for (int i = 0; i < d_valid; i++) {
+                if (c == 0) {
+                    t0[d+i] = out[i];
+                    if (q_pair) t1[d+i] = out[4+i];
+                } else {
+                    t0[d+i] += out[i];
+                    if (q_pair) t1[d+i] += out[4+i];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Float counterpart of _cross_tile_body().
+ */
+DISTANCE_INLINE void _cross_tile_body_float(matrix_t *points, int q_start,
+                                            int q_end, matrix_t *data,
+                                            int d_start, int d_end, int cols,
+                                            float *tile)
+{
+    for (int c = 0; c < cols; c += DISTANCE_DEPTH_TILE) {
+        int len = cols - c < DISTANCE_DEPTH_TILE ?
+                  cols - c : DISTANCE_DEPTH_TILE;
+        _cross_depth_tile_float(points, q_start, q_end, data, d_start, d_end,
+                                c, len, tile);
+    }
+}
+
+/**
+ * Float counterpart of _cross_depth_tile().
+ */
+DISTANCE_INLINE void _cross_depth_tile_float(matrix_t *points, int q_start,
+                                             int q_end, matrix_t *data,
+                                             int d_start, int d_end, int c,
+                                             int len, float *tile)
+{
+    int qn = q_end - q_start;
+    int dn = d_end - d_start;
+
+    for (int q = 0; q < qn; q += 2) {
+        int q_pair = q + 1 < qn;
+        const float *q0 = matrix_get_frow(points, q_start+q) + c;
+        const float *q1 = q_pair ?
+                          matrix_get_frow(points, q_start+q+1) + c : q0;
+        float *t0 = tile + q * DISTANCE_DATA_TILE;
+        float *t1 = t0 + DISTANCE_DATA_TILE;
+
+        for (int d = 0; d < dn; d += 4) {
+            int d_valid = dn - d < 4 ? dn - d : 4;
+            const float *d0 = matrix_get_frow(data, d_start+d) + c;
+            const float *d1 = d_valid > 1 ?
+                              matrix_get_frow(data, d_start+d+1) + c : d0;
+            const float *d2 = d_valid > 2 ?
+                              matrix_get_frow(data, d_start+d+2) + c : d0;
+            const float *d3 = d_valid > 3 ?
+                              matrix_get_frow(data, d_start+d+3) + c : d0;
+
+            float out[8];
+            _dot_2x4_float(q0, q1, d0, d1, d2, d3, len, out);
+
+            for (int i = 0; i < d_valid; i++) {
+                if (c == 0) {
+                    t0[d+i] = out[i];
+                    if (q_pair) t1[d+i] = out[4+i];
+                } else {
+                    t0[d+i] += out[i];
+                    if (q_pair) t1[d+i] += out[4+i];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Defines _cross_tile_ISA() and _cross_tile_float_ISA(), built with the given
+ * function attributes.
+ *
+ * Matrices of a width listed in DISTANCE_FIXED_WIDTHS get a case of their
+ * own, where the whole kernel is inlined for that constant width.
+ */
+#define DISTANCE_CASE(COLS)                                                 \
+    case COLS:                                                              \
+        _cross_tile_body(points, q_start, q_end, data, d_start, d_end,      \
+                         COLS, tile);                                       \
+        return;
+#define DISTANCE_CASE_FLOAT(COLS)                                           \
+    case COLS:                                                              \
+        _cross_tile_body_float(points, q_start, q_end, data, d_start,       \
+                               d_end, COLS, tile);                          \
+        return;
+#define DISTANCE_DEFINE_KERNELS(ISA, ATTRIBUTES)                            \
+ATTRIBUTES                                                                  \
+static void _cross_tile_##ISA(matrix_t *points, int q_start, int q_end,     \
+                              matrix_t *data, int d_start, int d_end,       \
+                              double *tile)                                 \
+{                                                                           \
+    int cols = matrix_get_cols(points);                                     \
+    switch (cols) {                                                         \
+    DISTANCE_FIXED_WIDTHS(DISTANCE_CASE)                                    \
+    }                                                                       \
+    _cross_tile_body(points, q_start, q_end, data, d_start, d_end,          \
+                     cols, tile);                                           \
+}                                                                           \
+ATTRIBUTES                                                                  \
+static void _cross_tile_float_##ISA(matrix_t *points, int q_start,          \
+                                    int q_end, matrix_t *data,              \
+                                    int d_start, int d_end, float *tile)    \
+{                                                                           \
+    int cols = matrix_get_cols(points);                                     \
+    switch (cols) {                                                         \
+    DISTANCE_FIXED_WIDTHS(DISTANCE_CASE_FLOAT)                              \
+    }                                                                       \
+    _cross_tile_body_float(points, q_start, q_end, data, d_start, d_end,    \
+                           cols, tile);                                     \
+}
+
+DISTANCE_DEFINE_KERNELS(generic, )
+#ifdef DISTANCE_X86
+DISTANCE_DEFINE_KERNELS(avx2, __attribute__ ((target ("avx2"))))
+#endif
+
+/**
+ * Sums the lanes of a vector, using a fixed pairwise order.
+ *
+ * Parameters:
+ *  -acc: A reference to the vector to be summed. It is overwritten.
+ *
+ * Returns:
+ *  The sum of all lanes.
+ */
+static inline double _reduce_lanes(distance_vec_t *acc)
+{
+    double lanes[DISTANCE_LANES];
+    memcpy(lanes, acc, sizeof(lanes));
+
+    for (int w = DISTANCE_LANES / 2; w > 0; w /= 2) {
+        for (int l = 0; l < w; l++) lanes[l] += lanes[l+w];
+    }
+    return lanes[0];
+}
+
+/**
+ * Micro-kernel that computes the dot products of two query vectors with four
+ * data vectors.
+ *
+ * Each dot product is accumulated lane by lane into its own vector register.
+ * Products never interact with each other, so the result of a single product
+ * does not depend on the vectors it is computed together with. Elements
+ * that do not fill a whole vector are loaded into a zeroed one, which leaves
+ * all sums unaffected.
+ *
+ * Parameters:
+ *  -q0, q1: The two query vectors.
+ *  -d0, d1, d2, d3: The four data vectors.
+ *  -len: Length of all vectors.
+ *  -out: An array of 8 doubles, where q0.d0 ... q0.d3 followed by
+ *          q1.d0 ... q1.d3 are written.
+ */
+DISTANCE_INLINE void _dot_2x4(const double *q0, const double *q1,
+                              const double *d0, const double *d1,
+                              const double *d2, const double *d3,
+                              int len, double *out)
+{
+    distance_vec_t a00 = { 0.0 }, a01 = { 0.0 }, a02 = { 0.0 }, a03 = { 0.0 };
+    distance_vec_t a10 = { 0.0 }, a11 = { 0.0 }, a12 = { 0.0 }, a13 = { 0.0 };
+
+    int c = 0;
+    for (; c + DISTANCE_LANES <= len; c += DISTANCE_LANES) {
+        distance_vec_t x0, x1, y0, y1, y2, y3;
+        memcpy(&x0, q0+c, sizeof(x0));
+        memcpy(&x1, q1+c, sizeof(x1));
+        memcpy(&y0, d0+c, sizeof(y0));
+        memcpy(&y1, d1+c, sizeof(y1));
+        memcpy(&y2, d2+c, sizeof(y2));
+        memcpy(&y3, d3+c, sizeof(y3));
+
+        a00 += x0 * y0; a01 += x0 * y1; a02 += x0 * y2; a03 += x0 * y3;
+        a10 += x1 * y0; a11 += x1 * y1; a12 += x1 * y2; a13 += x1 * y3;
+    }
+    if (c < len) {
+        size_t rem = sizeof(double) * (len - c);
+        distance_vec_t x0 = { 0.0 }, x1 = { 0.0 };
+        distance_vec_t y0 = { 0.0 }, y1 = { 0.0 }, y2 = { 0.0 }, y3 = { 0.0 };
+        memcpy(&x0, q0+c, rem);
+        memcpy(&x1, q1+c, rem);
+        memcpy(&y0, d0+c, rem);
+        memcpy(&y1, d1+c, rem);
+        memcpy(&y2, d2+c, rem);
+        memcpy(&y3, d3+c, rem);
+
+        a00 += x0 * y0; a01 += x0 * y1; a02 += x0 * y2; a03 += x0 * y3;
+        a10 += x1 * y0; a11 += x1 * y1; a12 += x1 * y2; a13 += x1 * y3;
+    }
+
+    // Accumulators are only copied out at the end, so they can be kept in
+    // registers during the whole loop.
+    distance_vec_t acc[8] = { a00, a01, a02, a03, a10, a11, a12, a13 };
+    for (int i = 0; i < 8; i++) out[i] = _reduce_lanes(&acc[i]);
+}
+
+/**
+ * Float counterpart of _reduce_lanes().
+ */
+static inline float _reduce_lanes_float(distance_fvec_t *acc)
+{
+    float lanes[DISTANCE_FLOAT_LANES];
+    memcpy(lanes, acc, sizeof(lanes));
+
+    for (int w = DISTANCE_FLOAT_LANES / 2; w > 0; w /= 2) {
+        for (int l = 0; l < w; l++) lanes[l] += lanes[l+w];
+    }
+    return lanes[0];
+}
+
+/**
+ * Float counterpart of _dot_2x4().
+ */
+DISTANCE_INLINE void _dot_2x4_float(const float *q0, const float *q1,
+                                    const float *d0, const float *d1,
+                                    const float *d2, const float *d3,
+                                    int len, float *out)
+{
+    distance_fvec_t a00 = { 0.0f }, a01 = { 0.0f }, a02 = { 0.0f }, a03 = { 0.0f };
+    distance_fvec_t a10 = { 0.0f }, a11 = { 0.0f }, a12 = { 0.0f }, a13 = { 0.0f };
+
+    int c = 0;
+    for (; c + DISTANCE_FLOAT_LANES <= len; c += DISTANCE_FLOAT_LANES) {
+        distance_fvec_t x0, x1, y0, y1, y2, y3;
+        memcpy(&x0, q0+c, sizeof(x0));
+        memcpy(&x1, q1+c, sizeof(x1));
+        memcpy(&y0, d0+c, sizeof(y0));
+        memcpy(&y1, d1+c, sizeof(y1));
+        memcpy(&y2, d2+c, sizeof(y2));
+        memcpy(&y3, d3+c, sizeof(y3));
+
+        a00 += x0 * y0; a01 += x0 * y1; a02 += x0 * y2; a03 += x0 * y3;
+        a10 += x1 * y0; a11 += x1 * y1; a12 += x1 * y2; a13 += x1 * y3;
+    }
+    if (c < len) {
+        size_t rem = sizeof(float) * (len - c);
+        distance_fvec_t x0 = { 0.0f }, x1 = { 0.0f };
+        distance_fvec_t y0 = { 0.0f }, y1 = { 0.0f }, y2 = { 0.0f }, y3 = { 0.0f };
+        memcpy(&x0, q0+c, rem);
+        memcpy(&x1, q1+c, rem);
+        memcpy(&y0, d0+c, rem);
+        memcpy(&y1, d1+c, rem);
+        memcpy(&y2, d2+c, rem);
+        memcpy(&y3, d3+c, rem);
+
+        a00 += x0 * y0; a01 += x0 * y1; a02 += x0 * y2; a03 += x0 * y3;
+        a10 += x1 * y0; a11 += x1 * y1; a12 += x1 * y2; a13 += x1 * y3;
+    }
+
+    distance_fvec_t acc[8] = { a00, a01, a02, a03, a10, a11, a12, a13 };
+    for (int i = 0; i < 8; i++) out[i] = _reduce_lanes_float(&acc[i]);
+}
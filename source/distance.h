@@ -0,0 +1,215 @@
+/**
+ * distance.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * distance.h defines a cache blocked engine for computing squared euclidean
+ * distances between the rows of two matrices.
+ *
+ * Distances are computed using the decomposition:
+ *      ||x - y||^2 = ||x||^2 + ||y||^2 - 2 * x.y
+ * where squared norms are computed once per row and the cross term x.y is
+ * computed for a whole tile of (query rows x data rows) at once, by a
+ * register blocked micro-kernel, in the same way a matrix multiplication
+ * would be computed.
+ *
+ * The cross term is computed by kernels specialized at compile time for the
+ * widths listed in DISTANCE_FIXED_WIDTHS, so all their loop bounds are
+ * constants. Matrices of any other width are handled by a generic kernel.
+ * All kernels sum in the same order, so they produce identical results.
+ *
+ * Kernels are built for several instruction sets (AVX2 on x86, besides the
+ * generic one the compiler targets), and one supported by the processor is
+ * selected on first use: AVX2 when available, or the generic one otherwise.
+ * DISTANCE_ISA environment variable may be set to "generic" or "avx2" for
+ * overriding the selection. Lanes are the same for all
+ * instruction sets and the code is built without contraction of
+ * multiply-adds, so the selection does not affect results.
+ *
+ * Every routine has a float counterpart, operating on matrices of floats
+ * (see matrix_create_float()). Float kernels use vectors of twice as many
+ * lanes, so the same SIMD registers process twice as many columns.
+ *
+ * Macros defined in distance.h:
+ *  -DISTANCE_QUERY_TILE
+ *  -DISTANCE_DATA_TILE
+ *  -DISTANCE_DEPTH_TILE
+ *  -DISTANCE_LANES
+ *  -DISTANCE_FLOAT_LANES
+ *  -DISTANCE_FIXED_WIDTHS(X)
+ *  -DISTANCE_ISA_GENERIC
+ *  -DISTANCE_ISA_AVX2
+ *
+ * Functions defined in distance.h:
+ *  -void distance_row_norms(matrix_t *m, double *norms)
+ *  -void distance_cross_tile(matrix_t *points, int q_start, int q_end,
+ *                            matrix_t *data, int d_start, int d_end,
+ *                            double *tile)
+ *  -void distance_sq_tile(matrix_t *points, const double *q_norms,
+ *                         int q_start, int q_end,
+ *                         matrix_t *data, const double *d_norms,
+ *                         int d_start, int d_end, double *tile)
+ *  -void distance_row_norms_float(matrix_t *m, float *norms)
+ *  -void distance_cross_tile_float(matrix_t *points, int q_start, int q_end,
+ *                                  matrix_t *data, int d_start, int d_end,
+ *                                  float *tile)
+ *  -void distance_sq_tile_float(matrix_t *points, const float *q_norms,
+ *                               int q_start, int q_end,
+ *                               matrix_t *data, const float *d_norms,
+ *                               int d_start, int d_end, float *tile)
+ *  -int distance_get_isa(void)
+ *  -const char *distance_isa_name(int isa)
+ */
+
+#ifndef __distance_h__
+#define __distance_h__
+
+#include "matrix.h"
+
+
+// Number of query rows processed together. Query tile should fit in L1/L2.
+#ifndef DISTANCE_QUERY_TILE
+#define DISTANCE_QUERY_TILE 32
+#endif
+
+// Number of data rows processed together. Data tile should fit in L2.
+#ifndef DISTANCE_DATA_TILE
+#define DISTANCE_DATA_TILE 128
+#endif
+
+// Number of columns accumulated at once, before moving to the next tile.
+// It should be a multiple of DISTANCE_LANES.
+#ifndef DISTANCE_DEPTH_TILE
+#define DISTANCE_DEPTH_TILE 256
+#endif
+
+// Number of independent partial sums kept for each dot product, i.e. the
+// width of the vectors used by the micro-kernel. It should be a power of 2.
+// Sums are never reassociated, so results only depend on this value and not
+// on the instruction set the kernel gets compiled for.
+#ifndef DISTANCE_LANES
+#define DISTANCE_LANES 4
+#endif
+
+// Number of independent partial sums kept for each dot product by the float
+// micro-kernel. It should be a power of 2.
+#ifndef DISTANCE_FLOAT_LANES
+#define DISTANCE_FLOAT_LANES 8
+#endif
+
+// Calls X(cols) for every width a kernel is specialized for: the width of
+// MNIST, the one of its SVD reduced version and powers of two. Every width
+// should appear once.
+#ifndef DISTANCE_FIXED_WIDTHS
+#define DISTANCE_FIXED_WIDTHS(X) \
+        X(2) X(4) X(8) X(16) X(30) X(32) X(64) X(128) X(256) X(784)
+#endif
+
+// Instruction sets kernels are built for.
+#define DISTANCE_ISA_GENERIC 0
+#define DISTANCE_ISA_AVX2 1
+
+/**
+ * Computes the squared euclidean norm of every row of given matrix.
+ *
+ * Norms are computed with the same summation order used for the cross term,
+ * so the squared distance of a row from itself is always exactly 0.
+ *
+ * Parameters:
+ *  -m: The matrix whose rows' norms will be computed.
+ *  -norms: An array of at least matrix_get_rows(m) doubles, where the
+ *          squared norm of each row will be written.
+ */
+void distance_row_norms(matrix_t *m, double *norms);
+
+/**
+ * Computes the dot products between a range of query rows and a range of
+ * data rows.
+ *
+ * Ranges are half-open, i.e. [start, end). The result is written in row major
+ * order into tile, with a leading dimension of DISTANCE_DATA_TILE. Thus,
+ * (q_end - q_start) should not exceed DISTANCE_QUERY_TILE and
+ * (d_end - d_start) should not exceed DISTANCE_DATA_TILE.
+ *
+ * Parameters:
+ *  -points: Matrix containing the query rows.
+ *  -q_start: First query row of the range (inclusive).
+ *  -q_end: Last query row of the range (exclusive).
+ *  -data: Matrix containing the data rows. It should be of the same width
+ *          as points.
+ *  -d_start: First data row of the range (inclusive).
+ *  -d_end: Last data row of the range (exclusive).
+ *  -tile: A buffer of at least DISTANCE_QUERY_TILE * DISTANCE_DATA_TILE
+ *          doubles, where the dot products will be written.
+ */
+void distance_cross_tile(matrix_t *points, int q_start, int q_end,
+                         matrix_t *data, int d_start, int d_end,
+                         double *tile);
+
+/**
+ * Computes the squared euclidean distances between a range of query rows and
+ * a range of data rows.
+ *
+ * It works the same way as distance_cross_tile(), though instead of dot
+ * products, tile is filled with squared distances, using the precomputed
+ * squared norms of query and data rows. Negative values resulting from
+ * rounding errors are clamped to 0.
+ *
+ * Parameters:
+ *  -points: Matrix containing the query rows.
+ *  -q_norms: Squared norms of all rows in points, as computed by
+ *          distance_row_norms().
+ *  -q_start: First query row of the range (inclusive).
+ *  -q_end: Last query row of the range (exclusive).
+ *  -data: Matrix containing the data rows.
+ *  -d_norms: Squared norms of all rows in data, as computed by
+ *          distance_row_norms().
+ *  -d_start: First data row of the range (inclusive).
+ *  -d_end: Last data row of the range (exclusive).
+ *  -tile: A buffer of at least DISTANCE_QUERY_TILE * DISTANCE_DATA_TILE
+ *          doubles, where the squared distances will be written.
+ */
+void distance_sq_tile(matrix_t *points, const double *q_norms,
+                      int q_start, int q_end,
+                      matrix_t *data, const double *d_norms,
+                      int d_start, int d_end, double *tile);
+
+/**
+ * Float counterpart of distance_row_norms(), for matrices of floats.
+ */
+void distance_row_norms_float(matrix_t *m, float *norms);
+
+/**
+ * Float counterpart of distance_cross_tile(), for matrices of floats.
+ */
+void distance_cross_tile_float(matrix_t *points, int q_start, int q_end,
+                               matrix_t *data, int d_start, int d_end,
+                               float *tile);
+
+/**
+ * Float counterpart of distance_sq_tile(), for matrices of floats.
+ *
+ * Squared distances are accumulated in single precision, so they carry a
+ * rounding error relative to the squared norms of the rows. They are
+ * intended for ranking candidates rather than for exact results.
+ */
+void distance_sq_tile_float(matrix_t *points, const float *q_norms,
+                            int q_start, int q_end,
+                            matrix_t *data, const float *d_norms,
+                            int d_start, int d_end, float *tile);
+
+/**
+ * Returns the instruction set of the kernels used by distance routines, one
+ * of DISTANCE_ISA_* values. It is selected on the first call.
+ */
+int distance_get_isa(void);
+
+/**
+ * Returns the name of given instruction set, as accepted by DISTANCE_ISA
+ * environment variable.
+ */
+const char *distance_isa_name(int isa);
+
+#endif
@@ -9,6 +9,7 @@
  */
 
 #include <stdlib.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -16,9 +17,46 @@
 
 #include "matrix.h"
 #include "knn.h"
+#include "knn_topk.h"
+#include "knn_tree.h"
+#include "knn_profile.h"
+#include "knn_transport.h"
 #include "distributed_knn.h"
 
 
+// Timers of every step of the last knn_search_distributed() call.
+struct Ring_Step_Timing {
+    double compute;  // Time spent on searching.
+    double comm;     // Time from starting the transfers until they completed.
+    double exposed;  // Time spent on waiting for transfers, after searching.
+};
+
+// State of the transfers of a ring step, progressed while searching.
+struct Ring_Progress {
+    struct Matrix_Channel *channel;  // Channel of the blocks of the ring.
+    struct KNN_Channel *nodes;  // Channel of node blocks, when no channel.
+    double completed;  // Time transfers were found complete, 0 until then.
+};
+
+static struct Ring_Step_Timing *ring_timings = NULL;
+static int ring_steps = 0;
+
+// Backend of local searches, as set by knn_set_search_backend().
+static int search_backend = KNN_BACKEND_DEFAULT;
+static double search_tolerance = 0.0;
+
+static void _ring_progress(void *arg);
+static MPI_Datatype _matrix_mpi_type(matrix_t *matrix);
+static void _free_matrix_views(struct Matrix_Channel *channel);
+static int _int_asc_comp(const void *a, const void *b);
+static double _hidden_percent(double comm, double exposed);
+static size_t _node_header_bytes(int max_blocks);
+static size_t _aligned_bytes(size_t bytes);
+static void _label_block(struct KNN_Pair **knns, int points, int k,
+                         matrix_t *labeled, matrix_t *labels);
+static matrix_t *_searched_block(matrix_t *block, int precision);
+
+
 matrix_t *knn_labeling_distributed(struct KNN_Pair **knns, int points, int k,
                                    matrix_t *local_labels, int prev_task,
                                    int next_task, int tasks_num)
@@ -28,12 +66,17 @@ matrix_t *knn_labeling_distributed(struct KNN_Pair **knns, int points, int k,
         qsort(knns[i], k, sizeof(struct KNN_Pair), KNN_Pair_asc_comp_by_index);
     }
 
+    // Blocks land on two buffers, allocated once and used in turns, for
+    // receiving next block while labeling with the current one.
     matrix_t *cur_labels = local_labels;
-    matrix_t *next_labels = NULL;
-    MPI_Request *send_req = NULL;  // Handlers for async send operations.
-    MPI_Request *recv_req = NULL;  // Handlers for async receive operation.
-    int send_req_num = 0;       // Number of send handlers.
-    int recv_req_num = 0;       // Number of receive handlers
+    struct Matrix_Channel channel;  // Channel blocks are passed through.
+    if (tasks_num > 1) {
+        if (_open_matrix_channel(local_labels, tasks_num - 1, prev_task,
+                                 next_task, &channel) != 0)
+        {
+            return NULL;
+        }
+    }
 
     // Initialize a counter for the index where labeling begins for the
     // nearest neighbors of each point.
@@ -44,185 +87,1788 @@ matrix_t *knn_labeling_distributed(struct KNN_Pair **knns, int points, int k,
 
     matrix_t *labeled = NULL;
 
+    KNN_PROFILE_BEGIN_RING("labeling", tasks_num);
+
     for (int i = 0; i < tasks_num; i++) {
-        size_t out_size = 0;
-        size_t in_size = 0;
-        char *out_object = NULL;
-        char *in_object = NULL;
+        KNN_PROFILE_STEP(i);
 
         if (i < tasks_num - 1) {
-            // Start sending current data to next process.
-            out_object = matrix_serialize(cur_labels, &out_size);
-            send_req = _async_send_object(
-                    out_object, out_size, next_task, &send_req_num);
+            KNN_PROFILE_START(post_start);
 
             // Start receiving next data from previous process.
-            recv_req = _async_recv_object(
-                   &in_object, &in_size, prev_task, &recv_req_num);
+            _recv_matrix(&channel, i);
+
+            // Start sending current data to next process.
+            _send_matrix(&channel, cur_labels);
+            KNN_PROFILE_STOP(post_start, KNN_PHASE_SERIALIZE);
         }
 
+        KNN_PROFILE_START(labeling_start);
         labeled = knn_labeling(knns, points, k, labeled, index_counter,
                                cur_labels, matrix_get_chunk_offset(cur_labels));
+        KNN_PROFILE_STOP(labeling_start, KNN_PHASE_LABELING);
 
        // On final iterations, no communications exist.
        if (i < tasks_num - 1) {
-           // Wait for send/receive operations to complete.
-           _wait_async_com(send_req, send_req_num);
-           _wait_async_com(recv_req, recv_req_num);
-
-           // Inflate an actual matrix object. Serialized objects are no longer
-           // needed after that.
-           next_labels = matrix_deserialize(in_object, in_size);
-           free(out_object);
-           free(in_object);
+           // Wait for send/receive operations to complete. Received block
+           // takes the shape described by its header, and labeling goes on
+           // with it.
+           cur_labels = _wait_matrix(&channel);
        }
+    }
+
+    KNN_PROFILE_END_RING();
+
+    if (tasks_num > 1) _close_matrix_channel(&channel);
+    free(index_counter);
+
+    return labeled;
+}
+
+matrix_t *knn_labeling_bidirectional(struct KNN_Pair **knns, int points,
+                                     int k, matrix_t *local_labels,
+                                     int prev_task, int next_task,
+                                     int tasks_num)
+{
+    // Sort the neighbors of each point by index.
+    for (int i = 0; i < points; i++) {
+        qsort(knns[i], k, sizeof(struct KNN_Pair), KNN_Pair_asc_comp_by_index);
+    }
+
+    // Blocks travel clockwise through the next half of the ring and
+    // counter-clockwise through the rest of it. With an even number of
+    // tasks, the block on the opposite side only arrives clockwise.
+    int hops[2] = { tasks_num / 2, (tasks_num - 1) / 2 };
+    int prev[2] = { prev_task, next_task };
+    int next[2] = { next_task, prev_task };
+    struct Matrix_Channel channels[2];  // Clockwise and counter-clockwise.
+    for (int d = 0; d < 2; d++) {
+        if (hops[d] == 0) continue;
+        if (_open_matrix_channel(local_labels, hops[d], prev[d], next[d],
+                                 &channels[d]) != 0)
+        {
+            if (d > 0) _close_matrix_channel(&channels[0]);
+            return NULL;
+        }
+    }
+
+    // Blocks of the two directions arrive in no common order, so neighbors
+    // of every block are looked up, instead of following an index counter
+    // as knn_labeling() does.
+    matrix_t *labeled = matrix_create(points, k);
+    if (!labeled) {
+        printf("ERROR: knn_labeling_bidirectional : Failed to allocate "
+               "memory.\n");
+    }
+
+    KNN_PROFILE_BEGIN_RING("labeling", hops[0] + 1);
+
+    // Block of each direction labeled on current step, if any.
+    matrix_t *cur_labels[2] = { local_labels, NULL };
+    for (int i = 0; i <= hops[0]; i++) {
+        KNN_PROFILE_STEP(i);
+
+        // Both directions are exchanged on every step, in the same order on
+        // all processes. Local block sets off in both of them.
+        KNN_PROFILE_START(post_start);
+        for (int d = 0; d < 2; d++) {
+            if (i < hops[d]) {
+                _recv_matrix(&channels[d], i);
+                _send_matrix(&channels[d],
+                             i == 0 ? local_labels : cur_labels[d]);
+            }
+        }
+        KNN_PROFILE_STOP(post_start, KNN_PHASE_SERIALIZE);
+
+        KNN_PROFILE_START(labeling_start);
+        for (int d = 0; d < 2 && labeled; d++) {
+            if (cur_labels[d]) {
+                _label_block(knns, points, k, labeled, cur_labels[d]);
+            }
+        }
+        KNN_PROFILE_STOP(labeling_start, KNN_PHASE_LABELING);
+
+        for (int d = 0; d < 2; d++) {
+            cur_labels[d] = i < hops[d] ? _wait_matrix(&channels[d]) : NULL;
+        }
+    }
+
+    KNN_PROFILE_END_RING();
+
+    for (int d = 0; d < 2; d++) {
+        if (hops[d] > 0) _close_matrix_channel(&channels[d]);
+    }
+
+    return labeled;
+}
+
+matrix_t *knn_labeling_routed(struct KNN_Pair **knns, int points, int k,
+                              matrix_t *local_labels)
+{
+    int tasks_num;
+    MPI_Comm_size(MPI_COMM_WORLD, &tasks_num);
+
+    // Every process owns a contiguous range of indexes, starting at the
+    // offset of its chunk.
+    int range[2];
+    range[0] = matrix_get_chunk_offset(local_labels);
+    range[1] = matrix_get_rows(local_labels);
+
+    size_t pairs = (size_t) points * k;
+    int *ranges = (int *) malloc(sizeof(int) * 2 * tasks_num);
+    int *by_offset = (int *) malloc(sizeof(int) * tasks_num);
+    int *counts = (int *) malloc(sizeof(int) * 4 * tasks_num);
+    int *needed = (int *) malloc(sizeof(int) * (pairs + 1));
+    matrix_t *labeled = matrix_create(points, k);
+    if (!ranges || !by_offset || !counts || !needed || !labeled) {
+        printf("ERROR: knn_labeling_routed : Failed to allocate memory.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    int *send_counts = counts;
+    int *send_displs = counts + tasks_num;
+    int *recv_counts = counts + 2 * tasks_num;
+    int *recv_displs = counts + 3 * tasks_num;
+
+    MPI_Allgather(range, 2, MPI_INT, ranges, 2, MPI_INT, MPI_COMM_WORLD);
+
+    // Indexes of all neighbors are deduplicated, so each one is requested
+    // only once.
+    int unique = 0;
+    for (int p = 0; p < points; p++) {
+        for (int i = 0; i < k; i++) {
+            if (knns[p][i].index >= 0) needed[unique++] = knns[p][i].index;
+        }
+    }
+    qsort(needed, unique, sizeof(int), _int_asc_comp);
+    int last = 0;
+    for (int i = 1; i < unique; i++) {
+        if (needed[i] != needed[last]) needed[++last] = needed[i];
+    }
+    if (unique > 0) unique = last + 1;
 
-       // If current block is not the local labels, it is no more needed.
-       if (i > 0) matrix_destroy(cur_labels);
-       // Do labeling for next block.
-       cur_labels = next_labels;
+    // Owners are visited in the order of their ranges, so sorted indexes
+    // are split into consecutive requests, one for each owner.
+    for (int r = 0; r < tasks_num; r++) {
+        int j = r;
+        while (j > 0 && ranges[2*by_offset[j-1]] > ranges[2*r]) {
+            by_offset[j] = by_offset[j-1];
+            j--;
+        }
+        by_offset[j] = r;
+    }
+    int pos = 0;
+    for (int o = 0; o < tasks_num; o++) {
+        int owner = by_offset[o];
+        int end = ranges[2*owner] + ranges[2*owner+1];
+        send_displs[owner] = pos;
+        while (pos < unique && needed[pos] < end) pos++;
+        send_counts[owner] = pos - send_displs[owner];
+    }
+    int answered = pos;  // Indexes beyond all ranges get no label.
+
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT,
+                 MPI_COMM_WORLD);
+    int requested = 0;
+    for (int r = 0; r < tasks_num; r++) {
+        recv_displs[r] = requested;
+        requested += recv_counts[r];
+    }
+
+    int *requests = (int *) malloc(sizeof(int) * (requested + 1));
+    int *answers = (int *) malloc(sizeof(int) * (unique + 1));
+    if (!requests || !answers) {
+        printf("ERROR: knn_labeling_routed : Failed to allocate memory.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    MPI_Alltoallv(needed, send_counts, send_displs, MPI_INT,
+                  requests, recv_counts, recv_displs, MPI_INT,
+                  MPI_COMM_WORLD);
+
+    // Requests are answered in place, by the labels of local points.
+    for (int i = 0; i < requested; i++) {
+        int index = requests[i] - range[0];
+        requests[i] = index >= 0 && index < range[1] ?
+                      (int) matrix_get_cell(local_labels, index, 0) : -1;
     }
 
+    for (int i = answered; i < unique; i++) answers[i] = -1;
+    MPI_Alltoallv(requests, recv_counts, recv_displs, MPI_INT,
+                  answers, send_counts, send_displs, MPI_INT,
+                  MPI_COMM_WORLD);
+
+    // Every neighbor finds the label of its index, among the deduplicated
+    // ones.
+    #pragma omp parallel for
+    for (int p = 0; p < points; p++) {
+        for (int i = 0; i < k; i++) {
+            int label = -1;
+            int index = knns[p][i].index;
+            if (index >= 0) {
+                int low = 0;
+                int high = unique;
+                while (low < high) {
+                    int mid = low + (high - low) / 2;
+                    if (needed[mid] < index) low = mid + 1;
+                    else high = mid;
+                }
+                label = answers[low];
+            }
+            knns[p][i].label = label;
+            matrix_set_cell(labeled, p, i, (double) label);
+        }
+    }
+
+    free(ranges);
+    free(by_offset);
+    free(counts);
+    free(needed);
+    free(requests);
+    free(answers);
+
     return labeled;
 }
 
-struct KNN_Pair **knn_search_distributed(matrix_t *local_data, int k,
+struct KNN_Pair **knn_search_distributed(matrix_t *local_data,
+                                         matrix_t *local_labels, int k,
                                          int prev_task, int next_task,
-                                         int tasks_num)
+                                         int tasks_num, int precision)
 {
-    matrix_t *cur_data_block = NULL;   // Current block of data to be used for knn search.
-    matrix_t *next_data_block = NULL;  // Next block of data for knn search.
-    MPI_Request *send_req = NULL;  // Handlers for async send operations.
-    MPI_Request *recv_req = NULL;  // Handlers for async receive operation.
-    int send_req_num = 0;       // Number of send handlers.
-    int recv_req_num = 0;       // Number of receive handlers.
-    struct KNN_Pair **knns = NULL; // K Nearest Neighbors for current query chunk.
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    int local_rows = matrix_get_rows(local_data);
 
-    cur_data_block = local_data;  // Start knn search using local data.
+    // Each block only visits the next half of the ring, carrying the nearest
+    // neighbors found for its points so far, since on every visit distances
+    // are used for the points of both the block and the process. This way,
+    // each pair of blocks meets exactly once. With an even number of tasks,
+    // a block and the one on the opposite side of the ring meet twice on the
+    // last step, so only processes of the first half search on it.
+    int steps = tasks_num / 2;
 
-    // Repeat the process tasks_num times and update kNNs based on the new
-    // blocks.
-    for (int i = 0; i < tasks_num; i++) {
-        size_t out_size = 0;
-        size_t in_size = 0;
-        char *out_object = NULL;
-        char *in_object = NULL;
+    // Every process takes part in the ring, so failures are gathered from
+    // all of them, and all of them give up together.
+    int failed = 0;
+    int any_failed;
 
-        // On final iteration, there is nothing more to send/receive. Last data
-        // exchange happened on tasks_num - 1 iteration.
-        if (i < tasks_num - 1) {
-            // Start sending current data to next process.
-            out_object = matrix_serialize(cur_data_block, &out_size);
-            send_req = _async_send_object(
-                    out_object, out_size, next_task, &send_req_num);
+    // Unless searching in double precision, blocks are searched as floats.
+    // They are passed around the ring as floats too, unless they are needed
+    // in double precision for re-ranking.
+    matrix_t *local_search = local_data;
+    if (precision != KNN_PRECISION_DOUBLE) {
+        local_search = matrix_to_float(local_data);
+    }
+    matrix_t *local_ring = precision == KNN_PRECISION_MIXED ?
+                           local_data : local_search;
 
-            // Start receiving next data from previous process.
-            recv_req = _async_recv_object(
-                   &in_object, &in_size, prev_task, &recv_req_num);
+    // Labels, when given, are packed once and follow their block around
+    // the ring.
+    int *packed = NULL;
+    int mismatch = local_labels &&
+                   matrix_get_rows(local_labels) != local_rows;
+    if (mismatch) {
+        printf("ERROR: knn_search_distributed : Labels don't match data.\n");
+        failed = 1;
+    } else if (local_labels) {
+        packed = knn_pack_labels(local_labels);
+    }
+
+    // Neighbors of local points are kept in selector form until the end.
+    struct KNN_Pair **knns = KNN_Pair_create_empty_table(local_rows, k);
+    if (!local_search || !knns || (local_labels && !mismatch && !packed)) {
+        printf("ERROR: knn_search_distributed : Failed to allocate memory.\n");
+        failed = 1;
+    }
+
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (any_failed) {
+        KNN_Pair_destroy_table(knns, local_rows);
+        free(packed);
+        if (local_search && local_search != local_data) {
+            matrix_destroy(local_search);
+        }
+        return NULL;
+    }
+    knn_table_init(knns, local_rows, k);
+
+    // Two buffers are allocated once and used in turns, for receiving
+    // next block while searching on the current one. Each one comes with
+    // a table for the neighbors carried by the block and, when labeling,
+    // with the labels of the block. Blocks read in place from other
+    // processes of the node land on no buffer, though their tables and
+    // labels do.
+    struct KNN_Pair **carried[2] = { NULL, NULL };
+    int *label_buffers[2] = { NULL, NULL };
+    struct Matrix_Channel blocks;         // Channel of the blocks.
+    struct KNN_Channel tables;            // Channel of the carried tables.
+    struct KNN_Channel block_labels;      // Channel of the labels of blocks.
+    struct Ring_Progress progress;        // Progress of current step's transfers.
+    int max_rows = 0;                     // Rows of the biggest block.
+    if (steps > 0) {
+        // Opening the channel fails on all processes, or on none.
+        int opened = _open_matrix_channel(local_ring, steps, prev_task,
+                                          next_task, &blocks) == 0;
+        if (opened) {
+            max_rows = blocks.max_rows;
+            failed = _create_carried_tables(max_rows, k, carried) != 0 ||
+                     (packed &&
+                      _create_label_buffers(max_rows, label_buffers) != 0);
+            MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX,
+                          MPI_COMM_WORLD);
+        }
+        if (!opened || any_failed) {
+            if (opened) _close_matrix_channel(&blocks);
+            for (int b = 0; b < 2; b++) {
+                free(label_buffers[b]);
+                KNN_Pair_destroy_table(carried[b], max_rows);
+            }
+            KNN_Pair_destroy_table(knns, local_rows);
+            free(packed);
+            if (local_search != local_data) matrix_destroy(local_search);
+            return NULL;
         }
 
-        // On first iteration, search is done using the local data chunk.
+        // Blocks always land on the same two buffers, along with their
+        // tables and labels, so channels are opened once for the whole ring.
+        int table_bytes = (int) (sizeof(struct KNN_Pair) * k * max_rows);
+        knn_channel_open(&tables, carried[0][0], carried[1][0], table_bytes,
+                         MPI_BYTE, MPI_TAG_KNNS, prev_task, next_task);
+        if (packed) {
+            knn_channel_open(&block_labels, label_buffers[0], label_buffers[1],
+                             max_rows, MPI_INT, MPI_TAG_LABELS,
+                             prev_task, next_task);
+        }
+    }
+
+    // Communications can only be progressed from within the search, when
+    // MPI allows the master thread of OpenMP regions to call it.
+    int thread_level;
+    MPI_Query_thread(&thread_level);
+    int use_progress = steps > 0 && thread_level >= MPI_THREAD_FUNNELED;
+
+    free(ring_timings);
+    ring_timings = (struct Ring_Step_Timing *) calloc(
+            steps + 1, sizeof(struct Ring_Step_Timing));
+    ring_steps = ring_timings ? steps + 1 : 0;
+
+    // With the tree backend, local points are indexed once, since they are
+    // searched on every step.
+    struct KNN_Tree *local_tree = NULL;
+    if (search_backend == KNN_BACKEND_VPTREE) {
+        local_tree = knn_tree_build(local_search);
+        failed |= local_tree == NULL;
+    }
+
+    // Bounding box of local points, against which visiting blocks are
+    // checked before searching. Without it, no block is skipped.
+    struct KNN_Bounds *local_bounds = knn_bounds_create(local_search);
+
+    KNN_PROFILE_BEGIN_RING("search", steps + 1);
+
+    matrix_t *next_block = NULL;  // Block received on previous step.
+    for (int i = 0; i <= steps; i++) {
+        double step_start = MPI_Wtime();
+        KNN_PROFILE_STEP(i);
+
+        // On first step, local block is searched against itself. On the
+        // rest, the block received on previous step, along with its
+        // carried neighbors.
+        matrix_t *block = i == 0 ? local_ring : next_block;
+        struct KNN_Pair **block_knns = i == 0 ? NULL : carried[(i-1) % 2];
+        int *labels = i == 0 ? packed : label_buffers[(i-1) % 2];
+        int forward = i < steps;  // Whether block goes on to next process.
+
+        if (forward) {
+            KNN_PROFILE_START(post_start);
+
+            // Receives are begun first, so they are already posted when
+            // data from previous process arrive. Nothing is carried by
+            // blocks that have not been searched yet.
+            _recv_matrix(&blocks, i);
+            if (i > 0) knn_channel_recv(&tables, i % 2);
+
+            // Block is never modified, so it can be forwarded at once.
+            _send_matrix(&blocks, block);
+            if (packed) {
+                knn_channel_recv(&block_labels, i % 2);
+                knn_channel_send(&block_labels, labels,
+                                 matrix_get_rows(block));
+            }
+
+            progress.channel = &blocks;
+            progress.nodes = NULL;
+            progress.completed = 0.0;
+            if (use_progress) knn_set_progress_hook(_ring_progress, &progress);
+            KNN_PROFILE_STOP(post_start, KNN_PHASE_SERIALIZE);
+        }
+
+        KNN_PROFILE_START(search_start);
         if (i == 0) {
-            // First nearest neighbor will be the point itself, so remove it.
-            struct KNN_Pair **knn_helper = knn_search(
-                    cur_data_block, local_data, k+1,
-                    matrix_get_chunk_offset(cur_data_block));
-            knns = KNN_Pair_create_subtable(
-                    knn_helper, 0, matrix_get_rows(local_data)-1, 1, k);
-            KNN_Pair_destroy_table(knn_helper, matrix_get_rows(local_data));
-        }
-        // On all remaining iterations, search is done using data chunks
-        // received from other tasks.
-        else {
-            struct KNN_Pair **new_knns = knn_search(
-                    cur_data_block, local_data, k,
-                    matrix_get_chunk_offset(cur_data_block));
-            // Merge new and old results.
-            _update_knns(knns, new_knns, matrix_get_rows(local_data), k);
-        }
-
-        // On final iterations, no communications exist.
-        if (i < tasks_num - 1) {
-            // Wait for send/receive operations to complete.
-            _wait_async_com(send_req, send_req_num);
-            _wait_async_com(recv_req, recv_req_num);
+            failed |= _search_local(local_search, local_data, packed,
+                                    local_tree, knns, k, precision) != 0;
+        }
+        else if (i < steps || tasks_num % 2 || rank < steps) {
+            failed |= _search_pair(local_search, local_data, packed,
+                                   local_tree, local_bounds, knns,
+                                   block, labels, block_knns,
+                                   k, precision) != 0;
+        }
+        KNN_PROFILE_STOP(search_start, KNN_PHASE_SEARCH);
+
+        double compute_end = MPI_Wtime();
+        double step_end = compute_end;
+
+        if (forward) {
+            knn_set_progress_hook(NULL, NULL);
+            _ring_progress(&progress);
+
+            // Carried neighbors, now updated, follow their block.
+            if (i > 0) {
+                KNN_PROFILE_START(post_start);
+                knn_channel_send(&tables, block_knns[0],
+                                 (int) (sizeof(struct KNN_Pair) * k *
+                                        matrix_get_rows(block)));
+                KNN_PROFILE_STOP(post_start, KNN_PHASE_SERIALIZE);
+            }
+
+            // Wait for send/receive operations to complete. Received block
+            // takes the shape described by its header.
+            next_block = _wait_matrix(&blocks);
+            KNN_PROFILE_START(wait_start);
+            if (packed) knn_channel_wait(&block_labels);
+            if (i > 0) {
+                knn_channel_wait(&tables);
+            } else {
+                _exchange_bounds(knns, local_rows, carried[0], max_rows, k,
+                                 prev_task, next_task);
+            }
+            KNN_PROFILE_STOP(wait_start, KNN_PHASE_WAIT);
+
+            step_end = MPI_Wtime();
+            if (progress.completed == 0.0) progress.completed = step_end;
+        }
+
+        // Blocks return their carried neighbors to their owners, after
+        // last step.
+        if (i == steps && steps > 0) {
+            _return_carried(block, block_knns, knns, local_rows, k,
+                            prev_task, next_task, steps);
+        }
 
-            // Inflate an actual matrix object. Serialized objects are no longer
-            // needed after that.
-            next_data_block = matrix_deserialize(in_object, in_size);
-            free(out_object);
-            free(in_object);
+        if (i < ring_steps) {
+            ring_timings[i].compute = compute_end - step_start;
+            if (i < steps) {
+                ring_timings[i].comm = progress.completed - step_start;
+                ring_timings[i].exposed = step_end - compute_end;
+            }
         }
+    }
+
+    KNN_PROFILE_END_RING();
 
-        // If current block is not the local data, it is no more needed.
-        if (i > 0) matrix_destroy(cur_data_block);
-        // Do the search for next block.
-        cur_data_block = next_data_block;
+    if (steps > 0) {
+        _close_matrix_channel(&blocks);
+        knn_channel_close(&tables);
+        if (packed) knn_channel_close(&block_labels);
+        for (int b = 0; b < 2; b++) {
+            free(label_buffers[b]);
+            KNN_Pair_destroy_table(carried[b], max_rows);
+        }
     }
+    free(packed);
+    knn_tree_destroy(local_tree);
+    knn_bounds_destroy(local_bounds);
+    if (local_search != local_data) matrix_destroy(local_search);
+
+    if (failed) {
+        KNN_Pair_destroy_table(knns, local_rows);
+        return NULL;
+    }
+
+    knn_table_finalize(knns, local_rows, k);
 
     return knns;
 }
 
+struct KNN_Pair **knn_search_hierarchical(matrix_t *local_data,
+                                          matrix_t *local_labels, int k,
+                                          int precision)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    int local_rows = matrix_get_rows(local_data);
+
+    MPI_Comm node_comm = knn_node_comm();
+    int failed = node_comm == MPI_COMM_NULL;
+    int any_failed;
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (any_failed) {
+        printf("ERROR: knn_search_hierarchical : Failed to discover nodes.\n");
+        return NULL;
+    }
+    int node_rank, node_size;
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm_size(node_comm, &node_size);
+    int leader = knn_node_of(rank);
+
+    // Leaders form the ring of nodes, in the order of their ranks. The rest
+    // of the processes stay out of it, as rings of their own.
+    int nodes = 1;
+    int prev_leader = rank;
+    int next_leader = rank;
+    MPI_Comm leader_comm;
+    MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, rank,
+                   &leader_comm);
+    if (leader_comm != MPI_COMM_NULL) {
+        int position;
+        MPI_Comm_rank(leader_comm, &position);
+        MPI_Comm_size(leader_comm, &nodes);
+        int neighbors[2] = { (position + nodes - 1) % nodes,
+                             (position + 1) % nodes };
+        int leaders[2];
+        MPI_Group leader_group, world;
+        MPI_Comm_group(leader_comm, &leader_group);
+        MPI_Comm_group(MPI_COMM_WORLD, &world);
+        MPI_Group_translate_ranks(leader_group, 2, neighbors, world, leaders);
+        MPI_Group_free(&leader_group);
+        MPI_Group_free(&world);
+        MPI_Comm_free(&leader_comm);
+        prev_leader = leaders[0];
+        next_leader = leaders[1];
+    }
+    MPI_Bcast(&nodes, 1, MPI_INT, 0, node_comm);
+
+    // Unless searching in double precision, blocks are searched as floats.
+    // They are passed around the ring as floats too, unless they are needed
+    // in double precision for re-ranking.
+    matrix_t *local_search = local_data;
+    if (precision != KNN_PRECISION_DOUBLE) {
+        local_search = matrix_to_float(local_data);
+    }
+    matrix_t *local_ring = precision == KNN_PRECISION_MIXED ?
+                           local_data : local_search;
+
+    // Labels, when given, are packed once into the node block.
+    int labels_match = !local_labels ||
+                       matrix_get_rows(local_labels) == local_rows;
+    int *packed = NULL;
+    if (local_labels && labels_match) packed = knn_pack_labels(local_labels);
+
+    struct KNN_Pair **knns = KNN_Pair_create_empty_table(local_rows, k);
+    if (!labels_match) {
+        printf("ERROR: knn_search_hierarchical : Labels don't match data.\n");
+        failed = 1;
+    }
+    else if (!local_search || !knns || (local_labels && !packed)) {
+        printf("ERROR: knn_search_hierarchical : Failed to allocate "
+               "memory.\n");
+        failed = 1;
+    }
+
+    // Every node block holds the blocks of all processes of the node, one
+    // after the other, and fits into the biggest node block of the ring.
+    int max_blocks;
+    MPI_Allreduce(&node_size, &max_blocks, 1, MPI_INT, MPI_MAX,
+                  MPI_COMM_WORLD);
+    size_t header_bytes = _node_header_bytes(max_blocks);
+    long sizes[2] = { 0, local_rows };  // Bytes of cells and rows.
+    if (local_ring) {
+        sizes[0] = (long) _aligned_bytes(matrix_get_cell_size(local_ring) *
+                                         local_rows *
+                                         matrix_get_stride(local_ring));
+    }
+    long offsets[2] = { 0, 0 };  // Of local cells and labels in node block.
+    long totals[2];
+    MPI_Exscan(sizes, offsets, 2, MPI_LONG, MPI_SUM, node_comm);
+    if (node_rank == 0) offsets[0] = offsets[1] = 0;
+    MPI_Allreduce(sizes, totals, 2, MPI_LONG, MPI_SUM, node_comm);
+    long node_bytes = (long) header_bytes + totals[0] +
+                      (local_labels ? totals[1] * (long) sizeof(int) : 0);
+    long capacity;
+    MPI_Allreduce(&node_bytes, &capacity, 1, MPI_LONG, MPI_MAX,
+                  MPI_COMM_WORLD);
+    capacity = (long) _aligned_bytes((size_t) capacity);
+    if (capacity > INT_MAX) {
+        if (rank == MPI_MASTER) {
+            printf("ERROR: knn_search_hierarchical : Node blocks don't fit "
+                   "into a single message.\n");
+        }
+        failed = 1;
+    }
+
+    // Node block of current node and the two slots node blocks of other
+    // nodes land on, all held in the shared segment of the leader, where
+    // every process of the node reads them in place.
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    struct KNN_Shared shared;
+    size_t segment_bytes = node_rank == 0 ?
+                           (size_t) capacity * (nodes > 1 ? 3 : 1) : 0;
+    if (any_failed || knn_shared_create(segment_bytes, &shared) != 0) {
+        if (knns) KNN_Pair_destroy_table(knns, local_rows);
+        free(packed);
+        if (local_search && local_search != local_data) {
+            matrix_destroy(local_search);
+        }
+        return NULL;
+    }
+    char *own = (char *) knn_shared_query(&shared, leader);
+    char *slots[2] = { own + capacity, own + 2 * capacity };
+
+    // Every process copies its block and labels into the node block once.
+    int *header = (int *) own;
+    if (node_rank == 0) {
+        header[0] = node_size;
+        header[1] = (int) totals[1];
+        header[2] = (int) node_bytes;
+        header[3] = local_labels ? (int) (header_bytes + totals[0]) : 0;
+    }
+    header[4 + 3 * node_rank] = local_rows;
+    header[5 + 3 * node_rank] = matrix_get_stride(local_ring);
+    header[6 + 3 * node_rank] = matrix_get_chunk_offset(local_ring);
+    memcpy(own + header_bytes + offsets[0], matrix_get_buffer(local_ring),
+           matrix_get_cell_size(local_ring) * local_rows *
+           matrix_get_stride(local_ring));
+    if (packed) {
+        memcpy(own + header_bytes + totals[0] + offsets[1] * sizeof(int),
+               packed, sizeof(int) * local_rows);
+    }
+    knn_shared_publish(&shared);
+
+    // Only leaders pass node blocks around, though the channel is opened by
+    // all processes.
+    struct KNN_Channel link;
+    if (nodes > 1) {
+        knn_channel_open(&link, node_rank == 0 ? slots[0] : NULL,
+                         node_rank == 0 ? slots[1] : NULL,
+                         node_rank == 0 ? (int) capacity : 0, MPI_BYTE,
+                         MPI_TAG_OBJECT, prev_leader, next_leader);
+    }
+
+    int thread_level;
+    MPI_Query_thread(&thread_level);
+    int use_progress = nodes > 1 && node_rank == 0 &&
+                       thread_level >= MPI_THREAD_FUNNELED;
+
+    free(ring_timings);
+    ring_timings = (struct Ring_Step_Timing *) calloc(
+            nodes, sizeof(struct Ring_Step_Timing));
+    ring_steps = ring_timings ? nodes : 0;
+
+    knn_table_init(knns, local_rows, k);
+
+    matrix_t *views = (matrix_t *) calloc(max_blocks, sizeof(matrix_t));
+    failed = views == NULL;
+
+    struct KNN_Tree *local_tree = NULL;
+    if (search_backend == KNN_BACKEND_VPTREE) {
+        local_tree = knn_tree_build(local_search);
+        failed |= local_tree == NULL;
+    }
+    struct KNN_Bounds *local_bounds = knn_bounds_create(local_search);
+
+    KNN_PROFILE_BEGIN_RING("search", nodes);
+
+    struct Ring_Progress progress;
+    for (int i = 0; i < nodes; i++) {
+        double step_start = MPI_Wtime();
+        KNN_PROFILE_STEP(i);
+
+        // On first step, the node block of current node is searched. On the
+        // rest, the one received by the leader on previous step.
+        char *node_block = i == 0 ? own : slots[(i-1) % 2];
+        int forward = node_rank == 0 && i < nodes - 1;
+
+        if (forward) {
+            KNN_PROFILE_START(post_start);
+            knn_channel_recv(&link, i % 2);
+            knn_channel_send(&link, node_block, ((int *) node_block)[2]);
+
+            progress.channel = NULL;
+            progress.nodes = &link;
+            progress.completed = 0.0;
+            if (use_progress) knn_set_progress_hook(_ring_progress, &progress);
+            KNN_PROFILE_STOP(post_start, KNN_PHASE_SERIALIZE);
+        }
+
+        // Local points are searched against every block of the node block,
+        // with all threads of current process.
+        KNN_PROFILE_START(search_start);
+        if (views) {
+            const int *labels;
+            int blocks = _node_block_views(node_block, max_blocks,
+                                           local_ring, views, &labels);
+            for (int b = 0; b < blocks && !failed; b++) {
+                if (i == 0 && b == node_rank) {
+                    failed |= _search_local(local_search, local_data, packed,
+                                            local_tree, knns, k,
+                                            precision) != 0;
+                }
+                else {
+                    failed |= _search_block(local_search, local_data,
+                                            local_bounds, knns, &views[b],
+                                            labels, k, precision) != 0;
+                }
+                if (labels) labels += views[b].rows;
+            }
+        }
+        KNN_PROFILE_STOP(search_start, KNN_PHASE_SEARCH);
+
+        double compute_end = MPI_Wtime();
+        double step_end = compute_end;
+
+        if (forward) {
+            knn_set_progress_hook(NULL, NULL);
+            _ring_progress(&progress);
+
+            KNN_PROFILE_START(wait_start);
+            knn_channel_wait(&link);
+            KNN_PROFILE_STOP(wait_start, KNN_PHASE_WAIT);
+
+            step_end = MPI_Wtime();
+            if (progress.completed == 0.0) progress.completed = step_end;
+        }
+
+        // The slot received on this step is searched on the next one, while
+        // the other slot is overwritten, so no process of the node moves on
+        // until all are done with current node block.
+        KNN_PROFILE_START(sync_start);
+        knn_shared_publish(&shared);
+        KNN_PROFILE_STOP(sync_start, KNN_PHASE_WAIT);
+
+        if (i < ring_steps) {
+            ring_timings[i].compute = compute_end - step_start;
+            if (forward) {
+                ring_timings[i].comm = progress.completed - step_start;
+                ring_timings[i].exposed = step_end - compute_end;
+            }
+        }
+    }
+
+    KNN_PROFILE_END_RING();
+
+    if (nodes > 1) knn_channel_close(&link);
+    knn_shared_destroy(&shared);
+    free(views);
+    free(packed);
+    knn_tree_destroy(local_tree);
+    knn_bounds_destroy(local_bounds);
+    if (local_search != local_data) matrix_destroy(local_search);
 
-MPI_Request *_async_send_object(char *object, size_t length, int rank,
-                               int *handlerc)
+    if (failed) {
+        KNN_Pair_destroy_table(knns, local_rows);
+        return NULL;
+    }
+
+    knn_table_finalize(knns, local_rows, k);
+
+    return knns;
+}
+
+struct KNN_Reference *knn_reference_create(matrix_t *local_data,
+                                           matrix_t *local_labels,
+                                           int precision)
 {
-    MPI_Request *handlers = (MPI_Request *) malloc(sizeof(MPI_Request));
-    *handlerc = 1;
+    struct KNN_Reference *reference = (struct KNN_Reference *) calloc(
+            1, sizeof(struct KNN_Reference));
+    if (!reference) {
+        printf("ERROR: knn_reference_create : Failed to allocate memory.\n");
+        return NULL;
+    }
+    reference->data = local_data;
+    reference->search = local_data;
+    reference->precision = precision;
 
-    // Send object.
-    MPI_Isend(object, length, MPI_CHAR, rank, MPI_TAG_OBJECT,
-              MPI_COMM_WORLD, handlers);
+    if (local_labels && matrix_get_rows(local_labels) !=
+                        matrix_get_rows(local_data))
+    {
+        printf("ERROR: knn_reference_create : Labels don't match data.\n");
+        free(reference);
+        return NULL;
+    }
+
+    // Everything that only depends on the reference block is prepared
+    // once, so every batch of queries only costs its search.
+    int failed = 0;
+    if (precision != KNN_PRECISION_DOUBLE) {
+        reference->search = matrix_to_float(local_data);
+        failed |= reference->search == NULL;
+    }
+    if (!failed && local_labels) {
+        reference->labels = knn_pack_labels(local_labels);
+        failed |= reference->labels == NULL;
+    }
+    if (!failed && search_backend == KNN_BACKEND_VPTREE) {
+        reference->tree = knn_tree_build(reference->search);
+        failed |= reference->tree == NULL;
+    }
+    if (!failed) reference->bounds = knn_bounds_create(reference->search);
+
+    if (failed) {
+        printf("ERROR: knn_reference_create : Failed to allocate memory.\n");
+        knn_reference_destroy(reference);
+        return NULL;
+    }
 
-    return handlers;
+    return reference;
 }
 
+void knn_reference_destroy(struct KNN_Reference *reference)
+{
+    if (!reference) return;
+    if (reference->search && reference->search != reference->data) {
+        matrix_destroy(reference->search);
+    }
+    free(reference->labels);
+    knn_tree_destroy(reference->tree);
+    knn_bounds_destroy(reference->bounds);
+    free(reference);
+}
 
-MPI_Request *_async_recv_object(char **object, size_t *length, int rank, int *handlerc)
+struct KNN_Pair **knn_query_distributed(struct KNN_Reference *reference,
+                                        matrix_t *local_queries, int k,
+                                        int prev_task, int next_task,
+                                        int tasks_num)
 {
-    MPI_Request *handlers = (MPI_Request *) malloc(sizeof(MPI_Request));
-    *handlerc = 1;
+    int local_rows = matrix_get_rows(local_queries);
+
+    // Every process takes part in the ring, so failures are gathered from
+    // all of them, and all of them give up together.
+    int failed = 0;
+    int any_failed;
+
+    // Queries are searched in the type reference is searched in. They are
+    // passed around the ring in that type too, unless they are needed in
+    // double precision for re-ranking.
+    matrix_t *queries = local_queries;
+    if (reference->precision == KNN_PRECISION_SINGLE) {
+        queries = matrix_to_float(local_queries);
+    }
+
+    struct KNN_Pair **knns = KNN_Pair_create_empty_table(local_rows, k);
+    if (!queries || !knns) {
+        printf("ERROR: knn_query_distributed : Failed to allocate memory.\n");
+        failed = 1;
+    }
+
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (any_failed) {
+        KNN_Pair_destroy_table(knns, local_rows);
+        if (queries && queries != local_queries) matrix_destroy(queries);
+        return NULL;
+    }
+    knn_table_init(knns, local_rows, k);
+
+    // Two buffers are allocated once and used in turns, for receiving next
+    // batch while searching the current one. Each one comes with a table
+    // for the neighbors found so far for the queries of the batch.
+    struct KNN_Pair **carried[2] = { NULL, NULL };
+    struct Matrix_Channel batches;        // Channel of the batches.
+    struct Ring_Progress progress;        // Progress of current step's transfers.
+    int max_rows = 0;                     // Rows of the biggest batch.
+    if (tasks_num > 1) {
+        // Opening the channel fails on all processes, or on none.
+        int opened = _open_matrix_channel(queries, tasks_num - 1, prev_task,
+                                          next_task, &batches) == 0;
+        if (opened) {
+            max_rows = batches.max_rows;
+            failed = _create_carried_tables(max_rows, k, carried) != 0;
+            MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX,
+                          MPI_COMM_WORLD);
+        }
+        if (!opened || any_failed) {
+            if (opened) _close_matrix_channel(&batches);
+            KNN_Pair_destroy_table(carried[0], max_rows);
+            KNN_Pair_destroy_table(carried[1], max_rows);
+            KNN_Pair_destroy_table(knns, local_rows);
+            if (queries != local_queries) matrix_destroy(queries);
+            return NULL;
+        }
+    }
+    int table_bytes = (int) (sizeof(struct KNN_Pair) * k * max_rows);
+
+    int thread_level;
+    MPI_Query_thread(&thread_level);
+    int use_progress = tasks_num > 1 && thread_level >= MPI_THREAD_FUNNELED;
+
+    // Reference blocks stay in place, while every batch of queries visits
+    // the whole ring. After its last search, the table of a batch moves one
+    // more process forward, back to the owner of the batch.
+    matrix_t *next_block = NULL;  // Batch received on previous step.
+    for (int i = 0; i < tasks_num; i++) {
+        matrix_t *block = i == 0 ? queries : next_block;
+        struct KNN_Pair **block_knns = i == 0 ? knns : carried[(i-1) % 2];
+        int forward = i < tasks_num - 1;  // Whether batch goes on.
+
+        if (forward) {
+            _recv_matrix(&batches, i);
+            _send_matrix(&batches, block);
+
+            progress.channel = &batches;
+            progress.nodes = NULL;
+            progress.completed = 0.0;
+            if (use_progress) knn_set_progress_hook(_ring_progress, &progress);
+        }
 
-    int size;
-    MPI_Status status;
+        failed |= _search_queries(reference, block, block_knns, k) != 0;
 
-    // Probe for length of incoming object.
-    MPI_Probe(rank, MPI_TAG_OBJECT, MPI_COMM_WORLD, &status);
-    MPI_Get_count(&status, MPI_CHAR, &size);
-    *length = (size_t) size;
+        if (forward) {
+            knn_set_progress_hook(NULL, NULL);
+            next_block = _wait_matrix(&batches);
+        }
 
-    // Start receiving the object.
-    *object = (char *) malloc(sizeof(char) * size);
-    MPI_Irecv(*object, size, MPI_CHAR, rank, MPI_TAG_OBJECT,
-              MPI_COMM_WORLD, handlers);
+        // Neighbors found so far follow their batch. On last step, the ones
+        // of local queries return.
+        if (tasks_num > 1) {
+            struct KNN_Pair **target = forward ? carried[i % 2] : knns;
+            int target_bytes = forward ? table_bytes :
+                    (int) (sizeof(struct KNN_Pair) * k * local_rows);
+            MPI_Sendrecv(block_knns[0], (int) (sizeof(struct KNN_Pair) * k *
+                                               matrix_get_rows(block)),
+                         MPI_BYTE, next_task, MPI_TAG_KNNS,
+                         target[0], target_bytes, MPI_BYTE, prev_task,
+                         MPI_TAG_KNNS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+    }
 
-    return handlers;
+    if (tasks_num > 1) {
+        _close_matrix_channel(&batches);
+        for (int b = 0; b < 2; b++) {
+            KNN_Pair_destroy_table(carried[b], max_rows);
+        }
+    }
+    if (queries != local_queries) matrix_destroy(queries);
+
+    if (failed) {
+        KNN_Pair_destroy_table(knns, local_rows);
+        return NULL;
+    }
+
+    knn_table_finalize(knns, local_rows, k);
+
+    return knns;
 }
 
+void knn_print_ring_timings(void)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
-void _wait_async_com(MPI_Request *handlers, int handlerc) {
-    // if (handlers == NULL) printf("handlers is null\n");
-    // printf("handlerc: %d\n", handlerc);
-    // printf("_wait_async_com() : handlers addr: 0x%lx\n", (long unsigned int) handlers);
+    // Every step is as slow as the slowest process, so the maximum of each
+    // timer over all processes is reported.
+    int steps;
+    MPI_Allreduce(&ring_steps, &steps, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if (steps < 2) return;
 
-    MPI_Waitall(handlerc, handlers, MPI_STATUSES_IGNORE);
+    double *local = (double *) malloc(3 * steps * sizeof(double));
+    double *worst = (double *) malloc(3 * steps * sizeof(double));
+    for (int i = 0; i < steps; i++) {
+        local[3*i] = ring_timings[i].compute;
+        local[3*i+1] = ring_timings[i].comm;
+        local[3*i+2] = ring_timings[i].exposed;
+    }
+    MPI_Reduce(local, worst, 3 * steps, MPI_DOUBLE, MPI_MAX, MPI_MASTER,
+               MPI_COMM_WORLD);
+
+    if (rank == MPI_MASTER) {
+        double total_comm = 0.0;
+        double total_exposed = 0.0;
+        printf("Ring step timings (max over processes):\n");
+        printf("  step  compute(s)  comm(s)  exposed(s)  hidden\n");
+        // Last step only computes, so it has no communication to hide.
+        for (int i = 0; i < steps - 1; i++) {
+            double comm = worst[3*i+1];
+            double exposed = worst[3*i+2];
+            printf("  %4d  %10.4f  %7.4f  %10.4f  %5.1f%%\n", i,
+                   worst[3*i], comm, exposed, _hidden_percent(comm, exposed));
+            total_comm += comm;
+            total_exposed += exposed;
+        }
+        printf("Ring communication took %.4f secs, %.1f%% hidden behind "
+               "computation.\n", total_comm,
+               _hidden_percent(total_comm, total_exposed));
+    }
+
+    free(local);
+    free(worst);
 }
 
 
-void _update_knns(struct KNN_Pair **original, struct KNN_Pair **new,
-                 int points, int k)
+void knn_set_search_backend(int backend, double tolerance)
 {
-    // Create an array that fits nearest neighbors from both original and new.
-    struct KNN_Pair *both = (struct KNN_Pair *) malloc(
-        sizeof(struct KNN_Pair) * k*2
-    );
+    search_backend = backend;
+    search_tolerance = tolerance;
+}
 
-    for (int i = 0; i < points; i++) {
-        memcpy(both, original[i], sizeof(struct KNN_Pair) * k);
-        memcpy(both+k, new[i], sizeof(struct KNN_Pair) * k);
-        qsort(both, k*2, sizeof(struct KNN_Pair), KNN_Pair_asc_comp);
-        memcpy(original[i], both, sizeof(struct KNN_Pair) * k);
+
+int _search_local(matrix_t *local_search, matrix_t *local_data,
+                  const int *local_labels, struct KNN_Tree *local_tree,
+                  struct KNN_Pair **knns, int k, int precision)
+{
+    int offset = matrix_get_chunk_offset(local_data);
+    int rows = matrix_get_rows(local_data);
+    int rc;
+
+    if (local_tree) {
+        rc = knn_tree_search_update(local_tree, offset, local_search, offset,
+                                    k, search_tolerance, knns);
+    }
+    else if (precision != KNN_PRECISION_MIXED) {
+        rc = knn_search_update(local_search, local_search, k,
+                               offset, offset, knns);
+    }
+    else {
+        // Candidates are found in single precision and re-ranked against the
+        // original data.
+        int candidates = k * KNN_RERANK_FACTOR;
+        struct KNN_Pair **found = KNN_Pair_create_empty_table(rows,
+                                                              candidates);
+        if (!found) return -1;
+        knn_table_init(found, rows, candidates);
+
+        rc = knn_search_update(local_search, local_search, candidates,
+                               offset, offset, found);
+        if (rc == 0) {
+            rc = knn_rerank_into(found, rows, candidates, local_data,
+                                 local_data, offset, offset, knns, k);
+        }
+
+        KNN_Pair_destroy_table(found, rows);
+    }
+
+    // Neighbors just found are labeled while their labels are at hand.
+    if (rc == 0 && local_labels) {
+        knn_table_label(knns, rows, k, local_labels, offset, rows);
+    }
+    return rc;
+}
+
+
+int _search_pair(matrix_t *local_search, matrix_t *local_data,
+                 const int *local_labels, struct KNN_Tree *local_tree,
+                 const struct KNN_Bounds *local_bounds,
+                 struct KNN_Pair **knns, matrix_t *block,
+                 const int *block_labels, struct KNN_Pair **block_knns,
+                 int k, int precision)
+{
+    int local_offset = matrix_get_chunk_offset(local_data);
+    int block_offset = matrix_get_chunk_offset(block);
+    int local_rows = matrix_get_rows(local_data);
+    int block_rows = matrix_get_rows(block);
+    int rc = -1;
+
+    // A block further from local points than the k-th neighbor of every
+    // point of both, can't change any of their neighbors.
+    if (local_bounds) {
+        struct KNN_Bounds *block_bounds = knn_bounds_create(block);
+        double gap = block_bounds ?
+                     knn_bounds_sq_gap(local_bounds, block_bounds) : 0.0;
+        knn_bounds_destroy(block_bounds);
+        if (gap > 0.0 && gap > knn_table_worst(knns, local_rows, k) &&
+            gap > knn_table_worst(block_knns, block_rows, k))
+        {
+            return 0;
+        }
+    }
+
+    matrix_t *block_search = _searched_block(block, precision);
+    if (!block_search) return -1;
+
+    if (local_tree) {
+        // Each side is searched on the tree of the other one. Block is only
+        // visiting, so its tree is built for this step.
+        struct KNN_Tree *block_tree = knn_tree_build(block_search);
+        if (block_tree) {
+            rc = knn_tree_search_update(block_tree, block_offset,
+                                        local_search, local_offset, k,
+                                        search_tolerance, knns);
+            if (rc == 0) {
+                rc = knn_tree_search_update(local_tree, local_offset,
+                                            block_search, block_offset, k,
+                                            search_tolerance, block_knns);
+            }
+            knn_tree_destroy(block_tree);
+        }
+    }
+    else if (precision != KNN_PRECISION_MIXED) {
+        rc = knn_search_symmetric(local_search, local_offset, knns,
+                                  block, block_offset, block_knns, k);
+    }
+    else {
+        // Candidates of both sides are found in single precision and
+        // re-ranked against the points of both in double precision.
+        int candidates = k * KNN_RERANK_FACTOR;
+        struct KNN_Pair **found_local = KNN_Pair_create_empty_table(
+                local_rows, candidates);
+        struct KNN_Pair **found_block = KNN_Pair_create_empty_table(
+                block_rows, candidates);
+        if (found_local && found_block) {
+            knn_table_init(found_local, local_rows, candidates);
+            knn_table_init(found_block, block_rows, candidates);
+            rc = knn_search_symmetric(local_search, local_offset, found_local,
+                                      block_search, block_offset, found_block,
+                                      candidates);
+        }
+        if (rc == 0) {
+            rc = knn_rerank_into(found_local, local_rows, candidates,
+                                 local_data, block, block_offset,
+                                 local_offset, knns, k);
+        }
+        if (rc == 0) {
+            rc = knn_rerank_into(found_block, block_rows, candidates, block,
+                                 local_data, local_offset, block_offset,
+                                 block_knns, k);
+        }
+
+        if (found_local) KNN_Pair_destroy_table(found_local, local_rows);
+        if (found_block) KNN_Pair_destroy_table(found_block, block_rows);
+    }
+    if (block_search != block) matrix_destroy(block_search);
+
+    // Neighbors of each side are points of the other one.
+    if (rc == 0 && local_labels && block_labels) {
+        knn_table_label(knns, local_rows, k,
+                        block_labels, block_offset, block_rows);
+        knn_table_label(block_knns, block_rows, k,
+                        local_labels, local_offset, local_rows);
+    }
+    return rc;
+}
+
+
+int _search_block(matrix_t *local_search, matrix_t *local_data,
+                  const struct KNN_Bounds *local_bounds,
+                  struct KNN_Pair **knns, matrix_t *block,
+                  const int *block_labels, int k, int precision)
+{
+    int local_offset = matrix_get_chunk_offset(local_data);
+    int block_offset = matrix_get_chunk_offset(block);
+    int local_rows = matrix_get_rows(local_data);
+    int block_rows = matrix_get_rows(block);
+    int rc = -1;
+
+    // Only neighbors of local points are updated, so a block further from
+    // them than the k-th neighbor of every one is skipped.
+    if (local_bounds) {
+        struct KNN_Bounds *block_bounds = knn_bounds_create(block);
+        double gap = block_bounds ?
+                     knn_bounds_sq_gap(local_bounds, block_bounds) : 0.0;
+        knn_bounds_destroy(block_bounds);
+        if (gap > 0.0 && gap > knn_table_worst(knns, local_rows, k)) return 0;
+    }
+
+    matrix_t *block_search = _searched_block(block, precision);
+    if (!block_search) return -1;
+
+    if (search_backend == KNN_BACKEND_VPTREE) {
+        struct KNN_Tree *block_tree = knn_tree_build(block_search);
+        if (block_tree) {
+            rc = knn_tree_search_update(block_tree, block_offset,
+                                        local_search, local_offset, k,
+                                        search_tolerance, knns);
+            knn_tree_destroy(block_tree);
+        }
+    }
+    else if (precision != KNN_PRECISION_MIXED) {
+        rc = knn_search_update(block, local_search, k,
+                               block_offset, local_offset, knns);
+    }
+    else {
+        // Candidates are found in single precision and re-ranked against
+        // the block in double precision.
+        int candidates = k * KNN_RERANK_FACTOR;
+        struct KNN_Pair **found = KNN_Pair_create_empty_table(local_rows,
+                                                              candidates);
+        if (found) {
+            knn_table_init(found, local_rows, candidates);
+            rc = knn_search_update(block_search, local_search, candidates,
+                                   block_offset, local_offset, found);
+        }
+        if (rc == 0) {
+            rc = knn_rerank_into(found, local_rows, candidates, local_data,
+                                 block, block_offset, local_offset, knns, k);
+        }
+
+        if (found) KNN_Pair_destroy_table(found, local_rows);
+    }
+    if (block_search != block) matrix_destroy(block_search);
+
+    if (rc == 0 && block_labels) {
+        knn_table_label(knns, local_rows, k, block_labels, block_offset,
+                        block_rows);
+    }
+    return rc;
+}
+
+
+int _search_queries(struct KNN_Reference *reference, matrix_t *queries,
+                    struct KNN_Pair **knns, int k)
+{
+    int ref_offset = matrix_get_chunk_offset(reference->data);
+    int ref_rows = matrix_get_rows(reference->data);
+    int rows = matrix_get_rows(queries);
+    int rc = -1;
+
+    // Queries further from reference than their k-th neighbor are not
+    // searched at all.
+    if (reference->bounds) {
+        struct KNN_Bounds *query_bounds = knn_bounds_create(queries);
+        double gap = query_bounds ?
+                     knn_bounds_sq_gap(reference->bounds, query_bounds) : 0.0;
+        knn_bounds_destroy(query_bounds);
+        if (gap > 0.0 && gap > knn_table_worst(knns, rows, k)) return 0;
+    }
+
+    matrix_t *queries_search = _searched_block(queries, reference->precision);
+    if (!queries_search) return -1;
+
+    // Queries are never part of reference, so no pair is excluded.
+    if (reference->tree) {
+        rc = knn_tree_search_update(reference->tree, ref_offset,
+                                    queries_search, -1, k, search_tolerance,
+                                    knns);
+    }
+    else if (reference->precision != KNN_PRECISION_MIXED) {
+        rc = knn_search_update(reference->search, queries, k,
+                               ref_offset, -1, knns);
+    }
+    else {
+        // Candidates are found in single precision and re-ranked against
+        // reference in double precision.
+        int candidates = k * KNN_RERANK_FACTOR;
+        struct KNN_Pair **found = KNN_Pair_create_empty_table(rows,
+                                                              candidates);
+        if (found) {
+            knn_table_init(found, rows, candidates);
+            rc = knn_search_update(reference->search, queries_search,
+                                   candidates, ref_offset, -1, found);
+        }
+        if (rc == 0) {
+            rc = knn_rerank_into(found, rows, candidates, queries,
+                                 reference->data, ref_offset, -1, knns, k);
+        }
+
+        if (found) KNN_Pair_destroy_table(found, rows);
+    }
+    if (queries_search != queries) matrix_destroy(queries_search);
+
+    if (rc == 0 && reference->labels) {
+        knn_table_label(knns, rows, k, reference->labels, ref_offset,
+                        ref_rows);
+    }
+    return rc;
+}
+
+int _create_carried_tables(int rows, int k, struct KNN_Pair ***tables)
+{
+    tables[0] = tables[1] = NULL;
+
+    // Tables are sent as bytes, so the biggest one has to fit into a single
+    // message. All processes are given the same rows and k.
+    if (sizeof(struct KNN_Pair) * k * (size_t) rows > INT_MAX) {
+        int rank;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        if (rank == MPI_MASTER) {
+            printf("ERROR: _create_carried_tables : Tables don't fit into a "
+                   "single message.\n");
+        }
+        return -1;
+    }
+
+    tables[0] = KNN_Pair_create_empty_table(rows, k);
+    tables[1] = KNN_Pair_create_empty_table(rows, k);
+    if (!tables[0] || !tables[1]) {
+        printf("ERROR: _create_carried_tables : Failed to allocate memory.\n");
+        if (tables[0]) KNN_Pair_destroy_table(tables[0], rows);
+        if (tables[1]) KNN_Pair_destroy_table(tables[1], rows);
+        tables[0] = tables[1] = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+void _return_carried(matrix_t *block, struct KNN_Pair **block_knns,
+                     struct KNN_Pair **knns, int points, int k,
+                     int prev_task, int next_task, int steps)
+{
+    // Owner of the block is as many processes back in the ring, as the steps
+    // block has travelled. Local block is as many processes forward.
+    int tasks_num;
+    MPI_Comm_size(MPI_COMM_WORLD, &tasks_num);
+    int *prevs = (int *) malloc(sizeof(int) * tasks_num);
+    int *nexts = (int *) malloc(sizeof(int) * tasks_num);
+    struct KNN_Pair **returned = KNN_Pair_create_empty_table(points, k);
+    if (!prevs || !nexts || !returned) {
+        printf("ERROR: _return_carried : Failed to allocate memory.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    MPI_Allgather(&prev_task, 1, MPI_INT, prevs, 1, MPI_INT, MPI_COMM_WORLD);
+    MPI_Allgather(&next_task, 1, MPI_INT, nexts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    int owner = prev_task;
+    int holder = next_task;
+    for (int s = 1; s < steps; s++) {
+        owner = prevs[owner];
+        holder = nexts[holder];
+    }
+
+    KNN_PROFILE_START(wait_start);
+    MPI_Sendrecv(block_knns[0],
+                 (int) (sizeof(struct KNN_Pair) * k * matrix_get_rows(block)),
+                 MPI_BYTE, owner, MPI_TAG_RESULTS,
+                 returned[0], (int) (sizeof(struct KNN_Pair) * k * points),
+                 MPI_BYTE, holder, MPI_TAG_RESULTS,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    KNN_PROFILE_STOP(wait_start, KNN_PHASE_WAIT);
+    KNN_PROFILE_COUNT(KNN_COUNTER_BYTES_SENT,
+                      sizeof(struct KNN_Pair) * k * matrix_get_rows(block));
+
+    KNN_PROFILE_START(merge_start);
+    knn_table_merge(knns, returned, points, k);
+    KNN_PROFILE_STOP(merge_start, KNN_PHASE_MERGE);
+
+    KNN_Pair_destroy_table(returned, points);
+    free(prevs);
+    free(nexts);
+}
+
+
+void _exchange_bounds(struct KNN_Pair **knns, int points,
+                      struct KNN_Pair **carried, int rows, int k,
+                      int prev_task, int next_task)
+{
+    double *sent = (double *) malloc(sizeof(double) * (points > 0 ? points : 1));
+    double *received = (double *) malloc(sizeof(double) * (rows > 0 ? rows : 1));
+    if (!sent || !received) {
+        printf("ERROR: _exchange_bounds : Failed to allocate memory.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    for (int p = 0; p < points; p++) {
+        sent[p] = knn_topk_worst(knns[p], k)->distance;
+    }
+    MPI_Sendrecv(sent, points, MPI_DOUBLE, next_task, MPI_TAG_BOUNDS,
+                 received, rows, MPI_DOUBLE, prev_task, MPI_TAG_BOUNDS,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    KNN_PROFILE_COUNT(KNN_COUNTER_BYTES_SENT, sizeof(double) * points);
+
+    knn_table_init_bounded(carried, rows, k, received);
+
+    free(sent);
+    free(received);
+}
+
+int _create_label_buffers(int rows, int **buffers)
+{
+    buffers[0] = (int *) malloc(sizeof(int) * (rows > 0 ? rows : 1));
+    buffers[1] = (int *) malloc(sizeof(int) * (rows > 0 ? rows : 1));
+    if (!buffers[0] || !buffers[1]) {
+        printf("ERROR: _create_label_buffers : Failed to allocate memory.\n");
+        free(buffers[0]);
+        free(buffers[1]);
+        buffers[0] = buffers[1] = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+int _create_ring_buffers(matrix_t *local, int rows, matrix_t **buffers)
+{
+    // Buffers hold cells of the same type as the blocks they receive.
+    matrix_t *(*create)(int32_t, int32_t) =
+            matrix_get_type(local) == MATRIX_FLOAT ?
+            matrix_create_float : matrix_create;
+    buffers[0] = create(rows, matrix_get_cols(local));
+    buffers[1] = create(rows, matrix_get_cols(local));
+    if (!buffers[0] || !buffers[1]) {
+        printf("ERROR: _create_ring_buffers : Failed to allocate memory.\n");
+        matrix_destroy(buffers[0]);
+        matrix_destroy(buffers[1]);
+        buffers[0] = buffers[1] = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int _open_matrix_channel(matrix_t *local, int hops, int prev_task,
+                         int next_task, struct Matrix_Channel *channel)
+{
+    int rank, tasks_num;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &tasks_num);
+
+    channel->hops = hops;
+    channel->step = 0;
+    channel->receiving = 0;
+    channel->buffers[0] = channel->buffers[1] = NULL;
+    channel->shared.window = MPI_WIN_NULL;
+
+    // Shapes of all blocks, along with the previous process of every one,
+    // which tells whose block each process holds on every step.
+    int shape[4] = { matrix_get_rows(local), matrix_get_stride(local),
+                     matrix_get_chunk_offset(local), prev_task };
+    int *shapes = (int *) malloc(sizeof(int) * 4 * tasks_num);
+    channel->owners = (int *) malloc(sizeof(int) * (hops + 1));
+    channel->views = (matrix_t **) calloc(hops + 1, sizeof(matrix_t *));
+    int failed = !shapes || !channel->owners || !channel->views;
+    int any_failed;
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (any_failed) {
+        if (failed) {
+            printf("ERROR: _open_matrix_channel : Failed to allocate "
+                   "memory.\n");
+        }
+        free(shapes);
+        free(channel->owners);
+        free(channel->views);
+        return -1;
+    }
+    MPI_Allgather(shape, 4, MPI_INT, shapes, 4, MPI_INT, MPI_COMM_WORLD);
+
+    channel->owners[0] = rank;
+    for (int s = 1; s <= hops; s++) {
+        channel->owners[s] = shapes[4 * channel->owners[s-1] + 3];
+    }
+
+    // Blocks of the same node are copied once into shared segments, where
+    // the rest of the node reads them in place, instead of receiving them.
+    size_t cell_size = matrix_get_cell_size(local);
+    size_t bytes = cell_size * matrix_get_rows(local) *
+                   matrix_get_stride(local);
+    if (knn_get_node_sharing() &&
+        knn_shared_create(bytes, &channel->shared) == 0)
+    {
+        memcpy(channel->shared.local, matrix_get_buffer(local), bytes);
+        knn_shared_publish(&channel->shared);
+
+        for (int s = 1; s <= hops && !failed; s++) {
+            int owner = channel->owners[s];
+            void *segment = knn_shared_query(&channel->shared, owner);
+            if (!segment) continue;
+
+            matrix_t *view = (matrix_t *) calloc(1, sizeof(matrix_t));
+            if (!view) {
+                failed = 1;
+                break;
+            }
+            *view = *local;
+            view->mapping = NULL;
+            view->mapping_size = 0;
+            if (matrix_get_type(local) == MATRIX_FLOAT) {
+                view->fdata = (float *) segment;
+            } else {
+                view->data = (double *) segment;
+            }
+            view->rows = shapes[4 * owner];
+            view->stride = shapes[4 * owner + 1];
+            view->chunk_offset = shapes[4 * owner + 2];
+            view->capacity = (size_t) view->rows * view->stride;
+            channel->views[s] = view;
+        }
+    }
+
+    // Ring buffers are only needed for receiving blocks of other nodes.
+    // Some transports exchange whole buffers, so all buffers that receive
+    // any block hold the biggest one of the ring.
+    channel->max_rows = 0;
+    for (int t = 0; t < tasks_num; t++) {
+        if (shapes[4 * t] > channel->max_rows) {
+            channel->max_rows = shapes[4 * t];
+        }
+    }
+    int rows = 0;
+    for (int s = 1; s <= hops; s++) {
+        if (!channel->views[s]) rows = channel->max_rows;
+    }
+    free(shapes);
+
+    // Blocks are sent as counts of cells, so the biggest one has to fit
+    // into a single message. All processes find the same biggest block.
+    if ((size_t) channel->max_rows * matrix_get_stride(local) > INT_MAX) {
+        if (rank == MPI_MASTER) {
+            printf("ERROR: _open_matrix_channel : Blocks don't fit into a "
+                   "single message.\n");
+        }
+        failed = 1;
+    }
+
+    if (!failed) {
+        failed = _create_ring_buffers(local, rows, channel->buffers) != 0;
+    }
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (any_failed) {
+        _free_matrix_views(channel);
+        matrix_destroy(channel->buffers[0]);
+        matrix_destroy(channel->buffers[1]);
+        return -1;
+    }
+
+    // Size of incoming blocks is not known, though they are always expected
+    // to fit in the buffers, so cells are exchanged up to their capacity.
+    knn_channel_open(&channel->shapes, channel->headers[0],
+                     channel->headers[1], 4, MPI_INT, MPI_TAG_HEADER,
+                     prev_task, next_task);
+    knn_channel_open(&channel->cells, matrix_get_buffer(channel->buffers[0]),
+                     matrix_get_buffer(channel->buffers[1]),
+                     (int) channel->buffers[0]->capacity,
+                     _matrix_mpi_type(local), MPI_TAG_OBJECT,
+                     prev_task, next_task);
+
+    return 0;
+}
+
+
+void _recv_matrix(struct Matrix_Channel *channel, int step)
+{
+    channel->step = step;
+    channel->receiving = !channel->views[step + 1];
+    if (channel->receiving) {
+        knn_channel_recv(&channel->shapes, step % 2);
+        knn_channel_recv(&channel->cells, step % 2);
+    } else {
+        knn_channel_skip(&channel->shapes, step % 2);
+        knn_channel_skip(&channel->cells, step % 2);
+    }
+}
+
+
+void _send_matrix(struct Matrix_Channel *channel, matrix_t *matrix)
+{
+    // Next process reads the block in place, when it runs on the same node
+    // as its owner.
+    int owner = channel->owners[channel->step];
+    if (channel->shared.window != MPI_WIN_NULL &&
+        knn_node_of(owner) == knn_node_of(channel->cells.next_task))
+    {
+        knn_channel_pass(&channel->shapes);
+        knn_channel_pass(&channel->cells);
+        return;
+    }
+
+    channel->header[0] = matrix_get_rows(matrix);
+    channel->header[1] = matrix_get_cols(matrix);
+    channel->header[2] = matrix_get_stride(matrix);
+    channel->header[3] = matrix_get_chunk_offset(matrix);
+
+    // Send header and then matrix's own buffer, without any copying.
+    knn_channel_send(&channel->shapes, channel->header, 4);
+    knn_channel_send(&channel->cells, matrix_get_buffer(matrix),
+                     matrix_get_rows(matrix) * matrix_get_stride(matrix));
+}
+
+
+int _test_matrix_channel(struct Matrix_Channel *channel)
+{
+    // Both channels are tested on every call, so none of them stalls.
+    int shaped = knn_channel_test(&channel->shapes);
+    int filled = knn_channel_test(&channel->cells);
+    return shaped && filled;
+}
+
+
+matrix_t *_wait_matrix(struct Matrix_Channel *channel)
+{
+    KNN_PROFILE_START(wait_start);
+    knn_channel_wait(&channel->shapes);
+    knn_channel_wait(&channel->cells);
+    KNN_PROFILE_STOP(wait_start, KNN_PHASE_WAIT);
+
+    if (!channel->receiving) return channel->views[channel->step + 1];
+
+    KNN_PROFILE_START(shape_start);
+    int slot = channel->cells.slot;
+    matrix_t *matrix = channel->buffers[slot];
+    const int *header = channel->headers[slot];
+    if (matrix_set_shape(matrix, header[0], header[2]) != 0) {
+        printf("ERROR: _wait_matrix : Received block doesn't fit into "
+               "buffer.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    matrix_set_chunk_offset(matrix, header[3]);
+    KNN_PROFILE_STOP(shape_start, KNN_PHASE_DESERIALIZE);
+
+    return matrix;
+}
+
+
+void _close_matrix_channel(struct Matrix_Channel *channel)
+{
+    knn_channel_close(&channel->shapes);
+    knn_channel_close(&channel->cells);
+    _free_matrix_views(channel);
+    matrix_destroy(channel->buffers[0]);
+    matrix_destroy(channel->buffers[1]);
+}
+
+
+int _node_block_views(void *node_block, int max_blocks, matrix_t *like,
+                      matrix_t *views, const int **labels)
+{
+    const int *header = (const int *) node_block;
+    char *cells = (char *) node_block + _node_header_bytes(max_blocks);
+    size_t cell_size = matrix_get_cell_size(like);
+
+    for (int b = 0; b < header[0]; b++) {
+        matrix_t *view = &views[b];
+        *view = *like;
+        view->mapping = NULL;
+        view->mapping_size = 0;
+        if (matrix_get_type(like) == MATRIX_FLOAT) {
+            view->fdata = (float *) cells;
+        } else {
+            view->data = (double *) cells;
+        }
+        view->rows = header[4 + 3 * b];
+        view->stride = header[5 + 3 * b];
+        view->chunk_offset = header[6 + 3 * b];
+        view->capacity = (size_t) view->rows * view->stride;
+        cells += _aligned_bytes(cell_size * view->capacity);
+    }
+
+    *labels = header[3] ?
+              (const int *) ((char *) node_block + header[3]) : NULL;
+    return header[0];
+}
+
+
+/**
+ * Progress hook of knn_search(), that lets MPI advance the transfers of
+ * current ring step and records the time they complete.
+ *
+ * Parameters:
+ *  -arg: A reference to the struct Ring_Progress object of current step.
+ */
+static void _ring_progress(void *arg)
+{
+    struct Ring_Progress *progress = (struct Ring_Progress *) arg;
+    if (progress->completed != 0.0) return;
+
+    int complete = progress->channel ?
+                   _test_matrix_channel(progress->channel) :
+                   knn_channel_test(progress->nodes);
+    if (complete) progress->completed = MPI_Wtime();
+}
+
+/**
+ * Returns the percentage of communication time that was not spent waiting.
+ */
+static double _hidden_percent(double comm, double exposed)
+{
+    if (comm <= 0.0) return 100.0;
+    double hidden = (comm - exposed) / comm * 100.0;
+    return hidden > 0.0 ? hidden : 0.0;
+}
+
+/**
+ * Returns the MPI datatype of the cells of given matrix.
+ */
+static MPI_Datatype _matrix_mpi_type(matrix_t *matrix)
+{
+    return matrix_get_type(matrix) == MATRIX_FLOAT ? MPI_FLOAT : MPI_DOUBLE;
+}
+
+/**
+ * Releases the shared segments of a channel, along with the matrices that
+ * view them. Views only point into the segments, so they are not destroyed
+ * as matrices.
+ */
+static void _free_matrix_views(struct Matrix_Channel *channel)
+{
+    for (int s = 0; s <= channel->hops; s++) free(channel->views[s]);
+    free(channel->views);
+    free(channel->owners);
+    knn_shared_destroy(&channel->shared);
+}
+
+/**
+ * Compares two integers, for sorting them in ascending order.
+ */
+static int _int_asc_comp(const void *a, const void *b)
+{
+    int ia = *((const int *) a);
+    int ib = *((const int *) b);
+    return (ia > ib) - (ia < ib);
+}
+
+/**
+ * Returns the bytes of the header of a node block, holding the number of its
+ * blocks, its rows, its bytes, the offset of its labels and then the rows,
+ * stride and chunk offset of every block. Cells follow it aligned.
+ */
+static size_t _node_header_bytes(int max_blocks)
+{
+    return _aligned_bytes(sizeof(int) * (4 + 3 * (size_t) max_blocks));
+}
+
+/**
+ * Rounds given bytes up to a multiple of MATRIX_ALIGNMENT.
+ */
+static size_t _aligned_bytes(size_t bytes)
+{
+    return (bytes + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT *
+           MATRIX_ALIGNMENT;
+}
+
+/**
+ * Sets the labels of the neighbors that belong to given block of labels.
+ * Neighbors of every point are sorted by index, so the ones of the block are
+ * found by a binary search, whatever the order blocks are visited in.
+ *
+ * Parameters:
+ *  -knns: The neighbors of local points, sorted by index.
+ *  -points: The number of rows in knns.
+ *  -k: The number of neighbors in each row.
+ *  -labeled: A points x k matrix, whose cells are set to the labels of the
+ *          neighbors in the same positions.
+ *  -labels: The block of labels, whose chunk offset is the index of its
+ *          first row.
+ */
+static void _label_block(struct KNN_Pair **knns, int points, int k,
+                         matrix_t *labeled, matrix_t *labels)
+{
+    int offset = matrix_get_chunk_offset(labels);
+    int end = offset + matrix_get_rows(labels);
+
+    #pragma omp parallel for
+    for (int p = 0; p < points; p++) {
+        int low = 0;
+        int high = k;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (knns[p][mid].index < offset) low = mid + 1;
+            else high = mid;
+        }
+        for (int i = low; i < k && knns[p][i].index < end; i++) {
+            matrix_set_cell(labeled, p, i,
+                            matrix_get_cell(labels,
+                                            knns[p][i].index - offset, 0));
+        }
     }
+}
 
-    free(both);
+/**
+ * Returns a block in the form it is searched in. In mixed precision, blocks
+ * are passed around in double precision, for re-ranking, and a float copy
+ * of them is searched. Else, the block itself is searched.
+ *
+ * Returns:
+ *  The block to be searched, which should be destroyed by the caller when
+ *  it is not the given one. On failure, returns NULL.
+ */
+static matrix_t *_searched_block(matrix_t *block, int precision)
+{
+    if (precision != KNN_PRECISION_MIXED ||
+        matrix_get_type(block) == MATRIX_FLOAT)
+    {
+        return block;
+    }
+
+    matrix_t *converted = matrix_to_float(block);
+    if (!converted) {
+        printf("ERROR: _searched_block : Failed to allocate memory.\n");
+    }
+    return converted;
 }
@@ -1,41 +1,150 @@
 /**
- * distributed_knn_blocking.h
+ * distributed_knn.h
  *
  * Created by Dimitrios Karageorgiou,
  *  for course "Parallel And Distributed Systems".
  *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
  *
  * This header provides a collection of routines and macros that may be used
- * for distributed knn search and labeling operations, based on MPI async
- * communications routines.
+ * for distributed knn search and labeling operations, on a ring of all
+ * processes in MPI_COMM_WORLD.
  *
- * Macros defined in distributed_knn_blocking.h:
+ * Data are passed around the ring through the channels of knn_transport.h,
+ * so the same ring drivers run on any of its transports, as selected by
+ * knn_set_transport(). The exchanges needed only once per call, like the
+ * return of carried neighbors, always use MPI_Sendrecv().
+ *
+ * When sharing memory within nodes is enabled by knn_set_node_sharing(),
+ * blocks of processes on the same node are read in place from shared
+ * segments, instead of being passed around. Only hops between nodes move
+ * blocks, though the neighbors and labels that follow them are still
+ * passed on every hop.
+ *
+ * knn_search_hierarchical() runs a ring of two levels instead: blocks of all
+ * processes of a node are aggregated into a single node block, which only
+ * the leader of the node, its lowest rank, passes around a ring of nodes.
+ * The rest of the node reads it in place, from the shared segment of the
+ * leader.
+ *
+ * Macros defined in distributed_knn.h:
  *  -MPI_TAG_OBJECT
+ *  -MPI_TAG_HEADER
+ *  -MPI_TAG_KNNS
+ *  -MPI_TAG_RESULTS
+ *  -MPI_TAG_LABELS
+ *  -MPI_TAG_BOUNDS
  *  -MPI_MASTER
  *
+ * Types defined in distributed_knn.h:
+ *  -struct Matrix_Channel
+ *  -struct KNN_Reference
+ *
  * Functions defined in distributed_knn.h:
  *  -matrix_t *knn_labeling_distributed(struct KNN_Pair **knns, int points, int k,
  *                                      matrix_t *local_labels, int prev_task,
  *                                      int next_task, int tasks_num)
- *  -struct KNN_Pair **knn_search_distributed(matrix_t *local_data, int k,
+ *  -matrix_t *knn_labeling_bidirectional(struct KNN_Pair **knns, int points,
+ *                                        int k, matrix_t *local_labels,
+ *                                        int prev_task, int next_task,
+ *                                        int tasks_num)
+ *  -matrix_t *knn_labeling_routed(struct KNN_Pair **knns, int points, int k,
+ *                                 matrix_t *local_labels)
+ *  -struct KNN_Pair **knn_search_distributed(matrix_t *local_data,
+ *                                            matrix_t *local_labels, int k,
  *                                            int prev_task, int next_task,
- *                                            int tasks_num)
- *  -void _update_knns(struct KNN_Pair **original, struct KNN_Pair **new,
- *                    int points, int k)
- *  -MPI_Request *_async_send_object(char *object, size_t length, int rank,
- *                                  int *handlerc)
- *  -MPI_Request *_async_recv_object(char **object, size_t *length,
- *                                   int rank, int *handlerc)
- *  -void _wait_async_com(MPI_Request *handlers, int handlerc)
+ *                                            int tasks_num, int precision)
+ *  -struct KNN_Pair **knn_search_hierarchical(matrix_t *local_data,
+ *                                             matrix_t *local_labels, int k,
+ *                                             int precision)
+ *  -void knn_set_search_backend(int backend, double tolerance)
+ *  -struct KNN_Reference *knn_reference_create(matrix_t *local_data,
+ *                                             matrix_t *local_labels,
+ *                                             int precision)
+ *  -void knn_reference_destroy(struct KNN_Reference *reference)
+ *  -struct KNN_Pair **knn_query_distributed(struct KNN_Reference *reference,
+ *                                           matrix_t *local_queries, int k,
+ *                                           int prev_task, int next_task,
+ *                                           int tasks_num)
+ *  -void knn_print_ring_timings(void)
+ *  -int _search_local(matrix_t *local_search, matrix_t *local_data,
+ *                     const int *local_labels, struct KNN_Tree *local_tree,
+ *                     struct KNN_Pair **knns, int k, int precision)
+ *  -int _search_pair(matrix_t *local_search, matrix_t *local_data,
+ *                    const int *local_labels, struct KNN_Tree *local_tree,
+ *                    const struct KNN_Bounds *local_bounds,
+ *                    struct KNN_Pair **knns, matrix_t *block,
+ *                    const int *block_labels, struct KNN_Pair **block_knns,
+ *                    int k, int precision)
+ *  -int _search_block(matrix_t *local_search, matrix_t *local_data,
+ *                     const struct KNN_Bounds *local_bounds,
+ *                     struct KNN_Pair **knns, matrix_t *block,
+ *                     const int *block_labels, int k, int precision)
+ *  -int _search_queries(struct KNN_Reference *reference, matrix_t *queries,
+ *                       struct KNN_Pair **knns, int k)
+ *  -int _create_carried_tables(int rows, int k, struct KNN_Pair ***tables)
+ *  -void _return_carried(matrix_t *block, struct KNN_Pair **block_knns,
+ *                        struct KNN_Pair **knns, int points, int k,
+ *                        int prev_task, int next_task, int steps)
+ *  -void _exchange_bounds(struct KNN_Pair **knns, int points,
+ *                         struct KNN_Pair **carried, int rows, int k,
+ *                         int prev_task, int next_task)
+ *  -int _create_label_buffers(int rows, int **buffers)
+ *  -int _create_ring_buffers(matrix_t *local, int rows, matrix_t **buffers)
+ *  -int _open_matrix_channel(matrix_t *local, int hops, int prev_task,
+ *                            int next_task, struct Matrix_Channel *channel)
+ *  -void _recv_matrix(struct Matrix_Channel *channel, int step)
+ *  -void _send_matrix(struct Matrix_Channel *channel, matrix_t *matrix)
+ *  -int _test_matrix_channel(struct Matrix_Channel *channel)
+ *  -matrix_t *_wait_matrix(struct Matrix_Channel *channel)
+ *  -void _close_matrix_channel(struct Matrix_Channel *channel)
+ *  -int _node_block_views(void *node_block, int max_blocks, matrix_t *like,
+ *                         matrix_t *views, const int **labels)
  */
 
 #ifndef __distributed_knn_h__
 #define __distributed_knn_h__
 
+#include "knn_transport.h"
+
 
 #define MPI_TAG_OBJECT 1  // A tag to be used when sending/receiving byte arrays.
+#define MPI_TAG_HEADER 2  // A tag to be used when sending/receiving headers.
+#define MPI_TAG_KNNS 3    // A tag for the neighbors carried by ring blocks.
+#define MPI_TAG_RESULTS 4 // A tag for neighbors returned to their owner.
+#define MPI_TAG_LABELS 5  // A tag for the packed labels of ring blocks.
+#define MPI_TAG_BOUNDS 6  // A tag for the k-th distances of ring blocks.
 #define MPI_MASTER 0      // The master task MPI_COMM_WORLD.
 
+// A channel of the matrices passed around a ring. A matrix is passed as a
+// small header, describing its shape, followed by its own data buffer,
+// unless it is read in place from the shared segment of its owner.
+struct Matrix_Channel {
+    int header[4];              // Rows, cols, stride and chunk offset sent.
+    int headers[2][4];          // Headers received along with the buffers.
+    matrix_t *buffers[2];       // Ring buffers incoming matrices land on.
+    int max_rows;               // Rows of the biggest matrix of the ring.
+    int hops;                   // Hops every matrix makes.
+    int step;                   // Current step of the ring.
+    int receiving;              // Whether current matrix lands on a buffer.
+    int *owners;                // Owner of the matrix held on every step.
+    matrix_t **views;           // Matrices of every step read in place.
+    struct KNN_Shared shared;   // Segments matrices are shared through.
+    struct KNN_Channel shapes;  // Channel of the headers.
+    struct KNN_Channel cells;   // Channel of the data buffers.
+};
+
+// A block of reference points, prepared once for searching any number of
+// query batches by knn_query_distributed(). It stays resident in the process
+// that owns it, while queries are passed around the ring.
+struct KNN_Reference {
+    matrix_t *data;            // Reference points, not owned.
+    matrix_t *search;          // Searched points, data or its float copy.
+    int *labels;               // Packed labels of the points, or NULL.
+    struct KNN_Tree *tree;     // VP-tree of searched points, or NULL.
+    struct KNN_Bounds *bounds; // Bounding box of searched points, or NULL.
+    int precision;             // One of KNN_PRECISION_* values.
+};
+
 /**
  * Finds the k-nearest-neighbors for the given local block, by utilizing
  * all blocks available in processes of MPI_COMM_WORLD communicator.
@@ -44,23 +153,184 @@
  * though returned values will never contain as a neighbor of a point, the point
  * itself.
  *
+ * Distances are symmetric, so each block only travels through the next half
+ * of the ring. On every step, distances between local points and the points
+ * of the visiting block update the neighbors of both, and the neighbors found
+ * for the points of the block travel along with it. After the last step,
+ * they are returned to the owner of the block and merged. This way, distance
+ * between any two points is computed once, instead of once by each of the
+ * processes that own them.
+ *
+ * Blocks set off carrying the k-th distances their points have found
+ * locally. A block is skipped, when its bounding box is too far from the one
+ * of local points to change the neighbors of any point of either. Within a
+ * search, the same holds for every pair of tiles of points. On clustered
+ * data, most pairs of blocks are then never computed.
+ *
+ * Blocks are passed around the ring while searching. When MPI has been
+ * initialized with at least MPI_THREAD_FUNNELED support, transfers are
+ * progressed from within the search itself, so they can complete in the
+ * background, unless the selected transport completes them before searching. The time spent on every step is kept and can be reported
+ * by knn_print_ring_timings().
+ *
  * Parameters:
  *  -local_data: A matrix containing the cords of the points their k-nearest-
  *          neigbors are searched. Every row of the matrix should contain the
  *          cords of a single point and can be of arbitrary size.
+ *  -local_labels: A matrix with the labels of the points in local_data, or
+ *          NULL. When given, labels are packed and passed around the ring
+ *          along with data blocks, so the label of every neighbor is set
+ *          when it is found (see knn_table_label()). Results can then be
+ *          classified without calling knn_labeling_distributed().
  *  -k: The number of nearest neigbors to be returned.
  *  -prev_task: The rank of previous node in MPI_COMM_WORLD.
  *  -next_task: The rank of next node in MPI_COMM_WORLD.
  *  -tasks_num: The overall number of tasks in MPI_COMM_WORLD.
+ *  -precision: One of KNN_PRECISION_* values. Unless it is
+ *          KNN_PRECISION_DOUBLE, a float copy of local_data is searched
+ *          instead. It is passed around the ring too, and results are
+ *          approximate, with KNN_PRECISION_SINGLE. With
+ *          KNN_PRECISION_MIXED, local_data is passed around, for exact
+ *          re-ranking of the candidates.
  *
  * Returns:
- *  A 2D array of (distance, index) pairs. Pairs in each row are the k nearest
- *  neighbors for the corresponding point (the one in the same row) in
- *  local_data matrix.
+ *  A 2D array of (distance, index, label) pairs. Pairs in each row are the k
+ *  nearest neighbors for the corresponding point (the one in the same row) in
+ *  local_data matrix. Labels are -1, unless local_labels is given. On
+ *  failure, returns NULL on all processes.
  */
-struct KNN_Pair **knn_search_distributed(matrix_t *local_data, int k,
+struct KNN_Pair **knn_search_distributed(matrix_t *local_data,
+                                         matrix_t *local_labels, int k,
                                          int prev_task, int next_task,
-                                         int tasks_num);
+                                         int tasks_num, int precision);
+
+/**
+ * Finds the k-nearest-neighbors for the given local block, as
+ * knn_search_distributed() does, over a ring of nodes instead of a ring of
+ * processes.
+ *
+ * Processes running on the same node are discovered by
+ * MPI_Comm_split_type(), through knn_node_comm(). Every process copies its
+ * block, along with its labels, into a node block held in the shared segment
+ * of its leader, the lowest rank of the node. Only leaders form a ring, in
+ * which node blocks travel through all nodes. A ring of N nodes then takes
+ * N-1 steps, each passing a single message as big as all blocks of a node,
+ * whatever the number of processes running on it.
+ *
+ * Node blocks land on two slots of the shared segment of the leader, where
+ * the rest of the node reads them in place. On every step, each process
+ * searches its own points against every block of current node block, with
+ * all the OpenMP threads it runs, so the search of a node block is split
+ * over all processes and threads of the node. Distances are not used
+ * symmetrically, since no neighbors travel with node blocks, so every
+ * distance is computed by the processes owning both of its points.
+ *
+ * It should be called by all processes in MPI_COMM_WORLD.
+ *
+ * Parameters:
+ *  -local_data: As in knn_search_distributed().
+ *  -local_labels: As in knn_search_distributed(). When given, labels are
+ *          packed into node blocks.
+ *  -k: The number of nearest neigbors to be returned.
+ *  -precision: One of KNN_PRECISION_* values, as in knn_search_distributed().
+ *
+ * Returns:
+ *  A 2D array of (distance, index, label) pairs, as in
+ *  knn_search_distributed(), or NULL on failure.
+ */
+struct KNN_Pair **knn_search_hierarchical(matrix_t *local_data,
+                                          matrix_t *local_labels, int k,
+                                          int precision);
+
+/**
+ * Selects the backend used by knn_search_distributed() for searching each
+ * pair of blocks.
+ *
+ * With KNN_BACKEND_VPTREE, a VP-tree of local points is built once and a
+ * tree of every visiting block is built on arrival (see knn_tree.h). Trees
+ * are built on the blocks as searched, so in mixed precision they index the
+ * float blocks and no re-ranking takes place, though distances are still
+ * computed in double precision.
+ *
+ * Parameters:
+ *  -backend: One of KNN_BACKEND_* values.
+ *  -tolerance: The allowed relative error of distances found by the tree
+ *          backend, as in knn_tree_search_update(). 0 for an exact search.
+ */
+void knn_set_search_backend(int backend, double tolerance);
+
+/**
+ * Prepares a local block of reference points for serving queries.
+ *
+ * The float copy, the packed labels, the VP-tree (when selected by
+ * knn_set_search_backend()) and the bounding box of the block are built here
+ * once, so they are reused by every later knn_query_distributed() call.
+ *
+ * Parameters:
+ *  -local_data: The local reference points. It should outlive the returned
+ *          object and should not be modified.
+ *  -local_labels: A matrix with the labels of the points in local_data, or
+ *          NULL. When given, every neighbor found is labeled.
+ *  -precision: One of KNN_PRECISION_* values, as in knn_search_distributed().
+ *
+ * Returns:
+ *  A new reference, that should be destroyed by knn_reference_destroy(), or
+ *  NULL on failure.
+ */
+struct KNN_Reference *knn_reference_create(matrix_t *local_data,
+                                           matrix_t *local_labels,
+                                           int precision);
+
+/**
+ * Destroys a reference created by knn_reference_create().
+ */
+void knn_reference_destroy(struct KNN_Reference *reference);
+
+/**
+ * Finds the k-nearest-neighbors of a local batch of query points, among the
+ * reference points of all processes in MPI_COMM_WORLD.
+ *
+ * Unlike knn_search_distributed(), queries are distinct from reference
+ * points, so no point is excluded from the neighbors of any query. Reference
+ * blocks never move. Instead, every batch of queries travels through the
+ * whole ring along with the neighbors found for it so far, and returns to
+ * its owner after the last step. A batch is skipped by a process, when it is
+ * too far from the local reference points to change any of its neighbors.
+ *
+ * It should be called by all processes in MPI_COMM_WORLD, each one with its
+ * own batch of queries, which may be empty.
+ *
+ * Parameters:
+ *  -reference: The local reference points, created by knn_reference_create().
+ *  -local_queries: The local query points, of the same width as reference
+ *          points. Indexes of neighbors refer to reference points.
+ *  -k: The number of nearest neigbors to be returned.
+ *  -prev_task: The rank of previous node in MPI_COMM_WORLD.
+ *  -next_task: The rank of next node in MPI_COMM_WORLD.
+ *  -tasks_num: The overall number of tasks in MPI_COMM_WORLD.
+ *
+ * Returns:
+ *  A 2D array of (distance, index, label) pairs, with the k nearest neighbors
+ *  of every query, or NULL on failure, on all processes. Labels are -1,
+ *  unless reference was created with labels.
+ */
+struct KNN_Pair **knn_query_distributed(struct KNN_Reference *reference,
+                                        matrix_t *local_queries, int k,
+                                        int prev_task, int next_task,
+                                        int tasks_num);
+
+/**
+ * Prints the per step timers of the last knn_search_distributed() call.
+ *
+ * For every step of the ring, the time spent on searching, the time it took
+ * for the transfers of the step to complete and the time spent on waiting
+ * for them after searching are printed, along with the percentage of
+ * communication time hidden behind computation. Timers are the maximum over
+ * all processes and are printed by MPI_MASTER.
+ *
+ * It should be called by all processes in MPI_COMM_WORLD.
+ */
+void knn_print_ring_timings(void);
 
  /**
   * Labels the nearest neighbors contained in given array by utilizing remote
@@ -85,84 +355,345 @@ matrix_t *knn_labeling_distributed(struct KNN_Pair **knns, int points, int k,
                                    matrix_t *local_labels, int prev_task,
                                    int next_task, int tasks_num);
 
+ /**
+  * Labels the nearest neighbors contained in given array, as
+  * knn_labeling_distributed() does, over a ring used in both directions.
+  *
+  * Every block of labels is sent both to next and to previous process. It
+  * travels clockwise through the next half of the ring and counter-clockwise
+  * through the rest of it, so each process receives two blocks per step and
+  * all blocks are visited in tasks_num / 2 steps, instead of tasks_num - 1.
+  * Both directions of every link carry a block on each step.
+  *
+  * It should be called by all processes in MPI_COMM_WORLD.
+  *
+  * Parameters:
+  *  -knns: A 2D array of struct KNN_Pair objects that contains a set of k
+  *          nearest neighbors. Usually it should be the one provided by
+  *          knn_search_distributed().
+  *  -points: The number of points contained knns.
+  *  -k: The number of nearest neigbors for each point contained in knns.
+  *  -local_labels: A matrix containing the labels available to the current
+  *          proccess.
+  *  -prev_task: The rank of previous node in MPI_COMM_WORLD.
+  *  -next_task: The rank of next node in MPI_COMM_WORLD.
+  *  -tasks_num: The overall number of tasks in MPI_COMM_WORLD.
+  *
+  * Returns:
+  *  A matrix containing the labels of the k nearest neighbors in knns 2D
+  *  array, sorted by index as in knn_labeling_distributed(), or NULL on
+  *  failure.
+  */
+matrix_t *knn_labeling_bidirectional(struct KNN_Pair **knns, int points,
+                                     int k, matrix_t *local_labels,
+                                     int prev_task, int next_task,
+                                     int tasks_num);
+
+ /**
+  * Labels the nearest neighbors contained in given array, by requesting
+  * their labels straight from the processes that own them.
+  *
+  * Indexes of all neighbors are deduplicated and grouped by the process
+  * whose chunk contains them. A single MPI_Alltoallv() exchange sends the
+  * requests and another one the labels back. Thus, communication volume
+  * depends on the distinct neighbors of local points, instead of the labels
+  * of all processes, as it does in knn_labeling_distributed().
+  *
+  * It should be called by all processes in MPI_COMM_WORLD.
+  *
+  * Parameters:
+  *  -knns: A 2D array of struct KNN_Pair objects that contains a set of k
+  *          nearest neighbors. Usually it should be the one provided by
+  *          knn_search_distributed(). The label of every pair is set.
+  *  -points: The number of points contained knns.
+  *  -k: The number of nearest neigbors for each point contained in knns.
+  *  -local_labels: A matrix containing the labels available to the current
+  *          proccess. Its chunk offset should be the index of its first row.
+  *
+  * Returns:
+  *  A matrix containing the labels of the k nearest neighbors in knns 2D
+  *  array, in the same order as in knns.
+  */
+matrix_t *knn_labeling_routed(struct KNN_Pair **knns, int points, int k,
+                              matrix_t *local_labels);
+
 /**
- * Updates an object with nearest neighbors provided by one knn search, by
- * using another one provided by a lookup on a different data block.
+ * Searches the local block for the k nearest neighbors of local points,
+ * in the requested precision, or on the tree of local points when given.
  *
- * It is the main function that combines results of many knn searches, thus
- * allowing a knn search to be done in parts, every time with a portion of the
- * complete block.
+ * Parameters:
+ *  -local_search: The local points, as searched in current precision.
+ *  -local_data: The local points in double precision.
+ *  -local_labels: The packed labels of local points, or NULL.
+ *  -local_tree: The tree of local_search, when searching with the tree
+ *          backend, else NULL.
+ *  -knns: The selectors of local points, as in knn_search_update().
+ *  -k: The number of nearest neighbors kept.
+ *  -precision: One of KNN_PRECISION_* values.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int _search_local(matrix_t *local_search, matrix_t *local_data,
+                  const int *local_labels, struct KNN_Tree *local_tree,
+                  struct KNN_Pair **knns, int k, int precision);
+
+/**
+ * Searches a visiting block and the local block against each other, in the
+ * requested precision. When local tree is given, a tree of the block is built
+ * and each block is searched on the tree of the other one.
+ *
+ * When the bounding box of the block is further from the one of local points
+ * than the k-th neighbor of every point of both, nothing is searched.
+ *
+ * Parameters:
+ *  -local_search: The local points, as searched in current precision.
+ *  -local_data: The local points in double precision.
+ *  -local_labels: The packed labels of local points, or NULL.
+ *  -local_tree: The tree of local_search, when searching with the tree
+ *          backend, else NULL.
+ *  -local_bounds: The bounding box of local_search, or NULL.
+ *  -knns: The selectors of local points, as in knn_search_update().
+ *  -block: The visiting block, of the same type as local_search.
+ *  -block_labels: The packed labels of the block, or NULL.
+ *  -block_knns: The selectors of the points of the block.
+ *  -k: The number of nearest neighbors kept.
+ *  -precision: One of KNN_PRECISION_* values.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int _search_pair(matrix_t *local_search, matrix_t *local_data,
+                 const int *local_labels, struct KNN_Tree *local_tree,
+                 const struct KNN_Bounds *local_bounds,
+                 struct KNN_Pair **knns, matrix_t *block,
+                 const int *block_labels, struct KNN_Pair **block_knns,
+                 int k, int precision);
+
+/**
+ * Searches a block of another process for the k nearest neighbors of local
+ * points, in the requested precision. Unlike _search_pair(), only the
+ * neighbors of local points are updated. With the tree backend, a tree of
+ * the block is built and searched.
+ *
+ * When the bounding box of the block is further from the one of local points
+ * than the k-th neighbor of every local point, nothing is searched.
  *
  * Parameters:
- *  -original: The 2D knn pairs array, to be updated. It usually is the result
- *          of the first knn search.
- *  -new: A 2D knn pairs array, used to update the original one. It usually is
- *          the result of all sebsequent knn searchs, after the initial one.
- *  -points: The number of points for which nearest neighbors are contained in
- *           original and new objects. This number is expected to be the same
- *           for both objects, and probably equal to the number of points this
- *           node has to find k nearest neighbors for. Otherwise, result is
- *           undefined
- *  -k: The number of nearest neighbors contained for every point in original
- *          and new objects. Both should contain the same number of nearest
- *          neighbors. Otherwise, results are undefined.
-*/
-void _update_knns(struct KNN_Pair **original, struct KNN_Pair **new,
-                 int points, int k);
+ *  -local_search: The local points, as searched in current precision.
+ *  -local_data: The local points in double precision.
+ *  -local_bounds: The bounding box of local_search, or NULL.
+ *  -knns: The selectors of local points, as in knn_search_update().
+ *  -block: The block, of the same type as local_search.
+ *  -block_labels: The packed labels of the block, or NULL.
+ *  -k: The number of nearest neighbors kept.
+ *  -precision: One of KNN_PRECISION_* values.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int _search_block(matrix_t *local_search, matrix_t *local_data,
+                  const struct KNN_Bounds *local_bounds,
+                  struct KNN_Pair **knns, matrix_t *block,
+                  const int *block_labels, int k, int precision);
 
 /**
- * An asynchronous send operation.
+ * Updates the neighbors of a batch of queries, with the ones found among the
+ * local reference points.
  *
- * Initializes a sends operation for the provided bytes array to process with
- * given rank and returns a handlers array for this operation.
+ * Parameters:
+ *  -reference: The local reference points.
+ *  -queries: The queries, of the same type as the searched reference points.
+ *  -knns: The selectors of the queries.
+ *  -k: The number of nearest neighbors kept.
  *
- * A call to _async_send_object should be matched by a call to _wait_async_com.
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int _search_queries(struct KNN_Reference *reference, matrix_t *queries,
+                    struct KNN_Pair **knns, int k);
+
+/**
+ * Creates the two tables that hold the neighbors carried by the blocks
+ * received in the ring buffers.
+ *
+ * It fails when the bytes of a table exceed INT_MAX, since they could not
+ * be sent in a single message. This way, counts of all tables sent, none
+ * of which is bigger, fit into an int.
  *
  * Parameters:
- *  -object: A bytes array to be send to given rank.
- *  -length: Length of object.
- *  -rank: Destination rank.
- *  -handlerc: A reference to a destination to return the number of returned
- *          handlers.
+ *  -rows: The rows of the biggest block.
+ *  -k: The number of nearest neighbors kept.
+ *  -tables: An array of two, where the created tables will be stored.
  *
  * Returns:
- *  An array of handlers for current operation.
+ *  0 on success, -1 on failure.
+ */
+int _create_carried_tables(int rows, int k, struct KNN_Pair ***tables);
+
+/**
+ * Returns the neighbors carried by the block visiting current process to
+ * its owner, and merges the neighbors carried by local block into knns.
+ *
+ * It should be called by all processes in MPI_COMM_WORLD, after the last
+ * step of the ring.
+ *
+ * Parameters:
+ *  -block: The last block visiting current process.
+ *  -block_knns: The neighbors carried by block.
+ *  -knns: The selectors of local points.
+ *  -points: The number of local points.
+ *  -k: The number of nearest neighbors kept.
+ *  -prev_task: The rank of previous node in MPI_COMM_WORLD.
+ *  -next_task: The rank of next node in MPI_COMM_WORLD.
+ *  -steps: The number of steps each block travelled.
+ */
+void _return_carried(matrix_t *block, struct KNN_Pair **block_knns,
+                     struct KNN_Pair **knns, int points, int k,
+                     int prev_task, int next_task, int steps);
+
+/**
+ * Sends to next process the k-th distance every local point has found so
+ * far and initializes the table carried by the block received from previous
+ * process, so it only keeps neighbors nearer than the ones its owner has
+ * already found (see knn_table_init_bounded()).
+ *
+ * It should be called by all processes, after searching the local block,
+ * since carried neighbors are merged into the ones of their owner, only
+ * neighbors that beat the k-th one of the owner can change the result.
+ * Bounded tables let distances, or whole blocks, be skipped earlier.
+ *
+ * Parameters:
+ *  -knns: The selectors of local points.
+ *  -points: The number of local points.
+ *  -carried: The table carried by the received block.
+ *  -rows: The rows of the received block.
+ *  -k: The number of nearest neighbors kept.
+ *  -prev_task: The rank of previous node in MPI_COMM_WORLD.
+ *  -next_task: The rank of next node in MPI_COMM_WORLD.
  */
-MPI_Request *_async_send_object(char *object, size_t length, int rank,
-                               int *handlerc);
+void _exchange_bounds(struct KNN_Pair **knns, int points,
+                      struct KNN_Pair **carried, int rows, int k,
+                      int prev_task, int next_task);
+
 /**
- * An asynchronous receive operation.
+ * Creates the two buffers that hold the packed labels of the blocks received
+ * in the ring buffers.
  *
- * Initializes a receive operation for a bytes array from process with given
- * rank and stores a pointer to it into object argument. Returns an array of
- * handlers for this operation.
+ * Parameters:
+ *  -rows: The rows of the biggest block.
+ *  -buffers: An array of two, where the created buffers will be stored.
  *
- * A call to _async_recv_object should be matched by a call to _wait_async_com.
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int _create_label_buffers(int rows, int **buffers);
+
+/**
+ * Creates the two buffers used in turns for receiving blocks in a ring.
+ *
+ * Buffers hold cells of the same type as local block.
  *
  * Parameters:
- *  -object: A reference to the location to return the reference to received
- *          array.
- *  -length: A reference to the location to return the length of the received
- *          object.
- *  -rank: The rank of the process from which the object will be received.
- *  -handlerc: A reference to a destination to return the number of returned
- *          handlers.
+ *  -local: The block of current process.
+ *  -rows: The rows of the biggest block buffers should be able to hold.
+ *  -buffers: An array of two, where the created buffers will be stored.
  *
  * Returns:
- *  An array of handlers for current operation.
+ *  0 on success, -1 on failure.
  */
-MPI_Request *_async_recv_object(char **object, size_t *length,
-                               int rank, int *handlerc);
+int _create_ring_buffers(matrix_t *local, int rows, matrix_t **buffers);
 
 /**
- * Blocks until operations defined by provided handlers are complete.
+ * Opens a channel of the matrices passed around a ring, along with the ring
+ * buffers they land on. It should be called by all processes in
+ * MPI_COMM_WORLD.
+ *
+ * When sharing memory within nodes is enabled, local matrix is copied into
+ * a shared segment, through which the processes of its node read it in
+ * place. Ring buffers are then left empty, unless some matrix is received
+ * from another node.
+ *
+ * It fails when the cells of the biggest matrix exceed INT_MAX, since they
+ * could not be sent in a single message.
  *
  * Parameters:
- *  -handlers: An array of handlers, as returned by async communication
- *          operations.
- *  -handlerc: The number of handlers contained in handlers.
+ *  -local: The matrix of current process, which should not be modified
+ *          until the channel is closed.
+ *  -hops: The number of times every matrix is passed on.
+ *  -prev_task: The rank of previous node in MPI_COMM_WORLD.
+ *  -next_task: The rank of next node in MPI_COMM_WORLD.
+ *  -channel: A reference to the object to keep the state of the channel.
+ *
+ * Returns:
+ *  0 on success, -1 on failure. It fails on all processes, or on none.
+ */
+int _open_matrix_channel(matrix_t *local, int hops, int prev_task,
+                         int next_task, struct Matrix_Channel *channel);
+
+/**
+ * Begins receiving the matrix of previous process, on given step of the
+ * ring, as in knn_channel_recv(). Nothing is received when the matrix is
+ * read in place.
+ */
+void _recv_matrix(struct Matrix_Channel *channel, int step);
+
+/**
+ * Sends a header with the shape of provided matrix and matrix's data buffer
+ * itself to next process, unless it reads the matrix in place. No copy of
+ * the data is made, so matrix should not be modified until _wait_matrix()
+ * returns. It should be called after _recv_matrix() of the same step.
  */
-void _wait_async_com(MPI_Request *handlers, int handlerc);
+void _send_matrix(struct Matrix_Channel *channel, matrix_t *matrix);
 
+/**
+ * Tests whether current exchange of matrices is complete, letting MPI
+ * progress it.
+ *
+ * A completed exchange should still be matched by _wait_matrix(), which then
+ * returns immediately.
+ *
+ * Returns:
+ *  1 if exchange is complete, else 0.
+ */
+int _test_matrix_channel(struct Matrix_Channel *channel);
+
+/**
+ * Blocks until current exchange of matrices is complete. The ring buffer
+ * that received the matrix takes the shape described by its header.
+ *
+ * Returns:
+ *  The matrix of previous process, either the ring buffer it landed on or
+ *  a view of the shared segment of its owner.
+ */
+matrix_t *_wait_matrix(struct Matrix_Channel *channel);
+
+/**
+ * Closes a channel opened by _open_matrix_channel(), releasing its ring
+ * buffers and shared segments. It should be called by all processes in
+ * MPI_COMM_WORLD, with no exchange in progress.
+ */
+void _close_matrix_channel(struct Matrix_Channel *channel);
+
+/**
+ * Sets up matrices that view the blocks of a node block in place, as
+ * aggregated by knn_search_hierarchical().
+ *
+ * Parameters:
+ *  -node_block: The node block, a header followed by the cells of its blocks
+ *          and their packed labels, if any.
+ *  -max_blocks: The most blocks of any node block, which sets the size of
+ *          the header.
+ *  -like: A matrix of the same type and columns as the blocks.
+ *  -views: An array of at least max_blocks matrices, filled with the views.
+ *          They only point into node_block, so they should not be destroyed.
+ *  -labels: Set to the packed labels of all blocks, one after the other, or
+ *          to NULL when node block carries no labels.
+ *
+ * Returns:
+ *  The number of blocks of the node block.
+ */
+int _node_block_views(void *node_block, int max_blocks, matrix_t *like,
+                      matrix_t *views, const int **labels);
 
 #endif
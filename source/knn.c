@@ -12,7 +12,54 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "knn.h"
+#include "distance.h"
+#include "knn_topk.h"
+#include "knn_profile.h"
+
+
+// A tile of data, along with the lower bound of its squared distances from
+// a tile of points.
+struct Tile_Gap {
+    double gap;
+    int tile;
+};
+
+
+static knn_progress_fn progress_hook = NULL;  // Set by knn_set_progress_hook().
+static void *progress_arg = NULL;             // Argument of progress_hook.
+
+static int _check_compatible(const char *caller, matrix_t *a, matrix_t *b);
+static void *_row_norms(matrix_t *m);
+static int _scan_tiles(matrix_t *data, matrix_t *points, int k,
+                       int d_offset, int p_offset, struct KNN_Pair **results);
+static void _symmetric_task(matrix_t *a, const void *a_norms, int a_offset,
+                            struct KNN_Pair **a_knns, int a_start, int a_end,
+                            matrix_t *b, const void *b_norms, int b_offset,
+                            struct KNN_Pair **b_knns, int b_start, int b_end,
+                            int k);
+static double _exact_sq_distance(matrix_t *a, int row_a,
+                                 matrix_t *b, int row_b);
+static double _sq_norm(matrix_t *m, int row);
+static inline double _cell_value(matrix_t *m, int row, int col);
+static void _fill_bounds(struct KNN_Bounds *bounds, matrix_t *m,
+                         int start, int end);
+static int _tile_prunable(const struct KNN_Bounds *a_bounds,
+                          struct KNN_Pair **a_knns, int a_start, int a_end,
+                          const struct KNN_Bounds *b_bounds,
+                          struct KNN_Pair **b_knns, int b_start, int b_end,
+                          int k);
+static int _tile_gap_comp(const void *a, const void *b);
+static inline void _knn_progress(void);
+static inline double _tile_flops(matrix_t *m, int rows, int cols);
+static int _lower_bound(const double *values, int n, double value);
+static matrix_t *_classify_votes(const char *caller, matrix_t *labeled_knns,
+                                 struct KNN_Pair **knns, int sweep);
 
 
 struct KNN_Pair **knn_search(matrix_t *data, matrix_t *points,
@@ -22,11 +69,7 @@ struct KNN_Pair **knn_search(matrix_t *data, matrix_t *points,
         printf("ERROR: knn_search() : Invalid Arguments.\n");
         return NULL;
     }
-    if (matrix_get_cols(data) != matrix_get_cols(points)) {
-        printf("ERROR: knn_search() : k on data=%d, k on points=%d\n",
-               matrix_get_cols(data), matrix_get_cols(points));
-        return NULL;
-    }
+    if (_check_compatible("knn_search", data, points) != 0) return NULL;
 
     // Get the number of points needed to query their k nearest neighbors.
     int pointc = matrix_get_rows(points);
@@ -39,49 +82,385 @@ struct KNN_Pair **knn_search(matrix_t *data, matrix_t *points,
         return NULL;
     }
 
-    // For every point in points matrix, find its kNNs in data matrix and
-    // store them into results.
-    #pragma omp parallel for
-    for (int p = 0; p < pointc; p++) {
-
-        // Calculate the k nearest neighbors for the current point, by
-        // searching on all the available data.
-        for (int d = 0; d < matrix_get_rows(data); d++) {
-
-            // Calculate the euclidian distance between a queried point and
-            // a data point.
-            double dist = 0.0;
-            for (int i = 0; i < matrix_get_cols(points); i++) {
-                dist += pow(matrix_get_cell(points, p, i) -
-                            matrix_get_cell(data, d, i), 2.0);
+    // Every row of results is used as a top-k selector, that keeps the
+    // k nearest data points found so far.
+    knn_table_init(results, pointc, k);
+
+    if (_scan_tiles(data, points, k, i_offset, -1, results) != 0) {
+        printf("ERROR: knn_search() : Failed to allocate memory.\n");
+        KNN_Pair_destroy_table(results, pointc);
+        return NULL;
+    }
+
+    knn_table_finalize(results, pointc, k);
+
+    return results;
+}
+
+int knn_search_update(matrix_t *data, matrix_t *points, int k,
+                      int d_offset, int p_offset, struct KNN_Pair **knns)
+{
+    if (_check_compatible("knn_search_update", data, points) != 0) return -1;
+
+    if (_scan_tiles(data, points, k, d_offset, p_offset, knns) != 0) {
+        printf("ERROR: knn_search_update() : Failed to allocate memory.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int knn_search_symmetric(matrix_t *a, int a_offset, struct KNN_Pair **a_knns,
+                         matrix_t *b, int b_offset, struct KNN_Pair **b_knns,
+                         int k)
+{
+    if (_check_compatible("knn_search_symmetric", a, b) != 0) return -1;
+
+    int a_rows = matrix_get_rows(a);
+    int b_rows = matrix_get_rows(b);
+
+    void *a_norms = _row_norms(a);
+    void *b_norms = _row_norms(b);
+    if (!a_norms || !b_norms) {
+        printf("ERROR: knn_search_symmetric() : Failed to allocate memory.\n");
+        free(a_norms);
+        free(b_norms);
+        return -1;
+    }
+
+    // Rows of both a and b are split into as many groups as the threads.
+    // On every round, each thread takes a different group of a and a
+    // different group of b, so no selector is ever updated by two threads
+    // at once. After as many rounds as the groups, every group of a has met
+    // every group of b.
+#ifdef _OPENMP
+    int groups = omp_get_max_threads();
+#else
+    int groups = 1;
+#endif
+
+    #pragma omp parallel
+    for (int round = 0; round < groups; round++) {
+        #pragma omp for schedule(static, 1)
+        for (int g = 0; g < groups; g++) {
+            int h = (g + round) % groups;
+            _symmetric_task(a, a_norms, a_offset, a_knns,
+                            (int) ((long) a_rows * g / groups),
+                            (int) ((long) a_rows * (g+1) / groups),
+                            b, b_norms, b_offset, b_knns,
+                            (int) ((long) b_rows * h / groups),
+                            (int) ((long) b_rows * (h+1) / groups), k);
+        }
+    }
+
+    free(a_norms);
+    free(b_norms);
+
+    return 0;
+}
+
+struct KNN_Pair **knn_search_rerank(matrix_t *data, matrix_t *points,
+                                    matrix_t *exact_data,
+                                    matrix_t *exact_points,
+                                    int k, int candidates, int i_offset)
+{
+    if (candidates < k) candidates = k;
+    if (_check_compatible("knn_search_rerank", data, points) != 0) return NULL;
+
+    int pointc = matrix_get_rows(points);
+    struct KNN_Pair **found = KNN_Pair_create_empty_table(pointc, candidates);
+    struct KNN_Pair **results = KNN_Pair_create_empty_table(pointc, k);
+    if (!found || !results) {
+        printf("ERROR: knn_search_rerank() : Failed to create results table.\n");
+        if (found) KNN_Pair_destroy_table(found, pointc);
+        if (results) KNN_Pair_destroy_table(results, pointc);
+        return NULL;
+    }
+    knn_table_init(found, pointc, candidates);
+    knn_table_init(results, pointc, k);
+
+    if (_scan_tiles(data, points, candidates, i_offset, -1, found) != 0) {
+        printf("ERROR: knn_search_rerank() : Failed to allocate memory.\n");
+        KNN_Pair_destroy_table(found, pointc);
+        KNN_Pair_destroy_table(results, pointc);
+        return NULL;
+    }
+
+    int rc = knn_rerank_into(found, pointc, candidates, exact_points,
+                             exact_data, i_offset, -1, results, k);
+    KNN_Pair_destroy_table(found, pointc);
+    if (rc != 0) {
+        KNN_Pair_destroy_table(results, pointc);
+        return NULL;
+    }
+    knn_table_finalize(results, pointc, k);
+
+    return results;
+}
+
+int knn_rerank_into(struct KNN_Pair **candidates, int points, int count,
+                    matrix_t *exact_points, matrix_t *exact_data,
+                    int d_offset, int p_offset, struct KNN_Pair **knns, int k)
+{
+    // Distances found in single precision carry the error of the engine, as
+    // in knn_bounds_sq_gap(), along with the error of rounding points to
+    // floats. Both are relative to the norms of the points, so the greatest
+    // norm of data bounds them for every data point left out of candidates.
+    int data_rows = matrix_get_rows(exact_data);
+    double data_norm = 0.0;
+    for (int j = 0; j < data_rows; j++) {
+        double norm = _sq_norm(exact_data, j);
+        if (norm > data_norm) data_norm = norm;
+    }
+    double error = (matrix_get_cols(exact_data) + 4) * FLT_EPSILON;
+    int failed = 0;
+
+    #pragma omp parallel
+    {
+        // Neighbors of a point before its candidates are offered, restored
+        // when they turn out to be too few.
+        struct KNN_Pair *saved = (struct KNN_Pair *) malloc(
+                sizeof(struct KNN_Pair) * k);
+        if (!saved) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+
+        #pragma omp for
+        for (int p = 0; p < points; p++) {
+            if (!saved) continue;
+            memcpy(saved, knns[p], sizeof(struct KNN_Pair) * k);
+
+            for (int c = 0; c < count; c++) {
+                int index = candidates[p][c].index;
+                if (index < 0) continue;  // Data had less points than candidates.
+                double dist = _exact_sq_distance(exact_points, p,
+                                                 exact_data, index - d_offset);
+                knn_topk_push(knns[p], k, dist, index);
             }
-            dist = pow(dist, 0.5);
 
-            // On first k data, just fill the k positions in results array.
-            if (d < k) {
-                results[p][d].distance = dist;
-                results[p][d].index = i_offset + d;
+            // Data points left out of the candidates are at least as far as
+            // the last one, up to the error of single precision. Unless that
+            // is further than the k-th neighbor, one of them may be nearer,
+            // so the point is searched on all data in double precision.
+            struct KNN_Pair *last = knn_topk_worst(candidates[p], count);
+            if (last->index < 0) continue;  // All data are candidates.
+            double margin = error * (_sq_norm(exact_points, p) + data_norm);
+            if (last->distance - margin >
+                knn_topk_worst(knns[p], k)->distance) continue;
 
-                // When last position in results array gets filled, sort data.
-                if (d == k-1) {
-                    qsort(results[p], k, sizeof(struct KNN_Pair),
-                          KNN_Pair_asc_comp);
-                }
+            memcpy(knns[p], saved, sizeof(struct KNN_Pair) * k);
+            for (int j = 0; j < data_rows; j++) {
+                if (p_offset >= 0 && d_offset + j == p_offset + p) continue;
+                double dist = _exact_sq_distance(exact_points, p,
+                                                 exact_data, j);
+                knn_topk_push(knns[p], k, dist, d_offset + j);
             }
-            // Every row in results is initialized and sorted. So if
-            // current distance is lesser than the distance of the last nearest
-            // neighbor, previous value is replaced by current one.
-            else if (dist < results[p][k-1].distance) {
-                results[p][k-1].distance = dist;
-                // Keep track on the index. i_offset is used as the base for
-                // all indexes.
-                results[p][k-1].index = i_offset + d;
-                qsort(results[p], k, sizeof(struct KNN_Pair), KNN_Pair_asc_comp);
+        }
+
+        free(saved);
+    }
+
+    if (failed) {
+        printf("ERROR: knn_rerank_into() : Failed to allocate memory.\n");
+        return -1;
+    }
+    return 0;
+}
+
+void knn_table_init(struct KNN_Pair **knns, int points, int k)
+{
+    #pragma omp parallel for
+    for (int p = 0; p < points; p++) knn_topk_init(knns[p], k);
+}
+
+void knn_table_init_bounded(struct KNN_Pair **knns, int points, int k,
+                            const double *bounds)
+{
+    #pragma omp parallel for
+    for (int p = 0; p < points; p++) {
+        knn_topk_init(knns[p], k);
+        if (isinf(bounds[p])) continue;
+        for (int i = 0; i < k; i++) {
+            knns[p][i].distance = bounds[p];
+            knns[p][i].index = INT_MAX;
+        }
+    }
+}
+
+void knn_table_merge(struct KNN_Pair **knns, struct KNN_Pair **other,
+                     int points, int k)
+{
+    #pragma omp parallel for
+    for (int p = 0; p < points; p++) {
+        for (int i = 0; i < k; i++) {
+            if (other[p][i].index < 0) continue;
+            knn_topk_push_pair(knns[p], k, &other[p][i]);
+        }
+    }
+}
+
+void knn_table_finalize(struct KNN_Pair **knns, int points, int k)
+{
+    // Square root is only needed for the final k nearest neighbors.
+    #pragma omp parallel for
+    for (int p = 0; p < points; p++) {
+        knn_topk_finalize(knns[p], k);
+        for (int i = 0; i < k; i++) {
+            knns[p][i].distance = sqrt(knns[p][i].distance);
+        }
+    }
+}
+
+void knn_table_label(struct KNN_Pair **knns, int points, int k,
+                     const int *labels, int l_offset, int l_count)
+{
+    #pragma omp parallel for
+    for (int p = 0; p < points; p++) {
+        for (int i = 0; i < k; i++) {
+            int index = knns[p][i].index - l_offset;
+            if (index >= 0 && index < l_count) {
+                knns[p][i].label = labels[index];
             }
         }
     }
+}
 
-    return results;
+double knn_table_worst(struct KNN_Pair **knns, int points, int k)
+{
+    double worst = 0.0;
+    for (int p = 0; p < points; p++) {
+        double d = knn_topk_worst(knns[p], k)->distance;
+        if (d > worst) worst = d;
+    }
+    return worst;
+}
+
+struct KNN_Bounds *knn_bounds_create(matrix_t *m)
+{
+    int rows = matrix_get_rows(m);
+    return knn_bounds_create_tiles(m, 0, rows, rows > 0 ? rows : 1);
+}
+
+struct KNN_Bounds *knn_bounds_create_tiles(matrix_t *m, int start, int end,
+                                           int tile)
+{
+    if (!m || start < 0 || end < start || tile < 1) {
+        printf("ERROR: knn_bounds_create_tiles() : Invalid Arguments.\n");
+        return NULL;
+    }
+
+    // Boxes are followed by the values of their columns, so all of them
+    // are freed at once.
+    int cols = matrix_get_cols(m);
+    int count = (end - start + tile - 1) / tile;
+    if (count == 0) count = 1;
+    size_t header = sizeof(struct KNN_Bounds) * count;
+    struct KNN_Bounds *bounds = (struct KNN_Bounds *) malloc(
+            header + sizeof(double) * 2 * cols * count);
+    if (!bounds) return NULL;
+
+    double *values = (double *) ((char *) bounds + header);
+    for (int t = 0; t < count; t++) {
+        int t_start = start + t * tile;
+        int t_end = t_start + tile < end ? t_start + tile : end;
+        bounds[t].lower = values + 2 * cols * t;
+        bounds[t].upper = bounds[t].lower + cols;
+        _fill_bounds(&bounds[t], m, t_start, t_end);
+    }
+
+    return bounds;
+}
+
+double knn_bounds_sq_gap(const struct KNN_Bounds *a,
+                         const struct KNN_Bounds *b)
+{
+    if (a->rows == 0 || b->rows == 0) return INFINITY;
+
+    // On every column, points are at least as far apart as the gap between
+    // the ranges of their boxes.
+    double sum = 0.0;
+    for (int c = 0; c < a->cols; c++) {
+        double gap = a->lower[c] - b->upper[c];
+        double other = b->lower[c] - a->upper[c];
+        if (other > gap) gap = other;
+        if (gap > 0.0) sum += gap * gap;
+    }
+    if (sum == 0.0) return 0.0;
+
+    // Engine computes distances out of the norms of the points, so its error
+    // is relative to them rather than to the distances.
+    double eps = a->type == MATRIX_FLOAT || b->type == MATRIX_FLOAT ?
+                 FLT_EPSILON : DBL_EPSILON;
+    sum -= a->cols * eps * (a->sq_norm + b->sq_norm);
+    return sum > 0.0 ? sum : 0.0;
+}
+
+void knn_bounds_destroy(struct KNN_Bounds *bounds)
+{
+    free(bounds);
+}
+
+int *knn_pack_labels(matrix_t *labels)
+{
+    int rows = matrix_get_rows(labels);
+    int *packed = (int *) malloc(sizeof(int) * (rows > 0 ? rows : 1));
+    if (!packed) return NULL;
+
+    for (int i = 0; i < rows; i++) {
+        packed[i] = (int) matrix_get_cell(labels, i, 0);
+    }
+
+    return packed;
+}
+
+matrix_t *knn_collect_labels(struct KNN_Pair **knns, int points, int k)
+{
+    matrix_t *labeled_dists = matrix_create(points, k);
+    if (!labeled_dists) {
+        printf("ERROR: knn_collect_labels: Failed to create matrix.\n");
+        return NULL;
+    }
+
+    for (int p = 0; p < points; p++) {
+        for (int i = 0; i < k; i++) {
+            matrix_set_cell(labeled_dists, p, i, (double) knns[p][i].label);
+        }
+    }
+
+    return labeled_dists;
+}
+
+int knn_parse_precision(const char *name)
+{
+    if (!strcmp(name, "double")) return KNN_PRECISION_DOUBLE;
+    if (!strcmp(name, "single")) return KNN_PRECISION_SINGLE;
+    if (!strcmp(name, "mixed")) return KNN_PRECISION_MIXED;
+    return -1;
+}
+
+const char *knn_precision_name(int precision)
+{
+    switch (precision) {
+    case KNN_PRECISION_SINGLE: return "single";
+    case KNN_PRECISION_MIXED: return "mixed";
+    default: return "double";
+    }
+}
+
+void knn_set_progress_hook(knn_progress_fn hook, void *arg)
+{
+    progress_hook = hook;
+    progress_arg = arg;
+}
+
+void knn_progress(void)
+{
+    _knn_progress();
+}
+
+double knn_sq_distance(matrix_t *a, int row_a, matrix_t *b, int row_b)
+{
+    return _exact_sq_distance(a, row_a, b, row_b);
 }
 
 matrix_t *knn_labeling(struct KNN_Pair **knns, int points, int k,
@@ -140,69 +519,158 @@ matrix_t *knn_labeling(struct KNN_Pair **knns, int points, int k,
     return labeled_dists;
 }
 
-matrix_t *knn_classify(matrix_t *labeled_knns)
+struct KNN_Label_Dict *knn_label_dict_create(matrix_t *labels)
 {
+    struct KNN_Label_Dict *dict = (struct KNN_Label_Dict *) malloc(
+            sizeof(struct KNN_Label_Dict));
+    if (!dict) {
+        printf("ERROR: knn_label_dict_create: Failed to allocate memory.\n");
+        return NULL;
+    }
+    dict->count = 0;
+    dict->labels = NULL;
 
-    matrix_t *labeled_points = matrix_create(matrix_get_rows(labeled_knns), 1);
-
-    // Find the greatest label value, so to hash using the value of every label
-    // itself.
-    // --- ASSUME ALL NON-NEGATIVE AND INTEGERS (JUST CODED INTO DOUBLES) ---
-    // --- MAY IMPLEMENT IT BETTER LATER, IF NEEDED ---
-    // --- A PROPER HASHTABLE IMPLEMENTATION IS NEEDED ---
-    double max = matrix_get_cell(labeled_knns, 0, 0);
+    int rows = matrix_get_rows(labels);
+    int cols = matrix_get_cols(labels);
+    int failed = 0;
 
-    for (int i = 0; i < matrix_get_rows(labeled_knns); i++) {
-        for (int j = 0; j < matrix_get_cols(labeled_knns); j++) {
-            double cur = matrix_get_cell(labeled_knns, i, j);
-            if (cur > max) max = cur;
-        }
-    }
+    #pragma omp parallel
+    {
+        // Every thread gathers the distinct labels of its rows into its own
+        // sorted array. Labels are few compared to cells, so inserting a new
+        // one is rare.
+        int count = 0;
+        int capacity = 16;
+        double *found = (double *) malloc(sizeof(double) * capacity);
+        double last = NAN;  // Consecutive labels are often the same.
 
-    // Find the most frequent label for each point's neigbors.
-    int int_max = (int) max;
+        #pragma omp for schedule(static)
+        for (int r = 0; r < rows; r++) {
+            if (!found) continue;
+            for (int c = 0; c < cols; c++) {
+                double label = matrix_get_cell(labels, r, c);
+                if (label == last) continue;
+                last = label;
 
-    int *label_counter = (int *) malloc(sizeof(int) * int_max);
-    for (int p = 0; p < matrix_get_rows(labeled_knns); p++) {
-        // Initialize the labels counter for each point.
-        for (int i = 0; i < (int) max; i++) label_counter[i] = 0;
+                int pos = _lower_bound(found, count, label);
+                if (pos < count && found[pos] == label) continue;
 
-        // Count the occurences of each label in a point's neigbors.
-        for (int i = 0; i < matrix_get_cols(labeled_knns); i++) {
-            double label = matrix_get_cell(labeled_knns, p, i);
-            label_counter[(int) label - 1]++;
+                if (count == capacity) {
+                    capacity *= 2;
+                    double *grown = (double *) realloc(
+                            found, sizeof(double) * capacity);
+                    if (!grown) {
+                        free(found);
+                        found = NULL;
+                        break;
+                    }
+                    found = grown;
+                }
+                memmove(found + pos + 1, found + pos,
+                        sizeof(double) * (count - pos));
+                found[pos] = label;
+                count++;
+            }
         }
 
-        // Find the most frequent label.
-        int max_ocur = 0;
-        int frequency = label_counter[0];
-        for (int i = 0; i < (int) max; i++) {
-            if (label_counter[i] > frequency) {
-                max_ocur = i;
-                frequency = label_counter[i];
+        // Labels of all threads are merged into the dictionary, one thread
+        // at a time.
+        #pragma omp critical
+        {
+            double *merged = NULL;
+            if (!found || failed) {
+                failed = 1;
+            } else {
+                merged = (double *) malloc(sizeof(double) *
+                                           (dict->count + count + 1));
+                if (!merged) failed = 1;
+            }
+            if (merged) {
+                int a = 0, b = 0, m = 0;
+                while (a < dict->count || b < count) {
+                    double next;
+                    if (b == count ||
+                        (a < dict->count && dict->labels[a] <= found[b]))
+                    {
+                        next = dict->labels[a++];
+                    } else {
+                        next = found[b++];
+                    }
+                    if (m == 0 || merged[m-1] != next) merged[m++] = next;
+                }
+                free(dict->labels);
+                dict->labels = merged;
+                dict->count = m;
             }
         }
 
-        matrix_set_cell(labeled_points, p, 0, (double) max_ocur + 1);
+        free(found);
+    }
+
+    if (failed) {
+        printf("ERROR: knn_label_dict_create: Failed to allocate memory.\n");
+        knn_label_dict_destroy(dict);
+        return NULL;
     }
 
-    return labeled_points;
+    return dict;
+}
+
+int knn_label_dict_id(const struct KNN_Label_Dict *dict, double label)
+{
+    int pos = _lower_bound(dict->labels, dict->count, label);
+    if (pos < dict->count && dict->labels[pos] == label) return pos;
+    return -1;
+}
+
+void knn_label_dict_destroy(struct KNN_Label_Dict *dict)
+{
+    if (!dict) return;
+    free(dict->labels);
+    free(dict);
+}
+
+matrix_t *knn_classify(matrix_t *labeled_knns)
+{
+    return _classify_votes("knn_classify", labeled_knns, NULL, 0);
+}
+
+matrix_t *knn_classify_weighted(matrix_t *labeled_knns,
+                                struct KNN_Pair **knns)
+{
+    return _classify_votes("knn_classify_weighted", labeled_knns, knns, 0);
+}
+
+matrix_t *knn_classify_sweep(matrix_t *labeled_knns, struct KNN_Pair **knns)
+{
+    return _classify_votes("knn_classify_sweep", labeled_knns, knns, 1);
 }
 
 struct KNN_Pair **KNN_Pair_create_empty_table(int points, int k)
 {
+    // All rows are kept in a single buffer, pointed by the first row, so the
+    // whole table can be transferred at once. At least one row pointer is
+    // always allocated, so the buffer can always be found.
     struct KNN_Pair **obj = (struct KNN_Pair **) malloc(
-            sizeof(struct KNN_Pair *) * points);
+            sizeof(struct KNN_Pair *) * (points > 0 ? points : 1));
     if (!obj) return NULL;
 
+    size_t pairs = (size_t) points * k;
+    obj[0] = (struct KNN_Pair *) malloc(
+            sizeof(struct KNN_Pair) * (pairs > 0 ? pairs : 1));
+    if (!obj[0]) {
+        free(obj);
+        return NULL;
+    }
+
     for (int i = 0; i < points; i++) {
-        obj[i] = (struct KNN_Pair *) malloc(sizeof(struct KNN_Pair) * k);
-        if (!obj[i]) return NULL;
+        obj[i] = obj[0] + (size_t) i * k;
 
         // Initialize the value of pairs.
         for (int j = 0; j < k; j++) {
             obj[i][j].distance = 0;
             obj[i][j].index = -1;
+            obj[i][j].label = -1;
         }
     }
 
@@ -211,7 +679,10 @@ struct KNN_Pair **KNN_Pair_create_empty_table(int points, int k)
 
 void KNN_Pair_destroy_table(struct KNN_Pair **table, int rows)
 {
-    for (int i = 0; i < rows; i++) free(table[i]);
+    (void) rows;  // Rows share a single buffer.
+
+    if (!table) return;
+    free(table[0]);
     free(table);
 }
 
@@ -254,6 +725,581 @@ int KNN_Pair_asc_comp_by_index(const void * a, const void *b)
 }
 
 
+/**
+ * Checks that two matrices can be searched against each other.
+ *
+ * Returns:
+ *  0 if they are of the same width and type, else -1.
+ */
+static int _check_compatible(const char *caller, matrix_t *a, matrix_t *b)
+{
+    if (matrix_get_cols(a) != matrix_get_cols(b)) {
+        printf("ERROR: %s() : k on data=%d, k on points=%d\n",
+               caller, matrix_get_cols(a), matrix_get_cols(b));
+        return -1;
+    }
+    if (matrix_get_type(a) != matrix_get_type(b)) {
+        printf("ERROR: %s() : data and points differ in type.\n", caller);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Computes the squared norms of all rows of a matrix, in the precision of
+ * its cells.
+ *
+ * Returns:
+ *  An array of doubles, or of floats for matrices of floats. On failure,
+ *  returns NULL.
+ */
+static void *_row_norms(matrix_t *m)
+{
+    int rows = matrix_get_rows(m);
+    void *norms = malloc(matrix_get_cell_size(m) * (rows > 0 ? rows : 1));
+    if (!norms) return NULL;
+
+    if (matrix_get_type(m) == MATRIX_FLOAT) {
+        distance_row_norms_float(m, (float *) norms);
+    } else {
+        distance_row_norms(m, (double *) norms);
+    }
+    return norms;
+}
+
+/**
+ * Computes a tile of squared distances as doubles, regardless of the type
+ * of the matrices, by using the distance engine of their precision.
+ */
+static inline void _sq_tile(matrix_t *points, const void *p_norms,
+                            int q_start, int q_end,
+                            matrix_t *data, const void *d_norms,
+                            int d_start, int d_end, double *tile)
+{
+    if (matrix_get_type(data) != MATRIX_FLOAT) {
+        distance_sq_tile(points, (const double *) p_norms, q_start, q_end,
+                         data, (const double *) d_norms, d_start, d_end, tile);
+        return;
+    }
+
+    // Selectors keep doubles, so float distances are widened.
+    float ftile[DISTANCE_QUERY_TILE * DISTANCE_DATA_TILE];
+    distance_sq_tile_float(points, (const float *) p_norms, q_start, q_end,
+                           data, (const float *) d_norms, d_start, d_end,
+                           ftile);
+    for (int q = 0; q < q_end - q_start; q++) {
+        for (int d = 0; d < d_end - d_start; d++) {
+            tile[q * DISTANCE_DATA_TILE + d] = ftile[q * DISTANCE_DATA_TILE + d];
+        }
+    }
+}
+
+/**
+ * Offers every (point, data) pair of given matrices, to the top-k selectors
+ * of the points.
+ *
+ * Parameters:
+ *  -data: The matrix of data points.
+ *  -points: The matrix of query points, of the same type as data.
+ *  -k: The number of nearest neighbors kept for each point.
+ *  -d_offset: The index of the first data point.
+ *  -p_offset: The index of the first query point, or -1. Pairs of a point
+ *          with a data point of the same index are skipped.
+ *  -results: The initialized top-k selectors of all points.
+ *
+ * Returns:
+ *  0 on success, -1 if memory allocation fails.
+ */
+static int _scan_tiles(matrix_t *data, matrix_t *points, int k,
+                       int d_offset, int p_offset, struct KNN_Pair **results)
+{
+    int pointc = matrix_get_rows(points);
+    int datac = matrix_get_rows(data);
+
+    // Precompute squared norms of all rows, so only the cross term has to be
+    // computed for every (point, data) pair.
+    void *q_norms = _row_norms(points);
+    void *d_norms = _row_norms(data);
+    if (!q_norms || !d_norms) {
+        free(q_norms);
+        free(d_norms);
+        return -1;
+    }
+
+    // Boxes of all tiles allow skipping the pairs of tiles that are too far
+    // apart. Without them, every pair is computed.
+    struct KNN_Bounds *q_bounds = knn_bounds_create_tiles(
+            points, 0, pointc, DISTANCE_QUERY_TILE);
+    struct KNN_Bounds *d_bounds = knn_bounds_create_tiles(
+            data, 0, datac, DISTANCE_DATA_TILE);
+    if (!q_bounds || !d_bounds) {
+        knn_bounds_destroy(q_bounds);
+        knn_bounds_destroy(d_bounds);
+        q_bounds = d_bounds = NULL;
+    }
+
+    // For every tile of points matrix, find its kNNs in data matrix and
+    // store them into results. Data are walked in tiles too, so both
+    // query and data rows needed by distance engine remain in cache.
+    #pragma omp parallel for schedule(dynamic)
+    for (int q_start = 0; q_start < pointc; q_start += DISTANCE_QUERY_TILE) {
+        int q_end = q_start + DISTANCE_QUERY_TILE < pointc ?
+                    q_start + DISTANCE_QUERY_TILE : pointc;
+
+        // Squared distances of current query tile from current data tile.
+        double tile[DISTANCE_QUERY_TILE * DISTANCE_DATA_TILE];
+
+        // Data tiles are visited nearest first, so selectors fill with near
+        // neighbors early. Once the nearest remaining tile is further than
+        // the k-th neighbor of every point of the tile, so are all the rest.
+        int d_tiles = (datac + DISTANCE_DATA_TILE - 1) / DISTANCE_DATA_TILE;
+        struct Tile_Gap *visits = NULL;
+        if (q_bounds) {
+            visits = (struct Tile_Gap *) malloc(
+                    sizeof(struct Tile_Gap) * (d_tiles > 0 ? d_tiles : 1));
+        }
+        if (visits) {
+            const struct KNN_Bounds *q_box =
+                    &q_bounds[q_start / DISTANCE_QUERY_TILE];
+            for (int t = 0; t < d_tiles; t++) {
+                visits[t].gap = knn_bounds_sq_gap(q_box, &d_bounds[t]);
+                visits[t].tile = t;
+            }
+            qsort(visits, d_tiles, sizeof(struct Tile_Gap), _tile_gap_comp);
+        }
+
+        for (int v = 0; v < d_tiles; v++) {
+            int t = visits ? visits[v].tile : v;
+            int d_start = t * DISTANCE_DATA_TILE;
+            int d_end = d_start + DISTANCE_DATA_TILE < datac ?
+                        d_start + DISTANCE_DATA_TILE : datac;
+
+            if (visits && visits[v].gap > 0.0 &&
+                visits[v].gap > knn_table_worst(results + q_start,
+                                                q_end - q_start, k))
+            {
+                break;
+            }
+
+            KNN_PROFILE_START(distance_start);
+            _sq_tile(points, q_norms, q_start, q_end,
+                     data, d_norms, d_start, d_end, tile);
+            KNN_PROFILE_STOP(distance_start, KNN_PHASE_DISTANCE);
+            KNN_PROFILE_COUNT(KNN_COUNTER_FLOPS, _tile_flops(
+                    points, q_end - q_start, d_end - d_start));
+            KNN_PROFILE_COUNT(KNN_COUNTER_DISTANCES,
+                              (double) (q_end - q_start) * (d_end - d_start));
+            _knn_progress();
+
+            // Ranking is done upon squared distances, since square root is
+            // monotonic. d_offset is used as the base for all indexes.
+            KNN_PROFILE_START(topk_start);
+            for (int p = q_start; p < q_end; p++) {
+                double *row = tile + (p - q_start) * DISTANCE_DATA_TILE;
+
+                // A point is never its own neighbor. An infinite distance
+                // is never kept by a selector.
+                if (p_offset >= 0) {
+                    int self = p_offset + p - d_offset - d_start;
+                    if (self >= 0 && self < d_end - d_start) {
+                        row[self] = INFINITY;
+                    }
+                }
+
+                knn_topk_scan(results[p], k, row,
+                              d_end - d_start, d_offset + d_start);
+            }
+            KNN_PROFILE_STOP(topk_start, KNN_PHASE_TOPK);
+            KNN_PROFILE_COUNT(KNN_COUNTER_CANDIDATES,
+                              (double) (q_end - q_start) * (d_end - d_start));
+        }
+
+        free(visits);
+    }
+
+    free(q_norms);
+    free(d_norms);
+    knn_bounds_destroy(q_bounds);
+    knn_bounds_destroy(d_bounds);
+
+    return 0;
+}
+
+/**
+ * Offers every pair between a range of rows of a and a range of rows of b,
+ * to the selectors of both rows.
+ *
+ * It is the unit of work of knn_search_symmetric(). Each distance is computed
+ * once and used for both sides.
+ */
+static void _symmetric_task(matrix_t *a, const void *a_norms, int a_offset,
+                            struct KNN_Pair **a_knns, int a_start, int a_end,
+                            matrix_t *b, const void *b_norms, int b_offset,
+                            struct KNN_Pair **b_knns, int b_start, int b_end,
+                            int k)
+{
+    double tile[DISTANCE_QUERY_TILE * DISTANCE_DATA_TILE];
+
+    // Pairs of tiles that are too far apart to change the neighbors of any
+    // of their rows are skipped.
+    struct KNN_Bounds *a_bounds = knn_bounds_create_tiles(
+            a, a_start, a_end, DISTANCE_QUERY_TILE);
+    struct KNN_Bounds *b_bounds = knn_bounds_create_tiles(
+            b, b_start, b_end, DISTANCE_DATA_TILE);
+    if (!a_bounds || !b_bounds) {
+        knn_bounds_destroy(a_bounds);
+        knn_bounds_destroy(b_bounds);
+        a_bounds = b_bounds = NULL;
+    }
+
+    for (int q_start = a_start; q_start < a_end; q_start += DISTANCE_QUERY_TILE) {
+        int q_end = q_start + DISTANCE_QUERY_TILE < a_end ?
+                    q_start + DISTANCE_QUERY_TILE : a_end;
+
+        for (int d_start = b_start; d_start < b_end;
+             d_start += DISTANCE_DATA_TILE)
+        {
+            int d_end = d_start + DISTANCE_DATA_TILE < b_end ?
+                        d_start + DISTANCE_DATA_TILE : b_end;
+
+            if (a_bounds &&
+                _tile_prunable(
+                    &a_bounds[(q_start - a_start) / DISTANCE_QUERY_TILE],
+                    a_knns, q_start, q_end,
+                    &b_bounds[(d_start - b_start) / DISTANCE_DATA_TILE],
+                    b_knns, d_start, d_end, k))
+            {
+                continue;
+            }
+
+            KNN_PROFILE_START(distance_start);
+            _sq_tile(a, a_norms, q_start, q_end,
+                     b, b_norms, d_start, d_end, tile);
+            KNN_PROFILE_STOP(distance_start, KNN_PHASE_DISTANCE);
+            KNN_PROFILE_COUNT(KNN_COUNTER_FLOPS, _tile_flops(
+                    a, q_end - q_start, d_end - d_start));
+            KNN_PROFILE_COUNT(KNN_COUNTER_DISTANCES,
+                              (double) (q_end - q_start) * (d_end - d_start));
+            _knn_progress();
+
+            // Rows of the tile are candidates for rows of a.
+            KNN_PROFILE_START(topk_start);
+            for (int p = q_start; p < q_end; p++) {
+                knn_topk_scan(a_knns[p], k,
+                              tile + (p - q_start) * DISTANCE_DATA_TILE,
+                              d_end - d_start, b_offset + d_start);
+            }
+
+            // Columns of the tile are candidates for rows of b.
+            for (int d = d_start; d < d_end; d++) {
+                struct KNN_Pair *row = b_knns[d];
+                struct KNN_Pair *worst = knn_topk_worst(row, k);
+                for (int p = q_start; p < q_end; p++) {
+                    double dist = tile[(p - q_start) * DISTANCE_DATA_TILE +
+                                       (d - d_start)];
+                    if (_knn_topk_less(dist, a_offset + p, worst)) {
+                        knn_topk_push(row, k, dist, a_offset + p);
+                    }
+                }
+            }
+            KNN_PROFILE_STOP(topk_start, KNN_PHASE_TOPK);
+            KNN_PROFILE_COUNT(KNN_COUNTER_CANDIDATES,
+                              2.0 * (q_end - q_start) * (d_end - d_start));
+        }
+    }
+    knn_bounds_destroy(a_bounds);
+    knn_bounds_destroy(b_bounds);
+}
+
+/**
+ * Returns the value of a cell of a matrix of any type, as a double.
+ */
+static inline double _cell_value(matrix_t *m, int row, int col)
+{
+    if (matrix_get_type(m) == MATRIX_FLOAT) {
+        return (double) matrix_get_frow(m, row)[col];
+    }
+    return matrix_get_cell(m, row, col);
+}
+
+/**
+ * Computes in double precision the squared euclidean distance between two
+ * rows of matrices of any type.
+ *
+ * Differences are summed directly, instead of using the norms decomposition,
+ * so the result carries no cancellation error.
+ */
+static double _exact_sq_distance(matrix_t *a, int row_a,
+                                 matrix_t *b, int row_b)
+{
+    int cols = matrix_get_cols(a);
+    double sum = 0.0;
+
+    // Distance is symmetric, so a row of doubles is always put first.
+    if (matrix_get_type(a) == MATRIX_FLOAT &&
+        matrix_get_type(b) == MATRIX_DOUBLE)
+    {
+        return _exact_sq_distance(b, row_b, a, row_a);
+    }
+
+    // Common cases of a row of doubles against a row of either type, are
+    // given loops of their own, that keep independent partial sums, so they
+    // can be vectorized.
+    if (matrix_get_type(a) == MATRIX_DOUBLE) {
+        double part[4] = { 0.0, 0.0, 0.0, 0.0 };
+        const double *x = matrix_get_row(a, row_a);
+        if (matrix_get_type(b) == MATRIX_DOUBLE) {
+            const double *y = matrix_get_row(b, row_b);
+            for (int c = 0; c < cols; c++) {
+                double diff = x[c] - y[c];
+                part[c % 4] += diff * diff;
+            }
+        } else {
+            const float *y = matrix_get_frow(b, row_b);
+            for (int c = 0; c < cols; c++) {
+                double diff = x[c] - (double) y[c];
+                part[c % 4] += diff * diff;
+            }
+        }
+        return (part[0] + part[2]) + (part[1] + part[3]);
+    }
+
+    for (int c = 0; c < cols; c++) {
+        double diff = _cell_value(a, row_a, c) - _cell_value(b, row_b, c);
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+/**
+ * Computes in double precision the squared euclidean norm of a row of a
+ * matrix of any type.
+ */
+static double _sq_norm(matrix_t *m, int row)
+{
+    int cols = matrix_get_cols(m);
+    double sum = 0.0;
+    for (int c = 0; c < cols; c++) {
+        double value = _cell_value(m, row, c);
+        sum += value * value;
+    }
+    return sum;
+}
+
+/**
+ * Calls the progress hook, if any, given that current thread is the one
+ * that is allowed to.
+ */
+static inline void _knn_progress(void)
+{
+    if (!progress_hook) return;
+#ifdef _OPENMP
+    if (omp_get_thread_num() != 0) return;
+#endif
+    progress_hook(progress_arg);
+}
+
+/**
+ * Computes the bounding box of rows [start, end) of a matrix, into a box
+ * whose columns are already allocated.
+ */
+static void _fill_bounds(struct KNN_Bounds *bounds, matrix_t *m,
+                         int start, int end)
+{
+    int cols = matrix_get_cols(m);
+
+    bounds->rows = end - start;
+    bounds->cols = cols;
+    bounds->type = matrix_get_type(m);
+    for (int c = 0; c < cols; c++) {
+        bounds->lower[c] = INFINITY;
+        bounds->upper[c] = -INFINITY;
+    }
+    for (int r = start; r < end; r++) {
+        for (int c = 0; c < cols; c++) {
+            double v = _cell_value(m, r, c);
+            if (v < bounds->lower[c]) bounds->lower[c] = v;
+            if (v > bounds->upper[c]) bounds->upper[c] = v;
+        }
+    }
+
+    // No point can have a greater value than the box on any column.
+    bounds->sq_norm = 0.0;
+    if (bounds->rows == 0) return;
+    for (int c = 0; c < cols; c++) {
+        double lo = bounds->lower[c] * bounds->lower[c];
+        double hi = bounds->upper[c] * bounds->upper[c];
+        bounds->sq_norm += lo > hi ? lo : hi;
+    }
+}
+
+/**
+ * Returns 1 if the distances between the rows of two tiles can't change the
+ * neighbors of any of them, else 0. Tables of neighbors can be NULL, when
+ * the rows of a tile are not searched for neighbors.
+ */
+static int _tile_prunable(const struct KNN_Bounds *a_bounds,
+                          struct KNN_Pair **a_knns, int a_start, int a_end,
+                          const struct KNN_Bounds *b_bounds,
+                          struct KNN_Pair **b_knns, int b_start, int b_end,
+                          int k)
+{
+    // Overlapping tiles, the common case on unclustered data, are rejected
+    // without looking at their selectors.
+    double gap = knn_bounds_sq_gap(a_bounds, b_bounds);
+    if (gap == 0.0) return 0;
+
+    if (a_knns && !(gap > knn_table_worst(a_knns + a_start,
+                                          a_end - a_start, k)))
+    {
+        return 0;
+    }
+    if (b_knns && !(gap > knn_table_worst(b_knns + b_start,
+                                          b_end - b_start, k)))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Compares two struct Tile_Gap objects, firstly by gap and secondly by tile.
+ */
+static int _tile_gap_comp(const void *a, const void *b)
+{
+    const struct Tile_Gap *x = (const struct Tile_Gap *) a;
+    const struct Tile_Gap *y = (const struct Tile_Gap *) b;
+    if (x->gap < y->gap) return -1;
+    if (x->gap > y->gap) return 1;
+    return x->tile - y->tile;
+}
+
+/**
+ * Returns the floating point operations of a tile of squared distances
+ * between rows of given width: a multiply and an add per column for the
+ * cross term, plus three operations for combining it with the norms.
+ */
+static inline double _tile_flops(matrix_t *m, int rows, int cols)
+{
+    return (double) rows * cols * (2.0 * matrix_get_cols(m) + 3.0);
+}
+
+/**
+ * Returns the position of the first of n values in ascending order, that is
+ * not less than the given value, or n if there is none.
+ */
+static int _lower_bound(const double *values, int n, double value)
+{
+    int low = 0;
+    int high = n;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (values[mid] < value) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+/**
+ * Counts the votes of the nearest neighbors of every point, for
+ * knn_classify(), knn_classify_weighted() and knn_classify_sweep().
+ *
+ * Parameters:
+ *  -caller: The name of the calling function, used in error messages.
+ *  -labeled_knns: A (points x k) matrix with the labels of the nearest
+ *          neighbors of each point, ordered by distance.
+ *  -knns: The nearest neighbors, whose distances weight their votes, or NULL
+ *          for one vote per neighbor.
+ *  -sweep: When not 0, a classification is kept for every number of
+ *          neighbors up to k. Else, only for k.
+ *
+ * Returns:
+ *  A (points x k) matrix when sweeping, else a (points x 1) matrix, or NULL
+ *  on failure.
+ */
+static matrix_t *_classify_votes(const char *caller, matrix_t *labeled_knns,
+                                 struct KNN_Pair **knns, int sweep)
+{
+    int points = matrix_get_rows(labeled_knns);
+    int k = matrix_get_cols(labeled_knns);
+
+    // Labels are mapped once to dense ids, so votes can be counted into
+    // plain arrays, whatever the labels are.
+    struct KNN_Label_Dict *dict = knn_label_dict_create(labeled_knns);
+    matrix_t *classified = dict ? matrix_create(points, sweep ? k : 1) : NULL;
+    if (!classified) {
+        printf("ERROR: %s: Failed to create matrix.\n", caller);
+        knn_label_dict_destroy(dict);
+        return NULL;
+    }
+
+    int failed = 0;
+
+    #pragma omp parallel
+    {
+        // Every thread counts votes into its own array. Only the counters
+        // touched by a point are cleared after it.
+        double *votes = (double *) calloc(dict->count + 1, sizeof(double));
+        int *ids = (int *) malloc(sizeof(int) * (k > 0 ? k : 1));
+        if (!votes || !ids) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+
+        #pragma omp for schedule(static)
+        for (int p = 0; p < points; p++) {
+            if (!votes || !ids) continue;
+
+            // Only the votes of the newly added label change on every step,
+            // so it is the only candidate for taking over the best one.
+            int best = -1;
+            for (int i = 0; i < k; i++) {
+                int id = knn_label_dict_id(
+                        dict, matrix_get_cell(labeled_knns, p, i));
+                ids[i] = id;
+
+                // Labels the dictionary can't hold, like NaN, get no vote.
+                if (id >= 0) {
+                    votes[id] += knns ?
+                            1.0 / (knns[p][i].distance + KNN_VOTE_EPSILON) :
+                            1.0;
+                    if (best < 0 || votes[id] > votes[best] ||
+                        (votes[id] == votes[best] && id < best))
+                    {
+                        best = id;
+                    }
+                }
+                if (sweep) {
+                    matrix_set_cell(classified, p, i,
+                                    best >= 0 ? dict->labels[best] : NAN);
+                }
+            }
+            if (!sweep) {
+                matrix_set_cell(classified, p, 0,
+                                best >= 0 ? dict->labels[best] : NAN);
+            }
+
+            for (int i = 0; i < k; i++) {
+                if (ids[i] >= 0) votes[ids[i]] = 0.0;
+            }
+        }
+
+        free(votes);
+        free(ids);
+    }
+
+    knn_label_dict_destroy(dict);
+
+    if (failed) {
+        printf("ERROR: %s: Failed to allocate memory.\n", caller);
+        matrix_destroy(classified);
+        return NULL;
+    }
+
+    return classified;
+}
+
+
 // ================== Legacy Code =================
 
 // struct KNN_Pair **KNN_Pair_create_subtable_ref(struct KNN_Pair **knns,
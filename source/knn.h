@@ -7,12 +7,65 @@
  *
  * knn.h defines routines that may be used for k-Nearest-Neighbors searching.
  *
+ * Macros defined in knn.h:
+ *  -KNN_PRECISION_DOUBLE
+ *  -KNN_PRECISION_SINGLE
+ *  -KNN_PRECISION_MIXED
+ *  -KNN_PRECISION_DEFAULT
+ *  -KNN_RERANK_FACTOR
+ *  -KNN_VOTE_EPSILON
+ *
  * Types defined in knn.h:
  *  -struct KNN_Pair
+ *  -struct KNN_Label_Dict
+ *  -struct KNN_Bounds
+ *  -knn_progress_fn
  *
  * Functions defined in knn.h:
  *  -struct KNN_Pair **knn_search(matrix_t *, matrix_t *, int, int)
+ *  -int knn_search_update(matrix_t *data, matrix_t *points, int k,
+ *                         int d_offset, int p_offset, struct KNN_Pair **knns)
+ *  -int knn_search_symmetric(matrix_t *a, int a_offset,
+ *                            struct KNN_Pair **a_knns, matrix_t *b,
+ *                            int b_offset, struct KNN_Pair **b_knns, int k)
+ *  -struct KNN_Pair **knn_search_rerank(matrix_t *data, matrix_t *points,
+ *                                       matrix_t *exact_data,
+ *                                       matrix_t *exact_points,
+ *                                       int k, int candidates, int i_offset)
+ *  -int knn_rerank_into(struct KNN_Pair **candidates, int points, int count,
+ *                       matrix_t *exact_points, matrix_t *exact_data,
+ *                       int d_offset, int p_offset, struct KNN_Pair **knns,
+ *                       int k)
+ *  -void knn_table_init(struct KNN_Pair **knns, int points, int k)
+ *  -void knn_table_init_bounded(struct KNN_Pair **knns, int points, int k,
+ *                               const double *bounds)
+ *  -void knn_table_merge(struct KNN_Pair **knns, struct KNN_Pair **other,
+ *                        int points, int k)
+ *  -void knn_table_finalize(struct KNN_Pair **knns, int points, int k)
+ *  -void knn_table_label(struct KNN_Pair **knns, int points, int k,
+ *                        const int *labels, int l_offset, int l_count)
+ *  -double knn_table_worst(struct KNN_Pair **knns, int points, int k)
+ *  -struct KNN_Bounds *knn_bounds_create(matrix_t *m)
+ *  -struct KNN_Bounds *knn_bounds_create_tiles(matrix_t *m, int start,
+ *                                              int end, int tile)
+ *  -double knn_bounds_sq_gap(const struct KNN_Bounds *a,
+ *                            const struct KNN_Bounds *b)
+ *  -void knn_bounds_destroy(struct KNN_Bounds *bounds)
+ *  -int *knn_pack_labels(matrix_t *labels)
+ *  -matrix_t *knn_collect_labels(struct KNN_Pair **knns, int points, int k)
+ *  -int knn_parse_precision(const char *name)
+ *  -const char *knn_precision_name(int precision)
+ *  -void knn_set_progress_hook(knn_progress_fn hook, void *arg)
+ *  -void knn_progress(void)
+ *  -double knn_sq_distance(matrix_t *a, int row_a, matrix_t *b, int row_b)
+ *  -struct KNN_Label_Dict *knn_label_dict_create(matrix_t *labels)
+ *  -int knn_label_dict_id(const struct KNN_Label_Dict *dict, double label)
+ *  -void knn_label_dict_destroy(struct KNN_Label_Dict *dict)
  *  -matrix_t *knn_classify(matrix_t *labeled_knns)
+ *  -matrix_t *knn_classify_weighted(matrix_t *labeled_knns,
+ *                                   struct KNN_Pair **knns)
+ *  -matrix_t *knn_classify_sweep(matrix_t *labeled_knns,
+ *                                struct KNN_Pair **knns)
  *  -matrix_t *knn_labeling(struct KNN_Pair **, int, int, matrix_t *, int *,
  *                          matrix_t *, int)
  *  -struct KNN_Pair **KNN_Pair_create_empty_table(int, int)
@@ -29,12 +82,64 @@
 #include "matrix.h"
 
 
+// Precisions a knn search can be done in:
+//  -double: Data are searched and transferred as doubles.
+//  -single: Data are searched and transferred as floats. Distances carry
+//      the rounding errors of single precision.
+//  -mixed: Data are transferred as doubles and searched as floats, and
+//      candidates are then re-ranked by distances computed in double
+//      precision. Points whose candidates may miss a neighbor, given the
+//      error of single precision, are searched again in double precision,
+//      so neighbors are the same as in double precision.
+#define KNN_PRECISION_DOUBLE 0
+#define KNN_PRECISION_SINGLE 1
+#define KNN_PRECISION_MIXED 2
+
+// Precision used when none is requested at runtime.
+#ifndef KNN_PRECISION_DEFAULT
+#define KNN_PRECISION_DEFAULT KNN_PRECISION_DOUBLE
+#endif
+
+// Candidates kept in mixed precision for every requested nearest neighbor.
+// Raising it makes points searched again in double precision rarer.
+#ifndef KNN_RERANK_FACTOR
+#define KNN_RERANK_FACTOR 2
+#endif
+
+// Added to the distance of every neighbor, when weighting its vote by the
+// inverse of it, so neighbors at a distance of 0 get a finite weight.
+#ifndef KNN_VOTE_EPSILON
+#define KNN_VOTE_EPSILON 1e-9
+#endif
+
 // A struct to keep data resulted by knn_search.
 struct KNN_Pair {
     double distance;
     int index;
+    int label;  // Label of the neighbor, or -1 when not known.
+};
+
+// A dictionary that maps the distinct labels of a matrix to dense ids. Ids
+// follow the ascending order of labels, i.e. labels[id] is the label of id.
+struct KNN_Label_Dict {
+    int count;       // Number of distinct labels.
+    double *labels;  // Distinct labels, in ascending order.
+};
+
+// An axis aligned bounding box of a set of points. It is a compact summary
+// of a block of points, that bounds the distances from any of them.
+struct KNN_Bounds {
+    int rows;        // Number of points summarized.
+    int cols;        // Width of the points.
+    int type;        // Type of the matrix of the points.
+    double sq_norm;  // Upper bound of the squared norms of the points.
+    double *lower;   // Least value of every column.
+    double *upper;   // Greatest value of every column.
 };
 
+// A function called periodically during long computations.
+typedef void (*knn_progress_fn)(void *arg);
+
 /**
  * Does a k-Nearest-Neighbors search for given points, on provided data.
  *
@@ -49,6 +154,9 @@ struct KNN_Pair {
  * the complete data set. The only required thing to know, is the offset of
  * current data chunk from the beggining of the complete data set.
  *
+ * data and points can both be matrices of floats, in which case distances
+ * are computed in single precision.
+ *
  * Parameters:
  *  -data : A matrix containing all the points, that will be searched for
  *          nearest points for every point in points argument.
@@ -61,46 +169,414 @@ struct KNN_Pair {
  * Returns:
  *  A table of KNN_Pair objects, each one containing the distance of k-th
  *  nearest neighbor from equivalent query point and their original index
- *  in data matrix plus the value of i_offset argument.
+ *  in data matrix plus the value of i_offset argument. Each row is sorted
+ *  in ascending order as defined by KNN_Pair_asc_comp(). If data contains
+ *  less than k points, remaining pairs have an infinite distance and an
+ *  index of -1.
  */
 struct KNN_Pair **knn_search(matrix_t *data, matrix_t *points,
                              int k, int i_offset);
 
 /**
- * Classifies points based on the given table of k-Nearest-Neigbors and
- * a provided matrix with their labels.
+ * Updates the nearest neighbors of given points, with the ones found in
+ * provided data.
  *
- * The 2D table of KNN_Pair objects, should normally be the result of
- * a call to knn_search() function.
+ * Unlike knn_search(), knns are not a final result, but a table of top-k
+ * selectors (see knn_topk.h) that may already contain neighbors, as left
+ * by knn_table_init() or previous updates. Distances in it are squared,
+ * until knn_table_finalize() is called. This way, a search can be continued
+ * block by block, without merging intermediate results.
  *
- * The use of i_offset argument allows to classify chunks of points returned
- * by knn_search() function. It should be the same offset provided to
- * knn_search(). When chunk classifying is not needed, it should always be 0.
+ * Parameters:
+ *  -data: The data points to be searched.
+ *  -points: The query points, of the same width and type as data.
+ *  -k: The number of nearest neighbors kept for each point.
+ *  -d_offset: The index of the first row of data.
+ *  -p_offset: The index of the first row of points, or -1. A pair of a point
+ *          and a data point of the same index, i.e. a point and itself,
+ *          is never considered.
+ *  -knns: The selectors of all points.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int knn_search_update(matrix_t *data, matrix_t *points, int k,
+                      int d_offset, int p_offset, struct KNN_Pair **knns);
+
+/**
+ * Updates the nearest neighbors of two sets of points, with the ones found
+ * in each other.
+ *
+ * The distance between a row of a and a row of b is computed once and is
+ * offered both to the selector of the row of a, as a neighbor of index
+ * b_offset + row of b, and to the selector of the row of b, as a neighbor
+ * of index a_offset + row of a. Selectors are the same as in
+ * knn_search_update(). a and b should not contain the same points.
+ *
+ * Work is divided among threads in rounds, so the selectors of a row are
+ * never updated by two threads at once.
  *
  * Parameters:
- *  -knns : A 2D table of KNN_Pair objects, as resulted by knn_search(). Each
- *          row is a point to be classified. On each row, k KNN_Pair objects
- *          should be contained, each one containing the distance and label's
- *          index of the k-th nearest neighbor to the point represented by this
- *          row.
- *  -points : The number of points contained in knns, i.e. the number of rows
- *          in knns.
- *  -k: The number of nearest neighbors to be used in classifying. This number
- *          should be equal or lesser than the nearest neighbors contained in
- *          knns for each point.
- *  -labels: A column matrix to look up the labels of kNNs contained in knns.
- *          Labels in this matrix should reside in the same order as defined
- *          by neighbors' indexes. i_offset can be used to control sliding up
- *          or down.
- *  -i_offset : An offset to be subtracted from all the neighbors' indexes in
- *          knns table, that will later be used for lookup in labels.
+ *  -a: The first set of points.
+ *  -a_offset: The index of the first row of a.
+ *  -a_knns: The selectors of the rows of a.
+ *  -b: The second set of points, of the same width and type as a.
+ *  -b_offset: The index of the first row of b.
+ *  -b_knns: The selectors of the rows of b.
+ *  -k: The number of nearest neighbors kept for each point.
  *
  * Returns:
- *  A (points x 1) matrix containing the classification of each point in knns.
- *  Each row of returned matrix, correspond to the equivalent point row in knns.
+ *  0 on success, -1 on failure.
+ */
+int knn_search_symmetric(matrix_t *a, int a_offset, struct KNN_Pair **a_knns,
+                         matrix_t *b, int b_offset, struct KNN_Pair **b_knns,
+                         int k);
+
+/**
+ * Does a k-Nearest-Neighbors search and re-ranks the results by distances
+ * computed in double precision.
+ *
+ * At first, the given number of candidates are found for each point, by
+ * calling knn_search() on data and points. Then, the distance of every
+ * candidate is recomputed in double precision, using the corresponding rows
+ * of exact_data and exact_points, and the k nearest of them are kept.
+ *
+ * It is intended for searching on single precision copies of the data (see
+ * matrix_to_float()), while getting the neighbors a search in double
+ * precision would return. Points whose candidates may miss a neighbor are
+ * searched again in double precision, as in knn_rerank_into().
+ *
+ * Parameters:
+ *  -data: The data points to be searched, of any type.
+ *  -points: The query points, of the same type as data.
+ *  -exact_data: A matrix with the same rows as data, used for re-ranking.
+ *          It can be data itself, e.g. when data is only available as floats.
+ *  -exact_points: A matrix with the same rows as points, used for re-ranking.
+ *  -k: The number of nearest neighbors to be returned for each point.
+ *  -candidates: The number of candidates to be re-ranked for each point. If
+ *          less than k, k is used.
+ *  -i_offset: The offset of data chunk, as in knn_search().
+ *
+ * Returns:
+ *  A table of KNN_Pair objects, as the one returned by knn_search(). On
+ *  failure, returns NULL.
+ */
+struct KNN_Pair **knn_search_rerank(matrix_t *data, matrix_t *points,
+                                    matrix_t *exact_data,
+                                    matrix_t *exact_points,
+                                    int k, int candidates, int i_offset);
+
+/**
+ * Offers candidate neighbors to selectors, by their distances computed in
+ * double precision.
+ *
+ * Candidates are expected to be the nearest ones by distances computed in
+ * single precision. Error of these distances is bounded by the norms of
+ * the points, so a data point left out of the candidates of a point can
+ * only be nearer than its k-th neighbor, when the last candidate is within
+ * that bound of the k-th neighbor. Such points are searched on all rows of
+ * exact_data in double precision instead, so neighbors are the same as the
+ * ones of a search in double precision on exact_data.
+ *
+ * Parameters:
+ *  -candidates: A table of candidates for each point, as found by
+ *          knn_search_update() in single precision.
+ *  -points: The number of points.
+ *  -count: The number of candidates for each point.
+ *  -exact_points: The points, in the precision used for re-ranking.
+ *  -exact_data: The data points candidates refer to, in the precision used
+ *          for re-ranking.
+ *  -d_offset: The index of the first row of exact_data.
+ *  -p_offset: The index of the first point, or -1, as in knn_search_update().
+ *  -knns: The selectors of the points, as in knn_search_update().
+ *  -k: The number of nearest neighbors kept for each point.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int knn_rerank_into(struct KNN_Pair **candidates, int points, int count,
+                    matrix_t *exact_points, matrix_t *exact_data,
+                    int d_offset, int p_offset, struct KNN_Pair **knns, int k);
+
+/**
+ * Initializes every row of a table to an empty top-k selector.
+ */
+void knn_table_init(struct KNN_Pair **knns, int points, int k);
+
+/**
+ * Initializes every row of a table to a top-k selector, that only keeps
+ * neighbors nearer than a given bound.
+ *
+ * Rows are filled with placeholder pairs of the bound as distance and of
+ * INT_MAX as index, or with empty pairs when the bound is infinite. It is
+ * intended for points whose k nearest neighbors so far are kept elsewhere,
+ * with a k-th (squared) distance of bound. Placeholders are ranked after any
+ * real neighbor of the same distance, so they never displace one when both
+ * tables are merged.
+ *
+ * Parameters:
+ *  -knns: The table to be initialized.
+ *  -points: The number of rows in knns.
+ *  -k: The number of neighbors in each row.
+ *  -bounds: The squared distance bound of every row.
+ */
+void knn_table_init_bounded(struct KNN_Pair **knns, int points, int k,
+                            const double *bounds);
+
+/**
+ * Offers all neighbors kept by the selectors of other table, to the
+ * selectors of knns. Both tables should be in selector form, i.e. not yet
+ * finalized.
+ */
+void knn_table_merge(struct KNN_Pair **knns, struct KNN_Pair **other,
+                     int points, int k);
+
+/**
+ * Turns a table of selectors into a final result, as the one returned by
+ * knn_search(), i.e. sorts every row and takes the square root of
+ * all distances.
+ */
+void knn_table_finalize(struct KNN_Pair **knns, int points, int k);
+
+/**
+ * Sets the label of every neighbor in knns, whose index falls in the range
+ * of given labels.
+ *
+ * It is intended to be called right after a block of data has been
+ * searched, with the labels of that block, so neighbors get labeled the
+ * moment they are found and no further labeling is needed.
+ *
+ * Parameters:
+ *  -knns: A table of neighbors, either in selector or final form.
+ *  -points: The number of rows in knns.
+ *  -k: The number of neighbors in each row.
+ *  -labels: The labels of the points with indexes in
+ *          [l_offset, l_offset + l_count).
+ *  -l_offset: The index of the point labels[0] refers to.
+ *  -l_count: The number of labels.
+ */
+void knn_table_label(struct KNN_Pair **knns, int points, int k,
+                     const int *labels, int l_offset, int l_count);
+
+/**
+ * Returns the greatest distance a new neighbor should be below, to be kept by
+ * any of the selectors of a table, i.e. the greatest k-th (squared) distance.
+ * It is infinite while any selector is not yet full.
+ */
+double knn_table_worst(struct KNN_Pair **knns, int points, int k);
+
+/**
+ * Creates the bounding box of all rows of a matrix.
+ *
+ * Returns:
+ *  A box that should be destroyed by knn_bounds_destroy(), or NULL on
+ *  failure.
+ */
+struct KNN_Bounds *knn_bounds_create(matrix_t *m);
+
+/**
+ * Splits rows [start, end) of a matrix in tiles of given size and creates
+ * the bounding box of every tile.
+ *
+ * Parameters:
+ *  -m: A matrix of doubles or floats.
+ *  -start: The first row of the first tile.
+ *  -end: The row after the last row of the last tile.
+ *  -tile: The number of rows in every tile, but the last one.
+ *
+ * Returns:
+ *  An array of ceil((end - start) / tile) boxes, in the order of the tiles,
+ *  that should be destroyed by knn_bounds_destroy(), or NULL on failure.
+ */
+struct KNN_Bounds *knn_bounds_create_tiles(matrix_t *m, int start, int end,
+                                           int tile);
+
+/**
+ * Returns a lower bound of the squared distance between any point summarized
+ * by a box and any point summarized by the other.
+ *
+ * Bound is lowered by the rounding error the distance engine of the type of
+ * the boxes may introduce, so any distance computed for such points is not
+ * less than it. Thus, when bound is greater than the k-th distance of every
+ * point of both boxes, none of the distances between them can change any
+ * nearest neighbor and their computation can be skipped.
+ *
+ * Returns:
+ *  The lower bound, or INFINITY when any of the boxes is empty.
+ */
+double knn_bounds_sq_gap(const struct KNN_Bounds *a,
+                         const struct KNN_Bounds *b);
+
+/**
+ * Destroys a box, or an array of boxes, created by knn_bounds_create() or
+ * knn_bounds_create_tiles().
+ */
+void knn_bounds_destroy(struct KNN_Bounds *bounds);
+
+/**
+ * Packs the first column of a labels matrix into an array of integers.
+ *
+ * Labels are expected to be integers coded into doubles, as knn_classify()
+ * does. Packed labels take half the space, when passed around along with
+ * data blocks.
+ *
+ * Returns:
+ *  An array of matrix_get_rows(labels) integers, that should be freed by
+ *  the caller, or NULL on failure.
+ */
+int *knn_pack_labels(matrix_t *labels);
+
+/**
+ * Creates a matrix of the labels of the nearest neighbors, as set by
+ * knn_table_label(), in the form knn_labeling() returns.
+ *
+ * Parameters:
+ *  -knns: A table of labeled neighbors.
+ *  -points: The number of rows in knns.
+ *  -k: The number of neighbors in each row.
+ *
+ * Returns:
+ *  A points x k matrix that can be passed to knn_classify(), or NULL on
+ *  failure.
+ */
+matrix_t *knn_collect_labels(struct KNN_Pair **knns, int points, int k);
+
+/**
+ * Returns the KNN_PRECISION_* value of a precision name, i.e. "double",
+ * "single" or "mixed", or -1 if name is not valid.
+ */
+int knn_parse_precision(const char *name);
+
+/**
+ * Returns the name of the given KNN_PRECISION_* value.
+ */
+const char *knn_precision_name(int precision);
+
+/**
+ * Sets a function to be called periodically by knn_search(), while it
+ * computes distances.
+ *
+ * It is intended for making progress on pending communications while
+ * searching. Hook is only ever called by the thread that called knn_search()
+ * (the master thread of OpenMP parallel regions), about once per tile of
+ * distances that thread computes.
+ *
+ * Parameters:
+ *  -hook: The function to be called, or NULL to remove the current one.
+ *  -arg: An argument passed to every call of hook.
+ */
+void knn_set_progress_hook(knn_progress_fn hook, void *arg);
+
+/**
+ * Calls the hook set by knn_set_progress_hook(), if any, given that it is
+ * called by the master thread. It allows searching backends other than
+ * knn_search() to make progress on pending communications too.
+ */
+void knn_progress(void);
+
+/**
+ * Computes in double precision the squared euclidean distance between two
+ * rows, directly from their cells. Matrices can be of either type.
+ *
+ * Parameters:
+ *  -a: The matrix of the first row.
+ *  -row_a: The first row.
+ *  -b: The matrix of the second row, of the same width as a.
+ *  -row_b: The second row.
+ */
+double knn_sq_distance(matrix_t *a, int row_a, matrix_t *b, int row_b);
+
+/**
+ * Creates a dictionary of the distinct values contained in a matrix.
+ *
+ * Labels can be arbitrary integers coded into doubles, not necessarily
+ * dense or starting from any specific value. Matrix is scanned in parallel.
+ *
+ * Parameters:
+ *  -labels: A matrix of labels of any shape, e.g. the one returned by
+ *          knn_collect_labels().
+ *
+ * Returns:
+ *  A dictionary that should be destroyed by knn_label_dict_destroy(), or
+ *  NULL on failure.
+ */
+struct KNN_Label_Dict *knn_label_dict_create(matrix_t *labels);
+
+/**
+ * Returns the dense id of a label, or -1 if label is not in dictionary.
+ */
+int knn_label_dict_id(const struct KNN_Label_Dict *dict, double label);
+
+/**
+ * Destroys a dictionary created by knn_label_dict_create().
+ */
+void knn_label_dict_destroy(struct KNN_Label_Dict *dict);
+
+/**
+ * Classifies points by the majority of the labels of their nearest
+ * neighbors.
+ *
+ * Labels are mapped to dense ids once, through a struct KNN_Label_Dict, and
+ * votes are counted in parallel, into counters private to each thread.
+ * Ties are resolved towards the lowest label. Labels missing from the
+ * dictionary, like NaN, get no vote, and a point none of whose neighbors
+ * votes is classified as NaN.
+ *
+ * Parameters:
+ *  -labeled_knns: A (points x k) matrix with the labels of the nearest
+ *          neighbors of each point, as returned by knn_collect_labels() or
+ *          knn_labeling().
+ *
+ * Returns:
+ *  A (points x 1) matrix containing the classification of each point in
+ *  labeled_knns, or NULL on failure.
  */
 matrix_t *knn_classify(matrix_t *labeled_knns);
 
+/**
+ * Classifies points as knn_classify() does, though the vote of every
+ * neighbor is weighted by the inverse of its distance, i.e.
+ * 1 / (distance + KNN_VOTE_EPSILON).
+ *
+ * Votes of each point are summed in the order of its neighbors, so results
+ * are the same for any number of threads. Ties are resolved towards the
+ * lowest label.
+ *
+ * Parameters:
+ *  -labeled_knns: A (points x k) matrix with the labels of the nearest
+ *          neighbors of each point.
+ *  -knns: The nearest neighbors the labels in labeled_knns belong to, in
+ *          the same order.
+ *
+ * Returns:
+ *  A (points x 1) matrix containing the classification of each point, or
+ *  NULL on failure.
+ */
+matrix_t *knn_classify_weighted(matrix_t *labeled_knns,
+                                struct KNN_Pair **knns);
+
+/**
+ * Classifies points for every number of nearest neighbors, from 1 up to the
+ * columns of given labels matrix, at once.
+ *
+ * Columns of labeled_knns are expected to be ordered by distance, as the
+ * ones returned by knn_collect_labels(), so the first j columns are the
+ * labels of the j nearest neighbors. Votes are counted incrementally, so
+ * classifying for all of them costs the same as classifying for the last
+ * one. Ties are resolved as in knn_classify(), towards the lowest label.
+ *
+ * Parameters:
+ *  -labeled_knns: A (points x K) matrix with the labels of the nearest
+ *          neighbors of each point.
+ *  -knns: The nearest neighbors the labels belong to, for weighting votes
+ *          as knn_classify_weighted() does, or NULL for majority voting.
+ *
+ * Returns:
+ *  A (points x K) matrix, whose column j contains the classification of
+ *  each point using its j+1 nearest neighbors, or NULL on failure.
+ */
+matrix_t *knn_classify_sweep(matrix_t *labeled_knns, struct KNN_Pair **knns);
+
 /**
  * Labels points in the given table of k-Nearest-Neigbors.
  *
@@ -152,6 +628,9 @@ matrix_t *knn_labeling(struct KNN_Pair **knns, int points, int k,
 /**
  * Creates a new 2D array with KNN_Pair objects.
  *
+ * All rows are stored contiguously in a single buffer, starting at the first
+ * row, so the whole table can be copied or transferred at once.
+ *
  * Parameters:
  *  -points: The number of points that should fit in array.
  *  -k: The number of nearest neighbors each point is expected to have.
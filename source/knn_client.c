@@ -0,0 +1,166 @@
+/**
+ * knn_client.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements the main entry point of a client of knn_server, that
+ * sends the points of a .karas file for classification, using the protocol
+ * of knn_service.h, and reports the latency of its requests.
+ *
+ * Usage:
+ *  ./bin/knn_client <path_to_socket> <path_to_queries_file> \
+ *          [<path_to_labels_file>]
+ *  ./bin/knn_client <path_to_socket> --shutdown
+ *
+ *      where:
+ *          -path_to_socket : Path of the Unix domain socket server listens on.
+ *          -path_to_queries_file : Path to a .karas file containing the cords
+ *              of the points to be classified.
+ *          -[optional] path_to_labels_file : Path to a .karas file containing
+ *              the actual labels of the points, for presenting the accuracy
+ *              of classification.
+ *          -shutdown : Asks the server to stop, after serving the requests
+ *              it has already received.
+ *
+ * Points are sent in requests of KNN_CLIENT_BATCH points, or of a single
+ * point when it is not set, each one sent after the previous one has been
+ * responded. Setting KNN_CLIENT_PRINT environment variable to "1" prints the
+ * label and the indexes of the nearest neighbors of every point.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "matrix.h"
+#include "knn_service.h"
+
+
+double get_elapsed_ms(struct timeval start, struct timeval stop);
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        printf("Required args: socket_path, queries_filename | --shutdown\n");
+        exit(-1);
+    }
+
+    int fd = knn_service_connect(argv[1]);
+    if (fd < 0) exit(-1);
+
+    if (!strcmp(argv[2], "--shutdown")) {
+        int rc = knn_service_send_shutdown(fd);
+        close(fd);
+        return rc == 0 ? 0 : -1;
+    }
+
+    matrix_t *queries = matrix_load_in_chunks(argv[2], 1, 0);
+    matrix_t *labels = NULL;
+    if (argc >= 4) labels = matrix_load_in_chunks(argv[3], 1, 0);
+    if (!queries || (argc >= 4 && !labels)) {
+        printf("ERROR: Failed to load queries.\n");
+        close(fd);
+        exit(-1);
+    }
+
+    int batch = 1;
+    char *batch_name = getenv("KNN_CLIENT_BATCH");
+    if (batch_name && strcmp(batch_name, "")) batch = atoi(batch_name);
+    if (batch < 1) batch = 1;
+    char *print_name = getenv("KNN_CLIENT_PRINT");
+    int print = print_name && !strcmp(print_name, "1");
+
+    int rows = matrix_get_rows(queries);
+    int cols = matrix_get_cols(queries);
+    int requests = (rows + batch - 1) / batch;
+    double *latencies = (double *) malloc(sizeof(double) * (requests + 1));
+    int valid = 0;
+    int failed = latencies == NULL;
+
+    for (int r = 0; r < requests && !failed; r++) {
+        int offset = r * batch;
+        int count = rows - offset < batch ? rows - offset : batch;
+
+        matrix_t *request = matrix_create(count, cols);
+        if (!request) {
+            failed = 1;
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            memcpy(matrix_get_row(request, i),
+                   matrix_get_row(queries, offset + i), sizeof(double) * cols);
+        }
+
+        struct timeval start, stop;
+        int resp_rows, k;
+        int *resp_labels, *resp_indexes;
+        gettimeofday(&start, NULL);
+        failed = knn_service_send_request(fd, request) != 0 ||
+                 knn_service_recv_response(fd, &resp_rows, &k, &resp_labels,
+                                           &resp_indexes) != 0;
+        gettimeofday(&stop, NULL);
+        matrix_destroy(request);
+        if (failed) break;
+        if (resp_rows != count) {
+            printf("ERROR: Request %d failed.\n", r);
+            free(resp_labels);
+            free(resp_indexes);
+            failed = 1;
+            break;
+        }
+        latencies[r] = get_elapsed_ms(start, stop);
+
+        for (int i = 0; i < count; i++) {
+            if (labels && resp_labels[i] ==
+                          (int) matrix_get_cell(labels, offset + i, 0))
+            {
+                valid++;
+            }
+            if (print) {
+                printf("%d: %d :", offset + i, resp_labels[i]);
+                for (int j = 0; j < k; j++) {
+                    printf(" %d", resp_indexes[(size_t) i * k + j]);
+                }
+                printf("\n");
+            }
+        }
+
+        free(resp_labels);
+        free(resp_indexes);
+    }
+
+    if (failed) {
+        printf("ERROR: Failed to communicate with server.\n");
+    } else {
+        double p50 = knn_service_percentile(latencies, requests, 0.50);
+        double p99 = knn_service_percentile(latencies, requests, 0.99);
+        printf("Sent %d queries in %d requests. Latency per request: "
+               "p50 %.3f msecs, p99 %.3f msecs.\n", rows, requests, p50, p99);
+        if (labels) {
+            printf("classification accuracy: %2.1f %%\n",
+                   rows > 0 ? (double) valid / rows * 100.0 : 0.0);
+        }
+    }
+
+    close(fd);
+    free(latencies);
+    matrix_destroy(queries);
+    matrix_destroy(labels);
+
+    return failed ? -1 : 0;
+}
+
+/*
+ * Returns the elapsed time in milliseconds between the two provided
+ * timeval objects.
+ */
+double get_elapsed_ms(struct timeval start, struct timeval stop)
+{
+    double elapsed_time = (stop.tv_sec - start.tv_sec) * 1000.0;
+    elapsed_time += (stop.tv_usec - start.tv_usec) / 1000.0;
+    return elapsed_time;
+}
@@ -0,0 +1,178 @@
+/**
+ * knn_generate.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements the main entry point of a generator of synthetic
+ * datasets, written as .karas files that testing.c and knn_server can load.
+ *
+ * Points are drawn around a number of cluster centers, uniformly placed in
+ * the unit hypercube, with every coordinate following a normal distribution
+ * of GENERATE_SPREAD deviation around the one of its center. The label of a
+ * point is the index of its cluster, modulo the number of labels. Without
+ * clusters, points are uniformly placed in the unit hypercube and labels
+ * are random.
+ *
+ * The same arguments always generate the same files, on any machine.
+ *
+ * Usage:
+ *  ./bin/knn_generate <output_prefix> <points> <dimensions> \
+ *          [<clusters> [<labels> [<seed>]]]
+ *
+ *      where:
+ *          -output_prefix : Points are written to <output_prefix>.karas and
+ *              their labels to <output_prefix>_labels.karas.
+ *          -points : Number of points to be generated.
+ *          -dimensions : Number of coordinates of every point.
+ *          -[optional] clusters : Number of clusters points are drawn from,
+ *              or 0 for uniformly placed points. Defaults to
+ *              GENERATE_CLUSTERS.
+ *          -[optional] labels : Number of distinct labels. Defaults to the
+ *              number of clusters, or to GENERATE_CLUSTERS without clusters.
+ *          -[optional] seed : Seed of the pseudo-random generator. Defaults
+ *              to 1.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+
+#define GENERATE_CLUSTERS 10  // Default number of clusters.
+#define GENERATE_SPREAD 0.1   // Deviation of points around their center.
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// State of a xorshift64* pseudo-random generator.
+typedef uint64_t random_t;
+
+double random_uniform(random_t *state);
+double random_normal(random_t *state);
+int write_header(FILE *f, int32_t rows, int32_t cols);
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4) {
+        printf("Required args: output_prefix, points, dimensions "
+               "[, clusters [, labels [, seed]]]\n");
+        exit(-1);
+    }
+
+    int points = atoi(argv[2]);
+    int dims = atoi(argv[3]);
+    int clusters = argc > 4 ? atoi(argv[4]) : GENERATE_CLUSTERS;
+    int labels_num = argc > 5 ? atoi(argv[5]) :
+                     (clusters > 0 ? clusters : GENERATE_CLUSTERS);
+    unsigned long long seed = argc > 6 ? strtoull(argv[6], NULL, 10) : 1;
+    if (points < 1 || dims < 1 || clusters < 0 || labels_num < 1) {
+        printf("ERROR: Invalid arguments.\n");
+        exit(-1);
+    }
+
+    size_t prefix_len = strlen(argv[1]);
+    char *data_fn = (char *) malloc(prefix_len + 16);
+    char *labels_fn = (char *) malloc(prefix_len + 16);
+    double *centers = (double *) malloc(
+            sizeof(double) * (size_t) (clusters > 0 ? clusters : 1) * dims);
+    double *row = (double *) malloc(sizeof(double) * dims);
+    if (!data_fn || !labels_fn || !centers || !row) {
+        printf("ERROR: Failed to allocate memory.\n");
+        exit(-1);
+    }
+    sprintf(data_fn, "%s.karas", argv[1]);
+    sprintf(labels_fn, "%s_labels.karas", argv[1]);
+
+    // A zero state would only produce zeros.
+    random_t state = (random_t) seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    for (size_t i = 0; i < (size_t) clusters * dims; i++) {
+        centers[i] = random_uniform(&state);
+    }
+
+    FILE *data_f = fopen(data_fn, "wb");
+    FILE *labels_f = fopen(labels_fn, "wb");
+    int failed = !data_f || !labels_f ||
+                 write_header(data_f, points, dims) != 0 ||
+                 write_header(labels_f, points, 1) != 0;
+
+    // Points are written one by one, so any number of them fits in memory.
+    for (int p = 0; p < points && !failed; p++) {
+        double label;
+        if (clusters > 0) {
+            int c = (int) (random_uniform(&state) * clusters);
+            if (c >= clusters) c = clusters - 1;
+            const double *center = centers + (size_t) c * dims;
+            for (int d = 0; d < dims; d++) {
+                row[d] = center[d] + GENERATE_SPREAD * random_normal(&state);
+            }
+            label = c % labels_num;
+        } else {
+            for (int d = 0; d < dims; d++) row[d] = random_uniform(&state);
+            label = (int) (random_uniform(&state) * labels_num) % labels_num;
+        }
+
+        failed = fwrite(row, sizeof(double), dims, data_f) != (size_t) dims ||
+                 fwrite(&label, sizeof(double), 1, labels_f) != 1;
+    }
+
+    if (data_f && fclose(data_f) != 0) failed = 1;
+    if (labels_f && fclose(labels_f) != 0) failed = 1;
+
+    if (failed) {
+        printf("ERROR: Failed to write %s and %s.\n", data_fn, labels_fn);
+    } else {
+        printf("Generated %d points of %d dimensions in %d clusters with %d "
+               "labels: %s, %s\n", points, dims, clusters, labels_num,
+               data_fn, labels_fn);
+    }
+
+    free(data_fn);
+    free(labels_fn);
+    free(centers);
+    free(row);
+
+    return failed ? -1 : 0;
+}
+
+/**
+ * Returns a pseudo-random number uniformly distributed in [0, 1).
+ */
+double random_uniform(random_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    uint64_t x = *state * 0x2545F4914F6CDD1DULL;
+    // The top 53 bits fill the mantissa of a double.
+    return (double) (x >> 11) / 9007199254740992.0;
+}
+
+/**
+ * Returns a pseudo-random number following the standard normal distribution,
+ * using the Box-Muller transform.
+ */
+double random_normal(random_t *state)
+{
+    double u1 = 1.0 - random_uniform(state);  // In (0, 1], so log() is finite.
+    double u2 = random_uniform(state);
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+/**
+ * Writes the header of a .karas file for a matrix of given shape.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int write_header(FILE *f, int32_t rows, int32_t cols)
+{
+    int32_t header[2] = { rows, cols };
+    return fwrite(header, sizeof(int32_t), 2, f) == 2 ? 0 : -1;
+}
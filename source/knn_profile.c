@@ -0,0 +1,363 @@
+/**
+ * knn_profile.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * knn_profile.c provides an implementation for routines defined in
+ * knn_profile.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L  // For getrusage().
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include <mpi.h>
+#include "knn_profile.h"
+
+
+#ifndef MPI_MASTER
+#define MPI_MASTER 0  // The task reports are written by.
+#endif
+
+// Greatest length of the name of a ring.
+#define KNN_PROFILE_NAME_LEN 32
+
+// Values recorded for every step: times of phases followed by counters.
+#define KNN_PROFILE_VALUES (KNN_PHASES + KNN_COUNTERS)
+
+// Records of a ring.
+struct Profile_Ring {
+    char name[KNN_PROFILE_NAME_LEN];
+    int steps;
+    double *values;  // steps x KNN_PROFILE_VALUES values.
+};
+
+static const char *phase_names[KNN_PHASES] = {
+    "search", "distance", "topk", "merge", "labeling",
+    "serialize", "wait", "deserialize", "step"
+};
+static const char *counter_names[KNN_COUNTERS] = {
+    "bytes_sent", "flops", "candidates", "distances"
+};
+
+static struct Profile_Ring *rings = NULL;
+static int rings_num = 0;
+static int current_ring = -1;  // Index of current ring, or -1.
+static int current_step = 0;
+static double step_start = 0.0;  // Time current step began.
+
+static void _add_value(int value, double n);
+static void _end_step(void);
+static const char *_value_name(int value);
+static void _write_stats(FILE *file, int csv, int ring, const char *name,
+                         const char *step, const char *metric, double min,
+                         double max, double sum, int tasks_num);
+
+
+int knn_profile_enabled(void)
+{
+#ifdef KNN_PROFILE
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+double knn_profile_now(void)
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+void knn_profile_begin_ring(const char *name, int steps)
+{
+    _end_step();
+    current_ring = -1;
+    if (steps < 1) return;
+
+    struct Profile_Ring *grown = (struct Profile_Ring *) realloc(
+            rings, sizeof(struct Profile_Ring) * (rings_num + 1));
+    if (!grown) {
+        printf("ERROR: knn_profile_begin_ring : Failed to allocate memory.\n");
+        return;
+    }
+    rings = grown;
+
+    struct Profile_Ring *ring = &rings[rings_num];
+    ring->values = (double *) calloc((size_t) steps * KNN_PROFILE_VALUES,
+                                     sizeof(double));
+    if (!ring->values) {
+        printf("ERROR: knn_profile_begin_ring : Failed to allocate memory.\n");
+        return;
+    }
+    strncpy(ring->name, name, KNN_PROFILE_NAME_LEN - 1);
+    ring->name[KNN_PROFILE_NAME_LEN - 1] = '\0';
+    ring->steps = steps;
+
+    current_ring = rings_num++;
+    current_step = 0;
+    step_start = knn_profile_now();
+}
+
+void knn_profile_step(int step)
+{
+    if (current_ring < 0) return;
+    if (step < 0 || step >= rings[current_ring].steps) return;
+
+    // Elapsed time of a step lasts until the next one begins.
+    if (step != current_step) {
+        _end_step();
+        current_step = step;
+        step_start = knn_profile_now();
+    }
+}
+
+void knn_profile_end_ring(void)
+{
+    _end_step();
+    current_ring = -1;
+}
+
+void knn_profile_add_time(int phase, double seconds)
+{
+    _add_value(phase, seconds);
+}
+
+void knn_profile_add_count(int counter, double n)
+{
+    _add_value(KNN_PHASES + counter, n);
+}
+
+void knn_profile_reset(void)
+{
+    for (int r = 0; r < rings_num; r++) free(rings[r].values);
+    free(rings);
+    rings = NULL;
+    rings_num = 0;
+    current_ring = -1;
+}
+
+int knn_profile_write(const char *path)
+{
+    int rank, tasks_num;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &tasks_num);
+
+    if (!knn_profile_enabled()) {
+        if (rank == MPI_MASTER) {
+            printf("ERROR: knn_profile_write : Profiling has not been "
+                   "compiled in (build with PROFILE=1).\n");
+        }
+        return -1;
+    }
+
+    // Every ring gets one more row, with the sums of its steps, so whole
+    // rings are compared between processes too.
+    int rows = 0;
+    for (int r = 0; r < rings_num; r++) rows += rings[r].steps + 1;
+
+    // Records are reduced value by value, so all processes should have
+    // recorded the same rings.
+    int layout[2] = { rings_num, rows };
+    int min_layout[2], max_layout[2];
+    MPI_Allreduce(layout, min_layout, 2, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(layout, max_layout, 2, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (min_layout[0] != max_layout[0] || min_layout[1] != max_layout[1]) {
+        if (rank == MPI_MASTER) {
+            printf("ERROR: knn_profile_write : Processes recorded different "
+                   "rings.\n");
+        }
+        return -1;
+    }
+
+    // Memory high-water mark of the process follows the rings.
+    size_t count = (size_t) rows * KNN_PROFILE_VALUES + 1;
+    double *local = (double *) calloc(count + 1, sizeof(double));
+    double *mins = (double *) malloc(sizeof(double) * (count + 1));
+    double *maxs = (double *) malloc(sizeof(double) * (count + 1));
+    double *sums = (double *) malloc(sizeof(double) * (count + 1));
+    int failed = !local || !mins || !maxs || !sums;
+    int any_failed;
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (any_failed) {
+        if (rank == MPI_MASTER) {
+            printf("ERROR: knn_profile_write : Failed to allocate memory.\n");
+        }
+        free(local);
+        free(mins);
+        free(maxs);
+        free(sums);
+        return -1;
+    }
+
+    double *row = local;
+    for (int r = 0; r < rings_num; r++) {
+        double *total = row + (size_t) rings[r].steps * KNN_PROFILE_VALUES;
+        for (int s = 0; s < rings[r].steps; s++) {
+            for (int v = 0; v < KNN_PROFILE_VALUES; v++) {
+                row[v] = rings[r].values[s * KNN_PROFILE_VALUES + v];
+                total[v] += row[v];
+            }
+            row += KNN_PROFILE_VALUES;
+        }
+        row += KNN_PROFILE_VALUES;
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) *row = (double) usage.ru_maxrss;
+
+    MPI_Reduce(local, mins, (int) count, MPI_DOUBLE, MPI_MIN, MPI_MASTER,
+               MPI_COMM_WORLD);
+    MPI_Reduce(local, maxs, (int) count, MPI_DOUBLE, MPI_MAX, MPI_MASTER,
+               MPI_COMM_WORLD);
+    MPI_Reduce(local, sums, (int) count, MPI_DOUBLE, MPI_SUM, MPI_MASTER,
+               MPI_COMM_WORLD);
+
+    int rc = 0;
+    if (rank == MPI_MASTER) {
+        size_t len = strlen(path);
+        int csv = len >= 4 && !strcmp(path + len - 4, ".csv");
+
+        FILE *file = fopen(path, "w");
+        if (!file) {
+            printf("ERROR: knn_profile_write : Failed to open %s.\n", path);
+            rc = -1;
+        }
+        else {
+            if (csv) {
+                fprintf(file, "ring,name,step,metric,min,max,mean,"
+                              "imbalance\n");
+            } else {
+                fprintf(file, "{\n  \"processes\": %d,\n  ", tasks_num);
+            }
+            _write_stats(file, csv, -1, "process", "total", "max_rss_kb",
+                         mins[count - 1], maxs[count - 1], sums[count - 1],
+                         tasks_num);
+            if (!csv) fprintf(file, ",\n  \"rings\": [");
+
+            size_t offset = 0;
+            for (int r = 0; r < rings_num; r++) {
+                if (!csv) {
+                    fprintf(file, "%s\n    {\n      \"name\": \"%s\",\n"
+                                  "      \"steps\": [", r > 0 ? "," : "",
+                            rings[r].name);
+                }
+
+                // Steps are followed by the row of the whole ring.
+                for (int s = 0; s <= rings[r].steps; s++) {
+                    char step[16];
+                    if (s < rings[r].steps) sprintf(step, "%d", s);
+                    else strcpy(step, "total");
+
+                    if (!csv) {
+                        if (s < rings[r].steps) {
+                            fprintf(file, "%s\n        {\n          "
+                                          "\"step\": %d", s > 0 ? "," : "", s);
+                        } else {
+                            fprintf(file, "\n      ],\n      \"total\": {");
+                        }
+                    }
+                    for (int v = 0; v < KNN_PROFILE_VALUES; v++) {
+                        if (!csv) {
+                            fprintf(file, "%s\n%s",
+                                    s < rings[r].steps || v > 0 ? "," : "",
+                                    s < rings[r].steps ? "          "
+                                                       : "        ");
+                        }
+                        _write_stats(file, csv, r, rings[r].name, step,
+                                     _value_name(v), mins[offset + v],
+                                     maxs[offset + v], sums[offset + v],
+                                     tasks_num);
+                    }
+                    if (!csv) {
+                        fprintf(file, s < rings[r].steps ? "\n        }"
+                                                         : "\n      }");
+                    }
+                    offset += KNN_PROFILE_VALUES;
+                }
+
+                if (!csv) fprintf(file, "\n    }");
+            }
+
+            if (!csv) fprintf(file, "\n  ]\n}\n");
+            if (fclose(file) != 0) rc = -1;
+        }
+    }
+    MPI_Bcast(&rc, 1, MPI_INT, MPI_MASTER, MPI_COMM_WORLD);
+
+    free(local);
+    free(mins);
+    free(maxs);
+    free(sums);
+
+    return rc;
+}
+
+/**
+ * Adds to a value of current step, unless no ring is current.
+ *
+ * Parameters:
+ *  -value: The position of the value in the records of a step, i.e. a
+ *          phase or KNN_PHASES plus a counter.
+ *  -n: The amount to add.
+ */
+static void _add_value(int value, double n)
+{
+    if (current_ring < 0) return;
+
+    double *slot = &rings[current_ring].values[
+            current_step * KNN_PROFILE_VALUES + value];
+    #pragma omp atomic
+    *slot += n;
+}
+
+/**
+ * Adds the time elapsed since current step began to it, unless no ring is
+ * current.
+ */
+static void _end_step(void)
+{
+    if (current_ring < 0) return;
+    _add_value(KNN_PHASE_STEP, knn_profile_now() - step_start);
+}
+
+/**
+ * Returns the name of a value of the records of a step.
+ */
+static const char *_value_name(int value)
+{
+    if (value < KNN_PHASES) return phase_names[value];
+    return counter_names[value - KNN_PHASES];
+}
+
+/**
+ * Writes the statistics of a metric over all processes, as a line of CSV
+ * or as a member of a JSON object. Metrics of the whole process belong to
+ * ring -1.
+ */
+static void _write_stats(FILE *file, int csv, int ring, const char *name,
+                         const char *step, const char *metric, double min,
+                         double max, double sum, int tasks_num)
+{
+    double mean = sum / tasks_num;
+    double imbalance = mean > 0.0 ? max / mean : 1.0;
+
+    if (csv) {
+        fprintf(file, "%d,%s,%s,%s,%.9g,%.9g,%.9g,%.4f\n", ring, name, step,
+                metric, min, max, mean, imbalance);
+    } else {
+        fprintf(file, "\"%s\": { \"min\": %.9g, \"max\": %.9g, "
+                      "\"mean\": %.9g, \"imbalance\": %.4f }",
+                metric, min, max, mean, imbalance);
+    }
+}
@@ -0,0 +1,173 @@
+/**
+ * knn_profile.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * knn_profile.h defines lightweight timers and counters for the phases of
+ * distributed knn search and labeling, recorded for every ring step of every
+ * process and reported by MPI_MASTER.
+ *
+ * Records are grouped in rings, one for every call of a ring driver, e.g.
+ * knn_search_distributed(), which is split into the steps of the ring.
+ * Anything recorded outside of a ring is ignored.
+ *
+ * Profiling is compiled in only when KNN_PROFILE is defined at build time
+ * (make all PROFILE=1). Otherwise, the KNN_PROFILE_* macros used for
+ * recording expand to nothing, so they cost nothing.
+ *
+ * Time of phases recorded from within OpenMP regions (distance and top-k) is
+ * summed over all threads, so it may exceed wall clock time. The wall clock
+ * time of every step is recorded as a phase of its own.
+ *
+ * Macros defined in knn_profile.h:
+ *  -KNN_PHASE_SEARCH
+ *  -KNN_PHASE_DISTANCE
+ *  -KNN_PHASE_TOPK
+ *  -KNN_PHASE_MERGE
+ *  -KNN_PHASE_LABELING
+ *  -KNN_PHASE_SERIALIZE
+ *  -KNN_PHASE_WAIT
+ *  -KNN_PHASE_DESERIALIZE
+ *  -KNN_PHASE_STEP
+ *  -KNN_PHASES
+ *  -KNN_COUNTER_BYTES_SENT
+ *  -KNN_COUNTER_FLOPS
+ *  -KNN_COUNTER_CANDIDATES
+ *  -KNN_COUNTER_DISTANCES
+ *  -KNN_COUNTERS
+ *  -KNN_PROFILE_START(timer)
+ *  -KNN_PROFILE_STOP(timer, phase)
+ *  -KNN_PROFILE_COUNT(counter, n)
+ *  -KNN_PROFILE_BEGIN_RING(name, steps)
+ *  -KNN_PROFILE_STEP(step)
+ *  -KNN_PROFILE_END_RING()
+ *
+ * Functions defined in knn_profile.h:
+ *  -int knn_profile_enabled(void)
+ *  -double knn_profile_now(void)
+ *  -void knn_profile_begin_ring(const char *name, int steps)
+ *  -void knn_profile_step(int step)
+ *  -void knn_profile_end_ring(void)
+ *  -void knn_profile_add_time(int phase, double seconds)
+ *  -void knn_profile_add_count(int counter, double n)
+ *  -void knn_profile_reset(void)
+ *  -int knn_profile_write(const char *path)
+ */
+
+#ifndef __knn_profile_h__
+#define __knn_profile_h__
+
+
+// Phases time is recorded for.
+#define KNN_PHASE_SEARCH 0       // Local searches of a ring step.
+#define KNN_PHASE_DISTANCE 1     // Computing tiles of distances.
+#define KNN_PHASE_TOPK 2         // Offering candidates to top-k selectors.
+#define KNN_PHASE_MERGE 3        // Merging tables of neighbors.
+#define KNN_PHASE_LABELING 4     // Labeling neighbors.
+#define KNN_PHASE_SERIALIZE 5    // Describing and posting outgoing data.
+#define KNN_PHASE_WAIT 6         // Waiting for transfers to complete.
+#define KNN_PHASE_DESERIALIZE 7  // Shaping received data.
+#define KNN_PHASE_STEP 8         // Whole step, in wall clock time.
+#define KNN_PHASES 9
+
+// Counters of work done.
+#define KNN_COUNTER_BYTES_SENT 0   // Bytes sent to other processes.
+#define KNN_COUNTER_FLOPS 1        // Floating point operations of distances.
+#define KNN_COUNTER_CANDIDATES 2   // Candidates offered to top-k selectors.
+#define KNN_COUNTER_DISTANCES 3    // Distances computed.
+#define KNN_COUNTERS 4
+
+#ifdef KNN_PROFILE
+#define KNN_PROFILE_START(timer) double timer = knn_profile_now()
+#define KNN_PROFILE_STOP(timer, phase) \
+        knn_profile_add_time(phase, knn_profile_now() - (timer))
+#define KNN_PROFILE_COUNT(counter, n) knn_profile_add_count(counter, n)
+#define KNN_PROFILE_BEGIN_RING(name, steps) knn_profile_begin_ring(name, steps)
+#define KNN_PROFILE_STEP(step) knn_profile_step(step)
+#define KNN_PROFILE_END_RING() knn_profile_end_ring()
+#else
+#define KNN_PROFILE_START(timer)
+#define KNN_PROFILE_STOP(timer, phase)
+#define KNN_PROFILE_COUNT(counter, n)
+#define KNN_PROFILE_BEGIN_RING(name, steps)
+#define KNN_PROFILE_STEP(step)
+#define KNN_PROFILE_END_RING()
+#endif
+
+/**
+ * Returns 1 if profiling has been compiled in, else 0.
+ */
+int knn_profile_enabled(void);
+
+/**
+ * Returns the current time in seconds, from an arbitrary point in the past.
+ */
+double knn_profile_now(void);
+
+/**
+ * Starts a new ring, in which following records are stored, beginning on
+ * its first step. It should be called by all processes, out of any
+ * OpenMP region.
+ *
+ * Parameters:
+ *  -name: The name of the ring in reports, e.g. "search".
+ *  -steps: The number of steps of the ring.
+ */
+void knn_profile_begin_ring(const char *name, int steps);
+
+/**
+ * Stores following records in the given step of current ring, which lasts
+ * until next step begins or the ring ends. It should be called out of any
+ * OpenMP region.
+ */
+void knn_profile_step(int step);
+
+/**
+ * Ends current ring, so following records are ignored.
+ */
+void knn_profile_end_ring(void);
+
+/**
+ * Adds time to a phase of current step. It may be called by many threads
+ * at once.
+ *
+ * Parameters:
+ *  -phase: One of KNN_PHASE_* values.
+ *  -seconds: The time to add.
+ */
+void knn_profile_add_time(int phase, double seconds);
+
+/**
+ * Adds to a counter of current step. It may be called by many threads at
+ * once.
+ *
+ * Parameters:
+ *  -counter: One of KNN_COUNTER_* values.
+ *  -n: The amount to add.
+ */
+void knn_profile_add_count(int counter, double n);
+
+/**
+ * Discards all recorded rings.
+ */
+void knn_profile_reset(void);
+
+/**
+ * Gathers the records of all processes to MPI_MASTER, which writes the
+ * minimum, maximum, mean and imbalance (maximum over mean) of every phase
+ * and counter, for every step of every ring and for whole rings, along with
+ * the memory high-water mark of the processes, in kilobytes. It should be
+ * called by all processes.
+ *
+ * Parameters:
+ *  -path: The file to write. A path ending in ".csv" is written as CSV,
+ *          anything else as JSON.
+ *
+ * Returns:
+ *  0 on success, -1 on failure, or when profiling has not been compiled in.
+ */
+int knn_profile_write(const char *path);
+
+#endif
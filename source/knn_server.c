@@ -0,0 +1,688 @@
+/**
+ * knn_server.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements the main entry point of a long running knn server,
+ * that classifies query points sent by clients over a Unix domain socket,
+ * using the protocol of knn_service.h.
+ *
+ * Reference points and their labels are loaded once, divided among the
+ * processes of MPI_COMM_WORLD, and prepared by knn_reference_create(). So,
+ * startup cost is only paid once, instead of once for every classification.
+ *
+ * Only MPI_MASTER listens on the socket. Requests that arrive close in time,
+ * from any number of clients, are coalesced into a micro-batch, until it
+ * holds enough queries to keep the OpenMP threads of all processes busy,
+ * or until the first one has waited for KNN_SERVER_WAIT milliseconds. Every
+ * micro-batch is scattered to all processes and searched with
+ * knn_query_distributed(). The label and the indexes of the nearest
+ * neighbors of every query are then gathered back to MPI_MASTER and
+ * returned to the client that sent it.
+ *
+ * The latency of every micro-batch, from the arrival of its first request
+ * to the response to its last one, is kept. Its median (p50) and 99th
+ * percentile (p99) are printed every KNN_SERVER_REPORT micro-batches and
+ * when the server stops.
+ *
+ * Usage:
+ *  mpirun -np <procs_num> ./bin/knn_server <path_to_socket> \
+ *          <path_to_data_file> <path_to_labels_file> <k>
+ *
+ *      where:
+ *          -procs_num : Number of processes to be spawned.
+ *          -path_to_socket : Path of the Unix domain socket to listen on.
+ *          -path_to_data_file : Path to a .karas file containing the cords
+ *              of the reference points.
+ *          -path_to_labels_file : Path to a .karas file containing the
+ *              labels of the reference points.
+ *          -k : The number of k-nearest-neighbors to be used for
+ *              classification.
+ *
+ * The server stops when a client sends a request of shutdown (see knn_client
+ * with --shutdown).
+ *
+ * KNN_PRECISION, KNN_BACKEND, KNN_TOLERANCE, KNN_TRANSPORT, KNN_NODE_SHARING,
+ * MATRIX_LOADER and KNN_VOTING environment variables are used in the same way
+ * as in testing.c. Also:
+ *  -KNN_SERVER_BATCH: The number of queries a micro-batch is filled up to.
+ *      When not set, KNN_SERVER_ROWS_PER_THREAD queries for every OpenMP
+ *      thread of every process are used.
+ *  -KNN_SERVER_WAIT: The greatest number of milliseconds a request waits
+ *      for others to join its micro-batch. Defaults to KNN_SERVER_WAIT_MS.
+ *  -KNN_SERVER_REPORT: The number of micro-batches between reports of
+ *      latency. 0 reports only on stopping. Defaults to
+ *      KNN_SERVER_REPORT_BATCHES.
+ */
+
+#define _POSIX_C_SOURCE 200809L  // For poll() and sigaction().
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <mpi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "knn.h"
+#include "knn_tree.h"
+#include "knn_service.h"
+#include "knn_transport.h"
+#include "matrix.h"
+#include "matrix_mpi.h"
+#include "distributed_knn.h"
+
+
+// Queries a micro-batch is filled up to for every thread, unless
+// KNN_SERVER_BATCH is set.
+#ifndef KNN_SERVER_ROWS_PER_THREAD
+#define KNN_SERVER_ROWS_PER_THREAD 64
+#endif
+
+// Default milliseconds a request waits for others to join its micro-batch.
+#ifndef KNN_SERVER_WAIT_MS
+#define KNN_SERVER_WAIT_MS 2
+#endif
+
+// Default micro-batches between reports of latency.
+#ifndef KNN_SERVER_REPORT_BATCHES
+#define KNN_SERVER_REPORT_BATCHES 100
+#endif
+
+// A request waiting in a micro-batch.
+struct Pending_Request {
+    int fd;              // Connection to respond to.
+    matrix_t *queries;   // Points of the request.
+};
+
+// A micro-batch of requests, along with the connections of the clients.
+struct Micro_Batch {
+    struct Pending_Request *requests;
+    int count;           // Requests in the micro-batch.
+    int capacity;        // Requests that fit in requests array.
+    int rows;            // Queries of all requests.
+    struct timeval first_arrival;
+    struct pollfd *fds;  // Listening socket, followed by clients.
+    int fds_count;
+    int fds_capacity;
+    int stop;            // Set when a client asks the server to stop.
+};
+
+
+int collect_batch(struct Micro_Batch *batch, int target, int wait_ms,
+                  int cols);
+int serve_batch(struct Micro_Batch *batch, struct KNN_Reference *reference,
+                int k, int weighted, int cols, int prev_task, int next_task,
+                int tasks_num, int rank);
+int add_client(struct Micro_Batch *batch, int fd);
+void remove_client(struct Micro_Batch *batch, int index);
+int add_request(struct Micro_Batch *batch, int fd, matrix_t *queries);
+void report_latency(double *latencies, int count, long queries);
+double get_elapsed_ms(struct timeval start, struct timeval stop);
+int read_env_int(const char *name, int fallback);
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 5) {
+        printf("Required args: socket_path, data_filename, labels_filename, "
+               "k\n");
+        exit(-1);
+    }
+
+    char *socket_path = argv[1];
+    char *data_fn = argv[2];
+    char *labels_fn = argv[3];
+    int k = atoi(argv[4]);
+
+    int tasks_num;
+    int rank;
+    int next_task;
+    int prev_task;
+
+    struct timeval start, stop;
+
+    int precision = KNN_PRECISION_DEFAULT;
+    char *precision_name = getenv("KNN_PRECISION");
+    if (precision_name && strcmp(precision_name, "")) {
+        precision = knn_parse_precision(precision_name);
+        if (precision < 0) {
+            printf("Invalid KNN_PRECISION: %s\n", precision_name);
+            exit(-1);
+        }
+    }
+
+    int backend = KNN_BACKEND_DEFAULT;
+    char *backend_name = getenv("KNN_BACKEND");
+    if (backend_name && strcmp(backend_name, "")) {
+        backend = knn_parse_backend(backend_name);
+        if (backend < 0) {
+            printf("Invalid KNN_BACKEND: %s\n", backend_name);
+            exit(-1);
+        }
+    }
+    double tolerance = 0.0;
+    char *tolerance_name = getenv("KNN_TOLERANCE");
+    if (tolerance_name && strcmp(tolerance_name, "")) {
+        tolerance = atof(tolerance_name);
+        if (tolerance < 0.0) {
+            printf("Invalid KNN_TOLERANCE: %s\n", tolerance_name);
+            exit(-1);
+        }
+    }
+    knn_set_search_backend(backend, tolerance);
+
+    int transport = KNN_TRANSPORT_DEFAULT;
+    char *transport_name = getenv("KNN_TRANSPORT");
+    if (transport_name && strcmp(transport_name, "")) {
+        transport = knn_parse_transport(transport_name);
+        if (transport < 0) {
+            printf("Invalid KNN_TRANSPORT: %s\n", transport_name);
+            exit(-1);
+        }
+    }
+    knn_set_transport(transport);
+
+    char *sharing_name = getenv("KNN_NODE_SHARING");
+    knn_set_node_sharing(sharing_name && strcmp(sharing_name, "") &&
+                         strcmp(sharing_name, "0"));
+
+    int weighted = 0;
+    char *voting_name = getenv("KNN_VOTING");
+    if (voting_name && strcmp(voting_name, "")) {
+        if (!strcmp(voting_name, "weighted")) weighted = 1;
+        else if (strcmp(voting_name, "majority")) {
+            printf("Invalid KNN_VOTING: %s\n", voting_name);
+            exit(-1);
+        }
+    }
+
+    int wait_ms = read_env_int("KNN_SERVER_WAIT", KNN_SERVER_WAIT_MS);
+    int report_every = read_env_int("KNN_SERVER_REPORT",
+                                    KNN_SERVER_REPORT_BATCHES);
+
+    int thread_level;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_level);
+    MPI_Comm_size(MPI_COMM_WORLD, &tasks_num);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    next_task = rank + 1;
+    prev_task = rank - 1;
+    if (rank == tasks_num - 1) next_task = 0;
+    if (rank == 0) prev_task = tasks_num - 1;
+
+    // Startup: reference points are loaded and prepared once.
+    MPI_Barrier(MPI_COMM_WORLD);
+    gettimeofday(&start, NULL);
+    int loader = matrix_select_loader(MPI_COMM_WORLD);
+    matrix_t *data = matrix_load_distributed(data_fn, loader, MPI_COMM_WORLD);
+    matrix_t *labels = matrix_load_distributed(labels_fn, loader,
+                                               MPI_COMM_WORLD);
+    struct KNN_Reference *reference = NULL;
+    if (data && labels) {
+        reference = knn_reference_create(data, labels, precision);
+    }
+    int failed = reference == NULL;
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (failed) {
+        printf("ERROR: Failed to load reference points in task %d.\n", rank);
+        knn_reference_destroy(reference);
+        matrix_destroy(data);
+        matrix_destroy(labels);
+        MPI_Finalize();
+        exit(-1);
+    }
+    int cols = matrix_get_cols(data);
+
+    // Enough queries for every thread of every process.
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    int all_threads;
+    MPI_Allreduce(&threads, &all_threads, 1, MPI_INT, MPI_SUM,
+                  MPI_COMM_WORLD);
+    int target = read_env_int("KNN_SERVER_BATCH",
+                              all_threads * KNN_SERVER_ROWS_PER_THREAD);
+    if (target < 1) target = 1;
+
+    struct Micro_Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    if (rank == MPI_MASTER) {
+        // A client leaving early should not terminate the server.
+        struct sigaction ignore;
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &ignore, NULL);
+
+        int listener = knn_service_listen(socket_path);
+        failed = listener < 0 || add_client(&batch, listener) != 0;
+    }
+    MPI_Bcast(&failed, 1, MPI_INT, MPI_MASTER, MPI_COMM_WORLD);
+
+    gettimeofday(&stop, NULL);
+    if (rank == MPI_MASTER && !failed) {
+        printf("Server started using %d processes in %s precision with %s "
+               "backend over %s transport in %.2f secs. Listening on %s, "
+               "micro-batches of %d queries.\n", tasks_num,
+               knn_precision_name(precision), knn_backend_name(backend),
+               knn_transport_name(transport),
+               get_elapsed_ms(start, stop) / 1000.0, socket_path, target);
+        fflush(stdout);
+    }
+
+    double *latencies = NULL;  // Latency of every micro-batch, in msecs.
+    int latencies_capacity = 0;
+    int batches = 0;
+    long queries = 0;
+
+    while (!failed) {
+        // The number of queries of next micro-batch, or -1 for stopping.
+        int command = -1;
+        if (rank == MPI_MASTER) {
+            if (collect_batch(&batch, target, wait_ms, cols) != 0) {
+                batch.stop = 1;
+            }
+            if (batch.count > 0) command = batch.rows;
+        }
+        MPI_Bcast(&command, 1, MPI_INT, MPI_MASTER, MPI_COMM_WORLD);
+        if (command < 0) break;
+
+        serve_batch(&batch, reference, k, weighted, cols, prev_task,
+                    next_task, tasks_num, rank);
+
+        if (rank == MPI_MASTER) {
+            gettimeofday(&stop, NULL);
+            if (batches == latencies_capacity) {
+                int capacity = latencies_capacity ?
+                               2 * latencies_capacity : 1024;
+                double *grown = (double *) realloc(
+                        latencies, sizeof(double) * capacity);
+                if (grown) {
+                    latencies = grown;
+                    latencies_capacity = capacity;
+                }
+            }
+            // When no more memory is available, latencies of the batches
+            // that do not fit are not recorded, but they are still served.
+            if (batches < latencies_capacity) {
+                latencies[batches] = get_elapsed_ms(batch.first_arrival,
+                                                    stop);
+                batches++;
+                if (report_every > 0 && batches % report_every == 0) {
+                    report_latency(latencies, batches, queries + command);
+                }
+            }
+            queries += command;
+
+            // Requests of a shutdown are served before stopping.
+            if (batch.stop) {
+                command = -1;
+                MPI_Bcast(&command, 1, MPI_INT, MPI_MASTER, MPI_COMM_WORLD);
+                break;
+            }
+        }
+    }
+
+    if (rank == MPI_MASTER) {
+        if (!failed) report_latency(latencies, batches, queries);
+        for (int i = 0; i < batch.fds_count; i++) close(batch.fds[i].fd);
+        if (batch.fds_count > 0) unlink(socket_path);
+        free(batch.fds);
+        free(batch.requests);
+        free(latencies);
+    }
+
+    knn_reference_destroy(reference);
+    matrix_destroy(data);
+    matrix_destroy(labels);
+
+    MPI_Finalize();
+
+    return failed ? -1 : 0;
+}
+
+/**
+ * Waits for requests to arrive and places them into a micro-batch.
+ *
+ * It blocks until a first request arrives. Then, it keeps collecting requests
+ * until the micro-batch contains at least target queries, or until wait_ms
+ * milliseconds have passed since the arrival of the first one. New
+ * connections are accepted while waiting.
+ *
+ * Parameters:
+ *  -batch : The micro-batch, that should contain no requests.
+ *  -target : The number of queries the micro-batch is filled up to.
+ *  -wait_ms : The greatest number of milliseconds to wait after the arrival
+ *          of the first request.
+ *  -cols : The number of coordinates of the reference points. Requests with
+ *          points of another width are responded with an error, instead of
+ *          being placed into the micro-batch.
+ *
+ * Returns:
+ *  0 on success, -1 on failure of the listening socket.
+ */
+int collect_batch(struct Micro_Batch *batch, int target, int wait_ms,
+                  int cols)
+{
+    int timeout = -1;  // Block until the first request.
+
+    while (!batch->stop && batch->rows < target) {
+        if (batch->count > 0) {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            timeout = wait_ms - (int) get_elapsed_ms(batch->first_arrival,
+                                                     now);
+            if (timeout <= 0) break;
+        }
+
+        int ready = poll(batch->fds, batch->fds_count, timeout);
+        if (ready == 0) break;
+        if (ready < 0) continue;  // Interrupted by a signal.
+
+        // Clients are visited backwards, so removing one does not move the
+        // ones left to be visited.
+        for (int i = batch->fds_count - 1; i > 0; i--) {
+            if (!batch->fds[i].revents) continue;
+
+            matrix_t *queries;
+            int fd = batch->fds[i].fd;
+            if (knn_service_recv_request(fd, &queries) != 0) {
+                remove_client(batch, i);
+            }
+            else if (!queries) batch->stop = 1;
+            else if (matrix_get_cols(queries) != cols ||
+                     add_request(batch, fd, queries) != 0)
+            {
+                matrix_destroy(queries);
+                knn_service_send_response(fd, KNN_SERVICE_ERROR, 0,
+                                          NULL, NULL);
+            }
+        }
+
+        if (batch->fds[0].revents & POLLIN) {
+            int client = accept(batch->fds[0].fd, NULL, NULL);
+            if (client >= 0 && add_client(batch, client) != 0) close(client);
+        }
+        else if (batch->fds[0].revents) return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Searches the queries of a micro-batch on all processes and responds to
+ * its requests.
+ *
+ * Queries are scattered as evenly as possible across processes, so each
+ * one searches its share against the reference points of all processes
+ * by knn_query_distributed(). The results are gathered back to MPI_MASTER.
+ *
+ * It should be called by all processes in MPI_COMM_WORLD, though only the
+ * micro-batch of MPI_MASTER is used. After it returns, the micro-batch of
+ * MPI_MASTER contains no requests.
+ *
+ * Returns:
+ *  0 on success, -1 on failure. Requests are responded with an error on
+ *  failure.
+ */
+int serve_batch(struct Micro_Batch *batch, struct KNN_Reference *reference,
+                int k, int weighted, int cols, int prev_task, int next_task,
+                int tasks_num, int rank)
+{
+    int total_rows = batch->rows;
+    MPI_Bcast(&total_rows, 1, MPI_INT, MPI_MASTER, MPI_COMM_WORLD);
+
+    // Queries travel packed, without the padding of matrix rows.
+    int *counts = (int *) malloc(sizeof(int) * tasks_num);
+    int *displs = (int *) malloc(sizeof(int) * tasks_num);
+    for (int t = 0; t < tasks_num; t++) {
+        int32_t offset, rows;
+        matrix_chunk_bounds(total_rows, tasks_num, t, &offset, &rows);
+        counts[t] = rows;
+        displs[t] = offset;
+    }
+    int local_rows = counts[rank];
+    int local_offset = displs[rank];
+
+    double *packed = NULL;
+    if (rank == MPI_MASTER) {
+        packed = (double *) malloc(sizeof(double) *
+                                   ((size_t) total_rows * cols + 1));
+        size_t row = 0;
+        for (int r = 0; packed && r < batch->count; r++) {
+            matrix_t *queries = batch->requests[r].queries;
+            for (int i = 0; i < matrix_get_rows(queries); i++, row++) {
+                memcpy(packed + row * cols, matrix_get_row(queries, i),
+                       sizeof(double) * cols);
+            }
+        }
+    }
+    double *local_packed = (double *) malloc(
+            sizeof(double) * ((size_t) local_rows * cols + 1));
+    matrix_t *local_queries = matrix_create(local_rows, cols);
+
+    int failed = local_packed == NULL || local_queries == NULL ||
+                 (rank == MPI_MASTER && packed == NULL);
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+
+    struct KNN_Pair **knns = NULL;
+    int *local_results = NULL;  // Label, followed by k indexes, per query.
+    int *results = NULL;
+    if (!failed) {
+        for (int t = 0; t < tasks_num; t++) {
+            counts[t] *= cols;
+            displs[t] *= cols;
+        }
+        MPI_Scatterv(packed, counts, displs, MPI_DOUBLE, local_packed,
+                     local_rows * cols, MPI_DOUBLE, MPI_MASTER,
+                     MPI_COMM_WORLD);
+        for (int i = 0; i < local_rows; i++) {
+            memcpy(matrix_get_row(local_queries, i),
+                   local_packed + (size_t) i * cols, sizeof(double) * cols);
+        }
+        matrix_set_chunk_offset(local_queries, local_offset);
+
+        knns = knn_query_distributed(reference, local_queries, k,
+                                     prev_task, next_task, tasks_num);
+
+        // Neighbors are labeled while searching.
+        matrix_t *labeled = NULL;
+        matrix_t *classified = NULL;
+        local_results = (int *) malloc(sizeof(int) *
+                                       ((size_t) local_rows * (k + 1) + 1));
+        if (knns) labeled = knn_collect_labels(knns, local_rows, k);
+        if (labeled) {
+            classified = weighted ? knn_classify_weighted(labeled, knns) :
+                                    knn_classify(labeled);
+        }
+        failed = !classified || !local_results;
+        for (int i = 0; !failed && i < local_rows; i++) {
+            int *cur = local_results + (size_t) i * (k + 1);
+            cur[0] = (int) matrix_get_cell(classified, i, 0);
+            for (int j = 0; j < k; j++) cur[j+1] = knns[i][j].index;
+        }
+        matrix_destroy(labeled);
+        matrix_destroy(classified);
+
+        MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX,
+                      MPI_COMM_WORLD);
+    }
+
+    if (!failed) {
+        for (int t = 0; t < tasks_num; t++) {
+            counts[t] = counts[t] / cols * (k + 1);
+            displs[t] = displs[t] / cols * (k + 1);
+        }
+        if (rank == MPI_MASTER) {
+            results = (int *) malloc(sizeof(int) *
+                                     ((size_t) total_rows * (k + 1) + 1));
+        }
+        // A failed allocation of master only fails responses.
+        MPI_Gatherv(local_results, local_rows * (k + 1), MPI_INT,
+                    results, counts, displs, MPI_INT, MPI_MASTER,
+                    MPI_COMM_WORLD);
+    }
+
+    if (rank == MPI_MASTER) {
+        int *labels = (int *) malloc(sizeof(int) * (total_rows + 1));
+        int *indexes = (int *) malloc(sizeof(int) *
+                                      ((size_t) total_rows * k + 1));
+        failed |= !results || !labels || !indexes;
+        for (int i = 0; !failed && i < total_rows; i++) {
+            int *cur = results + (size_t) i * (k + 1);
+            labels[i] = cur[0];
+            memcpy(indexes + (size_t) i * k, cur + 1, sizeof(int) * k);
+        }
+
+        // Every request gets its own contiguous share of the results.
+        int row = 0;
+        for (int r = 0; r < batch->count; r++) {
+            struct Pending_Request *request = &batch->requests[r];
+            int rows = matrix_get_rows(request->queries);
+            if (request->fd < 0) {
+                // Client has left.
+            } else if (failed) {
+                knn_service_send_response(request->fd, KNN_SERVICE_ERROR,
+                                          k, NULL, NULL);
+            } else {
+                knn_service_send_response(request->fd, rows, k,
+                                          labels + row,
+                                          indexes + (size_t) row * k);
+            }
+            row += rows;
+            matrix_destroy(request->queries);
+        }
+        batch->count = 0;
+        batch->rows = 0;
+
+        free(labels);
+        free(indexes);
+    }
+
+    if (knns) KNN_Pair_destroy_table(knns, local_rows);
+    matrix_destroy(local_queries);
+    free(local_packed);
+    free(local_results);
+    free(results);
+    free(packed);
+    free(counts);
+    free(displs);
+
+    return failed ? -1 : 0;
+}
+
+/**
+ * Adds a descriptor to the ones polled for a micro-batch.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int add_client(struct Micro_Batch *batch, int fd)
+{
+    if (batch->fds_count == batch->fds_capacity) {
+        int capacity = batch->fds_capacity ? 2 * batch->fds_capacity : 16;
+        struct pollfd *fds = (struct pollfd *) realloc(
+                batch->fds, sizeof(struct pollfd) * capacity);
+        if (!fds) return -1;
+        batch->fds = fds;
+        batch->fds_capacity = capacity;
+    }
+
+    batch->fds[batch->fds_count].fd = fd;
+    batch->fds[batch->fds_count].events = POLLIN;
+    batch->fds[batch->fds_count].revents = 0;
+    batch->fds_count++;
+    return 0;
+}
+
+/**
+ * Closes the connection of a client and stops polling it. Requests of the
+ * client already in the micro-batch are still served, though they are not
+ * responded, since their descriptor may be reused by a new client.
+ */
+void remove_client(struct Micro_Batch *batch, int index)
+{
+    for (int r = 0; r < batch->count; r++) {
+        if (batch->requests[r].fd == batch->fds[index].fd) {
+            batch->requests[r].fd = -1;
+        }
+    }
+    close(batch->fds[index].fd);
+    batch->fds[index] = batch->fds[batch->fds_count-1];
+    batch->fds_count--;
+}
+
+/**
+ * Adds a request to a micro-batch.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int add_request(struct Micro_Batch *batch, int fd, matrix_t *queries)
+{
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity ? 2 * batch->capacity : 16;
+        struct Pending_Request *requests = (struct Pending_Request *) realloc(
+                batch->requests, sizeof(struct Pending_Request) * capacity);
+        if (!requests) return -1;
+        batch->requests = requests;
+        batch->capacity = capacity;
+    }
+
+    if (batch->count == 0) gettimeofday(&batch->first_arrival, NULL);
+    batch->requests[batch->count].fd = fd;
+    batch->requests[batch->count].queries = queries;
+    batch->count++;
+    batch->rows += matrix_get_rows(queries);
+    return 0;
+}
+
+/**
+ * Prints the median and the 99th percentile of the latencies of all
+ * micro-batches served so far.
+ */
+void report_latency(double *latencies, int count, long queries)
+{
+    // Percentiles sort their input, so a copy is used.
+    double *sorted = (double *) malloc(sizeof(double) * (count + 1));
+    if (!sorted) return;
+    if (count > 0) memcpy(sorted, latencies, sizeof(double) * count);
+
+    double p50 = knn_service_percentile(sorted, count, 0.50);
+    double p99 = knn_service_percentile(sorted, count, 0.99);
+    printf("Served %ld queries in %d micro-batches. Latency per micro-batch: "
+           "p50 %.3f msecs, p99 %.3f msecs.\n", queries, count, p50, p99);
+    fflush(stdout);
+
+    free(sorted);
+}
+
+/*
+ * Returns the elapsed time in milliseconds between the two provided
+ * timeval objects.
+ */
+double get_elapsed_ms(struct timeval start, struct timeval stop)
+{
+    double elapsed_time = (stop.tv_sec - start.tv_sec) * 1000.0;
+    elapsed_time += (stop.tv_usec - start.tv_usec) / 1000.0;
+    return elapsed_time;
+}
+
+/**
+ * Returns the integer value of an environment variable, or fallback when
+ * it is not set.
+ */
+int read_env_int(const char *name, int fallback)
+{
+    char *value = getenv(name);
+    if (!value || !strcmp(value, "")) return fallback;
+    return atoi(value);
+}
@@ -0,0 +1,259 @@
+/**
+ * knn_service.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * knn_service.c provides an implementation for routines defined in
+ * knn_service.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L  // For sockets of sys/un.h.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "matrix.h"
+#include "knn_service.h"
+
+
+static int _fill_address(const char *path, struct sockaddr_un *address);
+static int _read_all(int fd, void *buffer, size_t bytes);
+static int _write_all(int fd, const void *buffer, size_t bytes);
+static int _double_comp(const void *a, const void *b);
+
+
+int knn_service_listen(const char *path)
+{
+    struct sockaddr_un address;
+    if (_fill_address(path, &address) != 0) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("ERROR: knn_service_listen");
+        return -1;
+    }
+
+    // A socket left behind by a previous server would fail binding.
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(fd, KNN_SERVICE_BACKLOG) != 0)
+    {
+        perror("ERROR: knn_service_listen");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int knn_service_connect(const char *path)
+{
+    struct sockaddr_un address;
+    if (_fill_address(path, &address) != 0) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("ERROR: knn_service_connect");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        perror("ERROR: knn_service_connect");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int knn_service_send_request(int fd, matrix_t *queries)
+{
+    int32_t header[2] = { matrix_get_rows(queries), matrix_get_cols(queries) };
+    if (_write_all(fd, header, sizeof(header)) != 0) return -1;
+
+    // Rows are padded in memory, so they are sent one by one.
+    size_t row_bytes = sizeof(double) * header[1];
+    for (int32_t i = 0; i < header[0]; i++) {
+        if (_write_all(fd, matrix_get_row(queries, i), row_bytes) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int knn_service_recv_request(int fd, matrix_t **queries)
+{
+    *queries = NULL;
+
+    int32_t header[2];
+    if (_read_all(fd, header, sizeof(header)) != 0) return -1;
+    if (header[0] == KNN_SERVICE_SHUTDOWN) return 0;
+    if (header[0] < 0 || header[0] > KNN_SERVICE_MAX_ROWS ||
+        header[1] <= 0 || header[1] > KNN_SERVICE_MAX_COLS ||
+        (int64_t) header[0] * header[1] > KNN_SERVICE_MAX_CELLS)
+    {
+        printf("ERROR: knn_service_recv_request : Invalid request.\n");
+        return -1;
+    }
+
+    matrix_t *received = matrix_create(header[0], header[1]);
+    if (!received) {
+        printf("ERROR: knn_service_recv_request : "
+               "Failed to allocate memory.\n");
+        return -1;
+    }
+
+    size_t row_bytes = sizeof(double) * header[1];
+    for (int32_t i = 0; i < header[0]; i++) {
+        if (_read_all(fd, matrix_get_row(received, i), row_bytes) != 0) {
+            matrix_destroy(received);
+            return -1;
+        }
+    }
+
+    *queries = received;
+    return 0;
+}
+
+int knn_service_send_response(int fd, int rows, int k, const int *labels,
+                              const int *indexes)
+{
+    int32_t header[2] = { rows, k };
+    if (_write_all(fd, header, sizeof(header)) != 0) return -1;
+    if (rows == KNN_SERVICE_ERROR) return 0;
+
+    if (_write_all(fd, labels, sizeof(int32_t) * rows) != 0 ||
+        _write_all(fd, indexes, sizeof(int32_t) * rows * k) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int knn_service_recv_response(int fd, int *rows, int *k, int **labels,
+                              int **indexes)
+{
+    *labels = NULL;
+    *indexes = NULL;
+
+    int32_t header[2];
+    if (_read_all(fd, header, sizeof(header)) != 0) return -1;
+    *rows = header[0];
+    *k = header[1];
+    if (header[0] == KNN_SERVICE_ERROR) return 0;
+    if (header[0] < 0 || header[1] < 0) return -1;
+
+    // At least one item is allocated, so an empty response is not mistaken
+    // for a failure.
+    *labels = (int *) malloc(sizeof(int32_t) * (header[0] + 1));
+    *indexes = (int *) malloc(sizeof(int32_t) *
+                              ((size_t) header[0] * header[1] + 1));
+    if (!*labels || !*indexes ||
+        _read_all(fd, *labels, sizeof(int32_t) * header[0]) != 0 ||
+        _read_all(fd, *indexes,
+                  sizeof(int32_t) * (size_t) header[0] * header[1]) != 0)
+    {
+        free(*labels);
+        free(*indexes);
+        *labels = NULL;
+        *indexes = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int knn_service_send_shutdown(int fd)
+{
+    int32_t header[2] = { KNN_SERVICE_SHUTDOWN, 0 };
+    return _write_all(fd, header, sizeof(header));
+}
+
+double knn_service_percentile(double *values, int n, double q)
+{
+    if (n <= 0) return NAN;
+
+    qsort(values, n, sizeof(double), _double_comp);
+
+    // Nearest rank method.
+    int rank = (int) ceil(q * n);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return values[rank-1];
+}
+
+/**
+ * Fills the address of a Unix domain socket on given path.
+ *
+ * Returns:
+ *  0 on success, -1 if path is too long.
+ */
+static int _fill_address(const char *path, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        printf("ERROR: Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+/**
+ * Reads exactly the given number of bytes.
+ *
+ * Returns:
+ *  0 on success, -1 on failure or when the connection is closed.
+ */
+static int _read_all(int fd, void *buffer, size_t bytes)
+{
+    char *cur = (char *) buffer;
+    while (bytes > 0) {
+        ssize_t n = read(fd, cur, bytes);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        cur += n;
+        bytes -= (size_t) n;
+    }
+    return 0;
+}
+
+/**
+ * Writes exactly the given number of bytes.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+static int _write_all(int fd, const void *buffer, size_t bytes)
+{
+    const char *cur = (const char *) buffer;
+    while (bytes > 0) {
+        ssize_t n = write(fd, cur, bytes);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        cur += n;
+        bytes -= (size_t) n;
+    }
+    return 0;
+}
+
+/**
+ * Compares two doubles, for sorting them in ascending order.
+ */
+static int _double_comp(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
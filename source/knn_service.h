@@ -0,0 +1,177 @@
+/**
+ * knn_service.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * knn_service.h defines the protocol spoken over a Unix domain stream socket
+ * between a knn server and its clients, along with routines for sending and
+ * receiving its messages.
+ *
+ * A client may send any number of requests over a single connection, each
+ * one getting a response in the same order. All integers are 32 bits wide
+ * and all values are in the native byte order, since both ends run on the
+ * same host.
+ *
+ * Request:
+ *  -rows: The number of query points, or KNN_SERVICE_SHUTDOWN for asking
+ *      the server to stop, after serving the requests it has received.
+ *  -cols: The number of coordinates of every point, which should match the
+ *      reference points of the server. Other widths get an error response.
+ *  -rows x cols doubles: The coordinates of the points, in row major order.
+ *
+ * Response:
+ *  -rows: The number of query points of the request, or KNN_SERVICE_ERROR
+ *      when the request could not be served. Nothing follows an error.
+ *  -k: The number of nearest neighbors of every point.
+ *  -rows integers: The label every point has been classified to.
+ *  -rows x k integers: The indexes of the nearest neighbors of every point
+ *      in the reference points, in ascending order of distance.
+ *
+ * Macros defined in knn_service.h:
+ *  -KNN_SERVICE_SHUTDOWN
+ *  -KNN_SERVICE_ERROR
+ *  -KNN_SERVICE_MAX_ROWS
+ *  -KNN_SERVICE_MAX_COLS
+ *  -KNN_SERVICE_MAX_CELLS
+ *  -KNN_SERVICE_BACKLOG
+ *
+ * Functions defined in knn_service.h:
+ *  -int knn_service_listen(const char *path)
+ *  -int knn_service_connect(const char *path)
+ *  -int knn_service_send_request(int fd, matrix_t *queries)
+ *  -int knn_service_recv_request(int fd, matrix_t **queries)
+ *  -int knn_service_send_response(int fd, int rows, int k, const int *labels,
+ *                                 const int *indexes)
+ *  -int knn_service_recv_response(int fd, int *rows, int *k, int **labels,
+ *                                 int **indexes)
+ *  -int knn_service_send_shutdown(int fd)
+ *  -double knn_service_percentile(double *values, int n, double q)
+ */
+
+#ifndef __knn_service_h__
+#define __knn_service_h__
+
+#include "matrix.h"
+
+
+#define KNN_SERVICE_SHUTDOWN -1  // Rows of a request asking server to stop.
+#define KNN_SERVICE_ERROR -1     // Rows of a response to a failed request.
+
+// Greatest number of points of a single request.
+#ifndef KNN_SERVICE_MAX_ROWS
+#define KNN_SERVICE_MAX_ROWS (1 << 20)
+#endif
+
+// Greatest number of coordinates of every point of a request.
+#ifndef KNN_SERVICE_MAX_COLS
+#define KNN_SERVICE_MAX_COLS (1 << 16)
+#endif
+
+// Greatest number of coordinates of all points of a request, which bounds
+// the memory a single request may take.
+#ifndef KNN_SERVICE_MAX_CELLS
+#define KNN_SERVICE_MAX_CELLS (1 << 27)
+#endif
+
+// Number of connections that may wait for being accepted.
+#define KNN_SERVICE_BACKLOG 64
+
+/**
+ * Creates a socket listening on the given path. A file already existing on
+ * path is removed.
+ *
+ * Returns:
+ *  The descriptor of the socket, or -1 on failure.
+ */
+int knn_service_listen(const char *path);
+
+/**
+ * Connects to a server listening on the given path.
+ *
+ * Returns:
+ *  The descriptor of the connection, or -1 on failure.
+ */
+int knn_service_connect(const char *path);
+
+/**
+ * Sends a request for classifying the given points.
+ *
+ * Parameters:
+ *  -fd: A connection to a server.
+ *  -queries: A matrix of doubles, with a point in every row.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int knn_service_send_request(int fd, matrix_t *queries);
+
+/**
+ * Receives a request.
+ *
+ * Requests with more rows, columns or cells than KNN_SERVICE_MAX_ROWS,
+ * KNN_SERVICE_MAX_COLS or KNN_SERVICE_MAX_CELLS are rejected before
+ * allocating anything for them, as a failure.
+ *
+ * Parameters:
+ *  -fd: A connection to a client.
+ *  -queries: A reference to the location to store a new matrix with the
+ *          points of the request, or NULL for a request of shutdown.
+ *
+ * Returns:
+ *  0 on success, -1 when the connection has been closed, or on failure.
+ */
+int knn_service_recv_request(int fd, matrix_t **queries);
+
+/**
+ * Sends the response to a request.
+ *
+ * Parameters:
+ *  -fd: A connection to a client.
+ *  -rows: The number of points of the request, or KNN_SERVICE_ERROR.
+ *  -k: The number of nearest neighbors of every point.
+ *  -labels: The labels of the points.
+ *  -indexes: The indexes of the nearest neighbors of the points, k for
+ *          every point.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int knn_service_send_response(int fd, int rows, int k, const int *labels,
+                              const int *indexes);
+
+/**
+ * Receives the response to a request.
+ *
+ * Parameters:
+ *  -fd: A connection to a server.
+ *  -rows: A reference to the location to store the number of points, or
+ *          KNN_SERVICE_ERROR.
+ *  -k: A reference to the location to store the number of neighbors.
+ *  -labels: A reference to the location to store a new array with the labels
+ *          of the points, that should be freed.
+ *  -indexes: A reference to the location to store a new array with the
+ *          indexes of the neighbors of the points, that should be freed.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int knn_service_recv_response(int fd, int *rows, int *k, int **labels,
+                              int **indexes);
+
+/**
+ * Asks the server on the other end of the connection to stop.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int knn_service_send_shutdown(int fd);
+
+/**
+ * Returns the q-quantile of an array of values, e.g. the median for q = 0.5.
+ * Values are sorted in place. NAN is returned for an empty array.
+ */
+double knn_service_percentile(double *values, int n, double q);
+
+#endif
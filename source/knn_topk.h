@@ -0,0 +1,254 @@
+/**
+ * knn_topk.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * knn_topk.h provides an inlined selector that keeps the k best
+ * (distance, index) pairs out of a stream of candidates.
+ *
+ * A row of k struct KNN_Pair objects is used as the storage of the selector.
+ * Depending on k, the row is maintained either:
+ *  -as a sorted array, where new candidates are inserted by shifting the
+ *   worse ones (k <= KNN_TOPK_HEAP_THRESHOLD). For k <= KNN_TOPK_FIXED_MAX
+ *   a variant specialized at compile time for that exact k is used.
+ *  -as a bounded max-heap, whose root is always the worst kept pair
+ *   (k > KNN_TOPK_HEAP_THRESHOLD).
+ * In any case, after knn_topk_finalize() the row is sorted in ascending order,
+ * using the same ordering as KNN_Pair_asc_comp(), i.e. firstly by distance and
+ * secondly by index.
+ *
+ * Empty positions are filled with a sentinel pair of infinite distance and
+ * an index of -1, so they are always the first to be replaced. Candidates
+ * offered by distance and index get a label of -1, which can be filled in
+ * later by knn_table_label(), while whole pairs keep their own label.
+ *
+ * Macros defined in knn_topk.h:
+ *  -KNN_TOPK_HEAP_THRESHOLD
+ *  -KNN_TOPK_FIXED_MAX
+ *  -KNN_TOPK_DEFINE_FIXED(K)
+ *
+ * Functions defined in knn_topk.h:
+ *  -void knn_topk_init(struct KNN_Pair *row, int k)
+ *  -struct KNN_Pair *knn_topk_worst(struct KNN_Pair *row, int k)
+ *  -void knn_topk_push(struct KNN_Pair *row, int k, double distance, int index)
+ *  -void knn_topk_push_pair(struct KNN_Pair *row, int k,
+ *                           const struct KNN_Pair *pair)
+ *  -void knn_topk_scan(struct KNN_Pair *row, int k, const double *dists,
+ *                      int n, int index_base)
+ *  -void knn_topk_finalize(struct KNN_Pair *row, int k)
+ */
+
+#ifndef __knn_topk_h__
+#define __knn_topk_h__
+
+#include <math.h>
+#include "knn.h"
+
+
+// Greatest k for which a sorted row is maintained. Above it, a max-heap is used.
+#ifndef KNN_TOPK_HEAP_THRESHOLD
+#define KNN_TOPK_HEAP_THRESHOLD 16
+#endif
+
+// Greatest k for which a specialized at compile time selector exists.
+#define KNN_TOPK_FIXED_MAX 8
+
+/**
+ * Returns 1 if (distance, index) pair should be ranked before the given one,
+ * else 0.
+ */
+static inline int _knn_topk_less(double distance, int index,
+                                 const struct KNN_Pair *pair)
+{
+    return distance < pair->distance ||
+           (distance == pair->distance && index < pair->index);
+}
+
+/**
+ * Inserts a pair into a sorted row, given that it is better than the last one.
+ */
+static inline void _knn_topk_insert_sorted(struct KNN_Pair *row, int k,
+                                           struct KNN_Pair item)
+{
+    int j = k - 1;
+    while (j > 0 && _knn_topk_less(item.distance, item.index, &row[j-1])) {
+        row[j] = row[j-1];
+        j--;
+    }
+    row[j] = item;
+}
+
+/**
+ * Places a pair to the root of a max-heap of size n and sifts it down to its
+ * proper position.
+ */
+static inline void _knn_topk_sift_down(struct KNN_Pair *heap, int n,
+                                       struct KNN_Pair item)
+{
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= n) break;
+        if (child + 1 < n && _knn_topk_less(heap[child].distance,
+                                            heap[child].index, &heap[child+1]))
+        {
+            child++;
+        }
+        if (!_knn_topk_less(item.distance, item.index, &heap[child])) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = item;
+}
+
+/**
+ * Defines _knn_topk_scan_fixed_K(), a scanner of candidates specialized for
+ * the given constant K, so the insertion loop can be fully unrolled.
+ */
+#define KNN_TOPK_DEFINE_FIXED(K)                                            \
+static inline void _knn_topk_scan_fixed_##K(struct KNN_Pair *row,           \
+                                            const double *dists,            \
+                                            int n, int index_base)          \
+{                                                                           \
+    for (int i = 0; i < n; i++) {                                           \
+        if (_knn_topk_less(dists[i], index_base + i, &row[K-1])) {          \
+            struct KNN_Pair item = { dists[i], index_base + i, -1 };        \
+            _knn_topk_insert_sorted(row, K, item);                          \
+        }                                                                   \
+    }                                                                       \
+}
+
+KNN_TOPK_DEFINE_FIXED(1)
+KNN_TOPK_DEFINE_FIXED(2)
+KNN_TOPK_DEFINE_FIXED(3)
+KNN_TOPK_DEFINE_FIXED(4)
+KNN_TOPK_DEFINE_FIXED(5)
+KNN_TOPK_DEFINE_FIXED(6)
+KNN_TOPK_DEFINE_FIXED(7)
+KNN_TOPK_DEFINE_FIXED(8)
+
+/**
+ * Initializes a row of k pairs to an empty selector.
+ *
+ * Parameters:
+ *  -row: The row to be used as selector's storage.
+ *  -k: The number of pairs to be kept.
+ */
+static inline void knn_topk_init(struct KNN_Pair *row, int k)
+{
+    for (int i = 0; i < k; i++) {
+        row[i].distance = INFINITY;
+        row[i].index = -1;
+        row[i].label = -1;
+    }
+}
+
+/**
+ * Returns a reference to the worst pair currently kept into selector. A new
+ * candidate is only kept if it ranks before that pair.
+ *
+ * Parameters:
+ *  -row: The storage of the selector.
+ *  -k: The number of pairs kept.
+ */
+static inline struct KNN_Pair *knn_topk_worst(struct KNN_Pair *row, int k)
+{
+    return k > KNN_TOPK_HEAP_THRESHOLD ? &row[0] : &row[k-1];
+}
+
+/**
+ * Offers a whole pair, along with its label, to the selector.
+ *
+ * Parameters:
+ *  -row: The storage of the selector.
+ *  -k: The number of pairs kept.
+ *  -pair: The candidate pair.
+ */
+static inline void knn_topk_push_pair(struct KNN_Pair *row, int k,
+                                      const struct KNN_Pair *pair)
+{
+    if (k > KNN_TOPK_HEAP_THRESHOLD) {
+        if (_knn_topk_less(pair->distance, pair->index, &row[0])) {
+            _knn_topk_sift_down(row, k, *pair);
+        }
+    }
+    else if (_knn_topk_less(pair->distance, pair->index, &row[k-1])) {
+        _knn_topk_insert_sorted(row, k, *pair);
+    }
+}
+
+/**
+ * Offers a candidate pair to the selector.
+ *
+ * Parameters:
+ *  -row: The storage of the selector.
+ *  -k: The number of pairs kept.
+ *  -distance: The distance of the candidate.
+ *  -index: The index of the candidate.
+ */
+static inline void knn_topk_push(struct KNN_Pair *row, int k,
+                                 double distance, int index)
+{
+    struct KNN_Pair item = { distance, index, -1 };
+    knn_topk_push_pair(row, k, &item);
+}
+
+/**
+ * Offers a whole array of candidates to the selector.
+ *
+ * The i-th candidate is given an index of index_base + i.
+ *
+ * Parameters:
+ *  -row: The storage of the selector.
+ *  -k: The number of pairs kept.
+ *  -dists: The distances of the candidates.
+ *  -n: The number of candidates.
+ *  -index_base: The index of the first candidate.
+ */
+static inline void knn_topk_scan(struct KNN_Pair *row, int k,
+                                 const double *dists, int n, int index_base)
+{
+    switch (k) {
+    case 1: _knn_topk_scan_fixed_1(row, dists, n, index_base); return;
+    case 2: _knn_topk_scan_fixed_2(row, dists, n, index_base); return;
+    case 3: _knn_topk_scan_fixed_3(row, dists, n, index_base); return;
+    case 4: _knn_topk_scan_fixed_4(row, dists, n, index_base); return;
+    case 5: _knn_topk_scan_fixed_5(row, dists, n, index_base); return;
+    case 6: _knn_topk_scan_fixed_6(row, dists, n, index_base); return;
+    case 7: _knn_topk_scan_fixed_7(row, dists, n, index_base); return;
+    case 8: _knn_topk_scan_fixed_8(row, dists, n, index_base); return;
+    }
+
+    // Keep the worst kept pair close, since most candidates are rejected
+    // by comparing against it.
+    struct KNN_Pair *worst = knn_topk_worst(row, k);
+    for (int i = 0; i < n; i++) {
+        if (_knn_topk_less(dists[i], index_base + i, worst)) {
+            knn_topk_push(row, k, dists[i], index_base + i);
+        }
+    }
+}
+
+/**
+ * Sorts the pairs kept by the selector in ascending order. After that, row
+ * should no more be used as a selector, unless reinitialized.
+ *
+ * Parameters:
+ *  -row: The storage of the selector.
+ *  -k: The number of pairs kept.
+ */
+static inline void knn_topk_finalize(struct KNN_Pair *row, int k)
+{
+    if (k <= KNN_TOPK_HEAP_THRESHOLD) return;
+
+    // Heap sort: repeatedly move the worst pair to the end of the row.
+    for (int end = k - 1; end > 0; end--) {
+        struct KNN_Pair item = row[end];
+        row[end] = row[0];
+        _knn_topk_sift_down(row, end, item);
+    }
+}
+
+#endif
@@ -0,0 +1,608 @@
+/**
+ * knn_transport.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * knn_transport.c provides an implementation for routines defined in
+ * knn_transport.h.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <mpi.h>
+#include "matrix.h"
+#include "knn_profile.h"
+#include "knn_transport.h"
+
+
+static void _nonblocking_open(struct KNN_Channel *channel);
+static void _nonblocking_recv(struct KNN_Channel *channel);
+static void _nonblocking_send(struct KNN_Channel *channel, const void *data,
+                              int count);
+static int _nonblocking_test(struct KNN_Channel *channel);
+static void _nonblocking_wait(struct KNN_Channel *channel);
+static void _nonblocking_close(struct KNN_Channel *channel);
+static void _blocking_open(struct KNN_Channel *channel);
+static void _blocking_send(struct KNN_Channel *channel, const void *data,
+                           int count);
+static void _blocking_wait(struct KNN_Channel *channel);
+static void _sendrecv_send(struct KNN_Channel *channel, const void *data,
+                           int count);
+static void _rma_open(struct KNN_Channel *channel);
+static void _rma_recv(struct KNN_Channel *channel);
+static void _rma_send(struct KNN_Channel *channel, const void *data,
+                      int count);
+static int _rma_test(struct KNN_Channel *channel);
+static void _rma_wait(struct KNN_Channel *channel);
+static void _rma_close(struct KNN_Channel *channel);
+static void _nothing(struct KNN_Channel *channel);
+static int _landed(struct KNN_Channel *channel);
+static const struct KNN_Transport *_transport(int transport);
+static void _count_sent(struct KNN_Channel *channel, int count);
+static int _init_nodes(void);
+static void *_align(void *address);
+
+// Transports, indexed by their KNN_TRANSPORT_* value. Blocking ones complete
+// the exchange on sending, or on passing when only receiving, so there is
+// nothing left to wait for.
+static const struct KNN_Transport transports[] = {
+    { "nonblocking", _nonblocking_open, _nonblocking_recv, _nonblocking_send,
+      _nothing, _nonblocking_test, _nonblocking_wait, _nonblocking_close },
+    { "blocking", _blocking_open, _nothing, _blocking_send,
+      _blocking_wait, _landed, _blocking_wait, _nothing },
+    { "sendrecv", _nothing, _nothing, _sendrecv_send,
+      _blocking_wait, _landed, _blocking_wait, _nothing },
+    { "rma", _rma_open, _rma_recv, _rma_send,
+      _nothing, _rma_test, _rma_wait, _rma_close }
+};
+
+// Transport of channels opened from now on, as set by knn_set_transport().
+static int selected_transport = KNN_TRANSPORT_DEFAULT;
+
+// Whether ring drivers share memory within nodes.
+static int node_sharing = 0;
+
+// Processes of the node of current process, discovered on first use.
+static MPI_Comm node_comm = MPI_COMM_NULL;
+static int *node_ranks = NULL;  // Rank in node_comm of every task, or -1.
+static int *node_ids = NULL;    // Node of every task.
+
+
+void knn_set_transport(int transport)
+{
+    selected_transport = transport;
+}
+
+int knn_get_transport(void)
+{
+    return selected_transport;
+}
+
+int knn_parse_transport(const char *name)
+{
+    if (!strcmp(name, "nonblocking")) return KNN_TRANSPORT_NONBLOCKING;
+    if (!strcmp(name, "blocking")) return KNN_TRANSPORT_BLOCKING;
+    if (!strcmp(name, "sendrecv")) return KNN_TRANSPORT_SENDRECV;
+    if (!strcmp(name, "rma")) return KNN_TRANSPORT_RMA;
+    return -1;
+}
+
+const char *knn_transport_name(int transport)
+{
+    return _transport(transport)->name;
+}
+
+void knn_channel_open(struct KNN_Channel *channel, void *slot0, void *slot1,
+                      int capacity, MPI_Datatype type, int tag,
+                      int prev_task, int next_task)
+{
+    channel->transport = _transport(selected_transport);
+    channel->slots[0] = slot0;
+    channel->slots[1] = slot1;
+    channel->capacity = capacity;
+    channel->type = type;
+    channel->tag = tag;
+    channel->prev_task = prev_task;
+    channel->next_task = next_task;
+    channel->slot = 0;
+    channel->receiving = 0;
+    channel->sending = 0;
+    channel->recv_first = 0;
+    channel->transport->open(channel);
+}
+
+void knn_channel_recv(struct KNN_Channel *channel, int slot)
+{
+    channel->slot = slot;
+    channel->receiving = 1;
+    channel->transport->recv(channel);
+}
+
+void knn_channel_skip(struct KNN_Channel *channel, int slot)
+{
+    channel->slot = slot;
+    channel->receiving = 0;
+}
+
+void knn_channel_send(struct KNN_Channel *channel, const void *data,
+                      int count)
+{
+    channel->sending = 1;
+    channel->transport->send(channel, data, count);
+}
+
+void knn_channel_pass(struct KNN_Channel *channel)
+{
+    channel->transport->pass(channel);
+}
+
+int knn_channel_test(struct KNN_Channel *channel)
+{
+    return channel->transport->test(channel);
+}
+
+void knn_channel_wait(struct KNN_Channel *channel)
+{
+    channel->transport->wait(channel);
+    channel->receiving = 0;
+    channel->sending = 0;
+}
+
+void knn_channel_close(struct KNN_Channel *channel)
+{
+    channel->transport->close(channel);
+}
+
+void knn_set_node_sharing(int enabled)
+{
+    node_sharing = enabled;
+}
+
+int knn_get_node_sharing(void)
+{
+    return node_sharing;
+}
+
+int knn_node_of(int task)
+{
+    if (!node_ids && _init_nodes() != 0) return task;
+    return node_ids[task];
+}
+
+MPI_Comm knn_node_comm(void)
+{
+    if (!node_ids && _init_nodes() != 0) return MPI_COMM_NULL;
+    return node_comm;
+}
+
+int knn_shared_create(size_t bytes, struct KNN_Shared *shared)
+{
+    shared->window = MPI_WIN_NULL;
+    shared->local = NULL;
+
+    int failed = _init_nodes() != 0;
+    int any_failed;
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (any_failed) return -1;
+
+    // Segments may start anywhere, so every one is allocated with room for
+    // being aligned. Shared memory is mapped on page boundaries in every
+    // process, so a segment is aligned at the same offset in all of them.
+    void *base = NULL;
+    int rc = MPI_Win_allocate_shared((MPI_Aint) (bytes + MATRIX_ALIGNMENT),
+                                     1, MPI_INFO_NULL, node_comm, &base,
+                                     &shared->window);
+    failed = rc != MPI_SUCCESS;
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (any_failed) {
+        if (failed) {
+            printf("ERROR: knn_shared_create : Failed to allocate shared "
+                   "memory.\n");
+        }
+        if (rc == MPI_SUCCESS) MPI_Win_free(&shared->window);
+        shared->window = MPI_WIN_NULL;
+        return -1;
+    }
+    shared->local = _align(base);
+
+    // A single passive epoch spans the whole life of the segments, during
+    // which they are synchronized by knn_shared_publish().
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, shared->window);
+    return 0;
+}
+
+void knn_shared_publish(struct KNN_Shared *shared)
+{
+    MPI_Win_sync(shared->window);
+    MPI_Barrier(node_comm);
+    MPI_Win_sync(shared->window);
+}
+
+void *knn_shared_query(struct KNN_Shared *shared, int task)
+{
+    if (node_ranks[task] < 0) return NULL;
+
+    MPI_Aint size;
+    int disp_unit;
+    void *segment;
+    MPI_Win_shared_query(shared->window, node_ranks[task], &size, &disp_unit,
+                         &segment);
+    return _align(segment);
+}
+
+void knn_shared_destroy(struct KNN_Shared *shared)
+{
+    if (shared->window == MPI_WIN_NULL) return;
+    MPI_Win_unlock_all(shared->window);
+    MPI_Win_free(&shared->window);
+    shared->local = NULL;
+}
+
+
+/**
+ * Sets up a persistent receive for each slot, since incoming messages always
+ * land on the same two buffers. Size of incoming messages is not known, so
+ * receives are set up for the whole capacity of the slots.
+ */
+static void _nonblocking_open(struct KNN_Channel *channel)
+{
+    for (int s = 0; s < 2; s++) {
+        MPI_Recv_init(channel->slots[s], channel->capacity, channel->type,
+                      channel->prev_task, channel->tag, MPI_COMM_WORLD,
+                      &channel->requests[s]);
+    }
+    channel->requests[2] = MPI_REQUEST_NULL;
+}
+
+/**
+ * Starts the receive of current slot, so it is already posted when the
+ * message of previous process arrives.
+ */
+static void _nonblocking_recv(struct KNN_Channel *channel)
+{
+    MPI_Start(&channel->requests[channel->slot]);
+}
+
+/**
+ * Starts sending the message, without any copying.
+ */
+static void _nonblocking_send(struct KNN_Channel *channel, const void *data,
+                              int count)
+{
+    MPI_Isend(data, count, channel->type, channel->next_task, channel->tag,
+              MPI_COMM_WORLD, &channel->requests[2]);
+    _count_sent(channel, count);
+}
+
+/**
+ * Tests both the receive and the send of current exchange, so none of them
+ * stalls.
+ */
+static int _nonblocking_test(struct KNN_Channel *channel)
+{
+    int received = 1;
+    int sent;
+    if (channel->receiving) {
+        MPI_Test(&channel->requests[channel->slot], &received,
+                 MPI_STATUS_IGNORE);
+        channel->receiving = !received;
+    }
+    MPI_Test(&channel->requests[2], &sent, MPI_STATUS_IGNORE);
+    return received && sent;
+}
+
+static void _nonblocking_wait(struct KNN_Channel *channel)
+{
+    if (channel->receiving) {
+        MPI_Wait(&channel->requests[channel->slot], MPI_STATUS_IGNORE);
+    }
+    MPI_Wait(&channel->requests[2], MPI_STATUS_IGNORE);
+}
+
+static void _nonblocking_close(struct KNN_Channel *channel)
+{
+    MPI_Request_free(&channel->requests[0]);
+    MPI_Request_free(&channel->requests[1]);
+}
+
+/**
+ * Finds the position of current process in its ring, out of the next
+ * process of every one, so exchanges are ordered by positions instead of
+ * ranks. Positions are counted from the lowest rank of the ring.
+ */
+static void _blocking_open(struct KNN_Channel *channel)
+{
+    int rank, tasks_num;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &tasks_num);
+
+    int *next = (int *) malloc(sizeof(int) * tasks_num);
+    if (!next) {
+        printf("ERROR: _blocking_open : Failed to allocate memory.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    MPI_Allgather(&channel->next_task, 1, MPI_INT, next, 1, MPI_INT,
+                  MPI_COMM_WORLD);
+
+    // Walk the ring once, counting the hops from current process to the
+    // lowest rank of it.
+    int length = 0;
+    int lowest = rank;
+    int to_lowest = 0;
+    int task = rank;
+    do {
+        task = next[task];
+        length++;
+        if (task < lowest) {
+            lowest = task;
+            to_lowest = length;
+        }
+    } while (task != rank && length < tasks_num);
+    free(next);
+
+    int position = (length - to_lowest) % length;
+    channel->recv_first = (position + 1) % length % 2 == 0;
+}
+
+/**
+ * Exchanges the message by blocking routines.
+ *
+ * Deadlocks in the ring are resolved by first receiving on processes whose
+ * next one is on an even position of the ring and first sending on the
+ * rest. That approach works for both even and odd total number of
+ * processes, since operations are two (send and receive). Thus, total
+ * number of performed operations is always even. A process that only sends,
+ * leaves a chain instead of a ring, which can't deadlock.
+ */
+static void _blocking_send(struct KNN_Channel *channel, const void *data,
+                           int count)
+{
+    void *slot = channel->slots[channel->slot];
+    if (channel->receiving && channel->recv_first) {
+        MPI_Recv(slot, channel->capacity, channel->type, channel->prev_task,
+                 channel->tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        channel->receiving = 0;
+    }
+    MPI_Send(data, count, channel->type, channel->next_task, channel->tag,
+             MPI_COMM_WORLD);
+    if (channel->receiving) {
+        MPI_Recv(slot, channel->capacity, channel->type, channel->prev_task,
+                 channel->tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        channel->receiving = 0;
+    }
+    _count_sent(channel, count);
+}
+
+/**
+ * Receives the message, when nothing is sent on this step.
+ */
+static void _blocking_wait(struct KNN_Channel *channel)
+{
+    if (!channel->receiving) return;
+    MPI_Recv(channel->slots[channel->slot], channel->capacity, channel->type,
+             channel->prev_task, channel->tag, MPI_COMM_WORLD,
+             MPI_STATUS_IGNORE);
+    channel->receiving = 0;
+}
+
+/**
+ * Exchanges the message in place, on the slot it is copied into. The same
+ * count is sent and received, so the whole slot is always exchanged, which
+ * fits the message of previous process whatever its size.
+ */
+static void _sendrecv_send(struct KNN_Channel *channel, const void *data,
+                           int count)
+{
+    if (!channel->receiving) {
+        MPI_Send(data, count, channel->type, channel->next_task,
+                 channel->tag, MPI_COMM_WORLD);
+        _count_sent(channel, count);
+        return;
+    }
+
+    if (count > channel->capacity) {
+        printf("ERROR: _sendrecv_send : Message doesn't fit into the slots "
+               "of the channel.\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    void *slot = channel->slots[channel->slot];
+    int size;
+    MPI_Type_size(channel->type, &size);
+    if (data != slot) memmove(slot, data, (size_t) size * count);
+
+    MPI_Sendrecv_replace(slot, channel->capacity, channel->type,
+                         channel->next_task, channel->tag,
+                         channel->prev_task, channel->tag,
+                         MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    channel->receiving = 0;
+    _count_sent(channel, channel->capacity);
+}
+
+/**
+ * Creates a window for each slot, along with the groups of the neighbors,
+ * which are the only processes epochs are synchronized with.
+ */
+static void _rma_open(struct KNN_Channel *channel)
+{
+    int size;
+    MPI_Type_size(channel->type, &size);
+    for (int s = 0; s < 2; s++) {
+        MPI_Win_create(channel->slots[s], (MPI_Aint) size * channel->capacity,
+                       size, MPI_INFO_NULL, MPI_COMM_WORLD,
+                       &channel->windows[s]);
+    }
+
+    MPI_Group world;
+    MPI_Comm_group(MPI_COMM_WORLD, &world);
+    MPI_Group_incl(world, 1, &channel->prev_task, &channel->groups[0]);
+    MPI_Group_incl(world, 1, &channel->next_task, &channel->groups[1]);
+    MPI_Group_free(&world);
+}
+
+/**
+ * Exposes current slot to previous process.
+ */
+static void _rma_recv(struct KNN_Channel *channel)
+{
+    MPI_Win_post(channel->groups[0], 0, channel->windows[channel->slot]);
+}
+
+/**
+ * Writes the message into the same slot of next process. All processes use
+ * the same slot on every step, so its window is the one of current slot.
+ */
+static void _rma_send(struct KNN_Channel *channel, const void *data,
+                      int count)
+{
+    MPI_Win window = channel->windows[channel->slot];
+    MPI_Win_start(channel->groups[1], 0, window);
+    MPI_Put(data, count, channel->type, channel->next_task, 0, count,
+            channel->type, window);
+    _count_sent(channel, count);
+}
+
+/**
+ * Tests whether the message of previous process has landed. The outgoing
+ * one is only known to be written when the access epoch completes, on
+ * waiting.
+ */
+static int _rma_test(struct KNN_Channel *channel)
+{
+    if (channel->receiving) {
+        int landed;
+        MPI_Win_test(channel->windows[channel->slot], &landed);
+        channel->receiving = !landed;
+    }
+    return !channel->receiving;
+}
+
+static void _rma_wait(struct KNN_Channel *channel)
+{
+    MPI_Win window = channel->windows[channel->slot];
+    if (channel->sending) MPI_Win_complete(window);
+    if (channel->receiving) MPI_Win_wait(window);
+}
+
+static void _rma_close(struct KNN_Channel *channel)
+{
+    MPI_Win_free(&channel->windows[0]);
+    MPI_Win_free(&channel->windows[1]);
+    MPI_Group_free(&channel->groups[0]);
+    MPI_Group_free(&channel->groups[1]);
+}
+
+/**
+ * An operation with nothing to do on a transport.
+ */
+static void _nothing(struct KNN_Channel *channel)
+{
+    (void) channel;
+}
+
+/**
+ * Returns whether the message of previous process has landed.
+ */
+static int _landed(struct KNN_Channel *channel)
+{
+    return !channel->receiving;
+}
+
+/**
+ * Returns the transport of given KNN_TRANSPORT_* value, or the default one
+ * for an unknown value.
+ */
+static const struct KNN_Transport *_transport(int transport)
+{
+    if (transport < 0 || transport > KNN_TRANSPORT_RMA) {
+        transport = KNN_TRANSPORT_DEFAULT;
+    }
+    return &transports[transport];
+}
+
+/**
+ * Counts the bytes of count elements of the channel as sent.
+ */
+static void _count_sent(struct KNN_Channel *channel, int count)
+{
+    int size;
+    MPI_Type_size(channel->type, &size);
+    KNN_PROFILE_COUNT(KNN_COUNTER_BYTES_SENT, (double) size * count);
+    (void) size;
+    (void) count;
+}
+
+/**
+ * Discovers the processes running on the same node as current one, unless
+ * already discovered. It should be called by all processes in
+ * MPI_COMM_WORLD.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+static int _init_nodes(void)
+{
+    if (node_ids) return 0;
+
+    int rank, tasks_num;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &tasks_num);
+
+    int *ranks = (int *) malloc(sizeof(int) * tasks_num);
+    int *ids = (int *) malloc(sizeof(int) * tasks_num);
+    if (!ranks || !ids) {
+        printf("ERROR: _init_nodes : Failed to allocate memory.\n");
+        free(ranks);
+        free(ids);
+        return -1;
+    }
+
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank,
+                        MPI_INFO_NULL, &node_comm);
+
+    // Ranks of node are ordered as in MPI_COMM_WORLD, so its first one is
+    // the lowest.
+    int node_rank, node_size;
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm_size(node_comm, &node_size);
+    int leader = rank;
+    MPI_Bcast(&leader, 1, MPI_INT, 0, node_comm);
+    MPI_Allgather(&leader, 1, MPI_INT, ids, 1, MPI_INT, MPI_COMM_WORLD);
+
+    for (int t = 0; t < tasks_num; t++) ranks[t] = -1;
+    MPI_Group world, node;
+    MPI_Comm_group(MPI_COMM_WORLD, &world);
+    MPI_Comm_group(node_comm, &node);
+    int *members = (int *) malloc(sizeof(int) * node_size * 2);
+    if (members) {
+        for (int n = 0; n < node_size; n++) members[n] = n;
+        MPI_Group_translate_ranks(node, node_size, members, world,
+                                  members + node_size);
+        for (int n = 0; n < node_size; n++) ranks[members[node_size + n]] = n;
+        free(members);
+    }
+    MPI_Group_free(&world);
+    MPI_Group_free(&node);
+    if (!members) {
+        printf("ERROR: _init_nodes : Failed to allocate memory.\n");
+        free(ranks);
+        free(ids);
+        return -1;
+    }
+
+    node_ranks = ranks;
+    node_ids = ids;
+    return 0;
+}
+
+/**
+ * Returns the first address from given one on, aligned to MATRIX_ALIGNMENT.
+ */
+static void *_align(void *address)
+{
+    uintptr_t offset = (uintptr_t) address % MATRIX_ALIGNMENT;
+    return offset ? (char *) address + (MATRIX_ALIGNMENT - offset) : address;
+}
@@ -0,0 +1,315 @@
+/**
+ * knn_transport.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * knn_transport.h defines the interface through which ring drivers pass
+ * data around the ring, along with the transports implementing it.
+ *
+ * Data are passed through channels. On every step of a ring, each process
+ * sends a message through a channel to the next process, while the message
+ * of the previous process lands on one of the two receive buffers (slots)
+ * of the channel, used in turns. A message is exchanged by:
+ *  1. knn_channel_recv(), selecting the slot the incoming message lands on.
+ *  2. knn_channel_send(), handing the outgoing message to the transport.
+ *  3. knn_channel_wait(), after which the slot holds the incoming message
+ *     and the outgoing one may be modified.
+ * Any work done between sending and waiting overlaps with communication, as
+ * far as the transport allows. knn_channel_test() lets MPI progress the
+ * exchange in the meantime. A process may only receive, or only send, on a
+ * step, as long as its neighbor skips the matching half of the exchange. A
+ * process that only sends calls knn_channel_skip() in place of receiving,
+ * while one that only receives calls knn_channel_pass() in place of
+ * sending.
+ *
+ * Transports available:
+ *  -nonblocking: Persistent receives for the slots and MPI_Isend() for
+ *      outgoing messages, completed on waiting.
+ *  -blocking: MPI_Send() and MPI_Recv() on sending, in an order that
+ *      avoids deadlocks in the ring, so nothing overlaps. The order depends
+ *      on the position of every process in the ring, which is found on
+ *      opening, so rings need not consist of consecutive ranks.
+ *  -sendrecv: The outgoing message is copied into the slot and exchanged
+ *      in place by MPI_Sendrecv_replace() on sending. Messages then fill
+ *      the whole slot, since the same count is sent and received. A half
+ *      exchange falls back to MPI_Send() or MPI_Recv().
+ *  -rma: Every slot is exposed through an MPI-3 window and outgoing messages
+ *      are written by MPI_Put() straight into the slot of the next process.
+ *      Epochs are synchronized with the two neighbors only, by post, start,
+ *      complete and wait (PSCW), instead of fences over all processes.
+ *
+ * Slots of a channel should hold the biggest message of the ring, in all
+ * processes that receive through it. A channel should be opened, used and
+ * closed by all processes in MPI_COMM_WORLD in the same order.
+ *
+ * Processes running on the same node may also share memory, through the
+ * segments of an MPI-3 shared window (see knn_shared_create()). Every
+ * process writes its own segment once and then reads the segments of the
+ * rest of its node in place, so ring drivers need not pass around the
+ * blocks of processes on the same node. Nodes are discovered by
+ * MPI_Comm_split_type(MPI_COMM_TYPE_SHARED). Sharing is used only when
+ * enabled by knn_set_node_sharing().
+ *
+ * Macros defined in knn_transport.h:
+ *  -KNN_TRANSPORT_NONBLOCKING
+ *  -KNN_TRANSPORT_BLOCKING
+ *  -KNN_TRANSPORT_SENDRECV
+ *  -KNN_TRANSPORT_RMA
+ *  -KNN_TRANSPORT_DEFAULT
+ *
+ * Types defined in knn_transport.h:
+ *  -struct KNN_Transport
+ *  -struct KNN_Channel
+ *  -struct KNN_Shared
+ *
+ * Functions defined in knn_transport.h:
+ *  -void knn_set_transport(int transport)
+ *  -int knn_get_transport(void)
+ *  -int knn_parse_transport(const char *name)
+ *  -const char *knn_transport_name(int transport)
+ *  -void knn_channel_open(struct KNN_Channel *channel, void *slot0,
+ *                         void *slot1, int capacity, MPI_Datatype type,
+ *                         int tag, int prev_task, int next_task)
+ *  -void knn_channel_recv(struct KNN_Channel *channel, int slot)
+ *  -void knn_channel_skip(struct KNN_Channel *channel, int slot)
+ *  -void knn_channel_send(struct KNN_Channel *channel, const void *data,
+ *                         int count)
+ *  -void knn_channel_pass(struct KNN_Channel *channel)
+ *  -int knn_channel_test(struct KNN_Channel *channel)
+ *  -void knn_channel_wait(struct KNN_Channel *channel)
+ *  -void knn_channel_close(struct KNN_Channel *channel)
+ *  -void knn_set_node_sharing(int enabled)
+ *  -int knn_get_node_sharing(void)
+ *  -int knn_node_of(int task)
+ *  -MPI_Comm knn_node_comm(void)
+ *  -int knn_shared_create(size_t bytes, struct KNN_Shared *shared)
+ *  -void knn_shared_publish(struct KNN_Shared *shared)
+ *  -void *knn_shared_query(struct KNN_Shared *shared, int task)
+ *  -void knn_shared_destroy(struct KNN_Shared *shared)
+ */
+
+#ifndef __knn_transport_h__
+#define __knn_transport_h__
+
+#include <stddef.h>
+#include <mpi.h>
+
+
+// Transports data can be passed around the ring with.
+#define KNN_TRANSPORT_NONBLOCKING 0
+#define KNN_TRANSPORT_BLOCKING 1
+#define KNN_TRANSPORT_SENDRECV 2
+#define KNN_TRANSPORT_RMA 3
+
+// Transport used when none is explicitly selected.
+#ifndef KNN_TRANSPORT_DEFAULT
+#define KNN_TRANSPORT_DEFAULT KNN_TRANSPORT_NONBLOCKING
+#endif
+
+struct KNN_Channel;
+
+// Operations of a transport, applied to the channels opened with it.
+struct KNN_Transport {
+    const char *name;
+    void (*open)(struct KNN_Channel *channel);
+    void (*recv)(struct KNN_Channel *channel);
+    void (*send)(struct KNN_Channel *channel, const void *data, int count);
+    void (*pass)(struct KNN_Channel *channel);
+    int (*test)(struct KNN_Channel *channel);
+    void (*wait)(struct KNN_Channel *channel);
+    void (*close)(struct KNN_Channel *channel);
+};
+
+// A stream of messages of a single datatype, passed around the ring.
+struct KNN_Channel {
+    const struct KNN_Transport *transport;
+    void *slots[2];          // Buffers incoming messages land on.
+    int capacity;            // Elements of type every slot holds.
+    MPI_Datatype type;
+    int tag;
+    int prev_task;           // Rank messages are received from.
+    int next_task;           // Rank messages are sent to.
+    int slot;                // Slot of current message.
+    int receiving;           // Whether a message is on its way to the slot.
+    int sending;             // Whether a message is on its way to next task.
+    int recv_first;          // Whether blocking exchanges receive first.
+    MPI_Request requests[3]; // Receives of the slots and current send.
+    MPI_Win windows[2];      // Windows exposing the slots, for rma.
+    MPI_Group groups[2];     // Groups of previous and next task, for rma.
+};
+
+// The segments of memory the processes of a node share.
+struct KNN_Shared {
+    MPI_Win window;          // Shared window of the segments.
+    void *local;             // Segment of current process.
+};
+
+/**
+ * Selects the transport channels opened from now on use.
+ *
+ * Parameters:
+ *  -transport: One of KNN_TRANSPORT_* values.
+ */
+void knn_set_transport(int transport);
+
+/**
+ * Returns the KNN_TRANSPORT_* value of the selected transport.
+ */
+int knn_get_transport(void);
+
+/**
+ * Returns the KNN_TRANSPORT_* value of a transport name, i.e. "nonblocking",
+ * "blocking", "sendrecv" or "rma", or -1 for an unknown name.
+ */
+int knn_parse_transport(const char *name);
+
+/**
+ * Returns the name of the given KNN_TRANSPORT_* value.
+ */
+const char *knn_transport_name(int transport);
+
+/**
+ * Opens a channel on the selected transport. It should be called by all
+ * processes in MPI_COMM_WORLD.
+ *
+ * Parameters:
+ *  -channel: The channel to be opened.
+ *  -slot0: The first buffer incoming messages land on.
+ *  -slot1: The second buffer incoming messages land on.
+ *  -capacity: The number of elements every slot holds.
+ *  -type: The datatype of the elements of messages.
+ *  -tag: The tag of messages, distinct from the tags of other channels
+ *          used at the same time.
+ *  -prev_task: The rank of previous node in MPI_COMM_WORLD.
+ *  -next_task: The rank of next node in MPI_COMM_WORLD.
+ */
+void knn_channel_open(struct KNN_Channel *channel, void *slot0, void *slot1,
+                      int capacity, MPI_Datatype type, int tag,
+                      int prev_task, int next_task);
+
+/**
+ * Begins the exchange of a message, which lands on given slot (0 or 1). All
+ * processes should use the same slot on the same step.
+ */
+void knn_channel_recv(struct KNN_Channel *channel, int slot);
+
+/**
+ * Takes the place of knn_channel_recv() on a step nothing is received, as
+ * previous process sends nothing. Slot is still selected, since some
+ * transports send to the same slot of next process.
+ */
+void knn_channel_skip(struct KNN_Channel *channel, int slot);
+
+/**
+ * Sends a message to next process, as part of the exchange begun by
+ * knn_channel_recv(). Data should not be modified until the exchange
+ * completes. knn_channel_pass() takes its place, when next process receives
+ * nothing on this step.
+ *
+ * Parameters:
+ *  -channel: The channel to send through.
+ *  -data: The elements of the message.
+ *  -count: The number of elements, no more than the capacity of the slots of
+ *          next process.
+ */
+void knn_channel_send(struct KNN_Channel *channel, const void *data,
+                      int count);
+
+/**
+ * Takes the place of knn_channel_send() on a step nothing is sent, while a
+ * message is received. Blocking transports receive it at this point, so
+ * exchanges of many channels complete in the same order on all processes.
+ */
+void knn_channel_pass(struct KNN_Channel *channel);
+
+/**
+ * Tests whether current exchange is complete, letting MPI progress it.
+ *
+ * A completed exchange should still be matched by knn_channel_wait(), which
+ * then returns immediately.
+ *
+ * Returns:
+ *  1 if exchange is complete, else 0.
+ */
+int knn_channel_test(struct KNN_Channel *channel);
+
+/**
+ * Blocks until current exchange is complete.
+ */
+void knn_channel_wait(struct KNN_Channel *channel);
+
+/**
+ * Closes a channel. It should be called by all processes in MPI_COMM_WORLD,
+ * with no exchange in progress.
+ */
+void knn_channel_close(struct KNN_Channel *channel);
+
+/**
+ * Enables or disables sharing memory between the processes of a node, in
+ * ring drivers. Disabled by default.
+ */
+void knn_set_node_sharing(int enabled);
+
+/**
+ * Returns 1 if sharing memory between the processes of a node is enabled,
+ * else 0.
+ */
+int knn_get_node_sharing(void);
+
+/**
+ * Returns the node a process of MPI_COMM_WORLD runs on, as the lowest rank
+ * running on it. Nodes are discovered on first call, which should be made
+ * by all processes in MPI_COMM_WORLD.
+ *
+ * Parameters:
+ *  -task: The rank of the process in MPI_COMM_WORLD.
+ */
+int knn_node_of(int task);
+
+/**
+ * Returns the communicator of the processes running on the same node as
+ * current one, ordered as in MPI_COMM_WORLD, or MPI_COMM_NULL on failure.
+ * Nodes are discovered on first call, which should be made by all processes
+ * in MPI_COMM_WORLD. The communicator is owned by knn_transport.c and should
+ * not be freed.
+ */
+MPI_Comm knn_node_comm(void);
+
+/**
+ * Allocates a segment of memory for current process, that all processes of
+ * its node can access. It should be called by all processes in
+ * MPI_COMM_WORLD.
+ *
+ * Segments are aligned to MATRIX_ALIGNMENT, so they may hold matrix data.
+ *
+ * Parameters:
+ *  -bytes: The size of the segment, which may differ between processes.
+ *  -shared: A reference to the object to keep the state of the segments.
+ *
+ * Returns:
+ *  0 on success, -1 on failure. It fails on all processes, or on none.
+ */
+int knn_shared_create(size_t bytes, struct KNN_Shared *shared);
+
+/**
+ * Makes what current process has written in its segment visible to the
+ * rest of its node. It should be called by all processes in MPI_COMM_WORLD,
+ * after writing their segments and before reading any other one.
+ */
+void knn_shared_publish(struct KNN_Shared *shared);
+
+/**
+ * Returns the segment of given process of MPI_COMM_WORLD, or NULL when it
+ * runs on another node.
+ */
+void *knn_shared_query(struct KNN_Shared *shared, int task);
+
+/**
+ * Releases the segments. It should be called by all processes in
+ * MPI_COMM_WORLD.
+ */
+void knn_shared_destroy(struct KNN_Shared *shared);
+
+#endif
@@ -0,0 +1,396 @@
+/**
+ * knn_tree.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation provided for routines defined in knn_tree.h
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "matrix.h"
+#include "knn.h"
+#include "knn_topk.h"
+#include "knn_tree.h"
+
+
+// A subtree pending to be visited by a query, along with a lower bound of
+// the distance of its points from the query.
+struct Tree_Visit {
+    int node;
+    double bound;
+};
+
+static int _build_node(struct KNN_Tree *tree, double *dists,
+                       int start, int end, double near, double far);
+static int _new_node(struct KNN_Tree *tree);
+static double _vantage_distances(struct KNN_Tree *tree, double *dists,
+                                 int start, int end);
+static void _select(int *order, double *dists, int lo, int hi, int nth);
+static void _range_bounds(const double *dists, int start, int end,
+                          double *near, double *far);
+static double _child_bound(const struct KNN_Tree_Node *child, double d);
+static void _search_point(struct KNN_Tree *tree, int d_offset,
+                          matrix_t *points, int row, int self, int k,
+                          double scale, struct KNN_Pair *knn);
+
+
+struct KNN_Tree *knn_tree_build(matrix_t *data)
+{
+    if (!data) {
+        printf("ERROR: knn_tree_build() : Invalid Arguments.\n");
+        return NULL;
+    }
+
+    int rows = matrix_get_rows(data);
+
+    // Every node has a distinct vantage point, so there can't be more
+    // nodes than rows.
+    struct KNN_Tree *tree = (struct KNN_Tree *) malloc(sizeof(struct KNN_Tree));
+    int *order = (int *) malloc(sizeof(int) * (rows + 1));
+    struct KNN_Tree_Node *nodes = (struct KNN_Tree_Node *) malloc(
+            sizeof(struct KNN_Tree_Node) * (rows + 1));
+    double *dists = (double *) malloc(sizeof(double) * (rows + 1));
+    if (!tree || !order || !nodes || !dists) {
+        printf("ERROR: knn_tree_build() : Failed to allocate memory.\n");
+        free(tree);
+        free(order);
+        free(nodes);
+        free(dists);
+        return NULL;
+    }
+
+    tree->data = data;
+    tree->order = order;
+    tree->nodes = nodes;
+    tree->node_count = 0;
+    for (int i = 0; i < rows; i++) order[i] = i;
+
+    // Subtrees cover disjoint ranges of order and dists, so they can be
+    // built by independent tasks.
+    if (rows > 0) {
+        #pragma omp parallel
+        #pragma omp single
+        _build_node(tree, dists, 0, rows, 0.0, 0.0);
+    }
+
+    free(dists);
+
+    return tree;
+}
+
+void knn_tree_destroy(struct KNN_Tree *tree)
+{
+    if (!tree) return;
+    free(tree->order);
+    free(tree->nodes);
+    free(tree);
+}
+
+int knn_tree_search_update(struct KNN_Tree *tree, int d_offset,
+                           matrix_t *points, int p_offset, int k,
+                           double tolerance, struct KNN_Pair **knns)
+{
+    if (!tree || !points || !knns || k < 1 || tolerance < 0.0) {
+        printf("ERROR: knn_tree_search_update() : Invalid Arguments.\n");
+        return -1;
+    }
+    if (matrix_get_cols(points) != matrix_get_cols(tree->data)) {
+        printf("ERROR: knn_tree_search_update() : Points and data are of "
+               "different width.\n");
+        return -1;
+    }
+    if (tree->node_count == 0) return 0;
+
+    int pointc = matrix_get_rows(points);
+    double scale = 1.0 + tolerance;
+
+    // Queries visit different parts of the tree, so they are distributed
+    // dynamically.
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int p = 0; p < pointc; p++) {
+        int self = p_offset >= 0 ? p_offset + p : -1;
+        _search_point(tree, d_offset, points, p, self, k, scale, knns[p]);
+        knn_progress();
+    }
+
+    return 0;
+}
+
+double knn_tree_lower_bound(struct KNN_Tree *tree, matrix_t *points, int row)
+{
+    if (!tree || tree->node_count == 0) return INFINITY;
+
+    // All points lie within the radius of root, around its vantage point.
+    struct KNN_Tree_Node *root = &tree->nodes[0];
+    double d = sqrt(knn_sq_distance(tree->data, root->vantage, points, row));
+    double bound = d - root->radius - 4 * DBL_EPSILON * (d + root->radius);
+    return bound > 0.0 ? bound : 0.0;
+}
+
+int knn_parse_backend(const char *name)
+{
+    if (!strcmp(name, "brute")) return KNN_BACKEND_BRUTE;
+    if (!strcmp(name, "vptree")) return KNN_BACKEND_VPTREE;
+    return -1;
+}
+
+const char *knn_backend_name(int backend)
+{
+    switch (backend) {
+    case KNN_BACKEND_VPTREE: return "vptree";
+    default: return "brute";
+    }
+}
+
+
+/**
+ * Builds the subtree of the points at positions [start, end) of tree's
+ * order.
+ *
+ * Parameters:
+ *  -tree: The tree being built.
+ *  -dists: A buffer of a double for each row of data, used for the distances
+ *          from vantage points.
+ *  -start: The first position of subtree's points.
+ *  -end: The position after the last one.
+ *  -near: Least distance of subtree's points from parent's vantage point.
+ *  -far: Greatest distance of subtree's points from parent's vantage point.
+ *
+ * Returns:
+ *  The node of subtree's root.
+ */
+static int _build_node(struct KNN_Tree *tree, double *dists,
+                       int start, int end, double near, double far)
+{
+    int id = _new_node(tree);
+    struct KNN_Tree_Node *node = &tree->nodes[id];
+    int count = end - start;
+
+    node->vantage = tree->order[start];
+    node->start = start;
+    node->end = end;
+    node->inner = -1;
+    node->outer = -1;
+    node->near = near;
+    node->far = far;
+    node->radius = _vantage_distances(tree, dists, start, end);
+
+    if (count <= KNN_TREE_LEAF_SIZE) return id;
+
+    // Rest points are split in two halves by position, so the nearest half
+    // goes to inner subtree.
+    int mid = start + 1 + (count - 1) / 2;
+    _select(tree->order, dists, start + 1, end, mid);
+
+    double inner_near, inner_far, outer_near, outer_far;
+    _range_bounds(dists, start + 1, mid, &inner_near, &inner_far);
+    _range_bounds(dists, mid, end, &outer_near, &outer_far);
+
+    if (mid > start + 1) {
+        #pragma omp task if (mid - start - 1 >= KNN_TREE_TASK_MIN)
+        node->inner = _build_node(tree, dists, start + 1, mid,
+                                  inner_near, inner_far);
+    }
+    if (end > mid) {
+        #pragma omp task if (end - mid >= KNN_TREE_TASK_MIN)
+        node->outer = _build_node(tree, dists, mid, end,
+                                  outer_near, outer_far);
+    }
+    #pragma omp taskwait
+
+    return id;
+}
+
+/**
+ * Reserves the next free node of a tree.
+ */
+static int _new_node(struct KNN_Tree *tree)
+{
+    int id;
+    #pragma omp atomic capture
+    id = tree->node_count++;
+    return id;
+}
+
+/**
+ * Computes the distances of points at positions (start, end) of tree's order,
+ * from the vantage point at start.
+ *
+ * Returns:
+ *  The greatest of the distances, or 0 when there are no such points.
+ */
+static double _vantage_distances(struct KNN_Tree *tree, double *dists,
+                                 int start, int end)
+{
+    matrix_t *data = tree->data;
+    int *order = tree->order;
+    int vantage = order[start];
+
+    dists[start] = 0.0;
+
+    // Ranges of the top levels are large enough to be split in tasks of
+    // their own.
+    #pragma omp taskloop if (end - start >= KNN_TREE_TASK_MIN) grainsize(1024)
+    for (int i = start + 1; i < end; i++) {
+        dists[i] = sqrt(knn_sq_distance(data, vantage, data, order[i]));
+    }
+
+    double radius = 0.0;
+    for (int i = start + 1; i < end; i++) {
+        if (dists[i] > radius) radius = dists[i];
+    }
+    return radius;
+}
+
+/**
+ * Partially sorts positions [lo, hi) of order, along with their distances,
+ * so the one at position nth is in its sorted position, lower ones are not
+ * further and upper ones are not nearer. Equal distances are ordered by row,
+ * so the result doesn't depend on the initial order.
+ */
+static void _select(int *order, double *dists, int lo, int hi, int nth)
+{
+    while (hi - lo > 1) {
+        // Middle position is used as pivot and moved to the end.
+        int p = lo + (hi - lo) / 2;
+        int last = hi - 1;
+        int t = order[p]; order[p] = order[last]; order[last] = t;
+        double u = dists[p]; dists[p] = dists[last]; dists[last] = u;
+
+        int store = lo;
+        for (int i = lo; i < last; i++) {
+            if (dists[i] < dists[last] ||
+                (dists[i] == dists[last] && order[i] < order[last]))
+            {
+                t = order[i]; order[i] = order[store]; order[store] = t;
+                u = dists[i]; dists[i] = dists[store]; dists[store] = u;
+                store++;
+            }
+        }
+        t = order[store]; order[store] = order[last]; order[last] = t;
+        u = dists[store]; dists[store] = dists[last]; dists[last] = u;
+
+        if (nth == store) return;
+        if (nth < store) hi = store;
+        else lo = store + 1;
+    }
+}
+
+/**
+ * Finds the least and greatest distances in positions [start, end).
+ */
+static void _range_bounds(const double *dists, int start, int end,
+                          double *near, double *far)
+{
+    *near = INFINITY;
+    *far = 0.0;
+    for (int i = start; i < end; i++) {
+        if (dists[i] < *near) *near = dists[i];
+        if (dists[i] > *far) *far = dists[i];
+    }
+}
+
+/**
+ * Returns a lower bound of the distance between a query and the points of
+ * a subtree, given the distance d of the query from parent's vantage point.
+ *
+ * Bound is lowered by a few ulps, so rounding errors of computed distances
+ * never cause a subtree containing a tied neighbor to be skipped.
+ */
+static double _child_bound(const struct KNN_Tree_Node *child, double d)
+{
+    double bound = child->near - d;
+    if (d - child->far > bound) bound = d - child->far;
+    bound -= 4 * DBL_EPSILON * (d + child->far);
+    return bound > 0.0 ? bound : 0.0;
+}
+
+/**
+ * Offers to the selector of a query point, all the points of the tree that
+ * may be nearer than its current k-th nearest neighbor.
+ *
+ * Subtrees are visited depth first, nearest half first, so the selector
+ * fills with near neighbors early and further subtrees get skipped.
+ *
+ * Parameters:
+ *  -tree: The tree to be searched.
+ *  -d_offset: The index of the first row of indexed data.
+ *  -points: The matrix of the query point.
+ *  -row: The row of the query point.
+ *  -self: The index of the query point, or -1.
+ *  -k: The number of nearest neighbors kept.
+ *  -scale: A factor all bounds are multiplied by, i.e. 1 + tolerance.
+ *  -knn: The selector of the query point.
+ */
+static void _search_point(struct KNN_Tree *tree, int d_offset,
+                          matrix_t *points, int row, int self, int k,
+                          double scale, struct KNN_Pair *knn)
+{
+    struct Tree_Visit stack[2 * KNN_TREE_MAX_DEPTH];
+    int top = 0;
+    matrix_t *data = tree->data;
+
+    stack[top].node = 0;
+    stack[top].bound = 0.0;
+    top++;
+
+    while (top > 0) {
+        top--;
+        struct KNN_Tree_Node *node = &tree->nodes[stack[top].node];
+
+        // Kept neighbors may have improved since subtree was pushed.
+        double bound = stack[top].bound * scale;
+        if (bound * bound > knn_topk_worst(knn, k)->distance) continue;
+
+        if (node->inner < 0 && node->outer < 0) {
+            for (int i = node->start; i < node->end; i++) {
+                int r = tree->order[i];
+                if (d_offset + r == self) continue;
+                knn_topk_push(knn, k, knn_sq_distance(points, row, data, r),
+                              d_offset + r);
+            }
+            continue;
+        }
+
+        double sq = knn_sq_distance(points, row, data, node->vantage);
+        if (d_offset + node->vantage != self) {
+            knn_topk_push(knn, k, sq, d_offset + node->vantage);
+        }
+        double d = sqrt(sq);
+
+        // The nearest subtree is pushed last, so it is visited first.
+        struct Tree_Visit children[2];
+        int n = 0;
+        if (node->inner >= 0) {
+            children[n].node = node->inner;
+            children[n].bound = _child_bound(&tree->nodes[node->inner], d);
+            n++;
+        }
+        if (node->outer >= 0) {
+            children[n].node = node->outer;
+            children[n].bound = _child_bound(&tree->nodes[node->outer], d);
+            n++;
+        }
+        if (n == 2 && children[0].bound < children[1].bound) {
+            struct Tree_Visit t = children[0];
+            children[0] = children[1];
+            children[1] = t;
+        }
+        for (int c = 0; c < n; c++) {
+            double b = children[c].bound * scale;
+            if (b * b <= knn_topk_worst(knn, k)->distance) {
+                stack[top++] = children[c];
+            }
+        }
+    }
+}
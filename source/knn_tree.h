@@ -0,0 +1,184 @@
+/**
+ * knn_tree.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * knn_tree.h defines a vantage point tree (VP-tree), that may be used as an
+ * alternative backend to the brute force search of knn.h, when data are of
+ * low intrinsic dimensionality.
+ *
+ * Every node of the tree selects one of its points as a vantage point and
+ * splits the rest into two halves, the inner one containing the points
+ * nearest to the vantage point. For each half, the range of distances of its
+ * points from the vantage point of their parent is kept, so a query can skip
+ * a whole subtree, when by the triangle inequality none of its points can be
+ * closer than its current k-th nearest neighbor.
+ *
+ * Halves are split by position rather than by a distance threshold, so the
+ * tree stays balanced even when many points are equidistant.
+ *
+ * Macros defined in knn_tree.h:
+ *  -KNN_TREE_LEAF_SIZE
+ *  -KNN_TREE_TASK_MIN
+ *  -KNN_TREE_MAX_DEPTH
+ *  -KNN_BACKEND_BRUTE
+ *  -KNN_BACKEND_VPTREE
+ *  -KNN_BACKEND_DEFAULT
+ *
+ * Types defined in knn_tree.h:
+ *  -struct KNN_Tree_Node
+ *  -struct KNN_Tree
+ *
+ * Functions defined in knn_tree.h:
+ *  -struct KNN_Tree *knn_tree_build(matrix_t *data)
+ *  -void knn_tree_destroy(struct KNN_Tree *tree)
+ *  -int knn_tree_search_update(struct KNN_Tree *tree, int d_offset,
+ *                              matrix_t *points, int p_offset, int k,
+ *                              double tolerance, struct KNN_Pair **knns)
+ *  -double knn_tree_lower_bound(struct KNN_Tree *tree, matrix_t *points,
+ *                               int row)
+ *  -int knn_parse_backend(const char *name)
+ *  -const char *knn_backend_name(int backend)
+ */
+
+#ifndef __knn_tree_h__
+#define __knn_tree_h__
+
+#include "matrix.h"
+#include "knn.h"
+
+
+// Greatest number of points kept in a leaf, which is scanned exhaustively.
+#ifndef KNN_TREE_LEAF_SIZE
+#define KNN_TREE_LEAF_SIZE 16
+#endif
+
+// Least number of points of a subtree, for it to be built by a task of its
+// own.
+#ifndef KNN_TREE_TASK_MIN
+#define KNN_TREE_TASK_MIN 4096
+#endif
+
+// Greatest depth of a tree. Halves are split evenly, so it is never reached
+// by a tree of less than 2^KNN_TREE_MAX_DEPTH points.
+#define KNN_TREE_MAX_DEPTH 48
+
+// Backends a local search can be done with:
+//  -brute: Every point is compared against every data point, using the
+//      cache blocked engine of distance.h.
+//  -vptree: Data points are indexed by a VP-tree and only the subtrees
+//      that may contain nearer neighbors are visited.
+#define KNN_BACKEND_BRUTE 0
+#define KNN_BACKEND_VPTREE 1
+
+// Backend used when none is explicitly selected.
+#ifndef KNN_BACKEND_DEFAULT
+#define KNN_BACKEND_DEFAULT KNN_BACKEND_BRUTE
+#endif
+
+// A node of a VP-tree. Points of the subtree rooted at a node occupy the
+// positions [start, end) of the order of the tree, with the vantage point
+// placed first.
+struct KNN_Tree_Node {
+    int vantage;      // Row of data used as vantage point.
+    int start;        // First position of the subtree's points.
+    int end;          // Position after the last one.
+    int inner;        // Node of the half nearest to vantage point, or -1.
+    int outer;        // Node of the other half, or -1.
+    double near;      // Least distance of subtree's points from the vantage
+                      // point of parent node.
+    double far;       // Greatest distance of subtree's points from the
+                      // vantage point of parent node.
+    double radius;    // Greatest distance of subtree's points from the
+                      // vantage point of this node.
+};
+
+// A VP-tree, indexing the rows of a matrix. Node 0 is the root.
+struct KNN_Tree {
+    matrix_t *data;   // Indexed data, not owned by the tree.
+    int *order;       // Rows of data, in the order of the nodes.
+    struct KNN_Tree_Node *nodes;
+    int node_count;
+};
+
+/**
+ * Builds a VP-tree on the rows of given matrix.
+ *
+ * Subtrees are built in parallel, by OpenMP tasks. Data are not copied, so
+ * the matrix should outlive the tree and should not be modified.
+ *
+ * Parameters:
+ *  -data: A matrix of either doubles or floats.
+ *
+ * Returns:
+ *  A new tree, that should be destroyed by knn_tree_destroy(), or NULL
+ *  on failure.
+ */
+struct KNN_Tree *knn_tree_build(matrix_t *data);
+
+/**
+ * Destroys a tree created by knn_tree_build().
+ */
+void knn_tree_destroy(struct KNN_Tree *tree);
+
+/**
+ * Updates the nearest neighbors of given points, with the ones found in the
+ * data indexed by given tree.
+ *
+ * It works the same way as knn_search_update(), i.e. knns is a table of
+ * top-k selectors keeping squared distances. Distances are computed directly,
+ * in double precision, from the cells of the matrices, whichever their type.
+ *
+ * With a tolerance of 0 the search is exact. A positive tolerance allows
+ * skipping subtrees whose points may only be closer than the current k-th
+ * nearest neighbor by a factor less than (1 + tolerance). Then, every
+ * returned neighbor is at most (1 + tolerance) times further than the
+ * true one of the same rank.
+ *
+ * Parameters:
+ *  -tree: The tree of data points to be searched.
+ *  -d_offset: The index of the first row of indexed data.
+ *  -points: The query points, of the same width as indexed data.
+ *  -p_offset: The index of the first row of points, or -1. A point is never
+ *          considered a neighbor of itself.
+ *  -k: The number of nearest neighbors kept for each point.
+ *  -tolerance: The allowed relative error of distances, 0 for an exact
+ *          search.
+ *  -knns: The selectors of all points.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int knn_tree_search_update(struct KNN_Tree *tree, int d_offset,
+                           matrix_t *points, int p_offset, int k,
+                           double tolerance, struct KNN_Pair **knns);
+
+/**
+ * Returns a lower bound of the distance between given point and any point
+ * indexed by the tree, using the bounds of its root. It can be used for
+ * skipping a whole block of data.
+ *
+ * Parameters:
+ *  -tree: The tree of data points.
+ *  -points: A matrix of the same width as indexed data.
+ *  -row: The row of points.
+ *
+ * Returns:
+ *  The lower bound (not squared), or INFINITY for a tree of no points.
+ */
+double knn_tree_lower_bound(struct KNN_Tree *tree, matrix_t *points, int row);
+
+/**
+ * Returns the KNN_BACKEND_* value of a backend name, i.e. "brute" or
+ * "vptree", or -1 for an unknown name.
+ */
+int knn_parse_backend(const char *name);
+
+/**
+ * Returns the name of the given KNN_BACKEND_* value.
+ */
+const char *knn_backend_name(int backend);
+
+#endif
@@ -8,47 +8,107 @@
  * matrix.c provides an implementation for routines defined in matrix.h.
  */
 
+#define _POSIX_C_SOURCE 200809L  // For posix_memalign(), mmap() and pread().
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "matrix.h"
 
 
+static matrix_t *_matrix_create_typed(int32_t rows, int32_t cols,
+									  int32_t type);
+static int _check_chunk_request(const char *filename, int32_t total_rows,
+								int32_t cols, int32_t chunks_num,
+								int32_t req_chunk);
+
+
 matrix_t *matrix_create(int32_t rows, int32_t cols)
 {
-	// Allocate a new matrix_t object.
-	matrix_t *matrix = (matrix_t *) malloc(sizeof(matrix_t));
-	if (matrix == NULL) return NULL;
+	return _matrix_create_typed(rows, cols, MATRIX_DOUBLE);
+}
 
-	matrix->rows = rows;
-	matrix->cols = cols;
 
-	// Allocate memory for rows * cols doubles.
-	matrix->data = (double **) malloc(sizeof(double *) * rows);
-	if (matrix->data == NULL) return NULL;  // -- Memory leak, cleanup pending. --
+matrix_t *matrix_create_float(int32_t rows, int32_t cols)
+{
+	return _matrix_create_typed(rows, cols, MATRIX_FLOAT);
+}
+
+
+matrix_t *matrix_to_float(matrix_t *matrix)
+{
+	int32_t rows = matrix_get_rows(matrix);
+	int32_t cols = matrix_get_cols(matrix);
+
+	matrix_t *converted = matrix_create_float(rows, cols);
+	if (converted == NULL) return NULL;
 
 	for (int32_t i = 0; i < rows; i++) {
-		matrix->data[i] = (double *) malloc(sizeof(double) * cols);
-		if (matrix->data[i] == NULL) return NULL;  // -- Memory leak, cleanup pending. --
+		const double *src = matrix_get_row(matrix, i);
+		float *dst = matrix_get_frow(converted, i);
+		for (int32_t j = 0; j < cols; j++) dst[j] = (float) src[j];
 	}
+	converted->chunk_offset = matrix->chunk_offset;
 
-    // A newly created matrix is always considered to be the first in its
-    // container array.
-    matrix->chunk_offset = 0;
-
-	return matrix;
+	return converted;
 }
 
 
 void matrix_destroy(matrix_t *matrix)
 {
-    for (int32_t i = 0; i < matrix->rows; i++) {
-		free(matrix->data[i]);
-	}
+	if (matrix == NULL) return;
+
+	if (matrix->mapping) munmap(matrix->mapping, matrix->mapping_size);
+	else free(matrix->data);
+	free(matrix->fdata);
 	free(matrix);
 }
 
 
+int32_t matrix_padded_cols(int32_t cols)
+{
+	int32_t align = MATRIX_ALIGNMENT / sizeof(double);
+
+	if (cols < align) return cols;
+	return ((cols + align - 1) / align) * align;
+}
+
+
+int matrix_set_shape(matrix_t *matrix, int32_t rows, int32_t stride)
+{
+	if (rows < 0 || stride < matrix->cols ||
+		(size_t) rows * stride > matrix->capacity)
+	{
+		return -1;
+	}
+
+	matrix->rows = rows;
+	matrix->stride = stride;
+
+	return 0;
+}
+
+
+void matrix_chunk_bounds(int32_t total_rows, int32_t chunks_num,
+						 int32_t req_chunk, int32_t *offset, int32_t *rows)
+{
+	int32_t base = total_rows / chunks_num;
+	int32_t remaining = total_rows % chunks_num;
+
+	if (req_chunk < remaining) {
+		*rows = base + 1;
+		*offset = req_chunk * (base + 1);
+	} else {
+		*rows = base;
+		*offset = ((base + 1) * remaining) + (base * (req_chunk - remaining));
+	}
+}
+
+
 matrix_t *matrix_load_in_chunks(const char *filename,
 								int32_t chunks_num,
 								int32_t req_chunk)
@@ -63,51 +123,149 @@ matrix_t *matrix_load_in_chunks(const char *filename,
 	int32_t rows;  // Rows contained in requested chunk.
 	int32_t cols;  // Columns of the matrix.
 
-	// Read total rows counter.
-	int rc = fread(&total_rows, sizeof(int32_t), 1, f);
-	if (rc != 1) {
-		printf("ERROR: Failed to read rows number.\n");
-		exit(-1);
+	// Read total rows and columns counters.
+	if (fread(&total_rows, sizeof(int32_t), 1, f) != 1 ||
+		fread(&cols, sizeof(int32_t), 1, f) != 1)
+	{
+		printf("ERROR: matrix_load_in_chunks : Failed to read header of %s\n",
+			   filename);
+		fclose(f);
+		return NULL;
 	}
-
-	// Read columns counter.
-	rc = fread(&cols, sizeof(int32_t), 1, f);
-	if (rc != 1) {
-		printf("ERROR: Failed to read cols number.\n");
-		exit(-1);
+	if (_check_chunk_request(filename, total_rows, cols,
+							 chunks_num, req_chunk) != 0)
+	{
+		fclose(f);
+		return NULL;
 	}
 
 	// Break the file into given number of chunks and set file
 	// position to the beggining of the requested chunk.
-	rows = total_rows / chunks_num;
-	int remaining = total_rows % chunks_num;
-	long int offset;
-	if (req_chunk < remaining) {
-		rows++;
-		offset = req_chunk * rows;
-	} else {
-		offset = ((rows + 1) * remaining) + (rows * (req_chunk - remaining));
+	int32_t offset;
+	matrix_chunk_bounds(total_rows, chunks_num, req_chunk, &offset, &rows);
+
+	if (fseek(f, (long) (sizeof(double) * offset * cols), SEEK_CUR) != 0) {
+		printf("ERROR: matrix_load_in_chunks : Failed to seek in %s\n",
+			   filename);
+		fclose(f);
+		return NULL;
 	}
 
-	rc = fseek(f, sizeof(double) * offset * cols, SEEK_CUR);
-
 	matrix_t *matrix = matrix_create(rows, cols);
+	if (matrix == NULL) {
+		printf("ERROR: matrix_load_in_chunks : Failed to allocate memory.\n");
+		fclose(f);
+		return NULL;
+	}
     matrix->chunk_offset = offset;  // Set the offset of the matrix object
                                     // to the number of rows from the beggining
                                     // of the file, till the first row to
                                     // be included in this matrix.
 
-	// Read data from file, row by row.
-	for(int32_t i = 0; i < rows; i++) {
-		rc = fread(matrix->data[i], sizeof(double), cols, f);
-		if (rc != cols) {
-			printf("Failed in reading col %d. \n", i+1);
-			exit(-1);
+	// Read data from file. When rows are not padded, the whole chunk is read
+	// at once. Otherwise, each row is read to its own place.
+	int failed = 0;
+	if (matrix_get_stride(matrix) == cols) {
+		size_t cells = (size_t) rows * cols;
+		failed = fread(matrix->data, sizeof(double), cells, f) != cells;
+	}
+	else {
+		for(int32_t i = 0; i < rows && !failed; i++) {
+			failed = fread(matrix_get_row(matrix, i), sizeof(double),
+						   cols, f) != (size_t) cols;
 		}
 	}
-
 	fclose(f);
 
+	if (failed) {
+		printf("ERROR: matrix_load_in_chunks : Failed in reading data of %s\n",
+			   filename);
+		matrix_destroy(matrix);
+		return NULL;
+	}
+
+	return matrix;
+}
+
+
+matrix_t *matrix_map_in_chunks(const char *filename,
+							   int32_t chunks_num,
+							   int32_t req_chunk)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("ERROR: matrix_map_in_chunks : Failed to open %s\n", filename);
+		return NULL;
+	}
+
+	int32_t header[2];  // Total rows and columns counters.
+	struct stat info;
+	if (pread(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+		fstat(fd, &info) != 0)
+	{
+		printf("ERROR: matrix_map_in_chunks : Failed to read header of %s\n",
+			   filename);
+		close(fd);
+		return NULL;
+	}
+	int32_t total_rows = header[0];
+	int32_t cols = header[1];
+	if (_check_chunk_request(filename, total_rows, cols,
+							 chunks_num, req_chunk) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	int32_t offset;
+	int32_t rows;
+	matrix_chunk_bounds(total_rows, chunks_num, req_chunk, &offset, &rows);
+
+	// A truncated file would raise SIGBUS on access, so it is rejected here.
+	off_t start = MATRIX_HEADER_SIZE + (off_t) sizeof(double) * offset * cols;
+	size_t bytes = sizeof(double) * (size_t) rows * cols;
+	if ((off_t) (start + bytes) > info.st_size) {
+		printf("ERROR: matrix_map_in_chunks : %s is truncated.\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	matrix_t *matrix = (matrix_t *) malloc(sizeof(matrix_t));
+	if (matrix == NULL) {
+		printf("ERROR: matrix_map_in_chunks : Failed to allocate memory.\n");
+		close(fd);
+		return NULL;
+	}
+
+	// Mappings should begin at a page boundary, so the page containing the
+	// first cell of the chunk is the first one mapped.
+	off_t page = (off_t) sysconf(_SC_PAGESIZE);
+	off_t map_start = start - start % page;
+	size_t map_size = bytes + (size_t) (start - map_start);
+	void *mapping = NULL;
+	if (map_size > 0) {
+		mapping = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+					   fd, map_start);
+	}
+	close(fd);
+	if (mapping == MAP_FAILED || (map_size > 0 && mapping == NULL)) {
+		printf("ERROR: matrix_map_in_chunks : Failed to map %s\n", filename);
+		free(matrix);
+		return NULL;
+	}
+
+	matrix->data = mapping ?
+				   (double *) ((char *) mapping + (start - map_start)) : NULL;
+	matrix->fdata = NULL;
+	matrix->type = MATRIX_DOUBLE;
+	matrix->rows = rows;
+	matrix->cols = cols;
+	matrix->stride = cols;
+	matrix->capacity = (size_t) rows * cols;
+	matrix->mapping = mapping;
+	matrix->mapping_size = map_size;
+	matrix->chunk_offset = offset;
+
 	return matrix;
 }
 
@@ -134,9 +292,14 @@ char *matrix_serialize(matrix_t *matrix, size_t *bytec)
     memcpy(buffer, &cols, sizeof(int32_t)); buffer += sizeof(int32_t);
     memcpy(buffer, &offset, sizeof(int32_t)); buffer += sizeof(int32_t);
 
-    for (int32_t i = 0; i < rows; i++) {
-        memcpy(buffer, matrix->data[i], sizeof(double) * cols);
-        buffer += sizeof(double) * cols;
+    if (matrix_get_stride(matrix) == cols) {
+        memcpy(buffer, matrix->data, sizeof(double) * rows * cols);
+    }
+    else {
+        for (int32_t i = 0; i < rows; i++) {
+            memcpy(buffer, matrix_get_row(matrix, i), sizeof(double) * cols);
+            buffer += sizeof(double) * cols;
+        }
     }
 
     return serialized;
@@ -160,12 +323,102 @@ matrix_t *matrix_deserialize(char *bytes, size_t bytec)
     }
 
     matrix_t *matrix = matrix_create(rows, cols);
+    if (matrix == NULL) {
+        printf("ERROR: matrix_deserialize : Failed to allocate memory.\n");
+        return NULL;
+    }
     matrix->chunk_offset = offset;
 
-    for (int32_t i = 0; i < rows; i++) {
-        memcpy(matrix->data[i], buffer, sizeof(double) * cols);
-        buffer += sizeof(double) * cols;
+    if (matrix_get_stride(matrix) == cols) {
+        memcpy(matrix->data, buffer, sizeof(double) * rows * cols);
+    }
+    else {
+        for (int32_t i = 0; i < rows; i++) {
+            memcpy(matrix_get_row(matrix, i), buffer, sizeof(double) * cols);
+            buffer += sizeof(double) * cols;
+        }
     }
 
     return matrix;
 }
+
+/**
+ * Creates a new empty matrix, whose cells are of the given type.
+ *
+ * Parameters:
+ *	-rows: Number of rows the new matrix will contain.
+ *	-cols: Number of cols the new matrix will contain.
+ *	-type: MATRIX_DOUBLE or MATRIX_FLOAT.
+ *
+ * On successful creation returns the matrix object. On failure, returns
+ * NULL.
+ */
+static matrix_t *_matrix_create_typed(int32_t rows, int32_t cols,
+									  int32_t type)
+{
+	// Allocate a new matrix_t object.
+	matrix_t *matrix = (matrix_t *) malloc(sizeof(matrix_t));
+	if (matrix == NULL) return NULL;
+
+	matrix->rows = rows;
+	matrix->cols = cols;
+	matrix->stride = matrix_padded_cols(cols);
+	matrix->type = type;
+	matrix->data = NULL;
+	matrix->fdata = NULL;
+	matrix->mapping = NULL;
+	matrix->mapping_size = 0;
+
+	// Allocate a single aligned buffer for all rows. At least one cell is
+	// allocated, so empty matrices are valid objects too.
+	size_t cells = (size_t) rows * matrix->stride;
+	size_t cell_size = matrix_get_cell_size(matrix);
+	void *buffer = NULL;
+	if (posix_memalign(&buffer, MATRIX_ALIGNMENT,
+					   cell_size * (cells > 0 ? cells : 1)))
+	{
+		free(matrix);
+		return NULL;
+	}
+	if (type == MATRIX_FLOAT) matrix->fdata = (float *) buffer;
+	else matrix->data = (double *) buffer;
+	matrix->capacity = cells;
+
+	// Padding cells are zeroed, so vectorized kernels can safely process
+	// whole strides.
+	if (matrix->stride > cols) {
+		for (int32_t i = 0; i < rows; i++) {
+			char *row = (char *) buffer + cell_size * i * matrix->stride;
+			memset(row + cell_size * cols, 0,
+				   cell_size * (matrix->stride - cols));
+		}
+	}
+
+    // A newly created matrix is always considered to be the first in its
+    // container array.
+    matrix->chunk_offset = 0;
+
+	return matrix;
+}
+
+/**
+ * Validates the header of a matrix file against a requested chunk.
+ *
+ * Returns:
+ *	0 if requested chunk can be loaded, else -1.
+ */
+static int _check_chunk_request(const char *filename, int32_t total_rows,
+								int32_t cols, int32_t chunks_num,
+								int32_t req_chunk)
+{
+	if (total_rows < 0 || cols < 1) {
+		printf("ERROR: %s is not a valid matrix file.\n", filename);
+		return -1;
+	}
+	if (chunks_num < 1 || req_chunk < 0 || req_chunk >= chunks_num) {
+		printf("ERROR: Invalid chunk %d out of %d requested from %s\n",
+			   req_chunk, chunks_num, filename);
+		return -1;
+	}
+	return 0;
+}
@@ -8,22 +8,60 @@
  * matrix.h defines routines that may be used for creating and managing
  * matrices of doubles.
  *
+ * All cells of a matrix are stored into a single contiguous buffer, aligned
+ * to MATRIX_ALIGNMENT bytes, in row major order. Rows of at least
+ * MATRIX_ALIGNMENT / sizeof(double) columns are padded with zeros up to the
+ * stride of the matrix, so every row of such a matrix of doubles begins at
+ * an aligned address too. Narrower rows are not padded (see
+ * matrix_padded_cols()), so only the first one of them is aligned. Rows of
+ * matrices of floats share the stride of doubles, so they are only aligned
+ * to half of MATRIX_ALIGNMENT. Routines working on rows should therefore
+ * not assume they are aligned. The distance kernels load them by unaligned
+ * loads. Matrices mapped by matrix_map_in_chunks() are an exception, as
+ * their buffer is not aligned either.
+ *
+ * Matrices of floats are supported too, mainly as compact copies of matrices
+ * of doubles, that can be searched and transferred faster. Their cells are
+ * accessed through matrix_get_frow(), while cell accessors only work on
+ * matrices of doubles.
+ *
  * Types defined in knn.h:
  *  -matrix_t (opaque)
  *
  * Macros defined in knn.h:
+ *	-MATRIX_ALIGNMENT
+ *	-MATRIX_HEADER_SIZE
+ *	-MATRIX_DOUBLE
+ *	-MATRIX_FLOAT
+ *	-matrix_get_type(matrix)
  *	-matrix_get_cols(matrix)
  *	-matrix_get_rows(matrix)
+ *	-matrix_get_stride(matrix)
  *	-matrix_get_cell(matrix, row, col)
+ *	-matrix_get_row(matrix, row)
+ *	-matrix_get_frow(matrix, row)
+ *	-matrix_get_buffer(matrix)
+ *	-matrix_get_cell_size(matrix)
  *	-matrix_get_chunk_offset(matrix)
  *	-matrix_set_cell(matrix, row, col, value)
+ *	-matrix_set_chunk_offset(matrix, offset)
  *
  * Functions defined in knn.h:
  *	-matrix_t *matrix_create(int32_t rows, int32_t cols)
+ *	-matrix_t *matrix_create_float(int32_t rows, int32_t cols)
+ *	-matrix_t *matrix_to_float(matrix_t *matrix)
  *	-void matrix_destroy(matrix_t *matrix)
+ *	-int32_t matrix_padded_cols(int32_t cols)
+ *	-int matrix_set_shape(matrix_t *matrix, int32_t rows, int32_t stride)
+ *	-void matrix_chunk_bounds(int32_t total_rows, int32_t chunks_num,
+ *							  int32_t req_chunk, int32_t *offset,
+ *							  int32_t *rows)
  *	-matrix_t *matrix_load_in_chunks(const char *filename,
  *	   								 int32_t chunks_num,
  * 									 int32_t req_chunk)
+ *	-matrix_t *matrix_map_in_chunks(const char *filename,
+ *									int32_t chunks_num,
+ *									int32_t req_chunk)
  *	-char *matrix_serialize(matrix_t *matrix, size_t *bytec)
  *	-matrix_t *matrix_deserialize(char *bytes, size_t bytec)
  */
@@ -31,18 +69,45 @@
 #ifndef __matrix_h__
 #define __matrix_h__
 
+#include <stddef.h>
 #include <stdint.h>
 
 
+// Alignment in bytes of the buffer that holds matrix data.
+#define MATRIX_ALIGNMENT 64
+
+// Size in bytes of the header of a .karas file, i.e. of rows and cols
+// counters. Cells follow it, as doubles in row major order.
+#define MATRIX_HEADER_SIZE (2 * sizeof(int32_t))
+
+// Types of the cells of a matrix.
+#define MATRIX_DOUBLE 0
+#define MATRIX_FLOAT 1
+
 typedef struct {
-	double **data;             // Actual data of the matrix.
+	double *data;              // Actual data of a matrix of doubles, row by
+	                           // row. NULL for matrices of floats.
+	float *fdata;              // Actual data of a matrix of floats, row by
+	                           // row. NULL for matrices of doubles.
+	int32_t type;              // Type of cells, MATRIX_DOUBLE or MATRIX_FLOAT.
 	int32_t rows;              // Rows counter of the matrix.
 	int32_t cols;              // Columns counter of the matrix.
+	int32_t stride;            // Distance in cells between the beggining of
+	                           // two consecutive rows.
+	size_t capacity;           // Number of cells allocated for data.
+	void *mapping;             // Start of the file mapping that data points
+	                           // into, or NULL if data are allocated.
+	size_t mapping_size;       // Size in bytes of the mapping.
     int32_t chunk_offset;      // Offset of this matrix, in its container
                                // array, if it belongs to any.
 } matrix_t;
 
 
+/**
+ * Returns the type of the cells of the given matrix.
+ */
+#define matrix_get_type(matrix) matrix->type
+
 /**
  * Returns number of columns of the given matrix.
  */
@@ -53,10 +118,43 @@ typedef struct {
  */
 #define matrix_get_rows(matrix) matrix->rows
 
+/**
+ * Returns the distance in cells between two consecutive rows of the matrix.
+ */
+#define matrix_get_stride(matrix) matrix->stride
+
 /**
  * Returns the value of matrix cell.
  */
-#define matrix_get_cell(matrix, row, col) matrix->data[row][col]
+#define matrix_get_cell(matrix, row, col) \
+	matrix->data[(size_t) (row) * matrix->stride + (col)]
+
+/**
+ * Returns a pointer to the first cell of a row. Cells of the row are
+ * contiguous, followed by zero padding up to the stride of the matrix.
+ */
+#define matrix_get_row(matrix, row) \
+	(matrix->data + (size_t) (row) * matrix->stride)
+
+/**
+ * Returns a pointer to the first cell of a row of a matrix of floats.
+ */
+#define matrix_get_frow(matrix, row) \
+	(matrix->fdata + (size_t) (row) * matrix->stride)
+
+/**
+ * Returns a pointer to the beggining of the data buffer of a matrix,
+ * regardless of its type.
+ */
+#define matrix_get_buffer(matrix) \
+	(matrix->type == MATRIX_FLOAT ? \
+	 (void *) matrix->fdata : (void *) matrix->data)
+
+/**
+ * Returns the size in bytes of a single cell of the given matrix.
+ */
+#define matrix_get_cell_size(matrix) \
+	(matrix->type == MATRIX_FLOAT ? sizeof(float) : sizeof(double))
 
 /**
  * Returns the offset of the first row of current matrix chunk
@@ -67,12 +165,20 @@ typedef struct {
 /**
  * Sets the value of a matrix cell to the given one.
  */
-#define matrix_set_cell(matrix, row, col, value) matrix->data[row][col] = value
+#define matrix_set_cell(matrix, row, col, value) \
+	matrix->data[(size_t) (row) * matrix->stride + (col)] = value
+
+/**
+ * Sets the offset of the first row of current matrix chunk from the
+ * beggining of the complete matrix.
+ */
+#define matrix_set_chunk_offset(matrix, offset) matrix->chunk_offset = offset
 
 /**
  * Creates a new empty matrix object.
  *
- * Elements are not initialized, and their initial value is undefined.
+ * Elements are not initialized, and their initial value is undefined. Though,
+ * padding cells at the end of each row are always set to zero.
  *
  * Parameters:
  *	-rows: Number of rows the new matrix will contain.
@@ -83,6 +189,35 @@ typedef struct {
  */
 matrix_t *matrix_create(int32_t rows, int32_t cols);
 
+/**
+ * Creates a new empty matrix of floats.
+ *
+ * It works the same way as matrix_create(). Rows of the new matrix have
+ * the same stride, as the rows of a matrix of doubles with the same columns.
+ *
+ * Parameters:
+ *	-rows: Number of rows the new matrix will contain.
+ *	-cols: Number of cols the new matrix will contain.
+ *
+ * On successful creation returns the matrix object. On failure, returns
+ * NULL.
+ */
+matrix_t *matrix_create_float(int32_t rows, int32_t cols);
+
+/**
+ * Creates a matrix of floats out of a matrix of doubles.
+ *
+ * Every cell is rounded to the nearest float. The chunk offset of the
+ * original matrix is kept.
+ *
+ * Parameters:
+ *	-matrix: A matrix of doubles.
+ *
+ * Returns:
+ *	On success, the new matrix of floats. On failure, returns NULL.
+ */
+matrix_t *matrix_to_float(matrix_t *matrix);
+
 /**
  * Destroys a matrix object and releases its resources.
  *
@@ -91,6 +226,55 @@ matrix_t *matrix_create(int32_t rows, int32_t cols);
  */
 void matrix_destroy(matrix_t *matrix);
 
+/**
+ * Returns the stride that a matrix with the given number of columns will
+ * have.
+ *
+ * Rows wide enough are padded to a multiple of MATRIX_ALIGNMENT bytes. Narrow
+ * ones, like column matrices, are not padded at all, since padding would
+ * multiply their size.
+ *
+ * Parameters:
+ *	-cols: Number of columns of the matrix.
+ */
+int32_t matrix_padded_cols(int32_t cols);
+
+/**
+ * Changes the number of rows and the stride of a matrix, without touching
+ * its data buffer.
+ *
+ * It is intended for matrices used as receive buffers, which are created
+ * with the greatest number of rows expected and then take the shape of
+ * every matrix whose cells are copied into their buffer.
+ *
+ * Parameters:
+ *	-matrix: The matrix to reshape.
+ *	-rows: The new number of rows.
+ *	-stride: The new stride. It should not be lesser than matrix's columns.
+ *
+ * Returns:
+ *	0 on success. If the new shape doesn't fit into the allocated buffer,
+ *	matrix is left untouched and -1 is returned.
+ */
+int matrix_set_shape(matrix_t *matrix, int32_t rows, int32_t stride);
+
+/**
+ * Computes the rows of a matrix that belong to a chunk.
+ *
+ * Chunks are as equal in size as possible. The first total_rows % chunks_num
+ * chunks contain a single row more than the rest.
+ *
+ * Parameters:
+ *	-total_rows: The rows of the complete matrix.
+ *	-chunks_num: The total number of chunks the matrix is divided into.
+ *	-req_chunk: The index of the chunk. It ranges into [0, chunks_num-1].
+ *	-offset: A reference to the location to write the index of the first row
+ *			of the chunk.
+ *	-rows: A reference to the location to write the rows of the chunk.
+ */
+void matrix_chunk_bounds(int32_t total_rows, int32_t chunks_num,
+						 int32_t req_chunk, int32_t *offset, int32_t *rows);
+
 /**
  * Loads a chunk of a matrix object stored to filesystem.
  *
@@ -106,6 +290,9 @@ void matrix_destroy(matrix_t *matrix);
  * When loading a chunk, the offset of its first row from the beggining of the
  * complete matrix can be queried by using matrix_get_chunk_offset() function.
  *
+ * Chunk is read with buffered stdio calls. See matrix_mpi.h for loaders
+ * suited to many processes.
+ *
  * Parameters:
  *	-filename: A path to a file that stores a matrix object.
  * 	-chunks_num: The total number of chunks the matrix should be divided into.
@@ -119,9 +306,39 @@ matrix_t *matrix_load_in_chunks(const char *filename,
 								int32_t chunks_num,
 								int32_t req_chunk);
 
+/**
+ * Maps a chunk of a matrix object stored to filesystem, without copying it.
+ *
+ * The chunk is the same one matrix_load_in_chunks() would load, though its
+ * data point straight into a private memory mapping of the file. Pages are
+ * read on first access and are shared through the page cache by all
+ * processes of the node that map the same file. Writing to the matrix never
+ * modifies the file.
+ *
+ * Rows of a mapped matrix are not padded, i.e. its stride equals its columns,
+ * and neither its buffer nor its rows are aligned to MATRIX_ALIGNMENT, as
+ * they begin right after the header of the file. So a mapped matrix should
+ * only be passed to routines that do not assume aligned rows.
+ * matrix_destroy() releases the mapping.
+ *
+ * Parameters:
+ *	-filename: A path to a file that stores a matrix object.
+ * 	-chunks_num: The total number of chunks the matrix should be divided into.
+ *	-req_chunk: The index of chunk to be mapped. It ranges into [0, chunks_num-1].
+ *
+ * Returns:
+ *	On success, the matrix object corresponding to requested chunk. On
+ *	failure, returns NULL.
+ */
+matrix_t *matrix_map_in_chunks(const char *filename,
+							   int32_t chunks_num,
+							   int32_t req_chunk);
+
 /**
  * Serializes the given matrix object.
  *
+ * Only matrices of doubles can be serialized.
+ *
  * Parameters:
  *	-matrix: The matrix to serialize.
  *	-bytec: A reference to the location to write the size in bytes of serialized
@@ -0,0 +1,176 @@
+/**
+ * matrix_mpi.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * matrix_mpi.c provides an implementation for routines defined in
+ * matrix_mpi.h.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <mpi.h>
+#include "matrix.h"
+#include "matrix_mpi.h"
+
+
+int matrix_select_loader(MPI_Comm comm)
+{
+    char *requested = getenv("MATRIX_LOADER");
+    if (requested) {
+        if (!strcmp(requested, "stdio")) return MATRIX_LOADER_STDIO;
+        if (!strcmp(requested, "mmap")) return MATRIX_LOADER_MMAP;
+        if (!strcmp(requested, "mpiio")) return MATRIX_LOADER_MPIIO;
+    }
+
+    // Processes that share memory with each other, are on the same node.
+    MPI_Comm node_comm;
+    int node_size;
+    int size;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+                        &node_comm);
+    MPI_Comm_size(node_comm, &node_size);
+    MPI_Comm_size(comm, &size);
+    MPI_Comm_free(&node_comm);
+
+    // Processes may see a different environment, so the decision is common.
+    int single_node = node_size == size;
+    int all_single_node;
+    MPI_Allreduce(&single_node, &all_single_node, 1, MPI_INT, MPI_LAND, comm);
+
+    return all_single_node ? MATRIX_LOADER_MMAP : MATRIX_LOADER_MPIIO;
+}
+
+const char *matrix_loader_name(int loader)
+{
+    switch (loader) {
+    case MATRIX_LOADER_MMAP: return "mmap";
+    case MATRIX_LOADER_MPIIO: return "mpiio";
+    default: return "stdio";
+    }
+}
+
+matrix_t *matrix_load_distributed(const char *filename, int loader,
+                                  MPI_Comm comm)
+{
+    int size;
+    int rank;
+    MPI_Comm_size(comm, &size);
+    MPI_Comm_rank(comm, &rank);
+
+    switch (loader) {
+    case MATRIX_LOADER_MPIIO:
+        return matrix_load_in_chunks_mpiio(filename, comm);
+
+    case MATRIX_LOADER_MMAP: {
+        matrix_t *matrix = matrix_map_in_chunks(filename, size, rank);
+        // Some filesystems cannot be mapped, though they can still be read.
+        if (matrix) return matrix;
+        break;
+    }
+    }
+
+    return matrix_load_in_chunks(filename, size, rank);
+}
+
+matrix_t *matrix_load_in_chunks_mpiio(const char *filename, MPI_Comm comm)
+{
+    int size;
+    int rank;
+    MPI_Comm_size(comm, &size);
+    MPI_Comm_rank(comm, &rank);
+
+    MPI_File fh;
+    if (MPI_File_open(comm, (char *) filename, MPI_MODE_RDONLY,
+                      MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+    {
+        if (rank == 0) {
+            printf("ERROR: matrix_load_in_chunks_mpiio : Failed to open %s\n",
+                   filename);
+        }
+        return NULL;
+    }
+
+    // All processes need the header, so it is read collectively too.
+    int32_t header[2] = { -1, -1 };  // Total rows and columns counters.
+    MPI_File_read_at_all(fh, 0, header, 2, MPI_INT, MPI_STATUS_IGNORE);
+    int32_t total_rows = header[0];
+    int32_t cols = header[1];
+    if (total_rows < 0 || cols < 1) {
+        if (rank == 0) {
+            printf("ERROR: matrix_load_in_chunks_mpiio : %s is not a valid "
+                   "matrix file.\n", filename);
+        }
+        MPI_File_close(&fh);
+        return NULL;
+    }
+
+    int32_t offset;
+    int32_t rows;
+    matrix_chunk_bounds(total_rows, size, rank, &offset, &rows);
+
+    matrix_t *matrix = matrix_create(rows, cols);
+    int failed = matrix == NULL;
+
+    // Each row is read into its own place, skipping the padding at its end.
+    MPI_Datatype contiguous_row;
+    MPI_Datatype row_type;
+    MPI_Type_contiguous(cols, MPI_DOUBLE, &contiguous_row);
+    MPI_Type_create_resized(
+            contiguous_row, 0,
+            (MPI_Aint) sizeof(double) * matrix_padded_cols(cols), &row_type);
+    MPI_Type_commit(&row_type);
+
+    // Calls are collective, so every process takes part in as many reads as
+    // the process with the biggest chunk does, even with no rows left.
+    int32_t batch = MATRIX_MPIIO_MAX_CELLS / cols > 0 ?
+                    MATRIX_MPIIO_MAX_CELLS / cols : 1;
+    int calls = failed ? 0 : (rows + batch - 1) / batch;
+    int max_calls;
+    MPI_Allreduce(&calls, &max_calls, 1, MPI_INT, MPI_MAX, comm);
+
+    for (int i = 0; i < max_calls; i++) {
+        int32_t first = i * batch;
+        int32_t count = 0;
+        void *buffer = NULL;
+        if (i < calls) {
+            count = rows - first < batch ? rows - first : batch;
+            buffer = matrix_get_row(matrix, first);
+        }
+        MPI_Offset position = (MPI_Offset) MATRIX_HEADER_SIZE +
+                (MPI_Offset) sizeof(double) * (offset + first) * cols;
+
+        MPI_Status status;
+        int read;
+        if (MPI_File_read_at_all(fh, position, buffer, count, row_type,
+                                 &status) != MPI_SUCCESS ||
+            MPI_Get_count(&status, row_type, &read) != MPI_SUCCESS ||
+            read != count)
+        {
+            failed = 1;
+        }
+    }
+
+    MPI_Type_free(&row_type);
+    MPI_Type_free(&contiguous_row);
+    MPI_File_close(&fh);
+
+    // A failure on any process fails the whole load.
+    int any_failed;
+    MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_LOR, comm);
+    if (any_failed) {
+        if (failed) {
+            printf("ERROR: matrix_load_in_chunks_mpiio : Failed in reading "
+                   "chunk %d of %s\n", rank, filename);
+        }
+        matrix_destroy(matrix);
+        return NULL;
+    }
+
+    matrix_set_chunk_offset(matrix, offset);
+
+    return matrix;
+}
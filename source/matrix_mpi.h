@@ -0,0 +1,119 @@
+/**
+ * matrix_mpi.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Parallel And Distributed Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * matrix_mpi.h defines routines for loading a matrix stored to filesystem,
+ * divided in chunks among the processes of an MPI communicator.
+ *
+ * Each process gets the chunk matrix_load_in_chunks() would load, using its
+ * rank as the requested chunk and the size of the communicator as the number
+ * of chunks. Three ways of loading are provided:
+ *  -stdio: Every process reads its chunk with matrix_load_in_chunks().
+ *  -mmap: Every process maps its chunk with matrix_map_in_chunks(). When
+ *      processes share a node, file is read once into the page cache and
+ *      no copy of it is made.
+ *  -mpiio: All processes read their chunks at once, using collective MPI-IO,
+ *      so a parallel filesystem receives a few large requests instead of
+ *      many small ones.
+ *
+ * Macros defined in matrix_mpi.h:
+ *  -MATRIX_LOADER_STDIO
+ *  -MATRIX_LOADER_MMAP
+ *  -MATRIX_LOADER_MPIIO
+ *  -MATRIX_MPIIO_MAX_CELLS
+ *
+ * Functions defined in matrix_mpi.h:
+ *  -int matrix_select_loader(MPI_Comm comm)
+ *  -const char *matrix_loader_name(int loader)
+ *  -matrix_t *matrix_load_distributed(const char *filename, int loader,
+ *                                     MPI_Comm comm)
+ *  -matrix_t *matrix_load_in_chunks_mpiio(const char *filename, MPI_Comm comm)
+ */
+
+#ifndef __matrix_mpi_h__
+#define __matrix_mpi_h__
+
+#include <mpi.h>
+#include "matrix.h"
+
+
+// Ways of loading a matrix among the processes of a communicator.
+#define MATRIX_LOADER_STDIO 0
+#define MATRIX_LOADER_MMAP 1
+#define MATRIX_LOADER_MPIIO 2
+
+// Greatest number of cells read by a process in a single MPI-IO call, so
+// counts never overflow and requests remain of a reasonable size.
+#ifndef MATRIX_MPIIO_MAX_CELLS
+#define MATRIX_MPIIO_MAX_CELLS (1 << 27)
+#endif
+
+/**
+ * Selects the best way of loading matrices among the processes of given
+ * communicator.
+ *
+ * When MATRIX_LOADER environment variable is set to "stdio", "mmap" or
+ * "mpiio", that loader is used. Otherwise, if all processes run on the same
+ * node, chunks are mapped, else they are read by collective MPI-IO.
+ *
+ * It should be called by all processes in comm.
+ *
+ * Parameters:
+ *  -comm: The communicator among which matrices will be loaded.
+ *
+ * Returns:
+ *  One of MATRIX_LOADER_* values. It is the same on all processes.
+ */
+int matrix_select_loader(MPI_Comm comm);
+
+/**
+ * Returns the name of the given MATRIX_LOADER_* value.
+ */
+const char *matrix_loader_name(int loader);
+
+/**
+ * Loads the chunk of a matrix that belongs to current process.
+ *
+ * Chunk is the one with the same index as the rank of the process in comm,
+ * out of as many chunks as the processes in comm.
+ *
+ * It should be called by all processes in comm, with the same arguments.
+ *
+ * Chunks loaded by MATRIX_LOADER_MMAP are mapped by matrix_map_in_chunks(),
+ * so their rows are neither padded nor aligned.
+ *
+ * Parameters:
+ *  -filename: A path to a file that stores a matrix object.
+ *  -loader: One of MATRIX_LOADER_* values, usually the one returned by
+ *          matrix_select_loader().
+ *  -comm: The communicator among which the matrix is divided.
+ *
+ * Returns:
+ *  On success, the chunk of the matrix. On failure, returns NULL.
+ */
+matrix_t *matrix_load_distributed(const char *filename, int loader,
+                                  MPI_Comm comm);
+
+/**
+ * Loads the chunk of a matrix that belongs to current process, by using
+ * collective MPI-IO.
+ *
+ * Chunk is read straight into the padded rows of the matrix, in calls of at
+ * most MATRIX_MPIIO_MAX_CELLS cells.
+ *
+ * It should be called by all processes in comm, with the same arguments.
+ *
+ * Parameters:
+ *  -filename: A path to a file that stores a matrix object.
+ *  -comm: The communicator among which the matrix is divided.
+ *
+ * Returns:
+ *  On success, the chunk of the matrix. If loading fails on any process,
+ *  NULL is returned on all of them.
+ */
+matrix_t *matrix_load_in_chunks_mpiio(const char *filename, MPI_Comm comm);
+
+#endif
@@ -48,6 +48,67 @@
  * every setup the executable will run upon. Though, in a cluster setup compile
  * the executable and follow cluster's guide to properly submit it.
  *
+ * The precision of knn search can be selected by setting KNN_PRECISION
+ * environment variable to "double", "single" or "mixed". When not set,
+ * KNN_PRECISION_DEFAULT is used, which can be overriden at build time.
+ *
+ * The backend of local searches can be selected by setting KNN_BACKEND
+ * environment variable to "brute" or "vptree". The tree backend is exact,
+ * unless KNN_TOLERANCE is set to a positive relative error of distances
+ * (see knn_tree.h). When not set, KNN_BACKEND_DEFAULT is used.
+ *
+ * Distance kernels are selected according to the instruction sets of the
+ * processor, unless DISTANCE_ISA environment variable is set to "generic"
+ * or "avx2" (see distance.h).
+ *
+ * The transport data are passed around the ring with can be selected by
+ * setting KNN_TRANSPORT environment variable to "nonblocking", "blocking",
+ * "sendrecv" or "rma" (see knn_transport.h). When not set,
+ * KNN_TRANSPORT_DEFAULT is used, which is "blocking" for blocking_knn.
+ *
+ * Setting KNN_NODE_SHARING environment variable to "1" lets processes on the
+ * same node read the blocks of each other in place, from MPI-3 shared
+ * memory, so only blocks of other nodes are passed around the ring.
+ *
+ * Setting KNN_RING environment variable to "hierarchical" searches over a
+ * ring of nodes, where the blocks of all processes of a node travel as a
+ * single node block and are shared within the node through MPI-3 shared
+ * memory (see knn_search_hierarchical()). Setting it to "flat" selects the
+ * default ring of all processes.
+ *
+ * The way data and labels are loaded can be selected by setting MATRIX_LOADER
+ * environment variable to "stdio", "mmap" or "mpiio" (see matrix_mpi.h).
+ *
+ * Nearest neighbors are labeled while searching, by passing labels around
+ * the ring along with data. Setting KNN_LABELING environment variable to
+ * "ring" labels them afterwards instead, by a separate pass of labels around
+ * the ring, while "bidirectional" passes labels both ways around the ring,
+ * in half the steps, and "routed" requests them afterwards from the processes
+ * that own them. Setting it to "fused" selects the default.
+ *
+ * Setting KNN_SWEEP environment variable to "1" classifies points for every
+ * k in [1, k] out of a single knn search, reporting and verifying accuracy
+ * for each of them.
+ *
+ * Setting KNN_VOTING environment variable to "weighted" weights the vote of
+ * every neighbor by the inverse of its distance. Setting it to "majority"
+ * selects the default, one vote per neighbor.
+ *
+ * Setting KNN_PROFILE_REPORT environment variable to a path writes the time
+ * of every phase of knn search and labeling, along with counters of the work
+ * done, for every ring step, as JSON, or as CSV for a path ending in ".csv"
+ * (see knn_profile.h). It requires building with PROFILE=1.
+ *
+ * Setting KNN_QUERIES environment variable to the path of a .karas file
+ * switches to serving mode. Points of data file are then used as reference
+ * points, loaded once and kept resident, while the points of queries file are
+ * classified in batches against them (see knn_query_distributed()). Batches
+ * contain KNN_BATCH queries overall, or all of them when it is not set, and
+ * are distributed across processes. When KNN_QUERY_LABELS is set to a .karas
+ * file with the actual labels of the queries, the accuracy of classification
+ * is presented. Neighbors are always labeled while searching in this mode,
+ * and precalculated results files are not used.
+ *
  */
 
 #include <stdio.h>
@@ -56,26 +117,26 @@
 #include <sys/time.h>
 #include <math.h>
 #include <mpi.h>
+#include "distance.h"
 #include "knn.h"
+#include "knn_profile.h"
+#include "knn_transport.h"
+#include "knn_tree.h"
 #include "matrix.h"
+#include "matrix_mpi.h"
+#include "distributed_knn.h"
 
-// If BLOCKING_COMMUNICATIONS is defined, then use header with
-// blocking communications. Else use the one with async ones. Also, the
-// appropriate implementation file should be linked.
-// ====Since there is no explicit shared interface between these two headers,
-// compatibility between them is provided for now as a convenience.
-// May implement it different later, without needed for now.====
-#ifdef BLOCKING_COMMUNICATIONS
-    #include "distributed_knn_blocking.h"
-#else
-    #include "distributed_knn.h"
-#endif
 
-
-int verify_classification(char *results_fn, int k, double actual);
+int verify_classification(char *results_fn, int k_min, int k_max,
+                          double *actual);
 int verify_search(char *indexes_fn, int points, int k,
                   struct KNN_Pair **actual, int processes, int rank);
 double get_elapsed_time(struct timeval start, struct timeval stop);
+int serve_queries(char *queries_fn, char *query_labels_fn, int batch,
+                  matrix_t *data, matrix_t *labels, int k, int precision,
+                  int sweep, int weighted, int loader, int prev_task,
+                  int next_task, int tasks_num, int rank);
+matrix_t *copy_rows(matrix_t *matrix, int offset, int rows);
 
 
 int main(int argc, char *argv[])
@@ -109,8 +170,106 @@ int main(int argc, char *argv[])
 
     struct timeval start, stop;
 
+    // Select the precision of knn search.
+    int precision = KNN_PRECISION_DEFAULT;
+    char *precision_name = getenv("KNN_PRECISION");
+    if (precision_name && strcmp(precision_name, "")) {
+        precision = knn_parse_precision(precision_name);
+        if (precision < 0) {
+            printf("Invalid KNN_PRECISION: %s\n", precision_name);
+            exit(-1);
+        }
+    }
+
+    // Select the backend of local searches.
+    int backend = KNN_BACKEND_DEFAULT;
+    char *backend_name = getenv("KNN_BACKEND");
+    if (backend_name && strcmp(backend_name, "")) {
+        backend = knn_parse_backend(backend_name);
+        if (backend < 0) {
+            printf("Invalid KNN_BACKEND: %s\n", backend_name);
+            exit(-1);
+        }
+    }
+    double tolerance = 0.0;
+    char *tolerance_name = getenv("KNN_TOLERANCE");
+    if (tolerance_name && strcmp(tolerance_name, "")) {
+        tolerance = atof(tolerance_name);
+        if (tolerance < 0.0) {
+            printf("Invalid KNN_TOLERANCE: %s\n", tolerance_name);
+            exit(-1);
+        }
+    }
+    knn_set_search_backend(backend, tolerance);
+
+    // Select the transport of ring exchanges.
+    int transport = KNN_TRANSPORT_DEFAULT;
+    char *transport_name = getenv("KNN_TRANSPORT");
+    if (transport_name && strcmp(transport_name, "")) {
+        transport = knn_parse_transport(transport_name);
+        if (transport < 0) {
+            printf("Invalid KNN_TRANSPORT: %s\n", transport_name);
+            exit(-1);
+        }
+    }
+    knn_set_transport(transport);
+
+    char *sharing_name = getenv("KNN_NODE_SHARING");
+    knn_set_node_sharing(sharing_name && strcmp(sharing_name, "") &&
+                         strcmp(sharing_name, "0"));
+
+    // Select the ring of search.
+    int hierarchical = 0;
+    char *ring_name = getenv("KNN_RING");
+    if (ring_name && strcmp(ring_name, "")) {
+        if (!strcmp(ring_name, "hierarchical")) hierarchical = 1;
+        else if (strcmp(ring_name, "flat")) {
+            printf("Invalid KNN_RING: %s\n", ring_name);
+            exit(-1);
+        }
+    }
+
+    // Select whether labeling is fused into search, or how it is done after.
+    int fused_labeling = 1;
+    int routed_labeling = 0;
+    int bidirectional_labeling = 0;
+    char *labeling_name = getenv("KNN_LABELING");
+    if (labeling_name && strcmp(labeling_name, "")) {
+        if (!strcmp(labeling_name, "ring")) fused_labeling = 0;
+        else if (!strcmp(labeling_name, "bidirectional")) {
+            fused_labeling = 0;
+            bidirectional_labeling = 1;
+        }
+        else if (!strcmp(labeling_name, "routed")) {
+            fused_labeling = 0;
+            routed_labeling = 1;
+        }
+        else if (strcmp(labeling_name, "fused")) {
+            printf("Invalid KNN_LABELING: %s\n", labeling_name);
+            exit(-1);
+        }
+    }
+
+    // Select whether to classify for all k up to the requested one.
+    char *sweep_name = getenv("KNN_SWEEP");
+    int sweep = sweep_name && strcmp(sweep_name, "") && strcmp(sweep_name, "0");
+
+    // Select how neighbors vote.
+    int weighted = 0;
+    char *voting_name = getenv("KNN_VOTING");
+    if (voting_name && strcmp(voting_name, "")) {
+        if (!strcmp(voting_name, "weighted")) weighted = 1;
+        else if (strcmp(voting_name, "majority")) {
+            printf("Invalid KNN_VOTING: %s\n", voting_name);
+            exit(-1);
+        }
+    }
+
     // Initialize MPI env.
-	MPI_Init(&argc, &argv);
+    // Ask for calls to MPI from master thread of OpenMP regions to be allowed,
+    // so communications can progress while searching.
+    int thread_level;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_level);
 	MPI_Comm_size(MPI_COMM_WORLD, &tasks_num);
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
@@ -121,28 +280,99 @@ int main(int argc, char *argv[])
     if (rank == 0) prev_task = tasks_num - 1;
 
     // Load a chunk of the data matrix, based on the rank of current process.
-    matrix_t *initial_data = matrix_load_in_chunks(data_fn, tasks_num, rank);
+    int loader = matrix_select_loader(MPI_COMM_WORLD);
+    gettimeofday(&start, NULL);
+    matrix_t *initial_data = matrix_load_distributed(data_fn, loader,
+                                                     MPI_COMM_WORLD);
+    MPI_Barrier(MPI_COMM_WORLD);
+    gettimeofday(&stop, NULL);
+    if (rank == MPI_MASTER) {
+        printf("Loading data using %s took: %.2f secs.\n",
+               matrix_loader_name(loader), get_elapsed_time(start, stop));
+    }
     if (!initial_data) {
         printf("ERROR: Failed to load data matrix in task %d.\n", rank);
         MPI_Finalize();
         exit(-1);
     }
 
+    // Load the labels chunk belonging to current process according to its rank.
+    matrix_t *labels = matrix_load_distributed(labels_fn, loader,
+                                               MPI_COMM_WORLD);
+    // Neighbors can't be labeled without them, neither while searching nor
+    // afterwards, so all processes stop when any of them failed.
+    int failed = labels == NULL;
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (failed) {
+        if (!labels) {
+            printf("ERROR: Failed to load labels matrix in task %d.\n", rank);
+        }
+        matrix_destroy(initial_data);
+        matrix_destroy(labels);
+        MPI_Finalize();
+        exit(-1);
+    }
+
+    // In serving mode, loaded points are only the reference of the queries.
+    char *queries_fn = getenv("KNN_QUERIES");
+    if (queries_fn && strcmp(queries_fn, "")) {
+        int batch = 0;
+        char *batch_name = getenv("KNN_BATCH");
+        if (batch_name && strcmp(batch_name, "")) batch = atoi(batch_name);
+        int rc = serve_queries(queries_fn, getenv("KNN_QUERY_LABELS"), batch,
+                               initial_data, labels, k, precision, sweep,
+                               weighted, loader, prev_task, next_task,
+                               tasks_num, rank);
+        matrix_destroy(initial_data);
+        matrix_destroy(labels);
+        MPI_Finalize();
+        return rc == 0 ? 0 : -1;
+    }
+
     // Calculate the time of knn search.
     MPI_Barrier(MPI_COMM_WORLD);
     gettimeofday(&start, NULL);
 
-    // Find the k nearest neighbors for local data chunk.
-    struct KNN_Pair **results = knn_search_distributed(
-            initial_data, k, prev_task, next_task, tasks_num);
+    // Find the k nearest neighbors for local data chunk, along with their
+    // labels when labeling is fused into search.
+    struct KNN_Pair **results;
+    if (hierarchical) {
+        results = knn_search_hierarchical(
+                initial_data, fused_labeling ? labels : NULL, k, precision);
+    } else {
+        results = knn_search_distributed(
+                initial_data, fused_labeling ? labels : NULL, k,
+                prev_task, next_task, tasks_num, precision);
+    }
+
+    // Searches fail on all processes together, though a NULL result is
+    // still checked everywhere, before anything is done with it.
+    failed = results == NULL;
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (failed) {
+        if (rank == MPI_MASTER) printf("ERROR: Knn search failed.\n");
+        KNN_Pair_destroy_table(results, matrix_get_rows(initial_data));
+        matrix_destroy(initial_data);
+        matrix_destroy(labels);
+        MPI_Finalize();
+        exit(-1);
+    }
 
     MPI_Barrier(MPI_COMM_WORLD);
     gettimeofday(&stop, NULL);
 
     if (rank == MPI_MASTER) {
-        printf("Knn Search using %d processes took: %.2f secs.\n",
-               tasks_num, get_elapsed_time(start, stop));
+        printf("Knn Search using %d processes in %s precision with %s "
+               "backend on %s kernels over %s transport on a %s ring took: "
+               "%.2f secs.\n",
+               tasks_num, knn_precision_name(precision),
+               knn_backend_name(backend),
+               distance_isa_name(distance_get_isa()),
+               knn_transport_name(transport),
+               hierarchical ? "hierarchical" : "flat",
+               get_elapsed_time(start, stop));
     }
+    knn_print_ring_timings();
 
     // If a validation file has been provided, check the validity of results of
     // knn search.
@@ -161,28 +391,76 @@ int main(int argc, char *argv[])
         }
     }
 
-    // Load the labels chunk belonging to current process according to its rank.
-    matrix_t *labels = matrix_load_in_chunks(labels_fn, tasks_num, rank);
-    if (!labels) {
-        printf("ERROR: Failed to load labels matrix in task %d.\n", rank);
-    }
-
     // Calculate time of classification.
     MPI_Barrier(MPI_COMM_WORLD);
     gettimeofday(&start, NULL);
 
-    // Perform a distributed labeling process, in order to get the labels
-    // of the nearest neighbors previously found.
-    matrix_t *labeled_results = knn_labeling_distributed(
-            results, matrix_get_rows(initial_data), k,
-            labels, prev_task, next_task, tasks_num
-    );
-    // Results of knn_search are no more needed.
-    KNN_Pair_destroy_table(results, matrix_get_rows(initial_data));
+    // Get the labels of the nearest neighbors previously found. Unless they
+    // have been found along with them, perform a distributed labeling process.
+    matrix_t *labeled_results;
+    if (fused_labeling) {
+        labeled_results = knn_collect_labels(
+                results, matrix_get_rows(initial_data), k);
+    } else if (routed_labeling) {
+        labeled_results = knn_labeling_routed(
+                results, matrix_get_rows(initial_data), k, labels);
+    } else {
+        matrix_t *(*labeling)(struct KNN_Pair **, int, int, matrix_t *, int,
+                              int, int) =
+                bidirectional_labeling ? knn_labeling_bidirectional :
+                                         knn_labeling_distributed;
+        matrix_t *by_index = labeling(
+                results, matrix_get_rows(initial_data), k,
+                labels, prev_task, next_task, tasks_num
+        );
+
+        // Distributed labeling leaves neighbors sorted by index, so their
+        // distance order is restored, along with their labels.
+        labeled_results = NULL;
+        if (by_index) {
+            for (int i = 0; i < matrix_get_rows(initial_data); i++) {
+                for (int j = 0; j < k; j++) {
+                    results[i][j].label =
+                            (int) matrix_get_cell(by_index, i, j);
+                }
+                qsort(results[i], k, sizeof(struct KNN_Pair),
+                      KNN_Pair_asc_comp);
+            }
+            matrix_destroy(by_index);
 
+            labeled_results = knn_collect_labels(
+                    results, matrix_get_rows(initial_data), k);
+        }
+    }
+    failed = labeled_results == NULL;
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (failed) {
+        if (!labeled_results) {
+            printf("ERROR: Failed to label nearest neighbors in task %d.\n",
+                   rank);
+        }
+        matrix_destroy(labeled_results);
+        KNN_Pair_destroy_table(results, matrix_get_rows(initial_data));
+        matrix_destroy(initial_data);
+        matrix_destroy(labels);
+        MPI_Finalize();
+        exit(-1);
+    }
     // Finally, use the labels of nearest neighbors, to classify each point
-    // in initial data.
-    matrix_t *classified = knn_classify(labeled_results);
+    // in initial data. When sweeping, column j of classified is the
+    // classification using j+1 nearest neighbors.
+    // Distances of the neighbors are only needed for weighting their votes.
+    struct KNN_Pair **weights = weighted ? results : NULL;
+    matrix_t *classified;
+    if (sweep) classified = knn_classify_sweep(labeled_results, weights);
+    else if (weighted) classified = knn_classify_weighted(labeled_results,
+                                                          results);
+    else classified = knn_classify(labeled_results);
+    matrix_destroy(labeled_results);
+    // Results of knn_search are no more needed.
+    KNN_Pair_destroy_table(results, matrix_get_rows(initial_data));
+    int k_min = sweep ? 1 : k;  // Smallest k points were classified for.
+    int k_count = k - k_min + 1;
 
     MPI_Barrier(MPI_COMM_WORLD);
     gettimeofday(&stop, NULL);
@@ -192,52 +470,54 @@ int main(int argc, char *argv[])
                tasks_num, get_elapsed_time(start, stop));
     }
 
-    // Verify the local classification results.
-    int valid = 0;
+    char *profile_fn = getenv("KNN_PROFILE_REPORT");
+    if (profile_fn && strcmp(profile_fn, "") &&
+        knn_profile_write(profile_fn) == 0 && rank == MPI_MASTER)
+    {
+        printf("Profile written to %s.\n", profile_fn);
+    }
+
+    // Verify the local classification results, for every k.
+    int *valid = (int *) calloc(k_count + 1, sizeof(int));
     for (int i = 0; i < matrix_get_rows(classified); i++) {
-        if (matrix_get_cell(classified, i, 0) ==
-            matrix_get_cell(labels, i, 0))
-        {
-            valid++;
+        for (int j = 0; j < k_count; j++) {
+            if (matrix_get_cell(classified, i, j) ==
+                matrix_get_cell(labels, i, 0))
+            {
+                valid[j]++;
+            }
         }
     }
+    // Last one is the number of points.
+    valid[k_count] = matrix_get_rows(classified);
 
     // Transmit local results to master process to join and present them.
+    // A simple MPI_Reduce operation is used. There is absolutely no need to go
+    // for ring topology. That would be a waste.
     int *success = NULL;
-    int *total = NULL;
-
     if (rank == MPI_MASTER) {
-        success = (int *) malloc(sizeof(int) * tasks_num);
-        total = (int *) malloc(sizeof(int) * tasks_num);
+        success = (int *) malloc(sizeof(int) * (k_count + 1));
     }
-
-    int current_points = matrix_get_rows(classified);
-
-    // A simple MPI_Gather operation is used. There is absolutely no need to go
-    // for ring topology. That would be a waste.
-    MPI_Gather(&valid, 1, MPI_INT, success, 1, MPI_INT,
-               MPI_MASTER, MPI_COMM_WORLD);
-    MPI_Gather(&current_points, 1, MPI_INT, total, 1, MPI_INT,
+    MPI_Reduce(valid, success, k_count + 1, MPI_INT, MPI_SUM,
                MPI_MASTER, MPI_COMM_WORLD);
 
     if (rank == MPI_MASTER) {
-        int total_valid = 0;
-        int total_all = 0;
-        for (int i = 0; i < tasks_num; i++) {
-            total_valid += success[i];
-            total_all += total[i];
-        }
-
-        free(success);
-        free(total);
-
-        double accuracy = ((double) total_valid / (double) total_all) * 100.0;
+        double *accuracy = (double *) malloc(sizeof(double) * k_count);
+        int total_all = success[k_count];
 
-        printf("k = %d - classification accuracy: %2.1f %%\n", k, accuracy);
+        for (int j = 0; j < k_count; j++) {
+            accuracy[j] = ((double) success[j] / (double) total_all) * 100.0;
+            printf("k = %d - classification accuracy: %2.1f %%\n",
+                   k_min + j, accuracy[j]);
+        }
 
         if (test_fn && strcmp(test_fn, ""))
-            verify_classification(test_fn, k, accuracy);
+            verify_classification(test_fn, k_min, k, accuracy);
+
+        free(accuracy);
+        free(success);
     }
+    free(valid);
 
 	matrix_destroy(initial_data);
     matrix_destroy(labels);
@@ -268,25 +548,232 @@ double get_elapsed_time(struct timeval start, struct timeval stop)
 }
 
 /**
- * Verifies results of classification, by comparing the accuracy percentage
+ * Classifies the points of a queries file against the reference points
+ * loaded by every process, in batches.
+ *
+ * Reference points are prepared once by knn_reference_create(). Then,
+ * every batch of queries is split across processes and searched by
+ * knn_query_distributed(), while reference points stay in place. Timings
+ * and, when actual labels of queries are provided, the accuracy of
+ * classification are printed by MPI_MASTER.
+ *
+ * It should be called by all processes in MPI_COMM_WORLD.
+ *
+ * Parameters:
+ *  -queries_fn : Path to a .karas file containing the cords of the queries.
+ *  -query_labels_fn : Path to a .karas file containing the actual labels of
+ *          the queries, or NULL.
+ *  -batch : The number of queries in a batch, over all processes. A
+ *          non-positive value places all queries in a single batch.
+ *  -data : The local chunk of reference points.
+ *  -labels : The labels of local reference points.
+ *  -k : The number of nearest neighbors used for classification.
+ *  -precision : One of KNN_PRECISION_* values.
+ *  -sweep : Whether queries are classified for every k in [1, k].
+ *  -weighted : Whether the votes of neighbors are weighted by distance.
+ *  -loader : One of MATRIX_LOADER_* values, used for loading queries.
+ *  -prev_task : The rank of previous node in MPI_COMM_WORLD.
+ *  -next_task : The rank of next node in MPI_COMM_WORLD.
+ *  -tasks_num : The overall number of tasks in MPI_COMM_WORLD.
+ *  -rank : The rank of current process in MPI_COMM_WORLD.
+ *
+ * Returns:
+ *  0 on success, -1 on failure.
+ */
+int serve_queries(char *queries_fn, char *query_labels_fn, int batch,
+                  matrix_t *data, matrix_t *labels, int k, int precision,
+                  int sweep, int weighted, int loader, int prev_task,
+                  int next_task, int tasks_num, int rank)
+{
+    struct timeval start, stop;
+
+    // Reference points are searched as loaded, for every batch.
+    gettimeofday(&start, NULL);
+    struct KNN_Reference *reference = knn_reference_create(data, labels,
+                                                           precision);
+    int failed = reference == NULL;
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (failed) {
+        knn_reference_destroy(reference);
+        return -1;
+    }
+    gettimeofday(&stop, NULL);
+    if (rank == MPI_MASTER) {
+        printf("Preparing reference points took: %.2f secs.\n",
+               get_elapsed_time(start, stop));
+    }
+
+    matrix_t *queries = matrix_load_distributed(queries_fn, loader,
+                                                MPI_COMM_WORLD);
+    matrix_t *query_labels = NULL;
+    if (query_labels_fn && strcmp(query_labels_fn, "")) {
+        query_labels = matrix_load_distributed(query_labels_fn, loader,
+                                               MPI_COMM_WORLD);
+        failed |= query_labels == NULL;
+    }
+    failed |= queries == NULL;
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (failed) {
+        printf("ERROR: Failed to load queries in task %d.\n", rank);
+        matrix_destroy(queries);
+        matrix_destroy(query_labels);
+        knn_reference_destroy(reference);
+        return -1;
+    }
+
+    // Every process takes its own share of a batch out of its chunk, so
+    // batches are split across processes the same way queries file is.
+    int local_rows = matrix_get_rows(queries);
+    int total_rows;
+    MPI_Allreduce(&local_rows, &total_rows, 1, MPI_INT, MPI_SUM,
+                  MPI_COMM_WORLD);
+    if (batch <= 0 || batch > total_rows) batch = total_rows;
+    int batches = batch > 0 ? (total_rows + batch - 1) / batch : 0;
+
+    int k_min = sweep ? 1 : k;  // Smallest k queries are classified for.
+    int k_count = k - k_min + 1;
+    int *valid = (int *) calloc(k_count + 1, sizeof(int));
+    double search_time = 0.0;
+
+    for (int b = 0; b < batches && !failed; b++) {
+        int32_t offset, rows;
+        matrix_chunk_bounds(local_rows, batches, b, &offset, &rows);
+        matrix_t *local_batch = copy_rows(queries, offset, rows);
+        failed = local_batch == NULL;
+        MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX,
+                      MPI_COMM_WORLD);
+        if (failed) {
+            matrix_destroy(local_batch);
+            break;
+        }
+
+        MPI_Barrier(MPI_COMM_WORLD);
+        gettimeofday(&start, NULL);
+        struct KNN_Pair **results = knn_query_distributed(
+                reference, local_batch, k, prev_task, next_task, tasks_num);
+        MPI_Barrier(MPI_COMM_WORLD);
+        gettimeofday(&stop, NULL);
+        search_time += get_elapsed_time(start, stop);
+
+        failed = results == NULL;
+        MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_MAX,
+                      MPI_COMM_WORLD);
+        if (failed) {
+            KNN_Pair_destroy_table(results, rows);
+            matrix_destroy(local_batch);
+            break;
+        }
+
+        // Neighbors are labeled while searching, so they are classified
+        // right away.
+        matrix_t *labeled_results = knn_collect_labels(results, rows, k);
+        struct KNN_Pair **weights = weighted ? results : NULL;
+        matrix_t *classified;
+        if (sweep) classified = knn_classify_sweep(labeled_results, weights);
+        else if (weighted) classified = knn_classify_weighted(labeled_results,
+                                                              results);
+        else classified = knn_classify(labeled_results);
+
+        for (int i = 0; query_labels && i < rows; i++) {
+            for (int j = 0; j < k_count; j++) {
+                if (matrix_get_cell(classified, i, j) ==
+                    matrix_get_cell(query_labels, offset + i, 0))
+                {
+                    valid[j]++;
+                }
+            }
+        }
+        valid[k_count] += rows;
+
+        matrix_destroy(classified);
+        matrix_destroy(labeled_results);
+        KNN_Pair_destroy_table(results, rows);
+        matrix_destroy(local_batch);
+    }
+
+    int *success = NULL;
+    if (rank == MPI_MASTER) {
+        success = (int *) malloc(sizeof(int) * (k_count + 1));
+    }
+    MPI_Reduce(valid, success, k_count + 1, MPI_INT, MPI_SUM,
+               MPI_MASTER, MPI_COMM_WORLD);
+
+    if (rank == MPI_MASTER && !failed) {
+        printf("Serving %d queries in %d batches using %d processes in %s "
+               "precision took: %.2f secs (%.4f secs per batch).\n",
+               total_rows, batches, tasks_num, knn_precision_name(precision),
+               search_time, batches > 0 ? search_time / batches : 0.0);
+
+        for (int j = 0; query_labels && j < k_count; j++) {
+            double accuracy = success[k_count] > 0 ?
+                    ((double) success[j] / (double) success[k_count]) * 100.0 :
+                    0.0;
+            printf("k = %d - classification accuracy: %2.1f %%\n",
+                   k_min + j, accuracy);
+        }
+    }
+    free(success);
+    free(valid);
+
+    matrix_destroy(queries);
+    matrix_destroy(query_labels);
+    knn_reference_destroy(reference);
+
+    return failed ? -1 : 0;
+}
+
+/**
+ * Returns a new matrix, with a copy of the given rows of a matrix. The chunk
+ * offset of the copy is set to the index of its first row.
+ *
+ * Parameters:
+ *  -matrix : The matrix rows are copied from.
+ *  -offset : The first row to be copied.
+ *  -rows : The number of rows to be copied.
+ *
+ * Returns:
+ *  The copy, or NULL on failure.
+ */
+matrix_t *copy_rows(matrix_t *matrix, int offset, int rows)
+{
+    int cols = matrix_get_cols(matrix);
+    matrix_t *copy = matrix_create(rows, cols);
+    if (!copy) return NULL;
+
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            matrix_set_cell(copy, i, j,
+                            matrix_get_cell(matrix, offset + i, j));
+        }
+    }
+    matrix_set_chunk_offset(copy, matrix_get_chunk_offset(matrix) + offset);
+
+    return copy;
+}
+
+/**
+ * Verifies results of classification, by comparing the accuracy percentages
  * of classification that took place by current implementation, against the
- * accuracy percentage of an external implementation.
+ * accuracy percentages of an external implementation.
  *
  * Parameters:
  *  -results_fn : Path to a .karas file containing a matrix of precalculated
  *          accuracy percentages for all k values up to the k value provided
- *          in k argument.
- *  -k : The number of nearest neighbors used in classification that resulted
- *          to the accuracy value provided in actual argument.
- *  -actual : The accuracy percentage of the classification that took place
- *          by current implementation.
+ *          in k_max argument.
+ *  -k_min : The number of nearest neighbors used in classification that
+ *          resulted to the first accuracy value provided in actual argument.
+ *  -k_max : The number of nearest neighbors used in classification that
+ *          resulted to the last accuracy value provided in actual argument.
+ *  -actual : The accuracy percentages of the classifications that took place
+ *          by current implementation, one for every k in [k_min, k_max].
  *
  * Returns:
- *  1 if actual value, matched the one contained in given matrix, else returns 0.
- *  Upon failing to load the matrix, or if matrix doesn't contain a
- *  precalculated value for given k, it returns -1.
+ *  1 if actual values, matched the ones contained in given matrix, else
+ *  returns 0. Upon failing to load the matrix, or if matrix doesn't contain a
+ *  precalculated value for k_max, it returns -1.
  */
-int verify_classification(char *results_fn, int k, double actual)
+int verify_classification(char *results_fn, int k_min, int k_max,
+                          double *actual)
 {
     matrix_t *results = matrix_load_in_chunks(results_fn, 1, 0);
 
@@ -295,25 +782,30 @@ int verify_classification(char *results_fn, int k, double actual)
         return -1;
     }
 
-    if (matrix_get_rows(results) < k) {
+    if (matrix_get_rows(results) < k_max) {
         // Each row is expected to hold the precalculated value for the
         // equivalent k value, starting from k=1. So if number of rows < k,
         // there is no possibility for a precalculated value to exist.
         printf("\tNo precalculated result is contained in %s for k = %d.\n",
-               results_fn, k);
+               results_fn, k_max);
+        matrix_destroy(results);
         return -1;
     }
 
     int pass = 1;
 
-    if (abs(matrix_get_cell(results, k-1, 0) - actual) < 0.1) {
-        printf("Classification Test: SUCCESS\n");
-    }
-    else {
-        printf("Classification Test: FAIL\n");
-        pass = 0;
+    for (int k = k_min; k <= k_max; k++) {
+        if (!(fabs(matrix_get_cell(results, k-1, 0) - actual[k-k_min]) < 0.1)) {
+            printf("\tClassification accuracy mismatch for k = %d.\n", k);
+            pass = 0;
+        }
     }
 
+    if (pass) printf("Classification Test: SUCCESS\n");
+    else printf("Classification Test: FAIL\n");
+
+    matrix_destroy(results);
+
     return pass;
 }
 